@@ -0,0 +1,31 @@
+/**
+ * The parts of the Arduino core used by the firmware, for the host build. Serial is stdout.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
+
+void yield();
+static inline void delay(uint32_t ms) { vTaskDelay(pdMS_TO_TICKS(ms)); }
+static inline unsigned long millis() { return (unsigned long)(esp_timer_get_time() / 1000); }
+static inline unsigned long micros() { return (unsigned long)esp_timer_get_time(); }
+/** CPU cycles of an ESP32 at esp_clk_cpu_freq() since the program started (wraps like the real one). */
+uint32_t esp_cpu_get_ccount();
+
+class HostSerial {
+public:
+    void begin(unsigned long baud) { (void)baud; }
+    int printf(const char* format, ...) __attribute__((format(printf, 2, 3)));
+    size_t print(const char* s) { return fputs(s, stdout) < 0 ? 0 : strlen(s); }
+    size_t println(const char* s = "") { return print(s) + print("\n"); }
+    void flush() { fflush(stdout); }
+};
+extern HostSerial Serial;
@@ -0,0 +1,85 @@
+/**
+ * The parts of SdFat used by the firmware, for the host build. The "card" is a directory on the
+ * host (the current directory unless SdFs::setHostRoot() is called) and files are POSIX files in it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <fcntl.h>
+
+#include <Arduino.h>
+
+typedef int oflag_t;
+
+#define DEDICATED_SPI 1
+#define SHARED_SPI 0
+#define SD_SCK_MHZ(mhz) (1000000UL * (mhz))
+#define FAT_TYPE_EXFAT 64
+
+struct SdSpiConfig {
+    SdSpiConfig(uint8_t cs, uint8_t options, uint32_t maxSck) { (void)cs; (void)options; (void)maxSck; }
+};
+
+class FsFile {
+    int fd = -1;
+
+public:
+    FsFile() { }
+    explicit FsFile(int fd) : fd(fd) { }
+    FsFile(const FsFile&) = delete;
+    FsFile& operator=(const FsFile&) = delete;
+    FsFile(FsFile&& other) : fd(other.fd) { other.fd = -1; }
+    FsFile& operator=(FsFile&& other);
+    ~FsFile() { close(); }
+
+    explicit operator bool() const { return fd >= 0; }
+    bool isOpen() const { return fd >= 0; }
+    bool close();
+
+    int read(void* buffer, size_t count);
+    size_t write(const void* buffer, size_t count);
+    bool seek(uint64_t position);
+    bool seekSet(uint64_t position) { return seek(position); }
+    uint64_t position() const;
+    uint64_t fileSize() const;
+    bool truncate(uint64_t length);
+    bool preAllocate(uint64_t length);
+    bool sync();
+    void flush() { sync(); }
+};
+
+class HostCard {
+public:
+    uint8_t errorCode() const { return 0; }
+    uint32_t errorData() const { return 0; }
+    uint32_t sectorCount() const { return 64 * 1024 * 1024; } // 32 GB
+};
+
+class HostVolume {
+public:
+    uint8_t fatType() const { return FAT_TYPE_EXFAT; }
+    uint32_t sectorsPerCluster() const { return 64; } // 32 KB
+    int32_t freeClusterCount() const { return -1; } // unknown
+};
+
+class SdFs {
+    HostCard hostCard;
+    HostVolume hostVolume;
+    bool mounted = false;
+
+public:
+    /** Set the directory used as the card (it must exist). */
+    static void setHostRoot(const char* path);
+
+    bool begin(SdSpiConfig config) { (void)config; mounted = true; return true; }
+    void end() { mounted = false; }
+    HostCard* card() { return &hostCard; }
+    HostVolume* vol() { return &hostVolume; }
+
+    FsFile open(const char* path, oflag_t oflag = O_RDONLY);
+    bool exists(const char* path);
+    bool mkdir(const char* path);
+    bool remove(const char* path);
+};
@@ -0,0 +1,15 @@
+/**
+ * The Arduino I2C library, for the host build. There is no bus: the codec drivers only take the
+ * address of Wire to make a CodecBus, which the host tests replace with a MockCodecBus.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+class TwoWire {
+public:
+    bool begin() { return true; }
+};
+extern TwoWire Wire;
@@ -0,0 +1,11 @@
+/**
+ * The types of the ESP-IDF LEDC driver used by ClockSignal, for the host build. There is no
+ * implementation: the host tests of the codec drivers provide a ClockSignal that does nothing.
+ */
+
+#pragma once
+
+#include <esp_err.h>
+
+typedef struct { int unused; } ledc_timer_config_t;
+typedef struct { int unused; } ledc_channel_config_t;
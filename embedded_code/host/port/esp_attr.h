@@ -0,0 +1,7 @@
+#pragma once
+
+// Placement and alignment attributes of ESP-IDF, which mean nothing on the host
+#define IRAM_ATTR
+#define IRAM_DATA_ATTR
+#define DRAM_ATTR
+#define WORD_ALIGNED_ATTR __attribute__((aligned(4)))
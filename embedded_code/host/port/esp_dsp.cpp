@@ -0,0 +1,137 @@
+/**
+ * The parts of esp-dsp used by DUET, for the host build (see esp_dsp.h).
+ */
+
+#include <esp_dsp.h>
+
+#include <math.h>
+#include <string.h>
+
+#include <vector>
+
+
+///// FIR /////
+
+esp_err_t dsps_fird_init_f32(fir_f32_t* fir, float* coeffs, float* delay, int N, int decim) {
+    if (!fir || !coeffs || !delay || N <= 0 || decim <= 0) { return ESP_ERR_INVALID_ARG; }
+    fir->coeffs = coeffs;
+    fir->delay = delay;
+    fir->N = N;
+    fir->pos = 0;
+    fir->decim = decim;
+    memset(delay, 0, N * sizeof(float));
+    return ESP_OK;
+}
+
+int dsps_fird_f32(fir_f32_t* fir, const float* input, float* output, int len) {
+    for (int i = 0; i < len; i++) {
+        for (int k = 0; k < fir->decim; k++) {
+            fir->delay[fir->pos++] = *input++;
+            if (fir->pos >= fir->N) { fir->pos = 0; }
+        }
+        // The first coefficient goes with the oldest sample (like esp-dsp)
+        float acc = 0;
+        int c = 0;
+        for (int n = fir->pos; n < fir->N; n++) { acc += fir->coeffs[c++] * fir->delay[n]; }
+        for (int n = 0; n < fir->pos; n++) { acc += fir->coeffs[c++] * fir->delay[n]; }
+        output[i] = acc;
+    }
+    return len;
+}
+
+
+///// FFT /////
+
+// The twiddle factors e^(-2 pi i k / (2 * fftMax)) for k < fftMax, so they cover the FFTs up to
+// fftMax and the real FFTs of 2 * fftMax (cos and sin interleaved)
+static std::vector<float> twiddles;
+static int fftMax = 0;
+static int fftUsers = 0;
+
+static esp_err_t fftInit(float* table, int N) {
+    if (table || N <= 0 || (N & (N - 1)) != 0) { return ESP_ERR_INVALID_ARG; }
+    fftUsers++;
+    if (N <= fftMax) { return ESP_OK; }
+    fftMax = N;
+    twiddles.resize(2 * N);
+    for (int k = 0; k < N; k++) {
+        twiddles[2 * k] = (float)cos(M_PI * k / N);
+        twiddles[2 * k + 1] = (float)-sin(M_PI * k / N);
+    }
+    return ESP_OK;
+}
+
+static void fftDeinit() {
+    if (fftUsers > 0 && --fftUsers == 0) { twiddles.clear(); twiddles.shrink_to_fit(); fftMax = 0; }
+}
+
+/** Radix-2 FFT of N complex numbers, in place and in order. */
+static esp_err_t fft(float* data, int N) {
+    if (N <= 0 || N > fftMax || (N & (N - 1)) != 0) { return ESP_ERR_INVALID_ARG; }
+    // Bit reversal
+    for (int i = 1, j = 0; i < N; i++) {
+        int bit = N >> 1;
+        for (; j & bit; bit >>= 1) { j ^= bit; }
+        j |= bit;
+        if (i < j) {
+            float t;
+            t = data[2 * i]; data[2 * i] = data[2 * j]; data[2 * j] = t;
+            t = data[2 * i + 1]; data[2 * i + 1] = data[2 * j + 1]; data[2 * j + 1] = t;
+        }
+    }
+    // Butterflies
+    for (int len = 2; len <= N; len <<= 1) {
+        const int step = 2 * fftMax / len;
+        for (int start = 0; start < N; start += len) {
+            for (int k = 0; k < len / 2; k++) {
+                const float wr = twiddles[2 * k * step], wi = twiddles[2 * k * step + 1];
+                float* a = &data[2 * (start + k)];
+                float* b = &data[2 * (start + k + len / 2)];
+                const float tr = b[0] * wr - b[1] * wi, ti = b[0] * wi + b[1] * wr;
+                b[0] = a[0] - tr; b[1] = a[1] - ti;
+                a[0] += tr; a[1] += ti;
+            }
+        }
+    }
+    return ESP_OK;
+}
+
+esp_err_t dsps_fft2r_init_fc32(float* table, int N) { return fftInit(table, N); }
+esp_err_t dsps_fft4r_init_fc32(float* table, int N) { return fftInit(table, N); }
+void dsps_fft2r_deinit_fc32() { fftDeinit(); }
+void dsps_fft4r_deinit_fc32() { fftDeinit(); }
+esp_err_t dsps_fft2r_fc32(float* data, int N) { return fft(data, N); }
+esp_err_t dsps_fft4r_fc32(float* data, int N) { return fft(data, N); }
+
+esp_err_t dsps_cplx2real_fc32(float* data, int N) {
+    if (N <= 0 || N > fftMax) { return ESP_ERR_INVALID_ARG; }
+    const int step = fftMax / N;
+    const float re = data[0], im = data[1];
+    data[0] = re + im;
+    data[1] = re - im;
+    // X[k] = (Z[k] + Z*[N-k]) / 2 - i e^(-pi i k / N) (Z[k] - Z*[N-k]) / 2, and X[N-k] from the same pair
+    for (int k = 1; k <= N / 2; k++) {
+        const float zr = data[2 * k], zi = data[2 * k + 1];
+        const float nr = data[2 * (N - k)], ni = data[2 * (N - k) + 1];
+        const float er = (zr + nr) * 0.5f, ei = (zi - ni) * 0.5f;  // even part
+        const float dr = (zr - nr) * 0.5f, di = (zi + ni) * 0.5f;  // odd part (before the twiddle)
+        const float wr = twiddles[2 * k * step], wi = twiddles[2 * k * step + 1];
+        // o = -i * w * d
+        const float tr = wr * dr - wi * di, ti = wr * di + wi * dr;
+        const float or_ = ti, oi = -tr;
+        data[2 * k] = er + or_;
+        data[2 * k + 1] = ei + oi;
+        data[2 * (N - k)] = er - or_;
+        data[2 * (N - k) + 1] = -(ei - oi);
+    }
+    return ESP_OK;
+}
+
+
+///// Math /////
+
+esp_err_t dsps_mul_f32(const float* in1, const float* in2, float* out, int len, int step1, int step2, int step_out) {
+    if (!in1 || !in2 || !out) { return ESP_ERR_INVALID_ARG; }
+    for (int i = 0; i < len; i++) { out[i * step_out] = in1[i * step1] * in2[i * step2]; }
+    return ESP_OK;
+}
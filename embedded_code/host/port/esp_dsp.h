@@ -0,0 +1,49 @@
+/**
+ * The parts of esp-dsp used by DUET, for the host build: plain C versions of the FIR decimator,
+ * the complex FFTs, and the element-wise multiply (see esp_dsp.cpp).
+ *
+ * The FFTs give the same results as esp-dsp's when followed by their bit reversal, which is all
+ * DUET does with them: here the FFT puts its output in order itself and the bit reversals do
+ * nothing.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <esp_err.h>
+
+/** A FIR filter (the fields DUET uses match esp-dsp's). */
+typedef struct fir_f32_s {
+    float* coeffs;
+    float* delay;
+    int N;          // length of the filter
+    int pos;        // next position in the delay line
+    int decim;      // decimation
+} fir_f32_t;
+
+/** Initialize a decimating FIR filter with coefficients and a delay line of N each. */
+esp_err_t dsps_fird_init_f32(fir_f32_t* fir, float* coeffs, float* delay, int N, int decim);
+/** Filter and decimate input into len outputs (reading len * decim inputs). Returns len. */
+int dsps_fird_f32(fir_f32_t* fir, const float* input, float* output, int len);
+
+/** Set up the FFTs of up to N complex numbers (table must be NULL). */
+esp_err_t dsps_fft2r_init_fc32(float* table, int N);
+esp_err_t dsps_fft4r_init_fc32(float* table, int N);
+void dsps_fft2r_deinit_fc32();
+void dsps_fft4r_deinit_fc32();
+
+/** FFT of N complex numbers (interleaved real and imaginary parts) in place, in order. */
+esp_err_t dsps_fft2r_fc32(float* data, int N);
+esp_err_t dsps_fft4r_fc32(float* data, int N);
+/** Nothing to do: the FFTs above are already in order. */
+static inline esp_err_t dsps_bit_rev2r_fc32(float* data, int N) { (void)data; (void)N; return ESP_OK; }
+static inline esp_err_t dsps_bit_rev4r_fc32(float* data, int N) { (void)data; (void)N; return ESP_OK; }
+
+/**
+ * Turn the FFT of N complex numbers that are 2N real samples into the first N bins of the FFT of
+ * the 2N reals. Bin 0 and bin N (which are both real) are put in data[0] and data[1].
+ */
+esp_err_t dsps_cplx2real_fc32(float* data, int N);
+
+/** out[i*step_out] = in1[i*step1] * in2[i*step2] for len elements. */
+esp_err_t dsps_mul_f32(const float* in1, const float* in2, float* out, int len, int step1, int step2, int step_out);
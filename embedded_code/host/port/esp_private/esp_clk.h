@@ -0,0 +1,7 @@
+#pragma once
+
+// The host build counts cycles of an ESP32 at 240 MHz (see esp_cpu_get_ccount() in Arduino.h)
+#define HOST_CPU_FREQ_HZ 240000000
+
+/** The CPU frequency in Hz. */
+static inline int esp_clk_cpu_freq() { return HOST_CPU_FREQ_HZ; }
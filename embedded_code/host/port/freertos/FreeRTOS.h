@@ -0,0 +1,41 @@
+/**
+ * The parts of FreeRTOS used by the firmware, implemented with threads for the host build (see
+ * host/CMakeLists.txt). A tick is a millisecond, priorities and stack sizes are ignored, and there
+ * are no interrupts (the FromISR functions are the same as the others without waiting).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+#include <esp_attr.h>
+#include <esp_err.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE 1
+#define pdFAIL pdFALSE
+#define pdPASS pdTRUE
+#define portMAX_DELAY ((TickType_t)0xffffffffUL)
+#define portTICK_PERIOD_MS 1
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define tskIDLE_PRIORITY 0
+#define portYIELD_FROM_ISR() ((void)0)
+
+/** A spinlock for critical sections (which don't disable interrupts here since there are none). */
+typedef struct {
+    std::atomic<bool> locked;
+} portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED { { false } }
+
+static inline void portENTER_CRITICAL(portMUX_TYPE* mux) {
+    while (mux->locked.exchange(true, std::memory_order_acquire)) { }
+}
+static inline void portEXIT_CRITICAL(portMUX_TYPE* mux) { mux->locked.store(false, std::memory_order_release); }
+#define portENTER_CRITICAL_ISR portENTER_CRITICAL
+#define portEXIT_CRITICAL_ISR portEXIT_CRITICAL
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "FreeRTOS.h"
+
+typedef struct HostQueue* QueueHandle_t;
+
+/** Create a queue of items that are copied in and out. Items of size 0 make a counting semaphore. */
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize);
+void vQueueDelete(QueueHandle_t queue);
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t ticksToWait);
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticksToWait);
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticksToWait);
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue);
+
+#define xQueueSend xQueueSendToBack
+#define xQueueSendToBackFromISR(queue, item, woken) ((void)(woken), xQueueSendToBack(queue, item, 0))
+#define xQueueReceiveFromISR(queue, item, woken) ((void)(woken), xQueueReceive(queue, item, 0))
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "queue.h"
+
+// Semaphores are queues of empty items, like in FreeRTOS
+typedef QueueHandle_t SemaphoreHandle_t;
+
+#define xSemaphoreCreateBinary() xQueueCreate(1, 0)
+#define vSemaphoreDelete(semaphore) vQueueDelete(semaphore)
+#define xSemaphoreTake(semaphore, ticksToWait) xQueueReceive(semaphore, NULL, ticksToWait)
+#define xSemaphoreGive(semaphore) xQueueSendToBack(semaphore, NULL, 0)
@@ -0,0 +1,249 @@
+/**
+ * The FreeRTOS, ESP-IDF, Arduino, and SdFat functions of the host build (see the headers in this
+ * directory).
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <esp_timer.h>
+#include <esp_private/esp_clk.h>
+#include <Arduino.h>
+#include <Wire.h>
+#include <SdFat.h>
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+///// Time /////
+
+static const std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+int64_t esp_timer_get_time() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - startTime).count();
+}
+
+uint32_t esp_cpu_get_ccount() {
+    const int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - startTime).count();
+    return (uint32_t)(ns * (HOST_CPU_FREQ_HZ / 1000000) / 1000);
+}
+
+/** Wait on a condition variable for some ticks (forever for portMAX_DELAY). Returns the predicate. */
+template <typename Predicate>
+static bool waitTicks(std::condition_variable& cv, std::unique_lock<std::mutex>& lock, TickType_t ticks, Predicate ready) {
+    if (ticks == portMAX_DELAY) { cv.wait(lock, ready); return true; }
+    return cv.wait_for(lock, std::chrono::milliseconds(ticks), ready);
+}
+
+
+///// Tasks /////
+
+struct HostTask {
+    TaskFunction_t function;
+    void* params;
+    std::mutex lock;
+    std::condition_variable notified;
+    uint32_t notifications = 0;
+};
+
+static thread_local HostTask* currentTask = NULL;
+
+static void* runTask(void* arg) {
+    currentTask = (HostTask*)arg;
+    currentTask->function(currentTask->params);
+    return NULL;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char* name, uint32_t stackDepth, void* params,
+                       UBaseType_t priority, TaskHandle_t* createdTask) {
+    (void)name; (void)stackDepth; (void)priority;
+    HostTask* task = new HostTask();
+    task->function = function;
+    task->params = params;
+    if (createdTask) { *createdTask = task; }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runTask, task) != 0) {
+        if (createdTask) { *createdTask = NULL; }
+        delete task;
+        return pdFAIL;
+    }
+    pthread_detach(thread);
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    if (task && task != currentTask) { fprintf(stderr, "!! Only a task can delete itself on the host\n"); abort(); }
+    pthread_exit(NULL); // the task object is kept since its handle may still be notified
+}
+
+void vTaskDelay(TickType_t ticks) {
+    if (ticks == portMAX_DELAY) { while (true) { std::this_thread::sleep_for(std::chrono::hours(1)); } }
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks));
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    if (!currentTask) { currentTask = new HostTask(); } // a thread that wasn't started by xTaskCreate()
+    return currentTask;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task) { (void)task; return 0; }
+
+uint32_t ulTaskNotifyTake(BaseType_t clearCountOnExit, TickType_t ticksToWait) {
+    HostTask* task = xTaskGetCurrentTaskHandle();
+    std::unique_lock<std::mutex> lock(task->lock);
+    waitTicks(task->notified, lock, ticksToWait, [task] { return task->notifications > 0; });
+    uint32_t count = task->notifications;
+    if (count) { task->notifications = clearCountOnExit ? 0 : count - 1; }
+    return count;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task) {
+    std::lock_guard<std::mutex> lock(task->lock);
+    task->notifications++;
+    task->notified.notify_all();
+    return pdPASS;
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t* higherPriorityTaskWoken) {
+    xTaskNotifyGive(task);
+    if (higherPriorityTaskWoken) { *higherPriorityTaskWoken = pdFALSE; }
+}
+
+
+///// Queues /////
+
+struct HostQueue {
+    const size_t length;
+    const size_t itemSize;
+    std::vector<uint8_t> items; // a ring of length items
+    size_t head = 0, count = 0;
+    std::mutex lock;
+    std::condition_variable changed;
+
+    HostQueue(size_t length, size_t itemSize) : length(length), itemSize(itemSize), items(length * itemSize) { }
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) { return length ? new HostQueue(length, itemSize) : NULL; }
+
+void vQueueDelete(QueueHandle_t queue) { delete queue; }
+
+BaseType_t xQueueSendToBack(QueueHandle_t queue, const void* item, TickType_t ticksToWait) {
+    std::unique_lock<std::mutex> lock(queue->lock);
+    if (!waitTicks(queue->changed, lock, ticksToWait, [queue] { return queue->count < queue->length; })) { return pdFALSE; }
+    if (queue->itemSize) { memcpy(&queue->items[(queue->head + queue->count) % queue->length * queue->itemSize], item, queue->itemSize); }
+    queue->count++;
+    queue->changed.notify_all();
+    return pdTRUE;
+}
+
+/** Take (or just copy) the item at the front of the queue. */
+static BaseType_t receive(QueueHandle_t queue, void* item, TickType_t ticksToWait, bool remove) {
+    std::unique_lock<std::mutex> lock(queue->lock);
+    if (!waitTicks(queue->changed, lock, ticksToWait, [queue] { return queue->count > 0; })) { return pdFALSE; }
+    if (queue->itemSize) { memcpy(item, &queue->items[queue->head * queue->itemSize], queue->itemSize); }
+    if (remove) {
+        queue->head = (queue->head + 1) % queue->length;
+        queue->count--;
+        queue->changed.notify_all();
+    }
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticksToWait) { return receive(queue, item, ticksToWait, true); }
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticksToWait) { return receive(queue, item, ticksToWait, false); }
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t queue) {
+    std::lock_guard<std::mutex> lock(queue->lock);
+    return queue->count;
+}
+
+
+///// Arduino /////
+
+HostSerial Serial;
+TwoWire Wire;
+
+void yield() { std::this_thread::yield(); }
+
+int HostSerial::printf(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int n = vprintf(format, args);
+    va_end(args);
+    return n;
+}
+
+
+///// SdFat /////
+
+static std::string hostRoot = ".";
+
+void SdFs::setHostRoot(const char* path) { hostRoot = path; }
+
+/** The host path of a path on the card. */
+static std::string hostPath(const char* path) { return hostRoot + (path[0] == '/' ? "" : "/") + path; }
+
+FsFile SdFs::open(const char* path, oflag_t oflag) {
+    if (!mounted) { return FsFile(); }
+    return FsFile(::open(hostPath(path).c_str(), oflag, 0644));
+}
+
+bool SdFs::exists(const char* path) { struct stat st; return mounted && stat(hostPath(path).c_str(), &st) == 0; }
+
+bool SdFs::mkdir(const char* path) { return mounted && ::mkdir(hostPath(path).c_str(), 0755) == 0; }
+
+bool SdFs::remove(const char* path) { return mounted && unlink(hostPath(path).c_str()) == 0; }
+
+FsFile& FsFile::operator=(FsFile&& other) {
+    if (this != &other) {
+        close();
+        fd = other.fd;
+        other.fd = -1;
+    }
+    return *this;
+}
+
+bool FsFile::close() {
+    if (fd < 0) { return false; }
+    bool ok = ::close(fd) == 0;
+    fd = -1;
+    return ok;
+}
+
+int FsFile::read(void* buffer, size_t count) { return fd < 0 ? -1 : (int)::read(fd, buffer, count); }
+
+size_t FsFile::write(const void* buffer, size_t count) {
+    if (fd < 0) { return 0; }
+    ssize_t n = ::write(fd, buffer, count);
+    return n < 0 ? 0 : (size_t)n;
+}
+
+bool FsFile::seek(uint64_t position) { return fd >= 0 && lseek(fd, (off_t)position, SEEK_SET) == (off_t)position; }
+
+uint64_t FsFile::position() const {
+    off_t position = fd < 0 ? -1 : lseek(fd, 0, SEEK_CUR);
+    return position < 0 ? 0 : (uint64_t)position;
+}
+
+uint64_t FsFile::fileSize() const {
+    struct stat st;
+    return fd >= 0 && fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+bool FsFile::truncate(uint64_t length) { return fd >= 0 && ftruncate(fd, (off_t)length) == 0; }
+
+bool FsFile::preAllocate(uint64_t length) { (void)length; return fd >= 0 && fileSize() == 0; }
+
+bool FsFile::sync() { return fd >= 0 && fsync(fd) == 0; }
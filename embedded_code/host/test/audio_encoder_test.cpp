@@ -0,0 +1,322 @@
+/**
+ * Tests the recording encoders by decoding what they make from the test signals (silence, sines,
+ * a multitone, a sweep, noise, and impulses, with a delayed and attenuated right channel): the
+ * lossless encoder must give back exactly the same samples (checking the CRCs of each frame), and
+ * IMA ADPCM must be within its expected signal to noise ratio. The audio is given to the encoders in
+ * pieces that don't line up with their blocks (like the recording does after a partial chunk), and
+ * the last short block is flushed.
+ */
+
+#include "audio_encoder.hpp"
+#include "audio.h"
+#include "signal_gen.hpp"
+#include "check.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#define SAMPLE_RATE 48000
+#define SECONDS_PER_SIGNAL 1
+#define PIECE_FRAMES 1000   // frames given to the encoder at a time (not a multiple of any block)
+#define EXTRA_FRAMES 777    // a short last block
+
+// IMA ADPCM (see audio_encoder_IMA_ADPCM.cpp)
+#define ADPCM_BLOCK_ALIGN (1024 * REC_CHANNELS)
+#define ADPCM_SAMPLES_PER_BLOCK ((ADPCM_BLOCK_ALIGN - 4 * REC_CHANNELS) * 2 / REC_CHANNELS + 1)
+#define ADPCM_MIN_SNR_DB 22.0f        // for the tones and the sweep (they measure 26-47 dB)
+#define ADPCM_MIN_NOISE_SNR_DB 12.0f  // for white noise (it measures ~16 dB)
+
+// The audio task isn't linked, so the rate is fixed
+uint32_t getSampleRate() { return SAMPLE_RATE; }
+
+/** The test signals, one after another. */
+static std::vector<int16_t> makeSignals() {
+    SignalGenerator gen(SAMPLE_RATE);
+    const float tones[3] = { 220.0f, 1250.0f, 5300.0f };
+    const uint32_t frames = SAMPLE_RATE * SECONDS_PER_SIGNAL;
+    std::vector<int16_t> samples;
+    for (int signal = 0; signal < 7; signal++) {
+        switch (signal) {
+            case 0: gen.setSilence(); break;
+            case 1: gen.setSine(440.0f, 0.5f); gen.setStereo(3.5f, 0.7f); break;
+            case 2: gen.setSine(1000.0f, 1.0f); gen.setStereo(-10.0f, 1.0f); break; // full scale (the side channel needs 17 bits)
+            case 3: gen.setMultitone(tones, 3, 0.8f); gen.setStereo(0, 0.5f); break;
+            case 4: gen.setSweep(50.0f, 15000.0f, SECONDS_PER_SIGNAL, true, 0.5f); gen.setStereo(1.25f, 0.9f); break;
+            case 5: gen.setNoise(0.3f, 7); gen.setStereo(20.0f, 0.6f); break;
+            default: gen.setImpulses(0.01f, 0.9f); gen.setStereo(0, 1.0f); break;
+        }
+        const size_t start = samples.size();
+        samples.resize(start + frames * REC_CHANNELS);
+        gen.generate(&samples[start], frames);
+    }
+    samples.resize(samples.size() + EXTRA_FRAMES * REC_CHANNELS, 0);
+    return samples;
+}
+
+/** Encode interleaved frames a piece at a time and flush the encoder. */
+static std::vector<uint8_t> encodeAll(AudioEncoder* encoder, const std::vector<int16_t>& samples) {
+    const uint32_t frames = samples.size() / REC_CHANNELS;
+    std::vector<uint8_t> out;
+    std::vector<uint8_t> piece(encoder->maxEncodedSize(PIECE_FRAMES));
+    for (uint32_t i = 0; i < frames; i += PIECE_FRAMES) {
+        const uint32_t n = frames - i < PIECE_FRAMES ? frames - i : PIECE_FRAMES;
+        const uint32_t length = encoder->encode(&samples[i * REC_CHANNELS], n, piece.data());
+        CHECK(length <= piece.size());
+        out.insert(out.end(), piece.begin(), piece.begin() + length);
+    }
+    const uint32_t length = encoder->flush(piece.data());
+    out.insert(out.end(), piece.begin(), piece.begin() + length);
+    CHECK_EQ(encoder->framesEncoded(), frames);
+    return out;
+}
+
+
+///// IMA ADPCM Decoder /////
+
+static const int16_t STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+static const int8_t INDEX_TABLE[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/** Decode Microsoft IMA ADPCM blocks to interleaved frames. */
+static std::vector<int16_t> decodeADPCM(const std::vector<uint8_t>& data) {
+    std::vector<int16_t> out;
+    for (size_t block = 0; block + ADPCM_BLOCK_ALIGN <= data.size(); block += ADPCM_BLOCK_ALIGN) {
+        const uint8_t* p = &data[block];
+        int32_t predictor[REC_CHANNELS];
+        int32_t index[REC_CHANNELS];
+        const size_t start = out.size();
+        out.resize(start + ADPCM_SAMPLES_PER_BLOCK * REC_CHANNELS);
+        int16_t* frames = &out[start];
+        for (int ch = 0; ch < REC_CHANNELS; ch++) {
+            predictor[ch] = (int16_t)(p[0] | (p[1] << 8));
+            index[ch] = p[2] > 88 ? 88 : p[2];
+            frames[ch] = (int16_t)predictor[ch];
+            p += 4;
+        }
+        for (int group = 0; group < (ADPCM_SAMPLES_PER_BLOCK - 1) / 8; group++) {
+            for (int ch = 0; ch < REC_CHANNELS; ch++) {
+                for (int i = 0; i < 8; i++) {
+                    const uint8_t nibble = (i & 1) ? (p[i / 2] >> 4) : (p[i / 2] & 0x0F);
+                    const int32_t step = STEP_TABLE[index[ch]];
+                    int32_t delta = step >> 3;
+                    if (nibble & 4) { delta += step; }
+                    if (nibble & 2) { delta += step >> 1; }
+                    if (nibble & 1) { delta += step >> 2; }
+                    predictor[ch] += (nibble & 8) ? -delta : delta;
+                    predictor[ch] = predictor[ch] > 32767 ? 32767 : predictor[ch] < -32768 ? -32768 : predictor[ch];
+                    index[ch] += INDEX_TABLE[nibble];
+                    index[ch] = index[ch] < 0 ? 0 : index[ch] > 88 ? 88 : index[ch];
+                    frames[(1 + group * 8 + i) * REC_CHANNELS + ch] = (int16_t)predictor[ch];
+                }
+                p += 4;
+            }
+        }
+    }
+    return out;
+}
+
+
+///// FLAC Decoder /////
+
+/** Reads bits MSB-first. */
+struct BitReader {
+    const uint8_t* data;
+    size_t size, pos = 0; // in bits
+
+    BitReader(const uint8_t* data, size_t bytes) : data(data), size(bytes * 8) {}
+
+    bool ok() const { return pos <= size; }
+    size_t bytePos() const { return pos / 8; }
+
+    uint32_t get(int n) {
+        uint32_t value = 0;
+        for (int i = 0; i < n; i++, pos++) {
+            const uint32_t bit = pos < size ? (data[pos / 8] >> (7 - pos % 8)) & 1 : 0;
+            value = (value << 1) | bit;
+        }
+        return value;
+    }
+    int32_t getSigned(int n) { return (int32_t)(get(n) << (32 - n)) >> (32 - n); }
+    uint32_t getUnary() { uint32_t q = 0; while (ok() && get(1) == 0) { q++; } return q; }
+    void align() { pos = (pos + 7) & ~(size_t)7; }
+};
+
+static uint8_t crc8(const uint8_t* data, size_t length) {
+    uint8_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) { crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1); }
+    }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t* data, size_t length) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint16_t)(data[i] << 8);
+        for (int bit = 0; bit < 8; bit++) { crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1); }
+    }
+    return crc;
+}
+
+/** Decode a subframe of n samples of the given size. Returns false if it isn't one the encoder makes. */
+static bool decodeSubframe(BitReader& r, uint32_t n, int bps, int32_t* out) {
+    const uint32_t header = r.get(8);
+    const uint32_t type = (header >> 1) & 0x3F;
+    if ((header & 0x81) != 0) { return false; } // padding and wasted bits
+    if (type == 0) {
+        const int32_t value = r.getSigned(bps);
+        for (uint32_t i = 0; i < n; i++) { out[i] = value; }
+        return true;
+    }
+    if (type == 1) {
+        for (uint32_t i = 0; i < n; i++) { out[i] = r.getSigned(bps); }
+        return true;
+    }
+    if (type < 8 || type > 12) { return false; }
+    const uint32_t order = type & 7;
+    for (uint32_t i = 0; i < order; i++) { out[i] = r.getSigned(bps); }
+    if (r.get(2) != 0 || r.get(4) != 0) { return false; } // 4-bit Rice parameters, one partition
+    const int k = (int)r.get(4);
+    for (uint32_t i = order; i < n; i++) {
+        const uint32_t u = (r.getUnary() << k) | (k ? r.get(k) : 0);
+        const int32_t residual = (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+        const int32_t* x = &out[i];
+        int32_t prediction = 0;
+        switch (order) {
+            case 1: prediction = x[-1]; break;
+            case 2: prediction = 2*x[-1] - x[-2]; break;
+            case 3: prediction = 3*x[-1] - 3*x[-2] + x[-3]; break;
+            case 4: prediction = 4*x[-1] - 6*x[-2] + 4*x[-3] - x[-4]; break;
+        }
+        out[i] = prediction + residual;
+    }
+    return true;
+}
+
+/** Decode the FLAC frames of the lossless encoder to interleaved frames, checking their CRCs. */
+static std::vector<int16_t> decodeFLAC(const std::vector<uint8_t>& data, uint32_t* badFrames) {
+    std::vector<int16_t> out;
+    std::vector<int32_t> channels[2];
+    *badFrames = 0;
+    size_t start = 0;
+    for (uint32_t frameNumber = 0; start < data.size(); frameNumber++) {
+        BitReader r(&data[start], data.size() - start);
+        bool ok = r.get(16) == 0xFFF8;
+        const uint32_t sizeCode = r.get(4);
+        const uint32_t rateCode = r.get(4);
+        const uint32_t assignment = r.get(4);
+        ok = ok && r.get(3) == 4 && r.get(1) == 0; // 16 bits
+        uint32_t number = r.get(8);
+        if (number >= 0x80) { // extended UTF-8
+            int more = 0;
+            while (number & (0x40 >> more)) { more++; }
+            number &= 0x3F >> more;
+            for (int i = 0; i < more; i++) { number = (number << 6) | (r.get(8) & 0x3F); }
+        }
+        ok = ok && number == frameNumber;
+        const uint32_t n = sizeCode == 12 ? 4096 : sizeCode == 7 ? r.get(16) + 1 : 0;
+        if (rateCode == 12) { r.get(8); } else if (rateCode == 13 || rateCode == 14) { r.get(16); }
+        ok = ok && rateCode == 10 && n > 0; // 48 kHz
+        ok = ok && crc8(&data[start], r.bytePos()) == r.get(8);
+        if (!ok) { (*badFrames)++; break; }
+
+        for (int ch = 0; ch < REC_CHANNELS; ch++) {
+            // The side channel has an extra bit
+            const bool side = (assignment == 8 && ch == 1) || (assignment == 9 && ch == 0) || (assignment == 10 && ch == 1);
+            channels[ch].resize(n);
+            if (!decodeSubframe(r, n, side ? 17 : 16, channels[ch].data())) { ok = false; break; }
+        }
+        r.align();
+        const size_t length = r.bytePos() + 2;
+        ok = ok && r.ok() && start + length <= data.size() && crc16(&data[start], r.bytePos()) == r.get(16);
+        if (!ok) { (*badFrames)++; break; }
+
+        for (uint32_t i = 0; i < n; i++) {
+            int32_t a = channels[0][i], b = channels[1][i], left = a, right = b;
+            if (assignment == 8) { right = a - b; }
+            else if (assignment == 9) { left = a + b; }
+            else if (assignment == 10) { const int32_t mid = (a << 1) | (b & 1); left = (mid + b) >> 1; right = (mid - b) >> 1; }
+            out.push_back((int16_t)left);
+            out.push_back((int16_t)right);
+        }
+        start += length;
+    }
+    return out;
+}
+
+
+///// Tests /////
+
+/** Signal to noise ratio (dB) of decoded against the original, for part of the frames. */
+static float snr(const std::vector<int16_t>& original, const std::vector<int16_t>& decoded, size_t firstFrame, size_t frames) {
+    double signal = 0, noise = 0;
+    for (size_t i = firstFrame * REC_CHANNELS; i < (firstFrame + frames) * REC_CHANNELS; i++) {
+        const double e = (double)decoded[i] - original[i];
+        signal += (double)original[i] * original[i];
+        noise += e * e;
+    }
+    return noise == 0 ? 200.0f : (float)(10 * log10(signal / noise));
+}
+
+/** The lossless encoder gives back exactly the same samples and compresses the tones. */
+static void testLossless(const std::vector<int16_t>& samples) {
+    AudioEncoder* encoder = create_audio_encoder(ENCODING_LOSSLESS);
+    CHECK(encoder != NULL);
+    if (!encoder) { return; }
+    const std::vector<uint8_t> encoded = encodeAll(encoder, samples);
+    uint32_t badFrames;
+    const std::vector<int16_t> decoded = decodeFLAC(encoded, &badFrames);
+    CHECK_EQ(badFrames, 0);
+    CHECK_EQ(decoded.size(), samples.size());
+    CHECK(decoded == samples);
+    const float ratio = (float)(samples.size() * sizeof(int16_t)) / encoded.size();
+    printf("  lossless: %u bytes to %u (%.2f:1), bit-exact: %s\n", (unsigned)(samples.size() * sizeof(int16_t)),
+        (unsigned)encoded.size(), ratio, decoded == samples ? "yes" : "no");
+    CHECK(ratio > 1.5f);
+    delete encoder;
+}
+
+/** IMA ADPCM is 4:1 and the tones come back within its expected SNR. */
+static void testADPCM(const std::vector<int16_t>& samples) {
+    AudioEncoder* encoder = create_audio_encoder(ENCODING_IMA_ADPCM);
+    CHECK(encoder != NULL);
+    if (!encoder) { return; }
+    const std::vector<uint8_t> encoded = encodeAll(encoder, samples);
+    const uint32_t frames = samples.size() / REC_CHANNELS;
+    CHECK_EQ(encoded.size(), (frames + ADPCM_SAMPLES_PER_BLOCK - 1) / ADPCM_SAMPLES_PER_BLOCK * ADPCM_BLOCK_ALIGN);
+    const std::vector<int16_t> decoded = decodeADPCM(encoded);
+    CHECK(decoded.size() >= samples.size()); // the last block is padded
+    if (decoded.size() < samples.size()) { delete encoder; return; }
+
+    const uint32_t perSignal = SAMPLE_RATE * SECONDS_PER_SIGNAL;
+    // Impulses aren't checked: the step size can't follow them, so they come back smeared
+    const char* names[6] = { "silence", "sine", "full-scale sine", "multitone", "sweep", "noise" };
+    for (int signal = 1; signal < 6; signal++) {
+        // Skip the first block of each signal (the step size adapts to it)
+        const float db = snr(samples, decoded, signal * perSignal + ADPCM_SAMPLES_PER_BLOCK, perSignal - ADPCM_SAMPLES_PER_BLOCK);
+        printf("  IMA ADPCM: %-15s SNR %.1f dB\n", names[signal], db);
+        CHECK(db >= (signal < 5 ? ADPCM_MIN_SNR_DB : ADPCM_MIN_NOISE_SNR_DB));
+    }
+    // Silence stays silent
+    bool silent = true;
+    for (uint32_t i = 0; i < perSignal * REC_CHANNELS; i++) { silent &= decoded[i] == 0; }
+    CHECK(silent);
+    delete encoder;
+}
+
+int main() {
+    const std::vector<int16_t> samples = makeSignals();
+    testLossless(samples);
+    testADPCM(samples);
+    return checkResult("audio_encoder_test");
+}
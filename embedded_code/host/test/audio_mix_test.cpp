@@ -0,0 +1,216 @@
+/**
+ * Tests the mixing kernels: sums and gains saturate at 32767 and -32768 instead of wrapping around,
+ * odd Q15 and Q12 products round to the nearest sample (halves up), crossfades start exactly at a,
+ * end at b, and join up across blocks (both ways), and the stereo path that handles a frame per
+ * 32-bit load and store gives the same samples as the one sample at a time path it skips. It is
+ * built with the undefined behavior sanitizer, so shifts of negative values or overflows fail it.
+ */
+
+#include "audio_mix.h"
+#include "check.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FRAMES 257  // odd, so the fast paths leave a sample for the scalar loop
+
+/** A random sample, often at or near full scale. */
+static int16_t randomSample() {
+    const int r = rand();
+    switch (r & 7) {
+        case 0: return 32767;
+        case 1: return -32768;
+        case 2: return (int16_t)(32767 - (r >> 3) % 16);
+        default: return (int16_t)((r >> 3) % 65536 - 32768);
+    }
+}
+
+static void fill(int16_t* samples, uint32_t length) {
+    for (uint32_t i = 0; i < length; i++) { samples[i] = randomSample(); }
+}
+
+/** The mix of a sample, rounded to the nearest with halves going up. */
+static int32_t referenceMix(int32_t a, int32_t b, int32_t ratioQ15) {
+    return b + (int32_t)floor((double)(a - b) * ratioQ15 / Q15_ONE + 0.5);
+}
+
+static int32_t referenceGain(int32_t x, int32_t gainQ12) {
+    const int32_t y = (int32_t)floor((double)x * gainQ12 / GAIN_Q12_ONE + 0.5);
+    return y > 32767 ? 32767 : y < -32768 ? -32768 : y;
+}
+
+/** Sums and gains clip at full scale (never wrap around to the other sign). */
+static void testSaturation() {
+    const int16_t a[8] = { 30000, -30000, 32767, -32768, -32768, 32767, 1, -1 };
+    const int16_t b[8] = { 30000, -30000, 1, -1, 32767, 32767, -1, -32768 };
+    const int16_t sum[8] = { 32767, -32768, 32767, -32768, -1, 32767, 0, -32768 };
+    int16_t out[2 * 16];
+    addAudio(a, b, 8, out);
+    for (int i = 0; i < 8; i++) { CHECK_EQ(out[i], sum[i]); }
+
+    // Just under 8x, and a gain beyond the Q12 range is held there
+    const int16_t x[4] = { 32767, -32768, 5000, -5000 };
+    gainAudio(x, 4, 32767, out);
+    CHECK_EQ(out[0], 32767);
+    CHECK_EQ(out[1], -32768);
+    CHECK_EQ(out[2], 32767);
+    CHECK_EQ(out[3], -32768);
+    int16_t held[4];
+    gainAudio(x, 4, 65535, held);
+    CHECK(memcmp(out, held, sizeof(held)) == 0);
+    gainAudio(x, 4, GAIN_Q12_ONE, out);
+    CHECK(memcmp(out, x, sizeof(x)) == 0);
+
+    // Ramping up a full-scale block stays at full scale
+    int16_t full[2 * 16];
+    for (int i = 0; i < 2 * 16; i++) { full[i] = (i & 1) ? -32768 : 32767; }
+    rampGainAudio(full, 16, 2, GAIN_Q12_ONE, 32767, out);
+    for (int i = 0; i < 2 * 16; i++) { CHECK_EQ(out[i], full[i]); }
+
+    // Mixes across the whole range are always between their inputs
+    const int16_t top[2] = { 32767, -32768 }, bottom[2] = { -32768, 32767 };
+    mixAudio(top, bottom, 2, 32767, out);
+    CHECK_EQ(out[0], referenceMix(32767, -32768, 32767));
+    CHECK_EQ(out[1], referenceMix(-32768, 32767, 32767));
+    CHECK(out[0] > 0 && out[1] < 0);
+}
+
+/** Odd products round to the nearest sample, with halves going up (towards positive). */
+static void testRounding() {
+    // a * 0.5 with odd a
+    const int16_t a[6] = { 1, -1, 3, -3, 32767, -32767 };
+    const int16_t zero[6] = { 0 };
+    const int16_t half[6] = { 1, 0, 2, -1, 16384, -16383 };
+    int16_t out[6];
+    mixAudio(a, zero, 6, Q15_ONE / 2, out);
+    for (int i = 0; i < 6; i++) { CHECK_EQ(out[i], half[i]); }
+    gainAudio(a, 6, GAIN_Q12_ONE / 2, out);
+    for (int i = 0; i < 6; i++) { CHECK_EQ(out[i], half[i]); }
+
+    // Everything else rounds to the nearest
+    int failures = 0;
+    for (int i = 0; i < 100000; i++) {
+        const int16_t x = randomSample(), y = randomSample();
+        const int16_t ratio = (int16_t)(rand() % Q15_ONE) | 1;
+        const uint16_t gain = (uint16_t)(rand() % 32768) | 1;
+        int16_t mixed, gained;
+        mixAudio(&x, &y, 1, ratio, &mixed);
+        gainAudio(&x, 1, gain, &gained);
+        if (mixed != referenceMix(x, y, ratio) || gained != referenceGain(x, gain)) { failures++; }
+    }
+    CHECK_EQ(failures, 0);
+}
+
+/** Crossfades start at a, end at b, and blocks join up, for 1 and 2 channels, both ways. */
+static void testCrossfade() {
+    for (uint8_t channels = 1; channels <= 2; channels++) {
+        const uint32_t length = FRAMES * channels;
+        int16_t a[2 * FRAMES], b[2 * FRAMES], out[2 * FRAMES];
+        fill(a, length);
+        fill(b, length);
+
+        // All of a at the first frame, and all of b at the top (32767 is 1/32768 short of it, so
+        // full-scale differences come up to 2 short)
+        crossfadeAudio(a, b, FRAMES, channels, 0, 32767, out);
+        CHECK(memcmp(out, a, channels * sizeof(int16_t)) == 0);
+        crossfadeAudio(a, b, FRAMES, channels, 32767, 32767, out);
+        bool nearB = true;
+        for (uint32_t i = 0; i < length; i++) { nearB &= out[i] == referenceMix(b[i], a[i], 32767) && abs(out[i] - b[i]) <= 2; }
+        CHECK(nearB);
+
+        // Negative ratios count as 0 (like mixAudio())
+        crossfadeAudio(a, b, FRAMES, channels, -100, -1, out);
+        CHECK(memcmp(out, a, length * sizeof(int16_t)) == 0);
+
+        // Two blocks from 0 to 16384 and 16384 to 32767 join up: the first frame of the second
+        // block is exactly halfway, and every frame is close to one crossfade over both
+        int16_t a2[4 * FRAMES], b2[4 * FRAMES], whole[4 * FRAMES], halves[4 * FRAMES];
+        fill(a2, 2 * length);
+        fill(b2, 2 * length);
+        for (int down = 0; down < 2; down++) {
+            const int16_t from = down ? 32767 : 0, to = down ? 0 : 32767;
+            crossfadeAudio(a2, b2, 2 * FRAMES, channels, from, to, whole);
+            crossfadeAudio(a2, b2, FRAMES, channels, from, Q15_ONE / 2, halves);
+            crossfadeAudio(&a2[length], &b2[length], FRAMES, channels, Q15_ONE / 2, to, &halves[length]);
+            for (uint8_t ch = 0; ch < channels; ch++) {
+                CHECK_EQ(halves[length + ch], referenceMix(b2[length + ch], a2[length + ch], Q15_ONE / 2));
+            }
+            int worst = 0;
+            for (uint32_t i = 0; i < 2 * length; i++) { worst = abs(whole[i] - halves[i]) > worst ? abs(whole[i] - halves[i]) : worst; }
+            CHECK(worst <= 2);
+            // Fading down gets within a step of a by the last frame
+            if (down) {
+                bool nearA = true;
+                for (uint32_t i = 2 * length - channels; i < 2 * length; i++) {
+                    nearA &= abs(whole[i] - a2[i]) <= abs(b2[i] - a2[i]) / (2 * FRAMES) + 1;
+                }
+                CHECK(nearA);
+            }
+        }
+    }
+}
+
+/**
+ * The stereo path (whole frames with 32-bit loads and stores) gives the same samples as the sample
+ * at a time path, which is taken when the buffers aren't 4-byte aligned. The output can be an input.
+ */
+static void testStereoFastPath() {
+    const uint32_t length = 2 * FRAMES;
+    // The slow copies start one sample along, so they aren't aligned
+    static int32_t aWords[FRAMES + 1], bWords[FRAMES + 1], fastWords[FRAMES + 1];
+    static int32_t aSlowWords[FRAMES + 1], bSlowWords[FRAMES + 1], slowWords[FRAMES + 1];
+    int16_t* a = (int16_t*)aWords;
+    int16_t* b = (int16_t*)bWords;
+    int16_t* fast = (int16_t*)fastWords;
+    int16_t* aSlow = (int16_t*)aSlowWords + 1;
+    int16_t* bSlow = (int16_t*)bSlowWords + 1;
+    int16_t* slow = (int16_t*)slowWords + 1;
+    fill(a, length);
+    fill(b, length);
+    memcpy(aSlow, a, length * sizeof(int16_t));
+    memcpy(bSlow, b, length * sizeof(int16_t));
+    auto same = [&]() { return memcmp(fast, slow, length * sizeof(int16_t)) == 0; };
+
+    const int16_t ratios[4] = { 0, 1, 12345, 32767 };
+    for (int16_t ratio : ratios) {
+        mixAudio(a, b, length - 1, ratio, fast);
+        mixAudio(aSlow, bSlow, length - 1, ratio, slow);
+        CHECK(memcmp(fast, slow, (length - 1) * sizeof(int16_t)) == 0);
+    }
+    addAudio(a, b, length, fast);
+    addAudio(aSlow, bSlow, length, slow);
+    CHECK(same());
+    const uint16_t gains[4] = { 0, 1, GAIN_Q12_ONE + 123, 32767 };
+    for (uint16_t gain : gains) {
+        gainAudio(a, length, gain, fast);
+        gainAudio(aSlow, length, gain, slow);
+        CHECK(same());
+    }
+    const int16_t fades[4][2] = { { 0, 32767 }, { 32767, 0 }, { 1000, 1001 }, { 20000, 3 } };
+    for (const int16_t* fade : fades) {
+        crossfadeAudio(a, b, FRAMES, 2, fade[0], fade[1], fast);
+        crossfadeAudio(aSlow, bSlow, FRAMES, 2, fade[0], fade[1], slow);
+        CHECK(same());
+        rampGainAudio(a, FRAMES, 2, (uint16_t)fade[0], (uint16_t)fade[1] / 4, fast);
+        rampGainAudio(aSlow, FRAMES, 2, (uint16_t)fade[0], (uint16_t)fade[1] / 4, slow);
+        CHECK(same());
+    }
+
+    // In place
+    memcpy(fast, a, length * sizeof(int16_t));
+    memcpy(slow, a, length * sizeof(int16_t));
+    crossfadeAudio(fast, b, FRAMES, 2, 32767, 0, fast);
+    crossfadeAudio(slow, bSlow, FRAMES, 2, 32767, 0, slow);
+    CHECK(same());
+}
+
+int main() {
+    srand(1);
+    testSaturation();
+    testRounding();
+    testCrossfade();
+    testStereoFastPath();
+    return checkResult("audio_mix_test");
+}
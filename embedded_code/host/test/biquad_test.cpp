@@ -0,0 +1,146 @@
+/**
+ * Tests the biquad cascades: a 360 Hz low-pass measures its designed response in both the float and
+ * the integer (Q30) versions at 44.1 and 48 kHz, and the two agree to within a few LSBs. Also times
+ * them against the 1-pole low-pass of the hear-through path (on the host, so only the ratios mean
+ * anything for the ESP32; see benchmarkFilters() for the device).
+ */
+
+#include "biquad.hpp"
+#include "check.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+#define TEST_FRAMES 1024 // a block of stereo frames
+#define SETTLE_BLOCKS 16 // blocks to let a filter settle before measuring
+#define BENCH_BLOCKS 20000
+
+/** The 1-pole low-pass of the hear-through path (see hearThroughFilter() in audio.cpp). */
+static void onePoleLowPass(const int16_t* in, int16_t* out, size_t numSamples, float alpha) {
+    static float prev[2] = { 0.0f, 0.0f };
+    for (size_t i = 0; i < numSamples; i += 2) {
+        for (int ch = 0; ch < 2; ++ch) {
+            prev[ch] = alpha * in[i + ch] + (1 - alpha) * prev[ch];
+            out[i + ch] = (int16_t)prev[ch];
+        }
+    }
+}
+
+/** Fill a block of stereo frames with a sine (-6 dBFS), continuing from the frame at offset. */
+static void sineBlock(int16_t* block, float frequency, float sampleRate, uint32_t offset) {
+    for (uint32_t i = 0; i < TEST_FRAMES; i++) {
+        block[2 * i] = block[2 * i + 1] = (int16_t)lrint(16384 * sin(2 * M_PI * frequency * ((i + offset) / (double)sampleRate)));
+    }
+}
+
+/**
+ * The gain in dB of a filter at a frequency (a multiple of 10 Hz), measured with a sine over the
+ * 0.1 s (a whole number of cycles) after it settles. If there is a reference filter, the largest
+ * difference between the outputs is kept in maxDifference.
+ */
+template <typename Filter>
+static double measureGainDb(Filter& filter, float frequency, float sampleRate, BiquadCascade* reference = NULL, double* maxDifference = NULL) {
+    int16_t in[2 * TEST_FRAMES], out[2 * TEST_FRAMES], expected[2 * TEST_FRAMES];
+    const uint32_t start = SETTLE_BLOCKS * TEST_FRAMES, end = start + (uint32_t)sampleRate / 10;
+    double inSum = 0, outSum = 0;
+    filter.reset();
+    if (reference) { reference->reset(); }
+    for (uint32_t offset = 0; offset < end; offset += TEST_FRAMES) {
+        sineBlock(in, frequency, sampleRate, offset);
+        filter.process(in, out, TEST_FRAMES);
+        if (reference) { reference->process(in, expected, TEST_FRAMES); }
+        for (uint32_t i = 0; i < TEST_FRAMES; i++) {
+            if (offset + i < start || offset + i >= end) { continue; }
+            inSum += (double)in[2 * i] * in[2 * i];
+            outSum += (double)out[2 * i + 1] * out[2 * i + 1];
+            if (reference) {
+                for (int ch = 0; ch < 2; ch++) {
+                    const double difference = fabs((double)out[2 * i + ch] - expected[2 * i + ch]);
+                    if (difference > *maxDifference) { *maxDifference = difference; }
+                }
+            }
+        }
+    }
+    return 10 * log10(outSum / inSum);
+}
+
+/** The response in dB of biquad coefficients at a frequency (worked out in double). */
+static double responseDb(const BiquadCoeffs& c, double frequency, double sampleRate) {
+    const double w = 2 * M_PI * frequency / sampleRate;
+    const double nr = c.b0 + c.b1 * cos(w) + c.b2 * cos(2 * w), ni = -c.b1 * sin(w) - c.b2 * sin(2 * w);
+    const double dr = 1 + c.a1 * cos(w) + c.a2 * cos(2 * w), di = -c.a1 * sin(w) - c.a2 * sin(2 * w);
+    return 10 * log10((nr * nr + ni * ni) / (dr * dr + di * di));
+}
+
+/** A 360 Hz low-pass has the response it was designed for in both versions. */
+static void testLowPassResponse(float sampleRate) {
+    const BiquadCoeffs lowpass = designBiquad(BIQUAD_LOWPASS, 360, 0.7071f, 0, sampleRate);
+    BiquadCascade filter(2);
+    BiquadCascadeQ15 filterQ15(2);
+    CHECK(filter.addStage(lowpass));
+    CHECK(filterQ15.addStage(lowpass));
+
+    const float frequencies[4] = { 50, 360, 1000, 3600 }; // multiples of 10 Hz
+    double maxDifference = 0;
+    for (float frequency : frequencies) {
+        const double expected = responseDb(lowpass, frequency, sampleRate);
+        const double gain = measureGainDb(filter, frequency, sampleRate);
+        const double gainQ15 = measureGainDb(filterQ15, frequency, sampleRate, &filter, &maxDifference);
+        printf("  %5.0f Hz at %5.0f Hz: %6.2f dB float, %6.2f dB Q30 (designed %6.2f dB)\n",
+            frequency, sampleRate, gain, gainQ15, expected);
+        CHECK(fabs(gain - expected) < 0.05);
+        CHECK(fabs(gainQ15 - expected) < 0.05);
+    }
+    CHECK(fabs(responseDb(lowpass, 360, sampleRate) + 3.01) < 0.05); // the cutoff is where it was designed
+    printf("  largest difference between float and Q30: %.0f LSB\n", maxDifference);
+    // Direct form I rounds each output, so it only drifts from the float version by a few LSBs
+    CHECK(maxDifference <= 4);
+}
+
+/** Coefficients that don't fit in Q30 (an unstable filter or a big boost) are refused. */
+static void testQ15Limits() {
+    BiquadCascadeQ15 filter(1);
+    const BiquadCoeffs tooBig = { 2.5f, 0, 0, 0, 0 };
+    CHECK(!filter.addStage(tooBig));
+    const BiquadCoeffs lowpass = designBiquad(BIQUAD_LOWPASS, 360, 0.7071f, 0, 48000);
+    for (int i = 0; i < BIQUAD_MAX_STAGES; i++) { CHECK(filter.addStage(lowpass)); }
+    CHECK(!filter.addStage(lowpass));
+    CHECK_EQ(filter.size(), BIQUAD_MAX_STAGES);
+}
+
+/** The nanoseconds per sample to run code BENCH_BLOCKS times over a block. */
+template <typename Code>
+static double timeNsPerSample(Code code) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCH_BLOCKS; i++) { code(); }
+    const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / ((double)BENCH_BLOCKS * 2 * TEST_FRAMES);
+}
+
+/** Print how long the filters take next to the 1-pole low-pass of the hear-through path. */
+static void benchmarkFilters() {
+    static int16_t in[2 * TEST_FRAMES], out[2 * TEST_FRAMES];
+    for (uint32_t i = 0; i < 2 * TEST_FRAMES; i++) { in[i] = (int16_t)(rand() - RAND_MAX / 2); }
+    const BiquadCoeffs lowpass = designBiquad(BIQUAD_LOWPASS, 360, 0.7071f, 0, 48000);
+    BiquadCascade filter(2);
+    BiquadCascadeQ15 filterQ15(2);
+    filter.addStage(lowpass);
+    filterQ15.addStage(lowpass);
+
+    const double onePole = timeNsPerSample([&] { onePoleLowPass(in, out, 2 * TEST_FRAMES, 0.05f); });
+    const double biquad = timeNsPerSample([&] { filter.process(in, out, TEST_FRAMES); });
+    const double biquadQ15 = timeNsPerSample([&] { filterQ15.process(in, out, TEST_FRAMES); });
+    printf("  1-pole (hear-through)      %6.2f ns/sample\n", onePole);
+    printf("  biquad (float)             %6.2f ns/sample (%.2fx)\n", biquad, biquad / onePole);
+    printf("  biquad (Q30)               %6.2f ns/sample (%.2fx)\n", biquadQ15, biquadQ15 / onePole);
+}
+
+int main() {
+    testLowPassResponse(44100);
+    testLowPassResponse(48000);
+    testQ15Limits();
+    benchmarkFilters();
+    return checkResult("biquad_test");
+}
@@ -0,0 +1,31 @@
+/**
+ * The few helpers the host tests share. Each test is a program that runs its checks, prints the
+ * ones that fail, and returns nonzero if any did (see add_test() in host/CMakeLists.txt).
+ */
+
+#pragma once
+
+#include <stdio.h>
+
+static int checkFailures = 0;
+
+/** Check that a condition holds, printing it if it doesn't (the test keeps going). */
+#define CHECK(condition) do { \
+    if (!(condition)) { printf("!! %s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); checkFailures++; } \
+} while (0)
+
+/** Check that two integers are equal, printing both if they aren't. */
+#define CHECK_EQ(actual, expected) do { \
+    long long actual_ = (long long)(actual), expected_ = (long long)(expected); \
+    if (actual_ != expected_) { \
+        printf("!! %s:%d: CHECK_EQ(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #actual, #expected, actual_, expected_); \
+        checkFailures++; \
+    } \
+} while (0)
+
+/** The exit code of a test: prints a summary and returns nonzero if any checks failed. */
+static inline int checkResult(const char* test) {
+    if (checkFailures) { printf("%s: %d checks failed\n", test, checkFailures); }
+    else { printf("%s: all checks passed\n", test); }
+    return checkFailures ? 1 : 0;
+}
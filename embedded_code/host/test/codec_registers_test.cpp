@@ -0,0 +1,215 @@
+/**
+ * Tests the codec register writes against MockCodecBus: the ES8388 driver sets itself up in a
+ * handful of burst transactions and its volume is posted to the writer task, unchanged registers
+ * aren't written again, and the WM8960's 9-bit registers are sent one at a time. The WM8960 driver
+ * itself sets up through the SparkFun library, so only its register format is tested here.
+ */
+
+#include "audio_codec.hpp"
+#include "clock_signal.hpp"
+#include "codec_registers.hpp"
+#include "check.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// The ES8388 on the bus (see audio_codec_ES8388.cpp)
+#define ES8388_ADDR 0x20
+#define ES8388_DACPOWER 0x04
+#define ES8388_ADCCONTROL1 0x09
+#define ES8388_DACCONTROL2 0x18
+#define ES8388_DACCONTROL3 0x19
+#define ES8388_DACCONTROL4 0x1a
+#define ES8388_DACCONTROL5 0x1b
+#define ES8388_DACCONTROL26 0x30
+
+// The WM8960 headphone volumes (see audio_codec_WM8960.cpp)
+#define WM8960_ADDR 0x1A
+#define WM8960_LOUT1_VOLUME 0x02
+#define WM8960_ROUT1_VOLUME 0x03
+#define WM8960_OUT1VU (1 << 8)
+
+// The longest the writer task may take to send posted writes
+#define WRITER_TIMEOUT_MS 1000
+
+
+///// Stand-ins for the hardware used by the ES8388 driver /////
+
+static MockCodecBus* es8388Bus = NULL;
+
+CodecBus* create_i2c_codec_bus(TwoWire* wire) {
+    (void)wire;
+    es8388Bus = new MockCodecBus(ES8388_ADDR, CODEC_REGS_8BIT);
+    return es8388Bus;
+}
+
+ClockSignal::ClockSignal(uint32_t frequency, int gpio) { (void)frequency; (void)gpio; }
+ClockSignal::~ClockSignal() { }
+esp_err_t ClockSignal::pause() { return ESP_OK; }
+esp_err_t ClockSignal::resume() { return ESP_OK; }
+
+
+/** Wait for the writer task to send both DAC volumes with the given value. */
+static bool waitForVolume(MockCodecBus* bus, uint8_t value) {
+    for (uint32_t waited = 0; bus->get(ES8388_DACCONTROL4) != value || bus->get(ES8388_DACCONTROL5) != value; waited++) {
+        if (waited >= WRITER_TIMEOUT_MS) { return false; }
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+    return true;
+}
+
+/** The ES8388 is set up in 14 bursts and its volume is posted, skipping unchanged values. */
+static void testES8388() {
+    AudioCodec* codec = create_audio_codec();
+    CHECK(es8388Bus != NULL);
+    if (!es8388Bus) { return; }
+    MockCodecBus* bus = es8388Bus;
+
+    CHECK(!codec->setup(47000));
+    CHECK_EQ(bus->getTransactions(), 0);
+
+    // 29 registers: the runs of consecutive ones are single bursts, each register is a byte and
+    // each transaction has the starting register
+    CHECK(codec->setup(48000));
+    CHECK_EQ(bus->getTransactions(), 14);
+    CHECK_EQ(bus->getBytes(), 29 + 14);
+    CHECK_EQ(bus->get(ES8388_DACCONTROL3), 0);              // unmuted at the end
+    CHECK_EQ(bus->get(ES8388_DACPOWER), (1 << 4) | (1 << 2)); // LOUT2 and ROUT2
+    CHECK_EQ(bus->get(ES8388_DACCONTROL2), 0b00010);        // single speed, MCLK/256
+    CHECK_EQ(bus->get(ES8388_ADCCONTROL1), 0xbb);
+    CHECK_EQ(bus->get(ES8388_DACCONTROL26), 0x1e);          // OUT2 at 0 dB
+    CHECK_EQ(bus->get(ES8388_DACCONTROL4), 0);
+
+    // 0 dB was written by the setup, so nothing is sent
+    bus->resetCounts();
+    codec->setVolume(73);
+    vTaskDelay(pdMS_TO_TICKS(20));
+    CHECK_EQ(bus->getTransactions(), 0);
+
+    // -10 dB is 20 half-dB steps of attenuation, sent as two writes by the writer task
+    codec->setVolume(63);
+    CHECK(waitForVolume(bus, 20));
+    CHECK_EQ(bus->getTransactions(), 2);
+    CHECK_EQ(bus->getBytes(), 4);
+
+    // Above 0 dB plays at 0 dB, muted is the most attenuation
+    codec->setVolume(79);
+    CHECK(waitForVolume(bus, 0));
+    codec->setVolume(-1);
+    CHECK(waitForVolume(bus, 192));
+    CHECK_EQ(bus->getTransactions(), 6);
+    delete codec;
+}
+
+/** Runs of consecutive registers are sent as bursts of up to CODEC_MAX_BURST. */
+static void testBursts() {
+    MockCodecBus bus(ES8388_ADDR, CODEC_REGS_8BIT);
+    CodecRegisters regs(&bus, ES8388_ADDR, CODEC_REGS_8BIT);
+    CodecRegisterStats stats;
+    for (uint8_t reg = 0; reg < 20; reg++) { CHECK(regs.write(reg, reg + 100)); }
+    CHECK(regs.write(30, 1));
+    CHECK(regs.write(32, 2));
+    CHECK_EQ(bus.getTransactions(), 0); // nothing is sent until the flush
+    CHECK(regs.flush());
+    CHECK_EQ(bus.getTransactions(), 4); // 16 + 4, then the two that aren't consecutive
+    CHECK_EQ(bus.getBytes(), (CODEC_MAX_BURST + 1) + (4 + 1) + 2 + 2);
+    for (uint8_t reg = 0; reg < 20; reg++) { CHECK_EQ(bus.get(reg), reg + 100); }
+    CHECK_EQ(bus.get(31), 0);
+    CHECK_EQ(bus.get(32), 2);
+    regs.getStats(&stats);
+    CHECK_EQ(stats.writes, 22);
+    CHECK_EQ(stats.skipped, 0);
+    CHECK_EQ(stats.transactions, 4);
+
+    // The same values again are skipped, a write that is out of order isn't part of a burst
+    bus.resetCounts();
+    CHECK(regs.write(5, 105));
+    CHECK(regs.write(7, 1));
+    CHECK(regs.write(6, 1));
+    CHECK(regs.flush());
+    CHECK_EQ(bus.getTransactions(), 2);
+    regs.getStats(&stats);
+    CHECK_EQ(stats.skipped, 1);
+
+    // Assumed values are skipped, forgotten ones are sent again
+    bus.resetCounts();
+    regs.assume(40, 7);
+    CHECK(regs.writeNow(40, 7));
+    CHECK_EQ(bus.getTransactions(), 0);
+    CHECK_EQ(bus.get(40), 0);
+    regs.forget();
+    CHECK(regs.writeNow(0, 100));
+    CHECK_EQ(bus.getTransactions(), 1);
+    CHECK(!regs.write(CODEC_MAX_REGISTERS, 1));
+}
+
+/** A failed write forgets the registers so the same values are sent again. */
+static void testFailure() {
+    MockCodecBus bus(ES8388_ADDR, CODEC_REGS_8BIT);
+    CodecRegisters regs(&bus, ES8388_ADDR, CODEC_REGS_8BIT);
+    CodecRegisterStats stats;
+    bus.fail(1);
+    CHECK(regs.write(1, 5));
+    CHECK(regs.write(2, 6));
+    CHECK(!regs.flush());
+    CHECK_EQ(regs.get(1), 0);
+    CHECK_EQ(bus.get(1), 0);
+    CHECK(regs.write(1, 5));
+    CHECK(regs.write(2, 6));
+    CHECK(regs.flush());
+    CHECK_EQ(bus.get(1), 5);
+    CHECK_EQ(bus.get(2), 6);
+    regs.getStats(&stats);
+    CHECK_EQ(stats.errors, 1);
+    CHECK_EQ(stats.skipped, 0);
+    CHECK_EQ(stats.transactions, 2);
+
+    // The wrong device address isn't acknowledged
+    CodecRegisters wrong(&bus, ES8388_ADDR + 2, CODEC_REGS_8BIT);
+    CHECK(!wrong.writeNow(1, 1));
+}
+
+/** The WM8960's 9-bit registers are sent one per transaction and posts keep only the last value. */
+static void testWM8960Format() {
+    MockCodecBus bus(WM8960_ADDR, CODEC_REGS_9BIT);
+    CodecRegisters regs(&bus, WM8960_ADDR, CODEC_REGS_9BIT);
+    CodecRegisterStats stats;
+    CHECK(regs.write(WM8960_LOUT1_VOLUME, 0x79));
+    CHECK(regs.write(WM8960_ROUT1_VOLUME, 0x79 | WM8960_OUT1VU));
+    CHECK(regs.flush());
+    CHECK_EQ(bus.getTransactions(), 2); // consecutive, but the WM8960 doesn't auto-increment
+    CHECK_EQ(bus.getBytes(), 4);
+    CHECK_EQ(bus.get(WM8960_LOUT1_VOLUME), 0x79);
+    CHECK_EQ(bus.get(WM8960_ROUT1_VOLUME), 0x179); // the 9th bit is in the address byte
+
+    // Posted several times (like setVolume() without the writer task), each is written once
+    bus.resetCounts();
+    for (uint16_t vol = 0x50; vol <= 0x60; vol += 8) {
+        regs.post(WM8960_LOUT1_VOLUME, vol);
+        regs.post(WM8960_ROUT1_VOLUME, vol | WM8960_OUT1VU);
+    }
+    CHECK_EQ(bus.getTransactions(), 0);
+    CHECK(regs.flush());
+    CHECK_EQ(bus.getTransactions(), 2);
+    CHECK_EQ(bus.get(WM8960_LOUT1_VOLUME), 0x60);
+    CHECK_EQ(bus.get(WM8960_ROUT1_VOLUME), 0x160);
+
+    // Posting the values the registers already have sends nothing
+    bus.resetCounts();
+    regs.post(WM8960_LOUT1_VOLUME, 0x60);
+    regs.post(WM8960_ROUT1_VOLUME, 0x160);
+    CHECK(regs.flush());
+    CHECK_EQ(bus.getTransactions(), 0);
+    regs.getStats(&stats);
+    CHECK_EQ(stats.writes, 2 + 2 + 2); // the posts replaced before being sent don't count
+    CHECK_EQ(stats.skipped, 2);
+    CHECK_EQ(regs.busTimeUs(100000), (uint32_t)((stats.bytes + stats.transactions) * 9 + stats.transactions * 2) * 10);
+}
+
+int main() {
+    testES8388();
+    testBursts();
+    testFailure();
+    testWM8960Format();
+    return checkResult("codec_registers_test");
+}
@@ -0,0 +1,167 @@
+/**
+ * Tests the DUET scheduler with made-up cycle counts: it steps down a level on each deadline miss,
+ * steps back up only after DUET_RECOVER_FRAMES frames in a row that would have fit comfortably,
+ * reuses the last peaks every other frame or keeps them at the lowest levels (still clustering once
+ * in a while), skips clustering that wouldn't fit in the rest of the budget, and keeps its stats.
+ */
+
+#include "duet_scheduler.hpp"
+#include "check.h"
+
+#include <stdio.h>
+
+#define BUDGET 1000
+
+/**
+ * Run a frame starting at now (which is moved to its end): the stages before clustering take
+ * `before` cycles, and clustering (if the scheduler lets it run) takes `clustering`. Returns whether
+ * it clustered.
+ */
+static bool runFrame(DuetScheduler& scheduler, uint32_t& now, uint32_t before, uint32_t clustering, bool havePeaks = true) {
+    scheduler.startFrame(now);
+    now += before / 2;
+    scheduler.endStage(STAGE_SPECTROGRAM, now);
+    now += before - before / 2;
+    scheduler.endStage(STAGE_WEIGHTS, now);
+    const bool clustered = scheduler.shouldCluster(now, havePeaks);
+    if (clustered) {
+        now += clustering;
+        scheduler.endStage(STAGE_PEAKS, now);
+    }
+    scheduler.endFrame(now);
+    return clustered;
+}
+
+/** Each miss steps down a level, down to the lowest, where more misses stay. */
+static void testStepDown() {
+    DuetScheduler scheduler(BUDGET);
+    uint32_t now = 0;
+    CHECK(runFrame(scheduler, now, 100, 300, false));
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FULL);
+    const DuetLevel expected[4] = { DUET_LEVEL_FEWER_POINTS, DUET_LEVEL_REUSE_PEAKS, DUET_LEVEL_SKIP_CLUSTERING, DUET_LEVEL_SKIP_CLUSTERING };
+    for (int i = 0; i < 4; i++) {
+        runFrame(scheduler, now, BUDGET + 100, 300);
+        CHECK_EQ(scheduler.level(), expected[i]);
+    }
+    DuetSchedulerStats stats;
+    scheduler.getStats(&stats);
+    CHECK_EQ(stats.misses, 4);
+    CHECK_EQ(stats.levelChanges, 3);
+
+    // The degraded levels do less clustering work
+    CHECK(scheduler.pointThreshold(0.5f) == 0.5f * DUET_DEGRADED_THRESHOLD_SCALE);
+    CHECK_EQ(scheduler.maxPoints(384), 192);
+    CHECK_EQ(scheduler.maxPoints(0), 0);
+    CHECK_EQ(scheduler.maxIterations(50), DUET_DEGRADED_MAX_ITERATIONS);
+}
+
+/** Steps back up only after DUET_RECOVER_FRAMES comfortable frames in a row, starting over after one that isn't. */
+static void testStepUp() {
+    DuetScheduler scheduler(BUDGET);
+    uint32_t now = 0xFFFFF000; // the cycle count wraps around in the middle
+    runFrame(scheduler, now, 100, 200, false);
+    runFrame(scheduler, now, BUDGET + 100, 200);
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FEWER_POINTS);
+
+    // 100 + 200 cycles, estimated at 500 with the full points (under 60% of the budget)
+    for (int i = 0; i < 20; i++) { runFrame(scheduler, now, 100, 200); }
+    // 400 + 300 cycles fit, but wouldn't comfortably with the full points
+    CHECK(runFrame(scheduler, now, 400, 300));
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FEWER_POINTS);
+    for (int i = 0; i < DUET_RECOVER_FRAMES - 1; i++) { runFrame(scheduler, now, 100, 200); }
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FEWER_POINTS);
+    runFrame(scheduler, now, 100, 200);
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FULL);
+
+    // It stays at the top
+    for (int i = 0; i < 2 * DUET_RECOVER_FRAMES; i++) { CHECK(runFrame(scheduler, now, 100, 200)); }
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FULL);
+    DuetSchedulerStats stats;
+    scheduler.getStats(&stats);
+    CHECK_EQ(stats.misses, 1);
+    CHECK_EQ(stats.levelChanges, 2);
+}
+
+/** At DUET_LEVEL_REUSE_PEAKS every other frame clusters, and at the lowest level one in DUET_RECOVER_FRAMES + 1. */
+static void testReuseAndSkip() {
+    DuetScheduler scheduler(BUDGET);
+    uint32_t now = 0;
+    runFrame(scheduler, now, 100, 600, false);
+    runFrame(scheduler, now, BUDGET + 100, 600);
+    runFrame(scheduler, now, BUDGET + 100, 600);
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_REUSE_PEAKS);
+    bool last = runFrame(scheduler, now, 100, 600);
+    for (int i = 0; i < 10; i++) {
+        const bool clustered = runFrame(scheduler, now, 100, 600);
+        CHECK(clustered != last);
+        last = clustered;
+    }
+    // Without peaks to reuse, it always clusters
+    if (!last) { CHECK(runFrame(scheduler, now, 100, 600)); }
+    CHECK(runFrame(scheduler, now, 100, 600, false));
+
+    // 100 + 600 cycles is too much to step back up from the lowest level
+    runFrame(scheduler, now, BUDGET + 100, 600);
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_SKIP_CLUSTERING);
+    int sinceClustered = 0;
+    while (!runFrame(scheduler, now, 100, 600) && sinceClustered <= DUET_RECOVER_FRAMES) { sinceClustered++; }
+    CHECK(sinceClustered <= DUET_RECOVER_FRAMES);
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < DUET_RECOVER_FRAMES; i++) { CHECK(!runFrame(scheduler, now, 100, 600)); }
+        CHECK(runFrame(scheduler, now, 100, 600));
+    }
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_SKIP_CLUSTERING);
+    DuetSchedulerStats stats;
+    scheduler.getStats(&stats);
+    CHECK(stats.skippedClustering >= 3 * DUET_RECOVER_FRAMES + 5);
+}
+
+/** Even at the top level, clustering is skipped if the last time it took wouldn't fit in the rest of the budget. */
+static void testSkipIfItWontFit() {
+    DuetScheduler scheduler(BUDGET);
+    uint32_t now = 0;
+    CHECK(runFrame(scheduler, now, 100, 800, false));
+    CHECK(!runFrame(scheduler, now, 300, 800));    // 300 + 800 > 1000
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FULL);  // and the frame fit
+    CHECK(runFrame(scheduler, now, 200, 800));     // 200 + 800 just fits
+    CHECK(runFrame(scheduler, now, 300, 800, false));
+    CHECK_EQ(scheduler.level(), DUET_LEVEL_FEWER_POINTS);
+}
+
+/** The frames, misses, worst frame, budget, and the average of each stage. */
+static void testStats() {
+    DuetScheduler scheduler(BUDGET);
+    uint32_t now = 0;
+    runFrame(scheduler, now, 200, 400, false);  // stages of 100, 100, and 400
+    runFrame(scheduler, now, 1000, 400);        // 500, 500, and skipped (1000 + 400 won't fit)
+    runFrame(scheduler, now, 200, 80);          // 100, 100, 80
+    scheduler.setBudget(2000);
+    DuetSchedulerStats stats;
+    scheduler.getStats(&stats);
+    CHECK_EQ(stats.frames, 3);
+    CHECK_EQ(stats.misses, 0);                  // 1000 cycles is within the budget
+    CHECK_EQ(stats.worstCycles, 1000);
+    CHECK_EQ(stats.budgetCycles, 2000);
+    CHECK_EQ(stats.skippedClustering, 1);
+    CHECK_EQ(stats.level, DUET_LEVEL_FULL);
+    // The first value, then 1/8 of the way to each new one
+    CHECK_EQ(stats.stageCycles[STAGE_SPECTROGRAM], 143); // 100, 150, then 150 - 50/8 rounded down
+    CHECK_EQ(stats.stageCycles[STAGE_PEAKS], 400 + (80 - 400) / 8);
+    CHECK_EQ(stats.stageCycles[STAGE_DEMIX], 0);
+
+    runFrame(scheduler, now, 2500, 80);
+    scheduler.getStats(&stats);
+    CHECK_EQ(stats.frames, 4);
+    CHECK_EQ(stats.misses, 1);
+    CHECK_EQ(stats.worstCycles, 2500);
+    CHECK_EQ(stats.level, DUET_LEVEL_FEWER_POINTS);
+}
+
+int main() {
+    testStepDown();
+    testStepUp();
+    testReuseAndSkip();
+    testSkipIfItWontFit();
+    testStats();
+    return checkResult("duet_scheduler_test");
+}
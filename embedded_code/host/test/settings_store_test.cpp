@@ -0,0 +1,257 @@
+/**
+ * Tests the settings store on the file-backed flash: records are appended with one write per commit,
+ * a scan recovers everything up to a damaged record, and compaction moves the values round-robin
+ * over the sectors without losing them if it is cut short.
+ */
+
+#include "settings_store.hpp"
+#include "check.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define FLASH_PATH "settings_store_test.bin"
+#define SECTOR_SIZE 4096
+
+// Sizes of the records in flash (see settings_store.cpp)
+#define SECTOR_HEADER 8
+#define INT_RECORD 12
+
+/** Passes everything through to another flash, counting the writes and erases and failing writes on request. */
+class FaultyFlash : public SettingsFlash {
+public:
+    SettingsFlash* const flash;
+    int writesLeft = -1; // writes that succeed before they all fail (-1 for no limit)
+    uint32_t writes = 0;
+    uint32_t erases = 0;
+
+    explicit FaultyFlash(SettingsFlash* flash) : flash(flash) { }
+    ~FaultyFlash() override { delete flash; }
+
+    uint32_t sectorSize() const override { return flash->sectorSize(); }
+    uint32_t sectorCount() const override { return flash->sectorCount(); }
+    bool read(uint32_t sector, uint32_t offset, void* data, uint32_t length) override { return flash->read(sector, offset, data, length); }
+    bool write(uint32_t sector, uint32_t offset, const void* data, uint32_t length) override {
+        if (writesLeft == 0) { return false; }
+        if (writesLeft > 0) { writesLeft--; }
+        writes++;
+        return flash->write(sector, offset, data, length);
+    }
+    bool erase(uint32_t sector) override { erases++; return flash->erase(sector); }
+};
+
+/** Open the test flash, erasing it first if fresh is set. */
+static FaultyFlash* openFlash(uint32_t sectors, bool fresh) {
+    if (fresh) { remove(FLASH_PATH); }
+    SettingsFlash* flash = create_file_settings_flash(FLASH_PATH, SECTOR_SIZE, sectors);
+    CHECK(flash != NULL);
+    return flash ? new FaultyFlash(flash) : NULL;
+}
+
+/** Each commit is one write appended after the last one, and unchanged values aren't written. */
+static void testLogWrites() {
+    FaultyFlash* flash = openFlash(2, true);
+    SettingsStore* store = new SettingsStore(flash);
+    SettingsStoreStats stats;
+    CHECK(store->begin());
+    store->stats(&stats);
+    CHECK_EQ(stats.used, SECTOR_HEADER);
+    CHECK_EQ(stats.sequence, 1); // the empty flash was set up with a first sector
+
+    CHECK(store->setInt(1, 42));
+    CHECK(store->setFloat(2, 1.5f));
+    CHECK(store->setBlob(3, "hello", 5));
+    uint32_t writes = flash->writes;
+    CHECK(store->commit());
+    CHECK_EQ(flash->writes - writes, 1);
+    store->stats(&stats);
+    CHECK_EQ(stats.commits, 1);
+    CHECK_EQ(stats.used, SECTOR_HEADER + INT_RECORD + INT_RECORD + 16);
+
+    // Setting the same value queues nothing
+    writes = flash->writes;
+    CHECK(store->setInt(1, 42));
+    CHECK(store->commit());
+    CHECK_EQ(flash->writes, writes);
+
+    CHECK(store->setInt(1, 43));
+    CHECK(store->remove(2));
+    CHECK(store->commit());
+    store->stats(&stats);
+    CHECK_EQ(stats.commits, 2);
+    CHECK_EQ(stats.used, SECTOR_HEADER + 3 * INT_RECORD + 16 + 8);
+
+    // Out of range keys and values
+    CHECK(!store->setInt(SETTINGS_MAX_KEYS, 1));
+    uint8_t big[SETTINGS_MAX_VALUE + 1] = { 0 };
+    CHECK(!store->setBlob(4, big, sizeof(big)));
+    delete store;
+    delete flash;
+
+    // Scanning finds the latest value of every key
+    flash = openFlash(2, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), 43);
+    CHECK(!store->has(2));
+    CHECK(store->getFloat(2, -1.0f) == -1.0f);
+    char blob[8] = { 0 };
+    CHECK_EQ(store->getBlob(3, blob, sizeof(blob)), 5);
+    CHECK(strcmp(blob, "hello") == 0);
+    CHECK_EQ(store->getInt(3, 7), 7); // the wrong type gives the default
+    store->stats(&stats);
+    CHECK_EQ(stats.used, SECTOR_HEADER + 3 * INT_RECORD + 16 + 8);
+    CHECK_EQ(flash->writes, 0);
+    CHECK_EQ(flash->erases, 0);
+    delete store;
+    delete flash;
+}
+
+/** A damaged record (a write cut short) hides it and everything after it until the next compaction. */
+static void testDamagedRecord() {
+    FaultyFlash* flash = openFlash(2, true);
+    SettingsStore* store = new SettingsStore(flash);
+    CHECK(store->begin());
+    store->setInt(1, 1);
+    CHECK(store->commit());
+    store->setInt(1, 2);
+    store->setInt(4, 7);
+    CHECK(store->commit());
+    delete store;
+
+    // Clear some bits in the value of the last record, like a write that didn't finish
+    const uint32_t zero = 0;
+    CHECK(flash->write(0, SECTOR_HEADER + 2 * INT_RECORD + 8, &zero, 4));
+    delete flash;
+
+    flash = openFlash(2, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), 2);
+    CHECK(!store->has(4));
+
+    // Nothing more is written after the damage, the next commit moves the values instead
+    SettingsStoreStats stats;
+    store->setInt(5, 9);
+    CHECK(store->commit());
+    store->stats(&stats);
+    CHECK_EQ(stats.compactions, 1);
+    CHECK_EQ(stats.commits, 0);
+    CHECK_EQ(stats.sequence, 2);
+    delete store;
+    delete flash;
+
+    flash = openFlash(2, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), 2);
+    CHECK_EQ(store->getInt(5), 9);
+    CHECK(!store->has(4));
+    store->stats(&stats);
+    CHECK_EQ(stats.sequence, 2);
+    CHECK_EQ(stats.used, SECTOR_HEADER + 2 * INT_RECORD);
+    delete store;
+    delete flash;
+}
+
+/** Commit changes to two keys until the values have been moved through every sector and back. */
+static void testCompaction() {
+    const uint32_t sectors = 3;
+    FaultyFlash* flash = openFlash(sectors, true);
+    SettingsStore* store = new SettingsStore(flash);
+    CHECK(store->begin());
+    SettingsStoreStats stats;
+    int32_t i = 0;
+    do {
+        i++;
+        store->setInt(1, i);
+        store->setInt(2, -i);
+        CHECK(store->commit());
+        store->stats(&stats);
+        CHECK(stats.used <= SECTOR_SIZE);
+    } while (stats.compactions < sectors + 1 && i < 10000);
+    CHECK_EQ(stats.compactions, sectors + 1);
+    CHECK_EQ(flash->erases, stats.compactions); // each compaction erases only the sector it moves to
+    CHECK_EQ(stats.sequence, sectors + 1);
+    CHECK_EQ(stats.used, SECTOR_HEADER + 2 * INT_RECORD); // just the moved values
+    // Every commit but the compactions was a single write of both records
+    CHECK_EQ(stats.commits, i - (int32_t)(stats.compactions - 1));
+    delete store;
+
+    // The sectors were used round-robin: 0 was set up, then 1, 2, and 0 again
+    const uint32_t expected[3] = { 4, 2, 3 };
+    for (uint32_t s = 0; s < sectors; s++) {
+        uint32_t header[2];
+        CHECK(flash->read(s, 0, header, sizeof(header)));
+        CHECK_EQ(header[1], expected[s]);
+    }
+    delete flash;
+
+    flash = openFlash(sectors, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), i);
+    CHECK_EQ(store->getInt(2), -i);
+    delete store;
+    delete flash;
+}
+
+/** A compaction that is cut short before the new sector's header is written leaves the old sector in use. */
+static void testInterruptedCompaction() {
+    FaultyFlash* flash = openFlash(2, true);
+    SettingsStore* store = new SettingsStore(flash);
+    CHECK(store->begin());
+    SettingsStoreStats stats;
+    int32_t i = 0;
+    store->stats(&stats);
+    while (stats.used + 2 * INT_RECORD <= SECTOR_SIZE) {
+        i++;
+        store->setInt(1, i);
+        store->setInt(2, -i);
+        CHECK(store->commit());
+        store->stats(&stats);
+    }
+    CHECK_EQ(stats.compactions, 1);
+
+    // The next commit moves the values: both records get written but not the header
+    flash->writesLeft = 2;
+    store->setInt(1, 1000);
+    store->setInt(2, -1000);
+    CHECK(!store->commit());
+    delete store;
+    flash->writesLeft = -1;
+    delete flash;
+
+    flash = openFlash(2, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), i);
+    CHECK_EQ(store->getInt(2), -i);
+    store->stats(&stats);
+    CHECK_EQ(stats.sequence, 1);
+
+    // Trying again works
+    store->setInt(1, 1000);
+    CHECK(store->commit());
+    store->stats(&stats);
+    CHECK_EQ(stats.sequence, 2);
+    delete store;
+    delete flash;
+
+    flash = openFlash(2, false);
+    store = new SettingsStore(flash);
+    CHECK(store->begin());
+    CHECK_EQ(store->getInt(1), 1000);
+    CHECK_EQ(store->getInt(2), -i);
+    delete store;
+    delete flash;
+}
+
+int main() {
+    testLogWrites();
+    testDamagedRecord();
+    testCompaction();
+    testInterruptedCompaction();
+    remove(FLASH_PATH);
+    return checkResult("settings_store_test");
+}
@@ -0,0 +1,172 @@
+/**
+ * Tests the volume knob mapping with traces of knob readings: a step, a slow turn all the way down,
+ * and a knob left on the edge between two levels with a noisy ADC. The volume task is simulated with
+ * the VolumeMap (and with the 10 ms moving average it used before), checking the levels it maps to,
+ * and that it wakes up and sets the volume far less often.
+ */
+
+#include "volume_map.hpp"
+#include "check.h"
+
+#include <stdio.h>
+
+// The volume task (see volume.cpp)
+#define VOL_POLL_IDLE_MS 100
+#define VOL_POLL_MOVING_MS 20
+#define VOL_BURST_READINGS 8
+#define VOL_SMOOTHING_SHIFT 2
+#define VOL_HYSTERESIS 64
+#define MAX_LEVEL 79
+#define LEVELS 80
+
+// The volume task before the VolumeMap: a moving average of a reading every 10 ms
+#define OLD_READINGS 20
+#define OLD_DELAY_MS 10
+
+/** A knob: moves linearly from one reading to another (starting and ending at given times), plus ADC noise. */
+struct Knob {
+    uint32_t startMs, endMs;
+    int32_t from, to;
+    int32_t noise;          // the readings are off by up to this much either way
+    uint32_t seed = 12345;
+
+    Knob(int32_t from, int32_t to, uint32_t startMs, uint32_t endMs, int32_t noise) :
+        startMs(startMs), endMs(endMs), from(from), to(to), noise(noise) { }
+
+    /** A single ADC reading at a time. */
+    uint16_t read(uint32_t ms) {
+        int32_t reading = ms <= startMs ? from : ms >= endMs ? to : from + (to - from) * (int32_t)(ms - startMs) / (int32_t)(endMs - startMs);
+        seed = seed * 1103515245 + 12345;
+        if (noise) { reading += (int32_t)((seed >> 16) % (2 * noise + 1)) - noise; }
+        return (uint16_t)(reading < 0 ? 0 : reading >= VOLUME_ADC_FULL_SCALE ? VOLUME_ADC_FULL_SCALE - 1 : reading);
+    }
+};
+
+/** The level of a steady reading. */
+static int8_t levelOf(int32_t reading) { return (int8_t)(MAX_LEVEL - reading * LEVELS / VOLUME_ADC_FULL_SCALE); }
+
+/** What the volume task did over a trace. */
+struct Run {
+    uint32_t wakeUps = 0;
+    uint32_t changes = 0;       // the times the volume was set (after the first)
+    uint32_t reversals = 0;     // the times the level moved the other way to the last change
+    uint32_t lastChangeMs = 0;
+    int8_t level = 0;
+
+    void set(int8_t newLevel, uint32_t ms) {
+        if (changes && (newLevel - level) * lastDirection < 0) { reversals++; }
+        lastDirection = newLevel > level ? 1 : -1;
+        level = newLevel;
+        lastChangeMs = ms;
+        changes++;
+    }
+
+private:
+    int lastDirection = 0;
+};
+
+/** Run the volume task with the VolumeMap (like adjustVolumeTask()) over a trace. */
+static Run runVolumeMap(Knob knob, uint32_t durationMs) {
+    auto readVolumeKnob = [&knob](uint32_t ms) {
+        uint16_t total = 0;
+        for (int i = 0; i < VOL_BURST_READINGS; i++) { total += knob.read(ms); }
+        return (uint16_t)(total / VOL_BURST_READINGS);
+    };
+    VolumeMap map(MAX_LEVEL, LEVELS, VOL_SMOOTHING_SHIFT, VOL_HYSTERESIS);
+    Run run;
+    map.reset(readVolumeKnob(0));
+    run.level = map.level();
+    for (uint32_t ms = 0; (ms += map.isMoving() ? VOL_POLL_MOVING_MS : VOL_POLL_IDLE_MS) <= durationMs; ) {
+        run.wakeUps++;
+        int8_t level;
+        if (map.update(readVolumeKnob(ms), &level)) { run.set(level, ms); }
+    }
+    return run;
+}
+
+/** Run the volume task as it was before the VolumeMap over a trace. */
+static Run runMovingAverage(Knob knob, uint32_t durationMs) {
+    uint16_t readings[OLD_READINGS];
+    int32_t total = 0;
+    for (int i = 0; i < OLD_READINGS; i++) { readings[i] = knob.read(0); total += readings[i]; }
+    Run run;
+    run.level = (int8_t)(MAX_LEVEL - (total * LEVELS) / (OLD_READINGS * VOLUME_ADC_FULL_SCALE));
+    int i = 0;
+    for (uint32_t ms = OLD_DELAY_MS; ms <= durationMs; ms += OLD_DELAY_MS) {
+        run.wakeUps++;
+        total -= readings[i];
+        readings[i] = knob.read(ms);
+        total += readings[i];
+        if (++i >= OLD_READINGS) { i = 0; }
+        const int8_t level = (int8_t)(MAX_LEVEL - (total * LEVELS) / (OLD_READINGS * VOLUME_ADC_FULL_SCALE));
+        if (level != run.level) { run.set(level, ms); }
+    }
+    return run;
+}
+
+static void printRuns(const char* trace, const Run& map, const Run& old) {
+    printf("  %-6s VolumeMap: %4u wake-ups, %3u changes, level %2d | moving average: %4u wake-ups, %3u changes, level %2d\n",
+        trace, map.wakeUps, map.changes, map.level, old.wakeUps, old.changes, old.level);
+}
+
+/** Steady readings map to their levels, and the top and bottom readings to the ends of the range. */
+static void testLevels() {
+    const int32_t readings[6] = { 0, 25, 1000, 2048, 3000, VOLUME_ADC_FULL_SCALE - 1 };
+    for (int32_t reading : readings) {
+        VolumeMap map(MAX_LEVEL, LEVELS, VOL_SMOOTHING_SHIFT, VOL_HYSTERESIS);
+        map.reset((uint16_t)reading);
+        CHECK_EQ(map.level(), levelOf(reading));
+        CHECK(!map.isMoving());
+    }
+    CHECK_EQ(levelOf(0), MAX_LEVEL);
+    CHECK_EQ(levelOf(VOLUME_ADC_FULL_SCALE - 1), MAX_LEVEL - LEVELS + 1);
+}
+
+/** A quick turn of the knob is followed within about half a second, without going back the other way. */
+static void testStep() {
+    const Knob knob(1000, 3000, 1000, 1000, 8);
+    const Run map = runVolumeMap(knob, 3000), old = runMovingAverage(knob, 3000);
+    printRuns("step", map, old);
+    CHECK_EQ(map.level, levelOf(3000));
+    CHECK_EQ(old.level, levelOf(3000));
+    printf("  the step was followed within %u ms\n", map.lastChangeMs - 1000);
+    CHECK(map.lastChangeMs <= 1000 + 600); // the next poll, then quick ones while the smoothing catches up
+    CHECK_EQ(map.reversals, 0);
+    CHECK(map.changes < old.changes);
+    CHECK(map.wakeUps * 5 < old.wakeUps);
+}
+
+/** A slow turn all the way down only ever goes down, and ends at the lowest level. */
+static void testRamp() {
+    const Knob knob(0, VOLUME_ADC_FULL_SCALE - 1, 500, 2500, 8);
+    const Run map = runVolumeMap(knob, 3500), old = runMovingAverage(knob, 3500);
+    printRuns("ramp", map, old);
+    CHECK_EQ(map.level, MAX_LEVEL - LEVELS + 1);
+    CHECK_EQ(old.level, MAX_LEVEL - LEVELS + 1);
+    CHECK_EQ(map.reversals, 0);
+    CHECK(map.lastChangeMs <= 2500 + 300);
+    // While it is turned, it is read every VOL_POLL_MOVING_MS and the volume is set at most that often
+    CHECK(map.changes <= 2000 / VOL_POLL_MOVING_MS + 5);
+    CHECK(map.wakeUps * 2 < old.wakeUps);
+}
+
+/** A knob left on the edge between two levels with a noisy ADC doesn't change the volume at all. */
+static void testNoise() {
+    const int32_t edge = 20 * VOLUME_ADC_FULL_SCALE / LEVELS; // between levels 59 and 60
+    const Knob knob(edge, edge, 0, 0, 40);
+    const Run map = runVolumeMap(knob, 10000), old = runMovingAverage(knob, 10000);
+    printRuns("noise", map, old);
+    CHECK_EQ(map.changes, 0);
+    CHECK(map.level == levelOf(edge) || map.level == levelOf(edge - 1));
+    CHECK(old.changes > 10); // the moving average flickered between the two
+    CHECK(map.wakeUps <= 10000 / VOL_POLL_IDLE_MS + 10); // rarely taken for being turned
+    CHECK(map.wakeUps * 5 < old.wakeUps);
+}
+
+int main() {
+    testLevels();
+    testStep();
+    testRamp();
+    testNoise();
+    return checkResult("volume_map_test");
+}
@@ -0,0 +1,296 @@
+/**
+ * Runs the audio task on a computer with the virtual audio codec: the recorded audio is read from a
+ * WAV file, the played audio (the hear-through filter and volume) is written to another one, and the
+ * recording is written to a directory standing in for the SD card.
+ *
+ *   virtual_audio [--unpaced] [--tone SECONDS] [--sd DIR] [--play PATH] [--sweep] [--drop] [--latency] [--duet] input.wav [output.wav]
+ *
+ * Paced, each block is only read once it would have been captured (like the real codec), which
+ * shows whether the SD card task keeps up in real time. Unpaced, the audio is taken as fast as the
+ * SD card task can write it, e.g. to go through hours of recorded audio. With --tone, a stereo test
+ * tone of the given length is written to the input file first. With --play, a file on the card is
+ * played in place of the live audio. With --sweep, the volume is turned down 1 dB at a time through
+ * several of the codec's coarse steps and back up, and the output must get steadily quieter and then
+ * louder (a step of the codec that isn't made up for by the software gain shows as a bump or dip).
+ * With --drop, the volume is turned down by DROP_DB at once (more than the codec is stepped by at a
+ * time), and the output must get quieter in ramps (a step of the codec that the software gain can't
+ * make up for shows as a sudden fall), ending up that much quieter.
+ * With --latency, the output is looped back to the input with the delays of the ESP32's DMA buffers
+ * and the latency is measured with probes (see latency.h), which must find exactly that round trip.
+ * With --duet, the input is then run through DUET a frame at a time (like the firmware would with the
+ * recorded audio), timing it and reporting its scheduler, and the tone (the same in both channels)
+ * must be found as a single source with no attenuation or delay between the channels.
+ *
+ * Returns 0 if all of the audio was played and recorded (nothing was dropped when unpaced, and the
+ * recording has every frame, up to the last partial chunk, when nothing was dropped), the
+ * file being played (if any) never ran out, the volume sweep or drop (if any) was smooth, the latency (if
+ * measured) was the simulated round trip, and DUET (if run) found the tone.
+ */
+
+#include "audio.h"
+#include "audio_io.h"
+#include "data.h"
+#include "duet.h"
+#include "duet_scheduler.hpp"
+#include "latency.h"
+#include "playback.h"
+#include "sd.h"
+#include "wav.h"
+
+#include <SdFat.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <atomic>
+#include <string>
+#include <vector>
+
+#define TONE_SAMPLE_RATE 48000
+#define TONE_HZ 440
+
+// The longest the SD card task may take to catch up at the end
+#define DRAIN_TIMEOUT_MS 10000
+
+// The volume sweep: from 0 dB down to SWEEP_LOWEST and back, a step every SWEEP_STEP_MS
+#define SWEEP_START_MS 200
+#define SWEEP_STEP_MS 25
+#define SWEEP_HIGHEST 73
+#define SWEEP_LOWEST 40
+#define SWEEP_WINDOW 480        // frames in which the peak is measured (10 ms at 48 kHz)
+#define SWEEP_TOLERANCE_DB 0.2f // the most the level may go the wrong way between windows
+#define DROP_DB 40
+#define DROP_MAX_STEP_DB 12.0f  // the most the level may fall between windows during the drop
+
+// The simulated loopback for --latency: the output waits in the DMA buffers like on the ESP32 (8 of
+// 1024 frames), then a little longer in the converters and the input DMA buffer
+#define LOOPBACK_OUTPUT_FRAMES (8 * 1024)
+#define LOOPBACK_INPUT_FRAMES 100
+
+// DUET must find the tone at an attenuation of 1 and a delay of 0, give or take this much
+#define DUET_TOLERANCE 0.1f
+
+/** Write a 16-bit stereo WAV file with a sine tone (-12 dBFS) for the given number of seconds. */
+static bool writeTone(const char* path, uint32_t seconds) {
+    FILE* f = fopen(path, "wb");
+    if (!f) { printf("!! Failed to create %s\n", path); return false; }
+    const uint32_t frames = seconds * TONE_SAMPLE_RATE;
+    const uint32_t dataSize = frames * 4;
+    const uint32_t header[11] = {
+        0x46464952, 36 + dataSize, 0x45564157, 0x20746d66, 16, 0x00020001, // RIFF, WAVE, fmt: PCM, 2 channels
+        TONE_SAMPLE_RATE, TONE_SAMPLE_RATE * 4, 0x00100004, 0x61746164, dataSize, // 4-byte frames, 16 bits
+    };
+    bool ok = fwrite(header, sizeof(header), 1, f) == 1;
+    for (uint32_t i = 0; ok && i < frames; i++) {
+        int16_t sample = (int16_t)(8192 * sinf(2 * (float)M_PI * TONE_HZ * i / TONE_SAMPLE_RATE));
+        int16_t frame[2] = { sample, sample };
+        ok = fwrite(frame, sizeof(frame), 1, f) == 1;
+    }
+    return fclose(f) == 0 && ok;
+}
+
+/** Turn the volume down from SWEEP_HIGHEST to SWEEP_LOWEST 1 dB at a time and back up, or just down by DROP_DB. */
+static void sweepVolume(bool drop) {
+    vTaskDelay(pdMS_TO_TICKS(SWEEP_START_MS));
+    if (drop) { setVolume(SWEEP_HIGHEST - DROP_DB); return; }
+    for (int volume = SWEEP_HIGHEST; volume >= SWEEP_LOWEST; volume--) { setVolume(volume); vTaskDelay(pdMS_TO_TICKS(SWEEP_STEP_MS)); }
+    for (int volume = SWEEP_LOWEST; volume <= SWEEP_HIGHEST; volume++) { setVolume(volume); vTaskDelay(pdMS_TO_TICKS(SWEEP_STEP_MS)); }
+}
+
+/**
+ * Check that the output of sweepVolume() got steadily quieter down to the quietest point and then
+ * steadily louder, measuring the peak of each window from before the start of the sweep. A drop must
+ * also fall by at most DROP_MAX_STEP_DB between windows, down to DROP_DB below (give or take a dB).
+ */
+static bool checkSweep(const char* path, bool drop) {
+    FILE* f = fopen(path, "rb");
+    if (!f || fseek(f, 44, SEEK_SET) != 0) { printf("!! Failed to open %s\n", path); if (f) { fclose(f); } return false; }
+    std::vector<float> peaks;
+    int16_t frames[SWEEP_WINDOW * PLAY_CHANNELS];
+    while (fread(frames, sizeof(frames), 1, f) == 1) {
+        int peak = 0;
+        for (int i = 0; i < SWEEP_WINDOW * PLAY_CHANNELS; i++) { peak = abs(frames[i]) > peak ? abs(frames[i]) : peak; }
+        peaks.push_back(peak ? 20 * log10f(peak / 32768.0f) : -96.0f);
+    }
+    fclose(f);
+
+    const size_t start = (size_t)((uint64_t)SWEEP_START_MS / 2 * getSampleRate() / 1000 / SWEEP_WINDOW); // once the filter settled
+    if (peaks.size() <= start) { printf("!! The output is too short for the volume sweep\n"); return false; }
+    size_t quietest = start;
+    for (size_t i = start; i < peaks.size(); i++) { if (peaks[i] < peaks[quietest]) { quietest = i; } }
+    float worst = 0, steepest = 0;
+    size_t worstAt = 0;
+    for (size_t i = start + 1; i < peaks.size(); i++) {
+        const float wrongWay = i <= quietest ? peaks[i] - peaks[i - 1] : peaks[i - 1] - peaks[i];
+        if (wrongWay > worst) { worst = wrongWay; worstAt = i; }
+        if (peaks[i - 1] - peaks[i] > steepest) { steepest = peaks[i - 1] - peaks[i]; }
+    }
+    printf("Volume sweep: %.1f dB to %.1f dB, the level went the wrong way by up to %.2f dB (at %.0f ms)\n",
+        peaks[start], peaks[quietest], worst, worstAt * SWEEP_WINDOW * 1000.0 / getSampleRate());
+    if (worst > SWEEP_TOLERANCE_DB) { printf("!! The volume sweep wasn't smooth\n"); return false; }
+    if (drop) {
+        printf("Volume drop: %.2f dB, falling by up to %.2f dB between windows\n", peaks[start] - peaks[quietest], steepest);
+        if (steepest > DROP_MAX_STEP_DB) { printf("!! The volume fell too suddenly\n"); return false; }
+        if (fabsf(peaks[start] - peaks[quietest] - DROP_DB) > 1) { printf("!! The volume didn't drop by %d dB\n", DROP_DB); return false; }
+    }
+    return true;
+}
+
+/**
+ * Run a 16-bit stereo WAV file through DUET a frame at a time, reporting how long it took and what
+ * the scheduler did. Then check that it found a single source that is the same in both channels.
+ */
+static bool runDuet(const char* path) {
+    if (duet_init(getSampleRate()) != ESP_OK) { printf("!! DUET init failed\n"); return false; }
+    FILE* f = fopen(path, "rb");
+    if (!f || fseek(f, 44, SEEK_SET) != 0) { printf("!! Failed to open %s\n", path); if (f) { fclose(f); } duet_deinit(); return false; }
+    std::vector<int16_t> frame(DUET_WINDOW_SIZE_HALF * duet_decimation() * REC_CHANNELS);
+    uint32_t frames = 0;
+    const int64_t start = esp_timer_get_time();
+    while (fread(frame.data(), frame.size() * sizeof(int16_t), 1, f) == 1) { process_audio_frame(frame.data()); frames++; }
+    const int64_t elapsedUs = esp_timer_get_time() - start;
+    fclose(f);
+
+    DuetSchedulerStats stats;
+    duet_get_scheduler_stats(&stats);
+    std::vector<float> alpha, delta;
+    duet_get_peaks(alpha, delta);
+    duet_deinit();
+
+    const double seconds = (double)frames * frame.size() / REC_CHANNELS / getSampleRate();
+    printf("DUET: %u frames (%.1f s of audio) in %.2f s, %.1fx real time\n", frames, seconds, elapsedUs / 1e6, seconds * 1e6 / (elapsedUs ? elapsedUs : 1));
+    printf("DUET scheduler: level %d, %u misses, %u level changes, %u frames reused the peaks, worst frame %u of %u cycles\n",
+        stats.level, stats.misses, stats.levelChanges, stats.skippedClustering, stats.worstCycles, stats.budgetCycles);
+    for (size_t i = 0; i < alpha.size(); i++) { printf("DUET source %u: attenuation %.3f, delay %.3f\n", (unsigned)i, alpha[i], delta[i]); }
+    if (!frames || stats.frames != frames) { printf("!! DUET didn't process every frame\n"); return false; }
+    if (alpha.size() != 1 || fabsf(alpha[0] - 1) > DUET_TOLERANCE || fabsf(delta[0]) > DUET_TOLERANCE) {
+        printf("!! DUET didn't find the tone\n");
+        return false;
+    }
+    return true;
+}
+
+/** Check that the recording on the card (uncompressed) has all of the frames that were read, none left behind. */
+static bool checkRecording(const char* sdRoot, uint64_t frames) {
+    std::string path = std::string(sdRoot) + "/audio_000000.wav";
+    FILE* f = fopen(path.c_str(), "rb");
+    uint32_t dataSize = 0;
+    bool ok = f && fseek(f, WAV_DATA_OFFSET - 4, SEEK_SET) == 0 && fread(&dataSize, sizeof(dataSize), 1, f) == 1;
+    if (f) { fclose(f); }
+    if (!ok) { printf("!! Failed to read the recording %s\n", path.c_str()); return false; }
+    const uint64_t recorded = dataSize / (REC_CHANNELS * REC_BYTES_PER_SAMPLE);
+    printf("Recorded %llu of %llu frames\n", (unsigned long long)recorded, (unsigned long long)frames);
+    if (recorded != frames) { printf("!! The recording is missing audio\n"); return false; }
+    return true;
+}
+
+static std::atomic<bool> recordingClosed(false);
+
+/** Close the recording files from the SD card task (see closeRecording()) and let the main thread know. */
+static bool closeAndSignal(SdFs* sd, void* params) {
+    closeRecording(sd, params);
+    recordingClosed.store(true);
+    return true;
+}
+
+/** Wait up to a timeout for a condition, checking every 10 ms. */
+template <typename Condition>
+static bool waitFor(uint32_t timeoutMs, Condition condition) {
+    for (uint32_t waited = 0; !condition(); waited += 10) {
+        if (waited >= timeoutMs) { return false; }
+        vTaskDelay(pdMS_TO_TICKS(10));
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    bool paced = true;
+    uint32_t toneSeconds = 0;
+    const char* sdRoot = NULL;
+    const char* playPath = NULL;
+    bool sweep = false;
+    bool drop = false;
+    bool latency = false;
+    bool duet = false;
+    const char* inputPath = NULL;
+    const char* outputPath = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--unpaced") == 0) { paced = false; }
+        else if (strcmp(argv[i], "--tone") == 0 && i + 1 < argc) { toneSeconds = (uint32_t)atoi(argv[++i]); }
+        else if (strcmp(argv[i], "--sd") == 0 && i + 1 < argc) { sdRoot = argv[++i]; }
+        else if (strcmp(argv[i], "--play") == 0 && i + 1 < argc) { playPath = argv[++i]; }
+        else if (strcmp(argv[i], "--sweep") == 0) { sweep = true; }
+        else if (strcmp(argv[i], "--drop") == 0) { sweep = drop = true; }
+        else if (strcmp(argv[i], "--latency") == 0) { latency = true; }
+        else if (strcmp(argv[i], "--duet") == 0) { duet = true; }
+        else if (!inputPath) { inputPath = argv[i]; }
+        else if (!outputPath) { outputPath = argv[i]; }
+        else { inputPath = NULL; break; }
+    }
+    if (!inputPath || (sweep && !outputPath)) {
+        printf("usage: %s [--unpaced] [--tone SECONDS] [--sd DIR] [--play PATH] [--sweep] [--drop] [--latency] [--duet] input.wav [output.wav]\n", argv[0]);
+        return 2;
+    }
+    if (sdRoot) {
+        mkdir(sdRoot, 0755);
+        SdFs::setHostRoot(sdRoot);
+    }
+    if (toneSeconds && !writeTone(inputPath, toneSeconds)) { return 1; }
+
+    configureVirtualAudio(inputPath, outputPath, paced);
+    if (latency) { configureVirtualLoopback(LOOPBACK_OUTPUT_FRAMES, LOOPBACK_INPUT_FRAMES); }
+    if (!setupSD() || !setupAudio()) { return 1; }
+    setVolume(73); // 0 dB
+    if (latency && !startLatency(LATENCY_CHIRP)) { return 1; }
+    if (playPath) { startPlayback(playPath); }
+    if (sweep) { sweepVolume(drop); }
+
+    // Wait for the whole input to be read and played (into the output file, if there is one),
+    // measuring the latency of each probe as it comes back
+    VirtualAudioStats stats;
+    LatencyReport report = {};
+    do {
+        vTaskDelay(pdMS_TO_TICKS(100));
+        if (latency && latencyProcess(&report)) { printLatencyReport(&report); }
+        getVirtualAudioStats(&stats);
+    } while (!stats.finished || (outputPath && stats.framesWritten < stats.framesRead));
+
+    // Let the SD card task write the rest of the whole chunks, then the last partial one as it closes
+    // the recording
+    RingBufferStats ring;
+    bool drained = waitFor(DRAIN_TIMEOUT_MS, [&ring] { getRecordingStats(&ring); return ring.used < SD_WRITE_CHUNK; });
+    submitSDTask(SD_LANE_AUDIO, closeAndSignal, getRecordingBuffer());
+    bool closed = waitFor(DRAIN_TIMEOUT_MS, [] { return recordingClosed.load(); });
+    closeVirtualAudio();
+
+    double seconds = stats.framesRead / (double)getSampleRate();
+    printf("Played %llu of %llu frames (%.1f s of audio in %.1f s, %.1fx real time)\n",
+        (unsigned long long)stats.framesWritten, (unsigned long long)stats.framesRead,
+        seconds, stats.elapsedUs / 1e6, seconds * 1e6 / (stats.elapsedUs ? stats.elapsedUs : 1));
+    printf("Recording: %u blocks dropped, ring buffer high water %u bytes, longest SD stall %u ms\n",
+        ring.overruns, ring.highWater, ring.maxStallUs / 1000);
+
+    if (!drained || !closed) { printf("!! The SD card task did not finish the recording\n"); return 1; }
+    if (!paced && ring.overruns) { printf("!! Audio was dropped without real-time pacing\n"); return 1; }
+    if (sdRoot && !ring.overruns && !checkRecording(sdRoot, stats.framesRead)) { return 1; }
+    if (playPath) {
+        PlaybackStats playback;
+        getPlaybackStats(&playback);
+        printf("Playback: %u frames played, %u underruns, slots of %u bytes, read latency up to %u ms\n",
+            playback.framesPlayed, playback.underruns, playback.slotSize, playback.readLatencyUs / 1000);
+        if (!playback.framesPlayed || playback.underruns) { printf("!! Playback did not keep up\n"); return 1; }
+    }
+    if (sweep && !checkSweep(outputPath, drop)) { return 1; }
+    if (latency) {
+        // The block the audio task waits for, then the simulated delays
+        const uint32_t expected = (uint32_t)lroundf(report.blockMs * getSampleRate() / 1000) + LOOPBACK_OUTPUT_FRAMES + LOOPBACK_INPUT_FRAMES;
+        if (report.measurements < 2 || report.missed) { printf("!! The latency probes weren't found\n"); return 1; }
+        if (report.roundTripFrames != expected) { printf("!! The latency was %u frames, not %u\n", (unsigned)report.roundTripFrames, (unsigned)expected); return 1; }
+    }
+    if (duet && !runDuet(inputPath)) { return 1; }
+    return 0;
+}
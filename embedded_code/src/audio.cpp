@@ -2,56 +2,203 @@
 #include "sd.h"
 #include "data.h"
 #include "audio_codec.hpp"
+#include "ring_buffer.hpp"
+#include "playback.h"
+#include "capture_stats.h"
+#include "gain_ramp.hpp"
+#include "latency.h"
+#include "duet.h" // DUET_SAMPLE_RATE
 
-#include <math.h> // for sin
+#include <atomic>
 
 // Background task
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 
-// I2S driver
-#include <driver/i2s.h>
+#include "audio_io.h"
 
-// I2S pins/port
-#define I2S_WS        33 // DACLRC/ADCLRC/LRC/"word select"/"left-right-channel", toggles for left or right channel data
-#define I2S_ADC_DATA  14 // ADC_DATA/SD/"serial data in", carries the I2S audio data from codec's ADC to ESP32 I2S bus
-#define I2S_DAC_DATA  32 // DAC_DATA/SDO/"serial data out", carries the I2S audio data from ESP32 to codec DAC
-#define I2S_BCLK      27 // BCLK/SCK/"bit clock", this is the clock for I2S audio, can be controlled via controller or peripheral
-#define I2S_PORT I2S_NUM_0 // Define which I2S peripheral to use
-
-// Audio Recording Buffers (double buffering)
+// Audio Recording Buffers
 #define DMA_BUFFER_SAMPLE_LEN 1024 // from ~64 to 1024 - lower reduces latency but increases overhead (1024 is about 23.2ms of audio)
 #define DMA_BUFFER_BYTE_LEN (DMA_BUFFER_SAMPLE_LEN * REC_BYTES_PER_SAMPLE * REC_CHANNELS) // IMPORTANT: this cannot be > 4096
 static_assert(DMA_BUFFER_BYTE_LEN <= 4096, "DMA buffer size must be <= 4096 bytes");
 #define BUFFER_READ_LEN (DMA_BUFFER_BYTE_LEN) // amount to try to read at once
-#define WAV_BUFFER_LEN (100*REC_BYTES_PER_SAMPLE*REC_CHANNELS*REC_SAMPLE_RATE/1000)  // ~100 ms of audio buffered before writing to SD card
-uint8_t readBuffer1[WAV_BUFFER_LEN + BUFFER_READ_LEN];
-uint8_t readBuffer2[WAV_BUFFER_LEN + BUFFER_READ_LEN];
-uint8_t writeBuffer[WAV_BUFFER_LEN + BUFFER_READ_LEN];
+static_assert(REC_SAMPLE_RATE == PLAY_SAMPLE_RATE && REC_CHANNELS * REC_BYTES_PER_SAMPLE == PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE, "Recorded and played frames must be the same size and rate (the output block is the size of the input block)");
+
+// The block sent to I2S for playback. The filter writes into it straight from the recorded block (or
+// the playback writes into it), so the recorded audio is never copied. It is also where a block is
+// read into when the ring buffer is full.
+uint8_t* outputBuffer = NULL;
+
+// The recorded audio is read from I2S straight into a ring buffer that the SD card task writes to
+// the card from. The ring buffer absorbs SD card stalls (e.g. flash erases, sometimes >250 ms) up
+// to its size; after that blocks are dropped (and counted). It is a multiple of SD_WRITE_CHUNK so
+// whole chunks can be written straight from it. 3 chunks is 96 KB or ~557 ms of audio.
+#define REC_RING_CHUNKS 3
+#define REC_RING_BLOCKS (REC_RING_CHUNKS * SD_WRITE_CHUNK / BUFFER_READ_LEN)
+static_assert(SD_WRITE_CHUNK % BUFFER_READ_LEN == 0, "SD write chunks must be a whole number of I2S reads");
+static_assert(REC_RING_CHUNKS >= 2, "Recording ring buffer must be at least two chunks so one can be written while the next is filled");
+RingBuffer* recordingBuffer = NULL;
+
+// The recording frame clock: the number of frames recorded (committed to the ring buffer) by the end
+// of the last block read from I2S and when that read finished. There are two copies so ISRs always
+// read a consistent one without locking: the audio task updates the other copy and then switches.
+struct FrameClock {
+    uint32_t frames;
+    int64_t time;
+};
+FrameClock IRAM_DATA_ATTR WORD_ALIGNED_ATTR frameClocks[2] = { { 0, 0 }, { 0, 0 } };
+std::atomic<uint32_t> frameClockIndex(0);
+uint32_t recordedFrames = 0; // only used by the audio task
+// The sample rate chosen by setupAudio()
+uint32_t sampleRate = REC_SAMPLE_RATE;
+// Frames per microsecond in 16.16 fixed point (so ISRs don't need a 64-bit divide)
+uint32_t framesPerUsQ16 = (uint32_t)((uint64_t)REC_SAMPLE_RATE * 65536 / 1000000);
+// Frames are only counted for up to two blocks after the last read (e.g. if the task is stalled)
+uint32_t frameClockMaxUs = (uint32_t)(2ull * DMA_BUFFER_SAMPLE_LEN * 1000000 / REC_SAMPLE_RATE);
 
 
 AudioCodec* audio_codec; // the audio codec object
 
+// The filter for the live audio that is played back (hear-through): a 1-pole low-pass, about 390 Hz
+// at 48 kHz. The biquad cascades in biquad.hpp roll off more steeply but take more than twice as long
+// per sample (see benchmarkFilters()), so they aren't used on the live path.
+#define HEAR_THROUGH_ALPHA 0.05f
+float hearThroughState[PLAY_CHANNELS] = {};
+
+/** Filter a block of interleaved frames from in into out with the hear-through low-pass (audio task only). */
+void hearThroughFilter(const int16_t* in, int16_t* out, size_t frames) {
+    float prev[PLAY_CHANNELS]; // in locals for the block so they stay in registers
+    for (int ch = 0; ch < PLAY_CHANNELS; ++ch) { prev[ch] = hearThroughState[ch]; }
+    for (size_t i = 0; i < frames; i++) {
+        for (int ch = 0; ch < PLAY_CHANNELS; ++ch) {
+            prev[ch] = HEAR_THROUGH_ALPHA * in[i * PLAY_CHANNELS + ch] + (1 - HEAR_THROUGH_ALPHA) * prev[ch];
+            out[i * PLAY_CHANNELS + ch] = (int16_t)prev[ch];
+        }
+    }
+    for (int ch = 0; ch < PLAY_CHANNELS; ++ch) { hearThroughState[ch] = prev[ch]; }
+}
 
-#define CHECK_I2S_EVENTS // check for I2S events (errors) in the audioRecordingTask, undefine to disable
-#ifdef CHECK_I2S_EVENTS
-#include <freertos/queue.h>
-QueueHandle_t i2sQueue = NULL;
-#endif
+// The volume is split between the codec and a software gain on the output. The codec is only set in
+// coarse steps (its registers are written over I2C, which is slow and steps audibly) and only once the
+// volume moves out of the range the software gain covers below it. Everything finer is done by the
+// software gain, which ramps smoothly to each new volume.
+//
+// The codec steps at once, so the audio task steps the software gain the other way at the same point
+// in the audio: from the next block it processes, and it only sets the codec once that block starts
+// to play (after the output queue ahead of it). Only the change in the volume is then ramped. When
+// the codec gets quieter the software gain is first ramped down by the step, so stepping it back up
+// never amplifies (or saturates) the samples, and the codec moves at most VOLUME_MAX_CODEC_STEP at a
+// time so the software gain keeps its resolution while it is that far down.
+#define VOLUME_COARSE_STEP 6    // dB between the volumes the codec is set to
+#define VOLUME_SOFT_RANGE 12    // dB the software gain attenuates before the codec is changed
+#define VOLUME_MAX_CODEC_STEP 18 // most dB the codec is changed by at once
+#define VOLUME_MAX 79           // +6 dB (see setVolume())
+#define VOLUME_RAMP_MS 20       // time for the software gain to reach a new volume
+GainRamp outputGain(PLAY_CHANNELS, 1); // the ramp length is set in setupAudio()
+static_assert(VOLUME_SOFT_RANGE >= VOLUME_COARSE_STEP, "The software gain must cover at least one coarse step");
+static_assert(VOLUME_MAX_CODEC_STEP >= VOLUME_COARSE_STEP && VOLUME_SOFT_RANGE + VOLUME_MAX_CODEC_STEP <= 40, "The software gain must stay within 40 dB of 0 dB (where Q12 has about 0.2 dB steps)");
+
+// The latest volume from setVolume() for the audio task: the codec volume in the high byte and the
+// software gain in dB in the low byte (VOLUME_MUTED to mute)
+#define VOLUME_MUTED -128
+#define VOLUME_REQUEST(codec, softDb) (uint16_t)((uint8_t)(int8_t)(codec) << 8 | (uint8_t)(int8_t)(softDb))
+std::atomic<uint16_t> volumeRequest(VOLUME_REQUEST(-1, 0));
+int8_t codecVolume = -1; // the codec volume of the latest request (-1 before the first setVolume())
+
+// The audio task's side (only used by the audio task)
+uint16_t appliedVolumeRequest = VOLUME_REQUEST(-1, 0);
+int8_t outputCodecVolume = -1;  // the codec volume the software gain is relative to
+bool codecVolumePending = false; // the codec still has to be set to outputCodecVolume
+uint32_t codecVolumeDelay = 0;  // frames still to be written to the output before it is set
+
+
+/** Set the codec to the volume the software gain is now relative to (audio task only). */
+void sendCodecVolume() {
+    audio_codec->setVolume(outputCodecVolume);
+    codecVolumePending = false;
+}
 
+/** Ramp the software gain to a gain in dB, or to nothing if it is VOLUME_MUTED (audio task only). */
+void setSoftGain(int softDb) {
+    if (softDb == VOLUME_MUTED) { outputGain.setGain(0); }
+    else { outputGain.setGainDb(softDb); }
+}
 
-void lowPassFilterGivenChannel(int16_t *samples, size_t numSamples, int channel, float alpha) {
-    static float prev[REC_CHANNELS] = { 0.0f, 0.0f }; // filter values for each channel
-    for (size_t i = channel; i < numSamples; i += REC_CHANNELS) {
-        prev[channel] = alpha * samples[i] + (1 - alpha) * prev[channel];
-        samples[i] = (int16_t)prev[channel];
+/**
+ * Take the latest volume from setVolume() before a block is processed (audio task only). When the
+ * codec volume changes, the software gain is stepped to make up for it from this block on, and the
+ * codec is set once the output queue ahead of this block has been played (see volumeWritten()).
+ * Another codec change waits until then. The codec is moved by up to VOLUME_MAX_CODEC_STEP at a time
+ * (with the software gain at 0 dB in between), and before it gets quieter the software gain is
+ * ramped down by the step, so that stepping the software gain up never goes above the volume.
+ */
+void applyVolume() {
+    const uint16_t request = volumeRequest.load(std::memory_order_acquire);
+    if (request == appliedVolumeRequest || codecVolumePending) { return; } // codec changes wait for the last one to be sent
+    const int8_t codec = (int8_t)(request >> 8);
+    const int8_t softDb = (int8_t)(request & 0xFF);
+    if (outputCodecVolume < 0) { // nothing to line up with at first
+        outputCodecVolume = codec;
+        sendCodecVolume();
+    }
+
+    int8_t next = codec;
+    if (next < outputCodecVolume - VOLUME_MAX_CODEC_STEP) { next = outputCodecVolume - VOLUME_MAX_CODEC_STEP; }
+    if (next > outputCodecVolume + VOLUME_MAX_CODEC_STEP) { next = outputCodecVolume + VOLUME_MAX_CODEC_STEP; }
+    const int nextSoftDb = next == codec || softDb == VOLUME_MUTED ? softDb : 0;
+    if (next != outputCodecVolume) {
+        const int step = outputCodecVolume - next;
+        if (step > 0) {
+            setSoftGain(nextSoftDb == VOLUME_MUTED ? VOLUME_MUTED : nextSoftDb - step);
+            if (outputGain.isRamping()) { return; } // step the codec once the software gain is down
+        }
+        outputGain.scaleNow(powf(10.0f, step / 20.0f));
+        codecVolumeDelay = getI2SOutputQueueFrames();
+        outputCodecVolume = next;
+        codecVolumePending = true;
+        if (!codecVolumeDelay) { sendCodecVolume(); }
     }
+    if (next == codec) { appliedVolumeRequest = request; }
+    setSoftGain(nextSoftDb);
+}
+
+/** Count the frames written to the output, setting the codec once its volume is due (audio task only). */
+void volumeWritten(uint32_t frames) {
+    if (!codecVolumePending) { return; }
+    if (frames < codecVolumeDelay) { codecVolumeDelay -= frames; }
+    else { sendCodecVolume(); }
+}
+
+/** Update the frame clock after a block has been read (and recorded if there was room). */
+void updateFrameClock(int64_t readTime) {
+    uint32_t next = frameClockIndex.load(std::memory_order_relaxed) ^ 1;
+    frameClocks[next].frames = recordedFrames;
+    frameClocks[next].time = readTime;
+    frameClockIndex.store(next, std::memory_order_release);
+}
+
+/**
+ * Get the index of the recorded frame being captured right now: the frames recorded by the last
+ * block read plus the frames captured since that read finished. This is constant time and can be
+ * called from an ISR. Anything that happens while blocks are being dropped is given the index of
+ * the end of the recorded audio before it.
+ */
+uint32_t IRAM_ATTR getRecordingFrame() {
+    const FrameClock& clock = frameClocks[frameClockIndex.load(std::memory_order_acquire)];
+    uint32_t elapsed = (uint32_t)(esp_timer_get_time() - clock.time);
+    if (elapsed > frameClockMaxUs) { elapsed = frameClockMaxUs; }
+    return clock.frames + ((elapsed * framesPerUsQ16) >> 16);
 }
 
-void lowPassFilter(uint8_t *data, size_t dataSize, float alpha) {
-    int16_t *samples = (int16_t *)data;
-    size_t numSamples = dataSize / sizeof(int16_t);
-    for (int ch = 0; ch < REC_CHANNELS; ++ch) { lowPassFilterGivenChannel(samples, numSamples, ch, alpha); }
+/**
+ * Have the SD card task write the recorded audio once there is at least a whole chunk of it. This
+ * never blocks: if the SD card task is already scheduled (or its queue is full) this is tried again
+ * after the next block.
+ */
+void scheduleRecordingWrite() {
+    if (recordingBuffer->available() >= SD_WRITE_CHUNK && recordingBuffer->scheduleConsumer()) {
+        if (!submitSDTask(SD_LANE_AUDIO, (SDCallback)writeRecordingBuffer, recordingBuffer, 0)) { recordingBuffer->consumerDone(); }
+    }
 }
 
 /**
@@ -59,72 +206,54 @@ void lowPassFilter(uint8_t *data, size_t dataSize, float alpha) {
  * while also writing audio data back to the I2S bus for playback.
  */
 void audioRecordingTask(void *pvParameters) {
-    uint8_t* buffer = readBuffer1; // the current buffer being read into (switches between readBuffer1 and readBuffer2 for double buffering)
-    uint16_t offset = 0; // the current offset in the buffer
-    // We only allow one write at a time, so we can use a single instance of the params
-    WriteWAVParams params = { .writing = false };
+    uint32_t reportedOverruns = 0;
 
     while (true) {
-#ifdef CHECK_I2S_EVENTS
-        // Check for I2S events (errors)
-        if (i2sQueue) {
-            i2s_event_t evt;
-            while (xQueueReceive(i2sQueue, &evt, 0)) {
-                if (evt.type == I2S_EVENT_DMA_ERROR) {
-                    printf("!! I2S DMA error\n");
-                } else if (evt.type == I2S_EVENT_RX_Q_OVF) {
-                    printf("!! I2S Overflow receive buffer\n");
-                } else if (evt.type == I2S_EVENT_TX_Q_OVF) {
-                    printf("!! I2S Overflow transmit buffer\n");
-                // } else if (evt.type == I2S_EVENT_RX_DONE) {
-                //     printf("-- I2S Received\n");
-                // } else if (evt.type == I2S_EVENT_TX_DONE) {
-                //     printf("-- I2S Transmitted\n");
-                }
-            }
-        }
-#endif
+        checkI2SEvents();
 
-        // Read audio data from the I2S bus
-        // TODO: several questions about i2s_read:
-        //    giving a smaller buffer size (e.g. 64) reduces latency but increases overhead
-        //    giving a small timeout (instead of infinite) could also reduce latency
+        // Read audio data from the I2S bus straight into the recording ring buffer. If the SD card
+        // has fallen too far behind, the block is still read (for playback) but not recorded.
+#if AUDIO_CODEC == AUDIO_CODEC_VIRTUAL
+        // Without real-time pacing there is no deadline, so wait for the SD card task instead
+        while (!isVirtualAudioPaced() && !recordingBuffer->hasRoom()) { scheduleRecordingWrite(); vTaskDelay(1); }
+#endif
+        uint8_t* block = recordingBuffer->acquire();
+        uint8_t* buffer = block ? block : outputBuffer;
         size_t bytesRead = 0;
-        esp_err_t result = i2s_read(I2S_PORT, &buffer[offset], BUFFER_READ_LEN, &bytesRead, portMAX_DELAY);
-        if (result != ESP_OK) { printf("!! I2S read error\n"); continue; }
-        //offset += bytesRead;
-    
-        int16_t min = 0, max = 0;
-        for (int i = 0; i < bytesRead / REC_BYTES_PER_SAMPLE; i++) {
-            int16_t sample = ((int16_t*)buffer)[i + offset / REC_BYTES_PER_SAMPLE];
-            if (sample < min) min = sample;
-            if (sample > max) max = sample;
+        bool readOK = readI2S(buffer, BUFFER_READ_LEN, &bytesRead);
+        int64_t readTime = esp_timer_get_time();
+        if (!readOK) { captureEvent(CAPTURE_READ_ERROR); continue; }
+        captureBlock((int16_t*)buffer, bytesRead / REC_BYTES_PER_SAMPLE, readTime);
+        latencyInput((const int16_t*)buffer, bytesRead / (REC_CHANNELS * REC_BYTES_PER_SAMPLE));
+
+        // Record the unfiltered block (the SD card task only reads it, so the filter can still read
+        // it after it is committed)
+        if (block) {
+            recordingBuffer->commit();
+            recordedFrames += bytesRead / (REC_CHANNELS * REC_BYTES_PER_SAMPLE);
         }
-        printf("Audio sample read: %d bytes, offset: %d\n", bytesRead, offset);
-        printf("Audio sample range: %d to %d\n", min, max);
+        updateFrameClock(readTime);
+        scheduleRecordingWrite();
 
-        memcpy(writeBuffer, &buffer[offset], bytesRead);
-        lowPassFilter(writeBuffer, bytesRead, 0.05);
+        // Output a file being played instead of the live audio
+        if (!readPlayback((int16_t*)outputBuffer, bytesRead / (PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE))) {
+            hearThroughFilter((const int16_t*)buffer, (int16_t*)outputBuffer, bytesRead / (REC_CHANNELS * REC_BYTES_PER_SAMPLE));
+        }
+        applyVolume();
+        outputGain.process((const int16_t*)outputBuffer, (int16_t*)outputBuffer, bytesRead / (PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE));
+        latencyOutput((int16_t*)outputBuffer, bytesRead / (PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE));
 
         //vTaskDelay(40 / portTICK_PERIOD_MS); // delay for 10 ms to allow other tasks to run
-        sendAudioToI2S(writeBuffer, bytesRead); // send the audio data to the I2S bus for playback
-
-        // Write the buffer to the SD card every so often
-        if (offset >= WAV_BUFFER_LEN) {
-            // if (params.writing) { printf("!! Audio writing is too slow\n"); }
-
-            // // Write the filled buffer to the SD card
-            // params.buffer = buffer;
-            // params.length = offset;
-            // params.writing = true;
-            // submitSDTask((SDCallback)writeWAVData, &params);
-
-            // // Swap the buffers
-            // buffer = (buffer == readBuffer1) ? readBuffer2 : readBuffer1;
-            offset = 0;
-
-            // TODO: remove this debug print
-            // printf("Audio Recording High watermark: %u\n", uxTaskGetStackHighWaterMark(NULL));
+        sendAudioToI2S(outputBuffer, bytesRead); // send the audio data to the I2S bus for playback
+        volumeWritten(bytesRead / (PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE));
+
+        // Report dropped audio (once per run of overruns instead of for every block)
+        RingBufferStats stats;
+        recordingBuffer->stats(&stats);
+        if (stats.overruns != reportedOverruns && block) {
+            printf("!! Audio writing is too slow: %u blocks dropped (SD card stalled for %u ms)\n",
+                stats.overruns - reportedOverruns, stats.maxStallUs / 1000);
+            reportedOverruns = stats.overruns;
         }
 
         yield();
@@ -133,134 +262,59 @@ void audioRecordingTask(void *pvParameters) {
     vTaskDelete(NULL);
 }
 
-
-/**
- * Generate a dual-channel sine wave.
- * The frequency should be in the range of human hearing (20 Hz to 20 kHz).
- * Two common frequencies are 440 Hz (A4) and 523.25 Hz (C5).
- * The amplitude should be in the range of 0 to 32767.
- * The offset is the starting point of the wave.
- * This returns the new offset after generating the wave.
- * The buffer length is in elements (not bytes).
- */
-uint32_t generateSineWave(float frequency, int16_t amplitude, uint32_t offset, uint16_t* buffer, uint32_t length) {
-    const float angularFreq = 2.0 * PI * frequency / REC_SAMPLE_RATE;
-    for (int i = 0; i < length/2; i++) {
-        buffer[2*i] = buffer[2*i+1] = amplitude * sin(angularFreq * (i + offset));
-    }
-    return (offset + length/2); // TODO: add in % so we don't overflow
-}
-
-
 /**
- * Mix two audio samples together.
+ * Get the statistics of the recording ring buffer: how full it is and has been, how many blocks
+ * were dropped because the SD card could not keep up, and how long the SD card has stalled.
  */
-void mixAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, float ratio, uint16_t* output) {
-    for (int i = 0; i < length; i++) {
-        output[i] = sample1[i] * ratio + sample2[i] * (1 - ratio);
-    }
+bool getRecordingStats(RingBufferStats* stats) {
+    if (!recordingBuffer) { return false; }
+    recordingBuffer->stats(stats);
+    return true;
 }
 
-/**
- * Add two audio samples together. Does not check for overflow.
- */
-void addAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, uint16_t* output) {
-    for (int i = 0; i < length; i++) {
-        output[i] = sample1[i] + sample2[i];
-    }
-}
+RingBuffer* getRecordingBuffer() { return recordingBuffer; }
 
 
 /**
  * Send audio data to the I2S bus for playback.
  */
-void sendAudioToI2S(uint8_t* data, uint32_t length) {
-    // TODO: is the loop necessary? can we just write the whole buffer at once? or maybe limit the size of each send or use a timeout and then use yield?
-    size_t bytesWritten = 0;
-    size_t offset = 0;
-    while (offset < length) {
-        i2s_write(I2S_PORT, &data[offset], length - offset, &bytesWritten, portMAX_DELAY);
-        offset += bytesWritten;
-    }
-}
+void sendAudioToI2S(uint8_t* data, uint32_t length) { writeI2S(data, length); }
 
 
 /**
- * Set the volume of the audio codec.
+ * Set the volume of the played audio.
  * The volume must be in the range -48 to 79 where:
  *   <0 is muted (should not be less than -48)
  *   0 to 79 is -73dB to +6dB in 1dB steps
+ *
+ * Muting and most changes only ramp the software gain. The codec is only changed (to the next
+ * coarse step at or above the volume, up to the most it can play) when the volume is above it or
+ * more than VOLUME_SOFT_RANGE below it. The audio task applies the change (see applyVolume()).
  */
 void setVolume(int8_t volume) {
-    if (audio_codec) {
-        audio_codec->setVolume(volume);
-    } else {
-        printf("!! Audio codec not set up\n");
+    if (!audio_codec) { printf("!! Audio codec not set up\n"); return; }
+    if (volume < 0) { volumeRequest.store(VOLUME_REQUEST(codecVolume, VOLUME_MUTED), std::memory_order_release); return; }
+    if (volume > VOLUME_MAX) { volume = VOLUME_MAX; }
+    if (codecVolume < 0 || volume > codecVolume || volume < codecVolume - VOLUME_SOFT_RANGE) {
+        int coarse = (volume + VOLUME_COARSE_STEP - 1) / VOLUME_COARSE_STEP * VOLUME_COARSE_STEP;
+        const int8_t max = audio_codec->maxVolume();
+        codecVolume = (int8_t)(coarse > max ? max : coarse);
     }
+    volumeRequest.store(VOLUME_REQUEST(codecVolume, volume - codecVolume), std::memory_order_release);
 }
 
 
-/**
- * Set up the I2S driver. This makes the ESP32 the master and operate in both RX and TX modes.
- */
-bool i2s_install() {
-    static_assert(REC_BITS_PER_SAMPLE == 8 || REC_BITS_PER_SAMPLE == 16 || REC_BITS_PER_SAMPLE == 24 || REC_BITS_PER_SAMPLE == 32, "Bits per sample must be 8, 16, 24, or 32 - only supported by the I2S driver");
-    static_assert(REC_CHANNELS == 1 || REC_CHANNELS == 2, "Channels must be 1 (mono) or 2 (stereo) - only supported by the I2S driver (unless TDM is supported)");
-    const i2s_driver_config_t i2s_config = {
-        .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_TX),
-        .sample_rate = REC_SAMPLE_RATE,
-        .bits_per_sample = (i2s_bits_per_sample_t)REC_BITS_PER_SAMPLE,  // also supports 8, 24, and 32 bit
-        .channel_format = (REC_CHANNELS == 2) ? I2S_CHANNEL_FMT_RIGHT_LEFT : I2S_CHANNEL_FMT_ONLY_LEFT,
-        .communication_format = audio_codec->i2s_comm_format(),
-        .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,  // TODO: does a higher level make sense? (or 0 for default)
-        
-        // For more info see https://www.reddit.com/r/esp32/comments/muj6wo/esp32_i2s_dma_settings_dma_buf_len_and_dma_buf/
-        // Basically:
-        //  * dma_buf_len is the number of samples in each buffer, whenever we read from I2S we
-        //    read in multiples of this size
-        //  * increasing dma_buf_len reduces CPU overhead but reduces granularity and increases
-        //    latency
-        //  * dma_buf_count is the number of buffers, increasing this increases memory usage but
-        //    allows for more buffers to be queued up in the driver before a call to i2s_read
-        // If we are keeping up with the audio data, we can use a small dma_buf_count (like 2). To
-        // reduce latency, we can use a small dma_buf_len (384 would be 8 ms at 48 kHz, 128 would
-        // be 8 ms at 16 kHz).
-        .dma_buf_count = 8,  // TODO: lower this
-        .dma_buf_len = DMA_BUFFER_SAMPLE_LEN,
-
-        .use_apll = false,
-        .tx_desc_auto_clear = false,  // for cleaner outputs when there are delays
-        .fixed_mclk = 0,
-        .mclk_multiple = I2S_MCLK_MULTIPLE_DEFAULT,  // TODO: 512?
-        .bits_per_chan = I2S_BITS_PER_CHAN_DEFAULT,  // default means to use the same as bits_per_sample
-    };
-#ifdef CHECK_I2S_EVENTS
-#define QUEUE_ARG 4, &i2sQueue
-#else
-#define QUEUE_ARG 0, NULL
-#endif
-    if (i2s_driver_install(I2S_PORT, &i2s_config, QUEUE_ARG) != ESP_OK) { printf("!! i2s_driver_install()\n"); return false; }
-    return true;
-
-    //i2s_set_clk(I2S_PORT, REC_SAMPLE_RATE, REC_BITS_PER_SAMPLE, I2S_CHANNEL_STEREO);
-    //i2s_set_dac_mode(I2S_DAC_CHANNEL_BOTH_EN);
+uint32_t chooseSampleRate(const uint32_t* rates, size_t count, uint32_t analysisRate, uint32_t minRate) {
+    uint32_t best = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (rates[i] >= minRate && rates[i] % analysisRate == 0 && (best == 0 || rates[i] < best)) { best = rates[i]; }
+    }
+    if (best) { return best; }
+    for (size_t i = 0; i < count; i++) { if (rates[i] == REC_SAMPLE_RATE) { return REC_SAMPLE_RATE; } }
+    return count ? rates[0] : REC_SAMPLE_RATE;
 }
 
-
-/**
- * Set up the I2S pins for the ESP32 Thing Plus C.
- */
-bool i2s_setpin() {
-    const i2s_pin_config_t pin_config = {
-        .mck_io_num = I2S_PIN_NO_CHANGE,
-        .bck_io_num = I2S_BCLK,
-        .ws_io_num = I2S_WS,
-        .data_out_num = I2S_DAC_DATA,
-        .data_in_num = I2S_ADC_DATA
-    };
-    if (i2s_set_pin(I2S_PORT, &pin_config) != ESP_OK) { printf("!! i2s_set_pin()\n"); return false; }
-    return true;
-}
+uint32_t getSampleRate() { return sampleRate; }
 
 
 /**
@@ -270,9 +324,27 @@ bool i2s_setpin() {
  */
 bool setupAudio() {
     audio_codec = create_audio_codec();
-    if (!audio_codec->setup()) { printf("!! Audio codec setup failed.\n"); return false; }
+
+    // Pick the sample rate that DUET can decimate from most cheaply
+    const uint32_t* rates;
+    size_t count = audio_codec->supportedSampleRates(&rates);
+    sampleRate = chooseSampleRate(rates, count, DUET_SAMPLE_RATE, AUDIO_MIN_SAMPLE_RATE);
+    if (sampleRate % DUET_SAMPLE_RATE != 0) { printf("!! No supported sample rate is a multiple of %d Hz, using %u Hz\n", DUET_SAMPLE_RATE, (unsigned)sampleRate); }
+    framesPerUsQ16 = (uint32_t)((uint64_t)sampleRate * 65536 / 1000000);
+    frameClockMaxUs = (uint32_t)(2ull * DMA_BUFFER_SAMPLE_LEN * 1000000 / sampleRate);
+
+    if (!audio_codec->setup(sampleRate)) { printf("!! Audio codec setup failed.\n"); return false; }
     vTaskDelay(10 / portTICK_PERIOD_MS); // Give time for codec to settle after setup
-    if (!i2s_install() || !i2s_setpin()) { return false; }
+    if (!setupI2S(audio_codec->i2s_comm_format(), DMA_BUFFER_SAMPLE_LEN, sampleRate)) { return false; }
+    setupCaptureStats(BUFFER_READ_LEN / (REC_CHANNELS * REC_BYTES_PER_SAMPLE), sampleRate);
+    setupLatency(sampleRate, BUFFER_READ_LEN / (REC_CHANNELS * REC_BYTES_PER_SAMPLE), getI2SOutputQueueFrames());
+    outputGain.setRampFrames(VOLUME_RAMP_MS * sampleRate / 1000);
+
+    // Allocate the recording ring buffer
+    uint8_t* ring = (uint8_t*)malloc(REC_RING_BLOCKS * BUFFER_READ_LEN);
+    outputBuffer = (uint8_t*)malloc(BUFFER_READ_LEN);
+    if (!ring || !outputBuffer) { printf("!! Failed to allocate the recording buffer\n"); return false; }
+    recordingBuffer = new RingBuffer(ring, BUFFER_READ_LEN, REC_RING_BLOCKS, SD_WRITE_CHUNK);
 
     // Start the audio recording task
     // TODO: can the stack size be smaller?
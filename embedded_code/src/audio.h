@@ -1,22 +1,36 @@
 #pragma once
 
 #include <stdint.h>
+#include <stddef.h>
+#include <esp_attr.h>
+
+#include "ring_buffer.hpp"
 
 // Which audio codec to use
 #define AUDIO_CODEC_WM8960 1
 #define AUDIO_CODEC_ES8388 2
 #define AUDIO_CODEC_TAC5x12 4
+#define AUDIO_CODEC_VIRTUAL 8 // WAV files instead of hardware (see audio_io.h)
+#ifndef AUDIO_CODEC
+#ifdef ESP_PLATFORM
 #define AUDIO_CODEC AUDIO_CODEC_ES8388
+#else
+#define AUDIO_CODEC AUDIO_CODEC_VIRTUAL // the only one without the hardware (see host/)
+#endif
+#endif
 
 // Audio Format Parameters
 // These cannot just be changed here without also changing the audio codec, I2S setup, and other parts of the code manually
+// The sample rate is chosen by setupAudio() from the rates the audio codec supports (see
+// chooseSampleRate()) and is then given by getSampleRate(). REC_SAMPLE_RATE is only used when none
+// of them can be decimated exactly to DUET_SAMPLE_RATE.
 #define REC_SAMPLE_RATE 44100
 #define REC_BITS_PER_SAMPLE 16
 #define REC_CHANNELS 2
 #define REC_BYTES_PER_SAMPLE (REC_BITS_PER_SAMPLE / 8)
-#define ONE_HOUR_OF_DATA (REC_SAMPLE_RATE * REC_CHANNELS * REC_BYTES_PER_SAMPLE * 3600)
+#define AUDIO_MIN_SAMPLE_RATE 32000 // lowest sample rate chosen for recording and playback
 
-#define PLAY_SAMPLE_RATE 44100
+#define PLAY_SAMPLE_RATE REC_SAMPLE_RATE // playback always uses the same rate as recording
 #define PLAY_BITS_PER_SAMPLE 16
 #define PLAY_CHANNELS 2
 #define PLAY_BYTES_PER_SAMPLE (PLAY_BITS_PER_SAMPLE / 8)
@@ -28,29 +42,41 @@
 bool setupAudio();
 
 /**
- * Set the volume of the audio codec.
- * The volume must be in the range -48 to 79 where:
- *   <0 is muted (should not be less than -48)
- *   0 to 79 is -73dB to +6dB in 1dB steps
+ * Choose the sample rate to use out of the rates supported by the audio codec: the one at least
+ * minRate that is the smallest exact multiple of the analysis rate (so it can be decimated with
+ * the fewest filter taps), or REC_SAMPLE_RATE (or the first rate if that isn't supported either)
+ * when none of them is a multiple.
  */
-void setVolume(int8_t volume);
+uint32_t chooseSampleRate(const uint32_t* rates, size_t count, uint32_t analysisRate, uint32_t minRate);
+
+/** The sample rate of the recorded and played audio (REC_SAMPLE_RATE until setupAudio() is called). */
+uint32_t getSampleRate();
 
 /**
- * Generate a dual-channel sine wave.
- * The frequency should be in the range of human hearing (20 Hz to 20 kHz).
- * Two common frequencies are 440 Hz (A4) and 523.25 Hz (C5).
- * The amplitude should be in the range of 0 to 32767.
- * The offset is the starting point of the wave.
- * This returns the new offset after generating the wave.
- * The buffer length is in elements (not bytes).
+ * Get the statistics of the recording ring buffer between the I2S and SD card tasks: how full it is
+ * and has been, how many blocks were dropped because the SD card could not keep up, and how long
+ * the SD card has stalled. Returns false if audio has not been set up.
  */
-uint32_t generateSineWave(float frequency, int16_t amplitude, uint32_t offset, uint16_t* buffer, uint32_t length);
+bool getRecordingStats(RingBufferStats* stats);
 
-/** Mix two audio samples together. */
-void mixAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, float ratio, uint16_t* output);
+/** The ring buffer of recorded audio between the I2S and SD card tasks (NULL until setupAudio()). */
+RingBuffer* getRecordingBuffer();
 
-/** Add two audio samples together. Does not check for overflow. */
-void addAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, uint16_t* output);
+/**
+ * Get the index of the recorded frame being captured right now, counting from the first frame
+ * recorded (the same count the SD card task uses for the frames written to the recording files).
+ * This is constant time and can be called from an ISR.
+ */
+uint32_t IRAM_ATTR getRecordingFrame();
+
+/**
+ * Set the volume of the played audio. The change is ramped smoothly by a software gain and the
+ * codec's volume is only changed in coarse steps.
+ * The volume must be in the range -48 to 79 where:
+ *   <0 is muted (should not be less than -48)
+ *   0 to 79 is -73dB to +6dB in 1dB steps
+ */
+void setVolume(int8_t volume);
 
 /** Send audio data to the I2S bus for playback. The length is in bytes. */
 void sendAudioToI2S(uint8_t* data, uint32_t length);
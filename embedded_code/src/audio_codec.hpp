@@ -8,22 +8,31 @@
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <driver/i2s.h>
+#include <stddef.h>
 
 #include "audio.h"
+#include "audio_io.h" // i2s_comm_format_t
 
 class AudioCodec {
 public:
+    virtual ~AudioCodec() { }
+
+    /**
+     * Get the sample rates the codec supports (for both recording and playback). Returns how many
+     * there are and sets rates to point to them. This can be called before setup().
+     */
+    virtual size_t supportedSampleRates(const uint32_t** rates) = 0;
+
     /**
-     * Set up the audio codec.
+     * Set up the audio codec with one of its supported sample rates.
      * 
      * Before this is called, the Serial and Wire interfaces must be set up.
      *
-     * This must be called before any other methods are called.
+     * This must be called before any other methods are called (except supportedSampleRates()).
      *
      * Returns true if the setup was successful, false otherwise.
      */
-    virtual bool setup() = 0;
+    virtual bool setup(uint32_t sampleRate) = 0;
 
     /**
      * Set the volume of the audio codec.
@@ -33,6 +42,12 @@ public:
      */
     virtual void setVolume(int8_t volume) = 0;
 
+    /**
+     * The highest volume (see setVolume()) the codec can play at. Anything above it is up to the
+     * software gain. The default is 79 (+6dB).
+     */
+    virtual int8_t maxVolume() { return 79; }
+
     /**
      * Get the I2S communication format used by the codec.
      * The default is I2S_COMM_FORMAT_STAND_I2S.
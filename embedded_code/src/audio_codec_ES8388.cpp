@@ -18,7 +18,9 @@
 #if AUDIO_CODEC == AUDIO_CODEC_ES8388
 
 #include "clock_signal.hpp"
+#include "codec_registers.hpp"
 #include <Wire.h>
+#include <stdio.h>
 
 
 // Configuration
@@ -35,11 +37,11 @@ static_assert(REC_CHANNELS == 2, "ES8388: CHANNELS must be 2 (with work 1, 3, or
 static_assert(PLAY_BITS_PER_SAMPLE == 16 || PLAY_BITS_PER_SAMPLE == 18 || PLAY_BITS_PER_SAMPLE == 20 || PLAY_BITS_PER_SAMPLE == 24 || PLAY_BITS_PER_SAMPLE == 32, "ES8388: PLAY_BITS_PER_SAMPLE must be 16, 18, 20, 24, or 32");
 static_assert(PLAY_CHANNELS == 2, "ES8388: CHANNELS must be 2 (with work 1, 3, or 4 channels could be supported as well)");
 
-static_assert(REC_SAMPLE_RATE == 8000 || REC_SAMPLE_RATE == 8018 || REC_SAMPLE_RATE == 11025 || REC_SAMPLE_RATE == 12000 || REC_SAMPLE_RATE == 16000 || REC_SAMPLE_RATE == 22050 ||
-    REC_SAMPLE_RATE == 24000 || REC_SAMPLE_RATE == 32000 || REC_SAMPLE_RATE == 44100 || REC_SAMPLE_RATE == 48000 || REC_SAMPLE_RATE == 88200 || REC_SAMPLE_RATE == 96000,
-    "ES8388: REC_SAMPLE_RATE must be one of the supported rates (8000, 8018, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000, 88200, or 96000)");
 static_assert(REC_SAMPLE_RATE == PLAY_SAMPLE_RATE, "ES8388: REC_SAMPLE_RATE must be equal to PLAY_SAMPLE_RATE (with work they could be different)");
 
+// Supported sample rates
+static const uint32_t SAMPLE_RATES[] = { 8000, 8018, 11025, 12000, 16000, 22050, 24000, 32000, 44100, 48000, 88200, 96000 };
+
 
 // Registers
 #define REG_CONTROL1         0x00
@@ -325,14 +327,13 @@ constexpr uint8_t bitsToWL(uint8_t bits) {
 
 class AudioCodec_ES8388 : public AudioCodec {
     ClockSignal* clock_signal;
-    TwoWire *i2c;
+    CodecBus* bus;
+    CodecRegisters regs;
     int freq;
     uint8_t clock_div;
 
-    inline bool write_reg(uint8_t reg, uint8_t value) {
-        i2c->beginTransmission((uint8_t)ES8388_ADDR);
-        return i2c->write(reg) && i2c->write(value) && i2c->endTransmission();
-    }
+    /** Queue a register write (sent in bursts by regs.flush()). */
+    inline bool write_reg(uint8_t reg, uint8_t value) { return regs.write(reg, value); }
 
     inline int clamp(int x, int min, int max) {
         if (x < min) return min;
@@ -348,24 +349,35 @@ class AudioCodec_ES8388 : public AudioCodec {
         return (-clamp(volume, -96, 0) << 1) + (plusHalf ? 1 : 0);
     }
 
+    /** Choose the master clock and its ratio to the sample rate. Returns false if the rate isn't supported. */
+    bool setClock(uint32_t sampleRate) {
+        if (sampleRate == 8000) { freq = 12288000; clock_div = FsRatio_MCLK_1536; } // or 12000000, FsRatio_MCLK_1500; 18432000, FsRatio_MCLK_72304
+        else if (sampleRate == 12000) { freq = 12288000; clock_div = FsRatio_MCLK_1024; } // or 12000000, FsRatio_MCLK_1000; 18432000, FsRatio_MCLK_1536
+        else if (sampleRate == 16000) { freq = 12288000; clock_div = FsRatio_MCLK_768; } // or 12000000, FsRatio_MCLK_750; 18432000, FsRatio_MCLK_1152
+        else if (sampleRate == 24000) { freq = 12288000; clock_div = FsRatio_MCLK_512; } // or 12000000, FsRatio_MCLK_500; 18432000, FsRatio_MCLK_768
+        else if (sampleRate == 32000) { freq = 12288000; clock_div = FsRatio_MCLK_384; } // or 12000000, FsRatio_MCLK_375; 18432000, FsRatio_MCLK_576
+        else if (sampleRate == 48000) { freq = 12288000; clock_div = FsRatio_MCLK_256; } // or 12000000, FsRatio_MCLK_250; 18432000, FsRatio_MCLK_384
+        else if (sampleRate == 96000) { freq = 12288000; clock_div = FsRatio_MCLK_128; } // or 12000000, FsRatio_MCLK_125; 18432000, FsRatio_MCLK_192
+        else if (sampleRate == 8018) { freq = 11289600; clock_div = FsRatio_MCLK_1408; } // or 16934400, FsRatio_MCLK_2112
+        else if (sampleRate == 11025) { freq = 11289600; clock_div = FsRatio_MCLK_1024; } // or 16934400, FsRatio_MCLK_1536
+        else if (sampleRate == 22050) { freq = 11289600; clock_div = FsRatio_MCLK_512; } // or 16934400, FsRatio_MCLK_768
+        else if (sampleRate == 44100) { freq = 11289600; clock_div = FsRatio_MCLK_256; } // or 16934400, FsRatio_MCLK_384
+        else if (sampleRate == 88200) { freq = 11289600; clock_div = FsRatio_MCLK_128; } // or 16934400, FsRatio_MCLK_192
+        else { return false; }
+        return true;
+    }
+
 public:
-    AudioCodec_ES8388() : i2c(&Wire) {
-        if (REC_SAMPLE_RATE == 8000) { freq = 12288000; clock_div = FsRatio_MCLK_1536; } // or 12000000, FsRatio_MCLK_1500; 18432000, FsRatio_MCLK_72304
-        else if (REC_SAMPLE_RATE == 12000) { freq = 12288000; clock_div = FsRatio_MCLK_1024; } // or 12000000, FsRatio_MCLK_1000; 18432000, FsRatio_MCLK_1536
-        else if (REC_SAMPLE_RATE == 16000) { freq = 12288000; clock_div = FsRatio_MCLK_768; } // or 12000000, FsRatio_MCLK_750; 18432000, FsRatio_MCLK_1152
-        else if (REC_SAMPLE_RATE == 24000) { freq = 12288000; clock_div = FsRatio_MCLK_512; } // or 12000000, FsRatio_MCLK_500; 18432000, FsRatio_MCLK_768
-        else if (REC_SAMPLE_RATE == 32000) { freq = 12288000; clock_div = FsRatio_MCLK_384; } // or 12000000, FsRatio_MCLK_375; 18432000, FsRatio_MCLK_576
-        else if (REC_SAMPLE_RATE == 48000) { freq = 12288000; clock_div = FsRatio_MCLK_256; } // or 12000000, FsRatio_MCLK_250; 18432000, FsRatio_MCLK_384
-        else if (REC_SAMPLE_RATE == 96000) { freq = 12288000; clock_div = FsRatio_MCLK_128; } // or 12000000, FsRatio_MCLK_125; 18432000, FsRatio_MCLK_192
-        else if (REC_SAMPLE_RATE == 8018) { freq = 11289600; clock_div = FsRatio_MCLK_1408; } // or 16934400, FsRatio_MCLK_2112
-        else if (REC_SAMPLE_RATE == 11025) { freq = 11289600; clock_div = FsRatio_MCLK_1024; } // or 16934400, FsRatio_MCLK_1536
-        else if (REC_SAMPLE_RATE == 22050) { freq = 11289600; clock_div = FsRatio_MCLK_512; } // or 16934400, FsRatio_MCLK_768
-        else if (REC_SAMPLE_RATE == 44100) { freq = 11289600; clock_div = FsRatio_MCLK_256; } // or 16934400, FsRatio_MCLK_384
-        else if (REC_SAMPLE_RATE == 88200) { freq = 11289600; clock_div = FsRatio_MCLK_128; } // or 16934400, FsRatio_MCLK_192
-        else { freq = 12288000; clock_div = FsRatio_MCLK_256; } // default: 48 kHz
+    explicit AudioCodec_ES8388(CodecBus* bus) : clock_signal(nullptr), bus(bus), regs(bus, ES8388_ADDR, CODEC_REGS_8BIT) { }
+    ~AudioCodec_ES8388() { delete clock_signal; delete bus; }
+
+    size_t supportedSampleRates(const uint32_t** rates) override {
+        *rates = SAMPLE_RATES;
+        return sizeof(SAMPLE_RATES) / sizeof(SAMPLE_RATES[0]);
     }
-    ~AudioCodec_ES8388() { delete clock_signal; }
-    bool setup() override {
+
+    bool setup(uint32_t sampleRate) override {
+        if (!setClock(sampleRate)) { printf("!! ES8388: unsupported sample rate %u\n", (unsigned)sampleRate); return false; }
         clock_signal = new ClockSignal(freq, CLOCK_PIN);
         if (clock_signal->resume() != ESP_OK) {
             delete clock_signal;
@@ -450,7 +462,11 @@ public:
             write_reg(REG_DACPOWER, LOUT1_EN | LOUT2_EN | ROUT1_EN | ROUT2_EN) &&
             #endif
             write_reg(REG_ADCPOWER, 0b00000001) &&      // power on ADC (inc mic bias) but int1 stays in low power mode
-            write_reg(REG_DACCONTROL3, UNMUTE | NO_SOFT_RAMP | NO_LR_GAINS_MATCH);
+            write_reg(REG_DACCONTROL3, UNMUTE | NO_SOFT_RAMP | NO_LR_GAINS_MATCH) &&
+
+            // Send all of the writes above (in order, with consecutive registers in single bursts)
+            regs.flush() &&
+            regs.startWriter();  // volume changes are posted to the writer task
 
 
             // TODO: reset internal state machine?
@@ -464,13 +480,21 @@ public:
         // dac_vol_handle = audio_codec_volume_init(&vol_cfg);
     }
 
+    /** 0dB, the most the DAC does. */
+    int8_t maxVolume() override { return 73; }
+
+    /**
+     * The volume is converted to the DAC attenuation (0 to 79 is -73dB to +6dB, so volumes above 73
+     * play at 0dB, the most the DAC does, and <0 at -96dB). Doesn't wait for the bus (the writes are
+     * sent by the writer task) and unchanged volumes aren't written.
+     */
     void setVolume(int8_t volume) override {
-        int8_t vol = AudioCodec_ES8388::volume_dac_adc(volume, false);
-        write_reg(REG_DACCONTROL5, vol);
-        write_reg(REG_DACCONTROL4, vol);
+        uint8_t vol = AudioCodec_ES8388::volume_dac_adc(volume < 0 ? -96 : volume - 73, false);
+        regs.post(REG_DACCONTROL4, vol);
+        regs.post(REG_DACCONTROL5, vol);
     }
 };
 
-AudioCodec* create_audio_codec() { return new AudioCodec_ES8388(); }
+AudioCodec* create_audio_codec() { return new AudioCodec_ES8388(create_i2c_codec_bus(&Wire)); }
 
 #endif
@@ -18,29 +18,50 @@
 #if AUDIO_CODEC == AUDIO_CODEC_WM8960
 
 #include <SparkFun_WM8960_Arduino_Library.h>
+#include <Wire.h>
+#include "codec_registers.hpp"
 
 // Configuration
 #define AUDIO_OUTPUT 2 // set to 0 for no audio output (just recording), 1 for loopback, 2 for manual output
 #define RECORDING_VOLUME 55 // 24db; value from 0-63, maps to -17.25dB to +30.00dB with 0.75dB steps
 
+// Registers written directly (the library writes each one up to 4 times to set the volume)
+#define WM8960_I2C_ADDR 0x1A
+#define REG_LOUT1_VOLUME 0x02
+#define REG_ROUT1_VOLUME 0x03
+#define OUT1VU (1 << 8)     // update both headphone volumes at once
+
 
-static_assert(REC_SAMPLE_RATE == 44100, "WM8960: Sample rate must be 44.1kHz (can be changed in code)");
 static_assert(REC_BITS_PER_SAMPLE == 16 || REC_BITS_PER_SAMPLE == 20 || REC_BITS_PER_SAMPLE == 24 || REC_BITS_PER_SAMPLE == 32, "WM8960: Bits per sample must be 16, 20, 24, or 32");
 static_assert(REC_CHANNELS == 1 || REC_CHANNELS == 2, "WM8960: Channels must be 1 (mono) or 2 (stereo), with work 3 or 4 channels could be supported as well");
 
-static_assert(PLAY_SAMPLE_RATE == 44100, "WM8960: Sample rate must be 44.1kHz (can be changed in code)");
 static_assert(PLAY_BITS_PER_SAMPLE == 16 || PLAY_BITS_PER_SAMPLE == 20 || PLAY_BITS_PER_SAMPLE == 24 || PLAY_BITS_PER_SAMPLE == 32, "WM8960: Bits per sample must be 16, 20, 24, or 32");
 static_assert(PLAY_CHANNELS == 1 || PLAY_CHANNELS == 2, "WM8960: Channels must be 1 (mono) or 2 (stereo), with work 3 or 4 channels could be supported as well");
 
 static_assert(PLAY_BITS_PER_SAMPLE == REC_BITS_PER_SAMPLE, "WM8960: Playback bits per sample must match recording bits per sample");
 
+// Supported sample rates (only the one the clock setup below is for)
+static const uint32_t SAMPLE_RATES[] = { 44100 };
+
 
 class AudioCodec_WM8960 : public AudioCodec {
     WM8960 audio_codec;
+    CodecBus* bus;
+    CodecRegisters regs;
 
 public:
-    bool setup() override {
+    explicit AudioCodec_WM8960(CodecBus* bus) : bus(bus), regs(bus, WM8960_I2C_ADDR, CODEC_REGS_9BIT) { }
+    ~AudioCodec_WM8960() { delete bus; }
+
+    size_t supportedSampleRates(const uint32_t** rates) override {
+        *rates = SAMPLE_RATES;
+        return sizeof(SAMPLE_RATES) / sizeof(SAMPLE_RATES[0]);
+    }
+
+    bool setup(uint32_t sampleRate) override {
         return // this is a chain of boolean ANDs, so if any fail, the whole thing fails
+            sampleRate == 44100 &&
+
             audio_codec.begin() &&  // Initialize the codec
 
             // General setup needed
@@ -194,19 +215,26 @@ public:
 #endif
 
             //audio_codec.enableLoopBack(); // Loopback sends ADC data directly into DAC
-            audio_codec.disableLoopBack();
+            audio_codec.disableLoopBack() &&
+
+            regs.startWriter();  // volume changes are posted to the writer task
     }
 
     /**
      * The volume must be in the range -48 to 79 where:
      *   <0 is muted (should not be less than -48)
      *   0 to 79 is -73dB to +6dB in 1dB steps
+     *
+     * This doesn't wait for the bus (the writes are sent by the writer task) and unchanged volumes
+     * aren't written. The left volume is latched until the right one is written with OUT1VU.
      */
     void setVolume(int8_t volume) override {
-        audio_codec.setHeadphoneVolume(volume + 48);
+        uint16_t vol = (uint16_t)(volume + 48) & 0x7F;
+        regs.post(REG_LOUT1_VOLUME, vol);
+        regs.post(REG_ROUT1_VOLUME, vol | OUT1VU);
     }
 };
 
-AudioCodec* create_audio_codec() { return new AudioCodec_WM8960(); }
+AudioCodec* create_audio_codec() { return new AudioCodec_WM8960(create_i2c_codec_bus(&Wire)); }
 
 #endif
@@ -0,0 +1,39 @@
+/**
+ * Virtual audio codec that goes with the virtual I2S bus in audio_io.cpp: the recorded audio is
+ * read from a WAV file and the played audio is written to another one.
+ *
+ * There is no hardware to set up. The volume is applied to the played audio (with the same mapping
+ * as the real codecs) so the output file sounds like what would have been heard.
+ */
+
+#include "audio_codec.hpp"
+#include "audio.h"
+
+#if AUDIO_CODEC == AUDIO_CODEC_VIRTUAL
+
+#include "audio_io.h"
+
+#include <math.h>
+
+class AudioCodec_Virtual : public AudioCodec {
+    uint32_t rate = 0;
+
+public:
+    /** The only rate is the one of the input file. */
+    size_t supportedSampleRates(const uint32_t** rates) override {
+        rate = getVirtualAudioSampleRate();
+        *rates = &rate;
+        return rate ? 1 : 0;
+    }
+
+    bool setup(uint32_t sampleRate) override { return sampleRate == getVirtualAudioSampleRate(); }
+
+    void setVolume(int8_t volume) override {
+        // <0 is muted, 0 to 79 is -73dB to +6dB
+        setVirtualAudioGain(volume < 0 ? 0.0f : powf(10.0f, (volume - 73) / 20.0f));
+    }
+};
+
+AudioCodec* create_audio_codec() { return new AudioCodec_Virtual(); }
+
+#endif
@@ -0,0 +1,13 @@
+#include "audio_encoder.hpp"
+
+// Defined in the individual encoder files
+AudioEncoder* create_ima_adpcm_encoder();
+AudioEncoder* create_lossless_encoder();
+
+AudioEncoder* create_audio_encoder(RecordingEncoding encoding) {
+    switch (encoding) {
+        case ENCODING_IMA_ADPCM: return create_ima_adpcm_encoder();
+        case ENCODING_LOSSLESS: return create_lossless_encoder();
+        default: return NULL;
+    }
+}
@@ -0,0 +1,72 @@
+/**
+ * General interface for encoders that compress recorded audio before it is
+ * written to the SD card.
+ *
+ * Encoders take interleaved 16-bit frames (REC_CHANNELS per frame) and produce
+ * whole encoded blocks that are stored in the data chunk of a WAV file. Input
+ * that doesn't fill a whole block is kept by the encoder until more input
+ * arrives or the encoder is flushed at the end of the file.
+ *
+ * Actual encoders are implemented in individual files.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "wav.h"
+
+/** The encodings available for recordings. */
+enum RecordingEncoding : uint8_t {
+    ENCODING_PCM = 0,       // uncompressed 16-bit PCM (written directly, no encoder)
+    ENCODING_IMA_ADPCM = 1, // IMA ADPCM, 4 bits per sample (4:1), lossy but almost free to encode
+    ENCODING_LOSSLESS = 2,  // FLAC frames with fixed predictors and Rice coding (usually ~2:1)
+};
+
+class AudioEncoder {
+public:
+    virtual ~AudioEncoder() {}
+
+    /** The encoding this encoder produces. */
+    virtual RecordingEncoding encoding() const = 0;
+
+    /** The format to put in the WAV header. */
+    virtual WavFormat format() const = 0;
+
+    /**
+     * Get the most bytes that encode() can output when given the number of
+     * frames (including any frames the encoder is holding on to).
+     */
+    virtual uint32_t maxEncodedSize(uint32_t frames) const = 0;
+
+    /**
+     * Encode interleaved frames, writing whole blocks to out (which must
+     * have room for maxEncodedSize(frames) bytes). Returns the number of
+     * bytes written to out.
+     */
+    virtual uint32_t encode(const int16_t* samples, uint32_t frames, uint8_t* out) = 0;
+
+    /**
+     * Encode any frames the encoder is holding on to as a final, possibly
+     * short, block. Returns the number of bytes written to out.
+     */
+    virtual uint32_t flush(uint8_t* out) = 0;
+
+    /** Forget all state and start again (e.g. for a new file). */
+    virtual void reset() = 0;
+
+    /** The number of frames that have been output by encode() and flush() since the last reset(). */
+    uint32_t framesEncoded() const { return frames; }
+
+protected:
+    uint32_t frames = 0;
+};
+
+/**
+ * Create an audio encoder object for the given encoding. Returns NULL for
+ * ENCODING_PCM since uncompressed audio is written directly, and when the
+ * encoder can't handle the sample rate (so the audio is recorded
+ * uncompressed). The caller is responsible for deleting the object when done.
+ */
+AudioEncoder* create_audio_encoder(RecordingEncoding encoding);
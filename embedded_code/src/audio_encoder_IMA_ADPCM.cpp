@@ -0,0 +1,159 @@
+/**
+ * IMA ADPCM encoder for recordings. This is the standard WAV IMA ADPCM format
+ * (format tag 0x0011) so recordings can be played by most software.
+ *
+ * Each block starts with a header for each channel (the first sample and the
+ * step index) followed by 4-bit samples, interleaved in groups of 8 samples
+ * (4 bytes) per channel. Encoding is just a few adds and compares per sample.
+ *
+ * See https://wiki.multimedia.cx/index.php/IMA_ADPCM and
+ * https://wiki.multimedia.cx/index.php/Microsoft_IMA_ADPCM
+ */
+
+#include "audio_encoder.hpp"
+#include "audio.h"
+
+#include <string.h>
+
+// Bytes in each block; 1024 bytes per channel is what most encoders use
+#define ADPCM_BLOCK_ALIGN (1024 * REC_CHANNELS)
+#define ADPCM_HEADER_SIZE (4 * REC_CHANNELS)
+// Frames in each block: the one in the header plus 2 per byte of each channel after the header
+#define ADPCM_SAMPLES_PER_BLOCK ((ADPCM_BLOCK_ALIGN - ADPCM_HEADER_SIZE) * 2 / REC_CHANNELS + 1)
+static_assert(REC_BITS_PER_SAMPLE == 16, "IMA ADPCM: REC_BITS_PER_SAMPLE must be 16");
+static_assert((ADPCM_SAMPLES_PER_BLOCK - 1) % 8 == 0, "IMA ADPCM: samples after the header must be in groups of 8");
+
+
+static const int16_t STEP_TABLE[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+};
+
+static const int8_t INDEX_TABLE[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+
+class AudioEncoder_IMA_ADPCM : public AudioEncoder {
+    // Frames that don't fill a whole block yet
+    int16_t pending[ADPCM_SAMPLES_PER_BLOCK * REC_CHANNELS];
+    uint32_t pendingFrames = 0;
+
+    // The step index of each channel carries over from block to block (the predictor is reset
+    // to the first sample of each block)
+    uint8_t stepIndex[REC_CHANNELS] = { 0 };
+
+    /** Encode a single sample, updating the predictor and step index. */
+    static inline uint8_t encodeSample(int32_t sample, int32_t& predictor, uint8_t& index) {
+        int32_t step = STEP_TABLE[index];
+        int32_t diff = sample - predictor;
+        uint8_t nibble = 0;
+        if (diff < 0) { nibble = 8; diff = -diff; }
+
+        // Same as the decoder: delta = (nibble&7 + 0.5) * step / 4
+        int32_t delta = step >> 3;
+        if (diff >= step) { nibble |= 4; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { nibble |= 2; diff -= step; delta += step; }
+        step >>= 1;
+        if (diff >= step) { nibble |= 1; delta += step; }
+
+        predictor += (nibble & 8) ? -delta : delta;
+        if (predictor > 32767) { predictor = 32767; } else if (predictor < -32768) { predictor = -32768; }
+        int32_t i = index + INDEX_TABLE[nibble];
+        index = i < 0 ? 0 : (i > 88 ? 88 : i);
+        return nibble;
+    }
+
+    /** Encode a whole block of frames to out. */
+    void encodeBlock(const int16_t* samples, uint8_t* out) {
+        int32_t predictor[REC_CHANNELS];
+        for (int ch = 0; ch < REC_CHANNELS; ch++) {
+            predictor[ch] = samples[ch];
+            out[0] = (uint8_t)(samples[ch] & 0xFF);
+            out[1] = (uint8_t)((uint16_t)samples[ch] >> 8);
+            out[2] = stepIndex[ch];
+            out[3] = 0;
+            out += 4;
+        }
+        samples += REC_CHANNELS;
+        for (uint32_t group = 0; group < (ADPCM_SAMPLES_PER_BLOCK - 1) / 8; group++) {
+            for (int ch = 0; ch < REC_CHANNELS; ch++) {
+                const int16_t* s = &samples[ch];
+                for (int i = 0; i < 8; i += 2) {
+                    uint8_t lo = encodeSample(s[i * REC_CHANNELS], predictor[ch], stepIndex[ch]);
+                    uint8_t hi = encodeSample(s[(i + 1) * REC_CHANNELS], predictor[ch], stepIndex[ch]);
+                    *out++ = lo | (hi << 4);
+                }
+            }
+            samples += 8 * REC_CHANNELS;
+        }
+    }
+
+public:
+    RecordingEncoding encoding() const override { return ENCODING_IMA_ADPCM; }
+
+    WavFormat format() const override {
+        return WavFormat {
+            .audioFormat = WAVE_FORMAT_IMA_ADPCM,
+            .blockAlign = ADPCM_BLOCK_ALIGN,
+            .bitsPerSample = 4,
+            .byteRate = (uint32_t)((uint64_t)getSampleRate() * ADPCM_BLOCK_ALIGN / ADPCM_SAMPLES_PER_BLOCK),
+            .samplesPerBlock = ADPCM_SAMPLES_PER_BLOCK,
+        };
+    }
+
+    uint32_t maxEncodedSize(uint32_t frames) const override {
+        return (frames + ADPCM_SAMPLES_PER_BLOCK - 1) / ADPCM_SAMPLES_PER_BLOCK * ADPCM_BLOCK_ALIGN;
+    }
+
+    uint32_t encode(const int16_t* samples, uint32_t count, uint8_t* out) override {
+        uint32_t length = 0;
+        while (count > 0) {
+            if (pendingFrames == 0 && count >= ADPCM_SAMPLES_PER_BLOCK) {
+                // Encode straight from the input
+                encodeBlock(samples, &out[length]);
+                samples += ADPCM_SAMPLES_PER_BLOCK * REC_CHANNELS;
+                count -= ADPCM_SAMPLES_PER_BLOCK;
+            } else {
+                // Collect frames until there is a whole block
+                uint32_t n = ADPCM_SAMPLES_PER_BLOCK - pendingFrames;
+                if (n > count) { n = count; }
+                memcpy(&pending[pendingFrames * REC_CHANNELS], samples, n * REC_CHANNELS * sizeof(int16_t));
+                pendingFrames += n;
+                samples += n * REC_CHANNELS;
+                count -= n;
+                if (pendingFrames < ADPCM_SAMPLES_PER_BLOCK) { break; }
+                encodeBlock(pending, &out[length]);
+                pendingFrames = 0;
+            }
+            length += ADPCM_BLOCK_ALIGN;
+            frames += ADPCM_SAMPLES_PER_BLOCK;
+        }
+        return length;
+    }
+
+    uint32_t flush(uint8_t* out) override {
+        if (pendingFrames == 0) { return 0; }
+
+        // Pad the last block by repeating the last frame; the fact chunk has the real length
+        for (uint32_t i = pendingFrames; i < ADPCM_SAMPLES_PER_BLOCK; i++) {
+            memcpy(&pending[i * REC_CHANNELS], &pending[(pendingFrames - 1) * REC_CHANNELS], REC_CHANNELS * sizeof(int16_t));
+        }
+        encodeBlock(pending, out);
+        frames += pendingFrames;
+        pendingFrames = 0;
+        return ADPCM_BLOCK_ALIGN;
+    }
+
+    void reset() override {
+        pendingFrames = 0;
+        frames = 0;
+        memset(stepIndex, 0, sizeof(stepIndex));
+    }
+};
+
+AudioEncoder* create_ima_adpcm_encoder() { return new AudioEncoder_IMA_ADPCM(); }
@@ -0,0 +1,376 @@
+/**
+ * Lossless encoder for recordings. The output is a sequence of FLAC frames
+ * (stored in the data chunk of a WAV file with the format tag 0xF1AC) using
+ * only the cheap parts of FLAC:
+ *   - fixed polynomial predictors of order 0 to 4 (no LPC)
+ *   - a single Rice partition per subframe with the parameter estimated from
+ *     the sum of the residuals
+ *   - constant subframes for silence and verbatim subframes when prediction
+ *     doesn't help
+ *   - the best of independent, left/side, right/side, and mid/side stereo
+ *
+ * Each frame has a sync code and CRCs so a reader can skip over a frame that
+ * was cut off (e.g. when the file was reopened after the SD card was removed).
+ *
+ * See https://xiph.org/flac/format.html
+ */
+
+#include "audio_encoder.hpp"
+#include "audio.h"
+#include "constexpr_array.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+// Frames in each FLAC frame (the last frame of a file may be shorter)
+#define FLAC_BLOCK_SIZE 4096
+#define FLAC_BLOCK_SIZE_CODE 12 // 256 * 2^(12-8) = 4096
+#define FLAC_MAX_ORDER 4
+static_assert(FLAC_BLOCK_SIZE == 256 << (FLAC_BLOCK_SIZE_CODE - 8), "FLAC: block size code doesn't match the block size");
+static_assert(REC_BITS_PER_SAMPLE == 16, "FLAC: REC_BITS_PER_SAMPLE must be 16");
+static_assert(REC_CHANNELS == 1 || REC_CHANNELS == 2, "FLAC: REC_CHANNELS must be 1 or 2");
+
+// Largest possible frame: header (at most 16 bytes), verbatim subframes (the side channel has an
+// extra bit), and the CRC-16
+#define FLAC_MAX_FRAME_SIZE (16 + REC_CHANNELS * (1 + (FLAC_BLOCK_SIZE * (REC_BITS_PER_SAMPLE + 1) + 7) / 8) + 2)
+
+
+///// CRCs /////
+
+constexpr uint8_t crc8Entry(size_t i) {
+    uint8_t crc = (uint8_t)i;
+    for (int bit = 0; bit < 8; bit++) { crc = (crc & 0x80) ? (uint8_t)((crc << 1) ^ 0x07) : (uint8_t)(crc << 1); }
+    return crc;
+}
+constexpr uint16_t crc16Entry(size_t i) {
+    uint16_t crc = (uint16_t)(i << 8);
+    for (int bit = 0; bit < 8; bit++) { crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x8005) : (uint16_t)(crc << 1); }
+    return crc;
+}
+static constexpr std::array<uint8_t, 256> CRC8_TABLE = make_array<uint8_t, 256>(crc8Entry);
+static constexpr std::array<uint16_t, 256> CRC16_TABLE = make_array<uint16_t, 256>(crc16Entry);
+
+static uint8_t crc8(const uint8_t* data, uint32_t length) {
+    uint8_t crc = 0;
+    for (uint32_t i = 0; i < length; i++) { crc = CRC8_TABLE[crc ^ data[i]]; }
+    return crc;
+}
+
+static uint16_t crc16(const uint8_t* data, uint32_t length) {
+    uint16_t crc = 0;
+    for (uint32_t i = 0; i < length; i++) { crc = (uint16_t)(crc << 8) ^ CRC16_TABLE[(crc >> 8) ^ data[i]]; }
+    return crc;
+}
+
+
+///// Bit Writer /////
+
+/** Writes bits MSB-first to a byte buffer. */
+struct BitWriter {
+    uint8_t* out;
+    uint32_t pos = 0; // bytes written to out
+    uint32_t acc = 0; // bits not written yet (the low `bits` bits)
+    int bits = 0;
+
+    BitWriter(uint8_t* out) : out(out) {}
+
+    /** Write the low n bits of value (n <= 24). */
+    inline void put(uint32_t value, int n) {
+        acc = (acc << n) | (value & ((1u << n) - 1));
+        bits += n;
+        while (bits >= 8) { bits -= 8; out[pos++] = (uint8_t)(acc >> bits); }
+    }
+
+    /** Write up to 32 bits. */
+    inline void putLong(uint32_t value, int n) {
+        if (n > 16) { put(value >> 16, n - 16); n = 16; }
+        put(value, n);
+    }
+
+    /** Write q zeros followed by a one. */
+    inline void putUnary(uint32_t q) {
+        while (q >= 16) { put(0, 16); q -= 16; }
+        put(1, q + 1);
+    }
+
+    /** Write zeros until the next byte boundary. */
+    inline void align() { if (bits) { put(0, 8 - bits); } }
+};
+
+
+///// Channels and Prediction /////
+
+// Sources for the subframes: the input channels, then mid and side for stereo
+#define SRC_LEFT 0
+#define SRC_RIGHT 1
+#define SRC_MID 2
+#define SRC_SIDE 3
+
+// FLAC channel assignments
+#define CHANNELS_INDEPENDENT (REC_CHANNELS - 1)
+#define CHANNELS_LEFT_SIDE 8
+#define CHANNELS_RIGHT_SIDE 9
+#define CHANNELS_MID_SIDE 10
+
+/** Get sample i of a source from interleaved frames. */
+static inline int32_t sourceSample(const int16_t* frames, uint8_t src, uint32_t i) {
+#if REC_CHANNELS == 2
+    int32_t left = frames[2*i], right = frames[2*i+1];
+    switch (src) {
+        case SRC_LEFT: return left;
+        case SRC_RIGHT: return right;
+        case SRC_MID: return (left + right) >> 1;
+        default: return left - right;
+    }
+#else
+    return frames[i];
+#endif
+}
+
+/** Residual of the fixed predictor of the given order, x holds the current and previous samples. */
+static inline int32_t fixedResidual(const int32_t* x, int order) {
+    switch (order) {
+        case 0: return x[0];
+        case 1: return x[0] - x[1];
+        case 2: return x[0] - 2*x[1] + x[2];
+        case 3: return x[0] - 3*x[1] + 3*x[2] - x[3];
+        default: return x[0] - 4*x[1] + 6*x[2] - 4*x[3] + x[4];
+    }
+}
+
+/** Map signed residuals to unsigned values for Rice coding: 0, -1, 1, -2, 2, ... */
+static inline uint32_t fold(int32_t r) { return ((uint32_t)r << 1) ^ (uint32_t)(r >> 31); }
+
+/** Analysis of one source in one block. */
+struct SubframeAnalysis {
+    bool constant;
+    uint8_t order;      // best fixed predictor order
+    uint8_t riceParam;  // Rice parameter for the residuals
+    uint32_t bits;      // estimated number of bits for the subframe
+};
+
+/**
+ * Analyze a source: find the cheapest fixed predictor order and its Rice parameter and estimate
+ * the size of the subframe (verbatim if that is smaller).
+ */
+static void analyzeSource(const int16_t* frames, uint8_t src, uint32_t n, int bps, SubframeAnalysis& result) {
+    // Sum of the absolute residuals of each order (after its warm-up samples). Since the folded
+    // residuals are at most twice these, the size estimated from them is never too small.
+    uint64_t sums[FLAC_MAX_ORDER + 1] = { 0 };
+    int32_t x[FLAC_MAX_ORDER + 1] = { 0 };
+    int32_t first = sourceSample(frames, src, 0);
+    bool constant = true;
+    for (uint32_t i = 0; i < n; i++) {
+        memmove(&x[1], &x[0], FLAC_MAX_ORDER * sizeof(int32_t));
+        x[0] = sourceSample(frames, src, i);
+        constant &= x[0] == first;
+        for (int order = 0; order <= FLAC_MAX_ORDER && (uint32_t)order <= i; order++) {
+            int32_t r = fixedResidual(x, order);
+            sums[order] += r < 0 ? -r : r;
+        }
+    }
+    result.constant = constant;
+    if (constant) { result.bits = 8 + bps; result.order = 0; result.riceParam = 0; return; }
+
+    int order = 0;
+    for (int o = 1; o <= FLAC_MAX_ORDER && (uint32_t)o < n; o++) { if (sums[o] < sums[order]) { order = o; } }
+
+    // Estimate the Rice coded size from the sum of the folded residuals: sum(u >> k) <= sum(u) >> k
+    uint32_t count = n - order;
+    uint64_t folded = sums[order] * 2;
+    uint32_t bestBits = UINT32_MAX;
+    uint8_t bestParam = 0;
+    for (uint8_t k = 0; k < 15; k++) {
+        uint64_t bits = (uint64_t)count * (k + 1) + (folded >> k);
+        if (bits < bestBits) { bestBits = (uint32_t)bits; bestParam = k; }
+    }
+    result.order = order;
+    result.riceParam = bestParam;
+    result.bits = 8 + order * bps + 2 + 4 + 4 + bestBits;
+
+    // Verbatim is just the samples
+    if (result.bits >= 8 + n * bps) { result.order = 0xFF; result.bits = 8 + n * bps; }
+}
+
+/** Write a subframe for a source as analyzed by analyzeSource(). */
+static void writeSubframe(BitWriter& w, const int16_t* frames, uint8_t src, uint32_t n, int bps, const SubframeAnalysis& analysis) {
+    if (analysis.constant) {
+        w.put(0x00, 8); // constant
+        w.putLong((uint32_t)sourceSample(frames, src, 0), bps);
+        return;
+    }
+    if (analysis.order == 0xFF) {
+        w.put(0x02, 8); // verbatim
+        for (uint32_t i = 0; i < n; i++) { w.putLong((uint32_t)sourceSample(frames, src, i), bps); }
+        return;
+    }
+
+    const int order = analysis.order;
+    const int k = analysis.riceParam;
+    w.put((0x08 | order) << 1, 8); // fixed predictor
+    int32_t x[FLAC_MAX_ORDER + 1] = { 0 };
+    for (int i = 0; i < order; i++) {
+        memmove(&x[1], &x[0], FLAC_MAX_ORDER * sizeof(int32_t));
+        x[0] = sourceSample(frames, src, i);
+        w.putLong((uint32_t)x[0], bps); // warm-up samples
+    }
+    w.put(0, 2); // Rice coding with 4-bit parameters
+    w.put(0, 4); // partition order 0 (one partition)
+    w.put(k, 4);
+    for (uint32_t i = order; i < n; i++) {
+        memmove(&x[1], &x[0], FLAC_MAX_ORDER * sizeof(int32_t));
+        x[0] = sourceSample(frames, src, i);
+        uint32_t u = fold(fixedResidual(x, order));
+        w.putUnary(u >> k);
+        if (k) { w.put(u, k); }
+    }
+}
+
+
+///// Frames /////
+
+/**
+ * FLAC code for the sample rate (and any extra bits needed at the end of the header): kHz in 8 bits
+ * (12), Hz in 16 bits (13), or tens of Hz in 16 bits (14). Returns 0 if the rate can't be put in the
+ * header (the code for taking it from a STREAMINFO block, which these files don't have).
+ */
+constexpr uint8_t sampleRateCode(uint32_t rate) {
+    return rate == 88200 ? 1 : rate == 176400 ? 2 : rate == 192000 ? 3 : rate == 8000 ? 4 :
+           rate == 16000 ? 5 : rate == 22050 ? 6 : rate == 24000 ? 7 : rate == 32000 ? 8 :
+           rate == 44100 ? 9 : rate == 48000 ? 10 : rate == 96000 ? 11 :
+           (rate % 1000 == 0 && rate / 1000 < 256) ? 12 : rate < 65536 ? 13 :
+           (rate % 10 == 0 && rate / 10 < 65536) ? 14 : 0;
+}
+static_assert(sampleRateCode(352800) == 14 && sampleRateCode(65535) == 13 && sampleRateCode(65537) == 0, "FLAC sample rate codes");
+
+/** Write the frame number as FLAC's extended UTF-8. */
+static void writeUTF8(BitWriter& w, uint32_t value) {
+    if (value < 0x80) { w.put(value, 8); return; }
+    int n = value < 0x800 ? 2 : value < 0x10000 ? 3 : value < 0x200000 ? 4 : value < 0x4000000 ? 5 : value < 0x80000000 ? 6 : 7;
+    w.put(((0xFF00 >> n) & 0xFF) | (uint32_t)((uint64_t)value >> (6 * (n - 1))), 8);
+    for (int i = n - 2; i >= 0; i--) { w.put(0x80 | ((value >> (6 * i)) & 0x3F), 8); }
+}
+
+/** Encode one FLAC frame of n frames. Returns the number of bytes written. */
+static uint32_t encodeFrame(const int16_t* frames, uint32_t n, uint32_t frameNumber, uint8_t* out) {
+    // Pick the channel assignment
+    uint8_t assignment = CHANNELS_INDEPENDENT;
+    uint8_t srcs[2] = { SRC_LEFT, SRC_RIGHT };
+    SubframeAnalysis analysis[2];
+#if REC_CHANNELS == 2
+    SubframeAnalysis all[4];
+    for (uint8_t src = 0; src < 4; src++) { analyzeSource(frames, src, n, src == SRC_SIDE ? 17 : 16, all[src]); }
+    uint32_t independent = all[SRC_LEFT].bits + all[SRC_RIGHT].bits;
+    uint32_t leftSide = all[SRC_LEFT].bits + all[SRC_SIDE].bits;
+    uint32_t rightSide = all[SRC_RIGHT].bits + all[SRC_SIDE].bits;
+    uint32_t midSide = all[SRC_MID].bits + all[SRC_SIDE].bits;
+    uint32_t best = independent;
+    if (leftSide < best) { best = leftSide; assignment = CHANNELS_LEFT_SIDE; srcs[0] = SRC_LEFT; srcs[1] = SRC_SIDE; }
+    if (rightSide < best) { best = rightSide; assignment = CHANNELS_RIGHT_SIDE; srcs[0] = SRC_SIDE; srcs[1] = SRC_RIGHT; }
+    if (midSide < best) { best = midSide; assignment = CHANNELS_MID_SIDE; srcs[0] = SRC_MID; srcs[1] = SRC_SIDE; }
+    analysis[0] = all[srcs[0]];
+    analysis[1] = all[srcs[1]];
+#else
+    analyzeSource(frames, SRC_LEFT, n, 16, analysis[0]);
+#endif
+
+    // Frame header
+    const uint32_t rate = getSampleRate(); // checked by create_lossless_encoder()
+    const uint8_t rateCode = sampleRateCode(rate);
+    BitWriter w(out);
+    w.put(0xFFF8, 16); // sync code, fixed block size
+    w.put(n == FLAC_BLOCK_SIZE ? FLAC_BLOCK_SIZE_CODE : 7, 4);
+    w.put(rateCode, 4);
+    w.put(assignment, 4);
+    w.put(4, 3); // 16 bits per sample
+    w.put(0, 1);
+    writeUTF8(w, frameNumber);
+    if (n != FLAC_BLOCK_SIZE) { w.put(n - 1, 16); }
+    if (rateCode == 12) { w.put(rate / 1000, 8); }
+    else if (rateCode == 13) { w.put(rate, 16); }
+    else if (rateCode == 14) { w.put(rate / 10, 16); }
+    w.put(crc8(out, w.pos), 8);
+
+    // Subframes
+    for (int ch = 0; ch < REC_CHANNELS; ch++) {
+        writeSubframe(w, frames, srcs[ch], n, srcs[ch] == SRC_SIDE ? 17 : 16, analysis[ch]);
+    }
+
+    // Footer
+    w.align();
+    uint16_t crc = crc16(out, w.pos);
+    w.put(crc, 16);
+    return w.pos;
+}
+
+
+class AudioEncoder_Lossless : public AudioEncoder {
+    // Frames that don't fill a whole block yet
+    int16_t pending[FLAC_BLOCK_SIZE * REC_CHANNELS];
+    uint32_t pendingFrames = 0;
+    uint32_t frameNumber = 0;
+
+public:
+    RecordingEncoding encoding() const override { return ENCODING_LOSSLESS; }
+
+    WavFormat format() const override {
+        return WavFormat {
+            .audioFormat = WAVE_FORMAT_FLAC,
+            .blockAlign = 1, // frames are variable size
+            .bitsPerSample = REC_BITS_PER_SAMPLE,
+            .byteRate = getSampleRate() * REC_CHANNELS * REC_BYTES_PER_SAMPLE, // at most
+            .samplesPerBlock = FLAC_BLOCK_SIZE,
+        };
+    }
+
+    uint32_t maxEncodedSize(uint32_t frames) const override {
+        return (frames + FLAC_BLOCK_SIZE - 1) / FLAC_BLOCK_SIZE * FLAC_MAX_FRAME_SIZE;
+    }
+
+    uint32_t encode(const int16_t* samples, uint32_t count, uint8_t* out) override {
+        uint32_t length = 0;
+        while (count > 0) {
+            if (pendingFrames == 0 && count >= FLAC_BLOCK_SIZE) {
+                // Encode straight from the input
+                length += encodeFrame(samples, FLAC_BLOCK_SIZE, frameNumber++, &out[length]);
+                samples += FLAC_BLOCK_SIZE * REC_CHANNELS;
+                count -= FLAC_BLOCK_SIZE;
+            } else {
+                // Collect frames until there is a whole block
+                uint32_t n = FLAC_BLOCK_SIZE - pendingFrames;
+                if (n > count) { n = count; }
+                memcpy(&pending[pendingFrames * REC_CHANNELS], samples, n * REC_CHANNELS * sizeof(int16_t));
+                pendingFrames += n;
+                samples += n * REC_CHANNELS;
+                count -= n;
+                if (pendingFrames < FLAC_BLOCK_SIZE) { break; }
+                length += encodeFrame(pending, FLAC_BLOCK_SIZE, frameNumber++, &out[length]);
+                pendingFrames = 0;
+            }
+            frames += FLAC_BLOCK_SIZE;
+        }
+        return length;
+    }
+
+    uint32_t flush(uint8_t* out) override {
+        if (pendingFrames == 0) { return 0; }
+        uint32_t length = encodeFrame(pending, pendingFrames, frameNumber++, out);
+        frames += pendingFrames;
+        pendingFrames = 0;
+        return length;
+    }
+
+    void reset() override {
+        pendingFrames = 0;
+        frameNumber = 0;
+        frames = 0;
+    }
+};
+
+AudioEncoder* create_lossless_encoder() {
+    if (!sampleRateCode(getSampleRate())) {
+        printf("!! Lossless encoding can't store a sample rate of %u Hz, recording uncompressed\n", (unsigned)getSampleRate());
+        return NULL;
+    }
+    return new AudioEncoder_Lossless();
+}
@@ -0,0 +1,398 @@
+#include "audio_io.h"
+#include "capture_stats.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+
+#if AUDIO_CODEC != AUDIO_CODEC_VIRTUAL
+
+///// ESP32 I2S Driver /////
+
+#include <freertos/queue.h>
+
+// I2S pins/port
+#define I2S_WS        33 // DACLRC/ADCLRC/LRC/"word select"/"left-right-channel", toggles for left or right channel data
+#define I2S_ADC_DATA  14 // ADC_DATA/SD/"serial data in", carries the I2S audio data from codec's ADC to ESP32 I2S bus
+#define I2S_DAC_DATA  32 // DAC_DATA/SDO/"serial data out", carries the I2S audio data from ESP32 to codec DAC
+#define I2S_BCLK      27 // BCLK/SCK/"bit clock", this is the clock for I2S audio, can be controlled via controller or peripheral
+#define I2S_PORT I2S_NUM_0 // Define which I2S peripheral to use
+#define I2S_DMA_BUFFERS 8 // TODO: lower this
+
+#define CHECK_I2S_EVENTS // count I2S events (errors) in checkI2SEvents(), undefine to disable
+#ifdef CHECK_I2S_EVENTS
+QueueHandle_t i2sQueue = NULL;
+#endif
+
+
+/**
+ * Set up the I2S driver. This makes the ESP32 the master and operate in both RX and TX modes.
+ */
+bool i2s_install(i2s_comm_format_t format, uint32_t bufferFrames, uint32_t sampleRate) {
+    static_assert(REC_BITS_PER_SAMPLE == 8 || REC_BITS_PER_SAMPLE == 16 || REC_BITS_PER_SAMPLE == 24 || REC_BITS_PER_SAMPLE == 32, "Bits per sample must be 8, 16, 24, or 32 - only supported by the I2S driver");
+    static_assert(REC_CHANNELS == 1 || REC_CHANNELS == 2, "Channels must be 1 (mono) or 2 (stereo) - only supported by the I2S driver (unless TDM is supported)");
+    const i2s_driver_config_t i2s_config = {
+        .mode = (i2s_mode_t)(I2S_MODE_MASTER | I2S_MODE_RX | I2S_MODE_TX),
+        .sample_rate = sampleRate,
+        .bits_per_sample = (i2s_bits_per_sample_t)REC_BITS_PER_SAMPLE,  // also supports 8, 24, and 32 bit
+        .channel_format = (REC_CHANNELS == 2) ? I2S_CHANNEL_FMT_RIGHT_LEFT : I2S_CHANNEL_FMT_ONLY_LEFT,
+        .communication_format = format,
+        .intr_alloc_flags = ESP_INTR_FLAG_LEVEL1,  // TODO: does a higher level make sense? (or 0 for default)
+
+        // For more info see https://www.reddit.com/r/esp32/comments/muj6wo/esp32_i2s_dma_settings_dma_buf_len_and_dma_buf/
+        // Basically:
+        //  * dma_buf_len is the number of samples in each buffer, whenever we read from I2S we
+        //    read in multiples of this size
+        //  * increasing dma_buf_len reduces CPU overhead but reduces granularity and increases
+        //    latency
+        //  * dma_buf_count is the number of buffers, increasing this increases memory usage but
+        //    allows for more buffers to be queued up in the driver before a call to i2s_read
+        // If we are keeping up with the audio data, we can use a small dma_buf_count (like 2). To
+        // reduce latency, we can use a small dma_buf_len (384 would be 8 ms at 48 kHz, 128 would
+        // be 8 ms at 16 kHz).
+        .dma_buf_count = I2S_DMA_BUFFERS,
+        .dma_buf_len = (int)bufferFrames,
+
+        .use_apll = false,
+        .tx_desc_auto_clear = false,  // for cleaner outputs when there are delays
+        .fixed_mclk = 0,
+        .mclk_multiple = I2S_MCLK_MULTIPLE_DEFAULT,  // TODO: 512?
+        .bits_per_chan = I2S_BITS_PER_CHAN_DEFAULT,  // default means to use the same as bits_per_sample
+    };
+#ifdef CHECK_I2S_EVENTS
+#define QUEUE_ARG 4, &i2sQueue
+#else
+#define QUEUE_ARG 0, NULL
+#endif
+    if (i2s_driver_install(I2S_PORT, &i2s_config, QUEUE_ARG) != ESP_OK) { printf("!! i2s_driver_install()\n"); return false; }
+    return true;
+
+    //i2s_set_clk(I2S_PORT, REC_SAMPLE_RATE, REC_BITS_PER_SAMPLE, I2S_CHANNEL_STEREO);
+    //i2s_set_dac_mode(I2S_DAC_CHANNEL_BOTH_EN);
+}
+
+
+/**
+ * Set up the I2S pins for the ESP32 Thing Plus C.
+ */
+bool i2s_setpin() {
+    const i2s_pin_config_t pin_config = {
+        .mck_io_num = I2S_PIN_NO_CHANGE,
+        .bck_io_num = I2S_BCLK,
+        .ws_io_num = I2S_WS,
+        .data_out_num = I2S_DAC_DATA,
+        .data_in_num = I2S_ADC_DATA
+    };
+    if (i2s_set_pin(I2S_PORT, &pin_config) != ESP_OK) { printf("!! i2s_set_pin()\n"); return false; }
+    return true;
+}
+
+
+static uint32_t dmaBufferFrames = 0;
+
+bool setupI2S(i2s_comm_format_t format, uint32_t bufferFrames, uint32_t sampleRate) {
+    dmaBufferFrames = bufferFrames;
+    return i2s_install(format, bufferFrames, sampleRate) && i2s_setpin();
+}
+
+uint32_t getI2SOutputQueueFrames() { return I2S_DMA_BUFFERS * dmaBufferFrames; }
+
+bool readI2S(uint8_t* data, size_t length, size_t* bytesRead) {
+    // TODO: several questions about i2s_read:
+    //    giving a smaller buffer size (e.g. 64) reduces latency but increases overhead
+    //    giving a small timeout (instead of infinite) could also reduce latency
+    *bytesRead = 0;
+    return i2s_read(I2S_PORT, data, length, bytesRead, portMAX_DELAY) == ESP_OK && *bytesRead == length;
+}
+
+void writeI2S(const uint8_t* data, size_t length) {
+    // TODO: is the loop necessary? can we just write the whole buffer at once? or maybe limit the size of each send or use a timeout and then use yield?
+    size_t bytesWritten = 0;
+    size_t offset = 0;
+    while (offset < length) {
+        i2s_write(I2S_PORT, &data[offset], length - offset, &bytesWritten, portMAX_DELAY);
+        offset += bytesWritten;
+    }
+}
+
+void checkI2SEvents() {
+#ifdef CHECK_I2S_EVENTS
+    if (!i2sQueue) { return; }
+    i2s_event_t evt;
+    while (xQueueReceive(i2sQueue, &evt, 0)) {
+        if (evt.type == I2S_EVENT_DMA_ERROR) {
+            captureEvent(CAPTURE_DMA_ERROR);
+        } else if (evt.type == I2S_EVENT_RX_Q_OVF) {
+            captureEvent(CAPTURE_RX_OVERFLOW);
+        } else if (evt.type == I2S_EVENT_TX_Q_OVF) {
+            captureEvent(CAPTURE_TX_OVERFLOW);
+        // } else if (evt.type == I2S_EVENT_RX_DONE) {
+        //     printf("-- I2S Received\n");
+        // } else if (evt.type == I2S_EVENT_TX_DONE) {
+        //     printf("-- I2S Transmitted\n");
+        }
+    }
+#endif
+}
+
+
+#else
+
+///// Virtual I2S Bus (WAV files) /////
+
+#include <esp_timer.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+static_assert(REC_BITS_PER_SAMPLE == 16 && PLAY_BITS_PER_SAMPLE == 16, "Virtual audio only supports 16-bit samples");
+
+// Only set before setupAudio()
+static const char* inputPath = VIRTUAL_AUDIO_INPUT;
+static const char* outputPath = VIRTUAL_AUDIO_OUTPUT;
+static bool paced = true;
+
+// Only used from the audio task (except for the stats, which may be slightly out of date)
+static FILE* input = NULL;
+static FILE* output = NULL;
+static uint16_t inputChannels = 0;
+static uint32_t sampleRate = 0; // of the input file (the output file is written at the same rate)
+static uint32_t inputRemaining = 0; // bytes of audio data left in the input file
+static int64_t startTime = 0; // when the first block was read
+static volatile uint64_t framesRead = 0;
+static volatile uint64_t framesWritten = 0;
+static bool inputEnded = false; // the last block of the input file has been read
+static std::atomic<bool> finished(false);
+static std::atomic<float> gain(1.0f);
+
+// The simulated loopback: the output is fed back to the input through a ring of frames that starts
+// with the delay (in frames) of silence in it
+static bool loopback = false;
+static uint32_t loopbackOutputDelay = 0, loopbackInputDelay = 0;
+static int16_t* loopbackRing = NULL;
+static uint32_t loopbackSize = 0, loopbackRead = 0, loopbackWrite = 0; // in frames
+
+/** The canonical 44-byte PCM WAV header (the output file is always this). */
+struct __attribute__((packed)) SimpleWavHeader {
+    char riff[4];
+    uint32_t riffSize;
+    char wave[4];
+    char fmt[4];
+    uint32_t fmtSize;
+    uint16_t audioFormat;
+    uint16_t numChannels;
+    uint32_t sampleRate;
+    uint32_t byteRate;
+    uint16_t blockAlign;
+    uint16_t bitsPerSample;
+    char data[4];
+    uint32_t dataSize;
+};
+
+void configureVirtualAudio(const char* inputPath_, const char* outputPath_, bool paced_) {
+    inputPath = inputPath_;
+    outputPath = outputPath_;
+    paced = paced_;
+}
+
+void configureVirtualLoopback(uint32_t outputDelayFrames, uint32_t inputDelayFrames) {
+    loopback = true;
+    loopbackOutputDelay = outputDelayFrames;
+    loopbackInputDelay = inputDelayFrames;
+}
+
+bool isVirtualAudioPaced() { return paced; }
+
+void setVirtualAudioGain(float gain_) { gain.store(gain_, std::memory_order_relaxed); }
+
+void getVirtualAudioStats(VirtualAudioStats* stats) {
+    stats->framesRead = framesRead;
+    stats->framesWritten = framesWritten;
+    stats->elapsedUs = startTime ? esp_timer_get_time() - startTime : 0;
+    stats->finished = finished.load(std::memory_order_acquire);
+}
+
+/**
+ * Open the input WAV file and find its audio data. It must be 16-bit PCM with either 1 channel
+ * (copied to every channel) or the recording number of channels. Does nothing if it's already open.
+ */
+static bool openInput() {
+    if (input) { return true; }
+    input = fopen(inputPath, "rb");
+    if (!input) { printf("!! Failed to open virtual audio input %s\n", inputPath); return false; }
+    char id[4];
+    uint32_t size;
+    if (fread(id, 1, 4, input) != 4 || memcmp(id, "RIFF", 4) != 0 || fread(&size, 4, 1, input) != 1 ||
+        fread(id, 1, 4, input) != 4 || memcmp(id, "WAVE", 4) != 0) {
+        printf("!! Virtual audio input %s is not a WAV file\n", inputPath);
+        return false;
+    }
+
+    // Go through the chunks until the data, checking the format on the way
+    bool haveFormat = false;
+    while (fread(id, 1, 4, input) == 4 && fread(&size, 4, 1, input) == 1) {
+        if (memcmp(id, "fmt ", 4) == 0 && size >= 16) {
+            SimpleWavHeader fmt;
+            if (fread(&fmt.audioFormat, 1, 16, input) != 16) { break; }
+            if (fmt.audioFormat != 1 || fmt.bitsPerSample != 16 || fmt.sampleRate == 0 ||
+                (fmt.numChannels != 1 && fmt.numChannels != REC_CHANNELS)) {
+                printf("!! Virtual audio input must be 16-bit PCM with 1 or %d channels\n", REC_CHANNELS);
+                return false;
+            }
+            inputChannels = fmt.numChannels;
+            sampleRate = fmt.sampleRate;
+            haveFormat = true;
+            size -= 16;
+        } else if (memcmp(id, "data", 4) == 0 && haveFormat) {
+            inputRemaining = size - size % (inputChannels * 2);
+            return true;
+        }
+        if (fseek(input, size + (size & 1), SEEK_CUR) != 0) { break; }
+    }
+    printf("!! Virtual audio input %s has no audio data\n", inputPath);
+    return false;
+}
+
+/** Write (or rewrite) the header of the output file with the current size. */
+static bool writeOutputHeader() {
+    uint32_t dataSize = (uint32_t)(framesWritten * PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE);
+    SimpleWavHeader header = {
+        { 'R', 'I', 'F', 'F' }, dataSize + (uint32_t)sizeof(SimpleWavHeader) - 8, { 'W', 'A', 'V', 'E' },
+        { 'f', 'm', 't', ' ' }, 16, 1, PLAY_CHANNELS, sampleRate,
+        sampleRate * PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE, PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE, 16,
+        { 'd', 'a', 't', 'a' }, dataSize,
+    };
+    long position = ftell(output);
+    bool ok = fseek(output, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, output) == 1;
+    if (position > (long)sizeof(header)) { fseek(output, position, SEEK_SET); }
+    return ok;
+}
+
+uint32_t getVirtualAudioSampleRate() { return openInput() ? sampleRate : 0; }
+
+uint32_t getI2SOutputQueueFrames() { return loopback ? loopbackOutputDelay : 0; }
+
+/**
+ * Replace a block read from the input file with the looped back output. The ring is made on the
+ * first block: a block is always read before the output for it is written, so the delay is a block
+ * plus the simulated delays.
+ */
+static void readLoopback(int16_t* samples, uint32_t frames) {
+    static_assert(REC_CHANNELS == PLAY_CHANNELS, "The virtual loopback needs the same channels for recording and playback");
+    if (!loopbackRing) {
+        const uint32_t delay = frames + loopbackOutputDelay + loopbackInputDelay;
+        loopbackSize = delay + 2 * frames;
+        loopbackRing = (int16_t*)calloc(loopbackSize * REC_CHANNELS, sizeof(int16_t));
+        if (!loopbackRing) { printf("!! Failed to allocate the virtual loopback\n"); loopback = false; return; }
+        loopbackRead = 0;
+        loopbackWrite = delay;
+    }
+    for (uint32_t i = 0; i < frames; i++) {
+        const bool empty = loopbackRead == loopbackWrite;
+        for (int ch = 0; ch < REC_CHANNELS; ch++) {
+            samples[i * REC_CHANNELS + ch] = empty ? 0 : loopbackRing[loopbackRead * REC_CHANNELS + ch];
+        }
+        if (!empty) { loopbackRead = (loopbackRead + 1) % loopbackSize; }
+    }
+}
+
+/** Add a block being written to the output to the loopback (dropped if the ring is full). */
+static void writeLoopback(const int16_t* samples, uint32_t frames) {
+    if (!loopbackRing) { return; }
+    for (uint32_t i = 0; i < frames; i++) {
+        const uint32_t next = (loopbackWrite + 1) % loopbackSize;
+        if (next == loopbackRead) { return; }
+        memcpy(&loopbackRing[loopbackWrite * PLAY_CHANNELS], &samples[i * PLAY_CHANNELS], PLAY_CHANNELS * sizeof(int16_t));
+        loopbackWrite = next;
+    }
+}
+
+bool setupI2S(i2s_comm_format_t format, uint32_t bufferFrames, uint32_t rate) {
+    if (!openInput()) { return false; }
+    if (rate != sampleRate) { printf("!! Virtual audio input is %u Hz, not %u Hz\n", (unsigned)sampleRate, (unsigned)rate); return false; }
+    if (outputPath) {
+        output = fopen(outputPath, "wb");
+        if (!output || !writeOutputHeader()) { printf("!! Failed to open virtual audio output %s\n", outputPath); return false; }
+    }
+    printf("Virtual audio: %s -> %s (%u Hz, %s)\n", inputPath, outputPath ? outputPath : "nothing", (unsigned)sampleRate, paced ? "paced" : "unpaced");
+    if (loopback) { printf("Virtual audio: output looped back to the input after %u + %u frames\n", (unsigned)loopbackOutputDelay, (unsigned)loopbackInputDelay); }
+    return true;
+}
+
+bool readI2S(uint8_t* data, size_t length, size_t* bytesRead) {
+    *bytesRead = 0;
+    if (inputEnded) {
+        // The audio task is done with the last block (it has been recorded and played)
+        finished.store(true, std::memory_order_release);
+        while (true) { vTaskDelay(portMAX_DELAY); } // like a bus that never delivers any more audio
+    }
+    if (!startTime) { startTime = esp_timer_get_time(); }
+
+    // Read the block, converting mono to every channel
+    const uint32_t frameSize = REC_CHANNELS * REC_BYTES_PER_SAMPLE;
+    const uint32_t inputFrameSize = inputChannels * REC_BYTES_PER_SAMPLE;
+    uint32_t frames = length / frameSize;
+    if (frames * inputFrameSize > inputRemaining) { frames = inputRemaining / inputFrameSize; }
+    size_t got = fread(data, inputFrameSize, frames, input);
+    if (inputChannels != REC_CHANNELS) {
+        int16_t* samples = (int16_t*)data;
+        for (int32_t i = got - 1; i >= 0; i--) {
+            for (int ch = 0; ch < REC_CHANNELS; ch++) { samples[i * REC_CHANNELS + ch] = samples[i]; }
+        }
+    }
+    inputRemaining -= got * inputFrameSize;
+    if (got < length / frameSize) {
+        // End of the input: the rest of the last block is silence
+        memset(data + got * frameSize, 0, length - got * frameSize);
+        inputEnded = true;
+    }
+    if (loopback) { readLoopback((int16_t*)data, length / frameSize); }
+
+    // When paced, the block is only returned once it would have been captured
+    uint64_t frameCount = framesRead + length / frameSize;
+    if (paced) {
+        int64_t due = startTime + (int64_t)(frameCount * 1000000 / sampleRate);
+        int64_t wait = due - esp_timer_get_time();
+        if (wait >= 1000) { vTaskDelay(pdMS_TO_TICKS(wait / 1000)); }
+    }
+    framesRead = frameCount;
+    *bytesRead = length;
+    return true;
+}
+
+void writeI2S(const uint8_t* data, size_t length) {
+    if (!output && !loopbackRing) { return; }
+    const float g = gain.load(std::memory_order_relaxed);
+    const int16_t* samples = (const int16_t*)data;
+    int16_t scaled[256];
+    static_assert(256 % PLAY_CHANNELS == 0, "Output chunks must be whole frames");
+    for (size_t offset = 0; offset < length / 2; offset += 256) {
+        size_t n = length / 2 - offset < 256 ? length / 2 - offset : 256;
+        for (size_t i = 0; i < n; i++) {
+            float x = samples[offset + i] * g;
+            scaled[i] = x > 32767.0f ? 32767 : x < -32768.0f ? -32768 : (int16_t)x;
+        }
+        if (output) { fwrite(scaled, 2, n, output); }
+        writeLoopback(scaled, n / PLAY_CHANNELS);
+    }
+    framesWritten += length / (PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE);
+}
+
+void checkI2SEvents() { }
+
+void closeVirtualAudio() {
+    if (output) {
+        writeOutputHeader();
+        fclose(output);
+        output = NULL;
+    }
+    if (input) {
+        fclose(input);
+        input = NULL;
+    }
+    free(loopbackRing);
+    loopbackRing = NULL;
+}
+
+#endif
@@ -0,0 +1,100 @@
+#pragma once
+
+// The I2S bus that the audio is read from and played to.
+//
+// With a real audio codec this is the ESP32 I2S driver. With AUDIO_CODEC_VIRTUAL the input is read
+// from a WAV file and the output is written to another WAV file, so the recording task and the DUET
+// path can run without the hardware (e.g. on a computer over hours of recorded audio). The virtual
+// bus can be paced like the real one (each block is returned when it would have been captured) or
+// unpaced (as fast as the rest of the code can take the audio).
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#ifdef ESP_PLATFORM
+#include <driver/i2s.h>
+#else
+// Only the virtual bus is built on a computer (see host/), and it ignores the format
+typedef int i2s_comm_format_t;
+#define I2S_COMM_FORMAT_STAND_I2S 0
+#endif
+
+#include "audio.h"
+
+/**
+ * Set up the I2S bus for both recording and playback with the given communication format (from the
+ * audio codec), DMA buffers of the given number of frames, and sample rate. For the virtual bus
+ * this opens the input and output files (and the input must be at the sample rate).
+ */
+bool setupI2S(i2s_comm_format_t format, uint32_t bufferFrames, uint32_t sampleRate);
+
+/**
+ * Read a block of recorded audio, waiting until all of it is available. Returns false if reading
+ * failed (bytesRead is how much was read).
+ */
+bool readI2S(uint8_t* data, size_t length, size_t* bytesRead);
+
+/** Write audio to be played, waiting until all of it has been queued. The length is in bytes. */
+void writeI2S(const uint8_t* data, size_t length);
+
+/** Count any errors reported by the I2S driver since the last call in the capture statistics. */
+void checkI2SEvents();
+
+/**
+ * The most frames of output queued in the DMA buffers before they are played (the output latency
+ * added by the driver). For the virtual bus this is the simulated output delay of the loopback.
+ */
+uint32_t getI2SOutputQueueFrames();
+
+
+#if AUDIO_CODEC == AUDIO_CODEC_VIRTUAL
+
+// Default files used by the virtual bus (change with configureVirtualAudio())
+#define VIRTUAL_AUDIO_INPUT "input.wav"
+#define VIRTUAL_AUDIO_OUTPUT "output.wav"
+
+/** Statistics about the virtual bus. */
+struct VirtualAudioStats {
+    uint64_t framesRead;    // frames read from the input file
+    uint64_t framesWritten; // frames written to the output file
+    int64_t elapsedUs;      // time since the first read (so framesRead / elapsed is the speed)
+    bool finished;          // the whole input file has been read and handled by the audio task
+};
+
+/**
+ * Set the files read and written by the virtual bus and whether it is paced in real time. This must
+ * be called before setupAudio(). The output file can be NULL to discard the output.
+ */
+void configureVirtualAudio(const char* inputPath, const char* outputPath, bool paced);
+
+/**
+ * Get the sample rate of the input file (the only rate the virtual bus supports), opening it if
+ * needed. Returns 0 if it can't be opened or isn't a supported WAV file.
+ */
+uint32_t getVirtualAudioSampleRate();
+
+/**
+ * Loop the output back to the input (instead of the audio from the input file) like a cable from
+ * the codec's output to its input, e.g. to measure the latency (see latency.h). The delays simulate
+ * the output DMA buffers and the rest of the round trip (converters and input buffering) in frames,
+ * on top of the block the audio task always waits for. The input file still sets the sample rate and
+ * how long the audio runs. This must be called before setupAudio().
+ */
+void configureVirtualLoopback(uint32_t outputDelayFrames, uint32_t inputDelayFrames);
+
+/** Check if the virtual bus is paced in real time. */
+bool isVirtualAudioPaced();
+
+/** Set the gain applied to the output (set by the virtual audio codec from its volume). */
+void setVirtualAudioGain(float gain);
+
+/**
+ * Get the statistics of the virtual bus. Once finished is set, readI2S() blocks forever (like a
+ * silent bus) and closeVirtualAudio() can be called.
+ */
+void getVirtualAudioStats(VirtualAudioStats* stats);
+
+/** Finish the output file (its WAV header is only complete after this) and close both files. */
+void closeVirtualAudio();
+
+#endif
@@ -0,0 +1,129 @@
+#include "audio_mix.h"
+#include "fast_math.hpp"
+
+#include <stddef.h>
+#include <string.h>
+
+
+/** Check if all of the buffers are aligned for 32-bit access (a whole stereo frame at a time). */
+static inline bool aligned32(const void* a, const void* b, const void* c) {
+    return ((uintptr_t)a & 3) == 0 && ((uintptr_t)b & 3) == 0 && ((uintptr_t)c & 3) == 0;
+}
+
+/** Load two samples with one 32-bit load. */
+static inline void load2(const int16_t* p, int32_t& lo, int32_t& hi) {
+    uint32_t w;
+    memcpy(&w, p, 4); // a single l32i when aligned
+    lo = (int16_t)(w & 0xFFFF);
+    hi = (int16_t)(w >> 16);
+}
+
+/** Store two samples with one 32-bit store. */
+static inline void store2(int16_t* p, int32_t lo, int32_t hi) {
+    uint32_t w = (uint16_t)lo | ((uint32_t)(uint16_t)hi << 16);
+    memcpy(p, &w, 4);
+}
+
+/** b + (a - b) * ratio, which is always between a and b so it never needs saturating. */
+static inline int32_t mix1(int32_t a, int32_t b, int32_t ratioQ15) {
+    return b + (((a - b) * ratioQ15 + (1 << 14)) >> 15);
+}
+
+static inline int32_t gain1(int32_t x, int32_t gainQ12) {
+    return saturate16((x * gainQ12 + (1 << 11)) >> 12);
+}
+
+
+void OPTIMIZE_FOR_SPEED mixAudio(const int16_t* a, const int16_t* b, uint32_t length, int16_t ratioQ15, int16_t* output) {
+    const int32_t r = ratioQ15 < 0 ? 0 : ratioQ15;
+    uint32_t i = 0;
+    if (aligned32(a, b, output)) {
+        for (; i + 2 <= length; i += 2) {
+            int32_t a0, a1, b0, b1;
+            load2(&a[i], a0, a1);
+            load2(&b[i], b0, b1);
+            store2(&output[i], mix1(a0, b0, r), mix1(a1, b1, r));
+        }
+    }
+    for (; i < length; i++) { output[i] = (int16_t)mix1(a[i], b[i], r); }
+}
+
+void OPTIMIZE_FOR_SPEED addAudio(const int16_t* a, const int16_t* b, uint32_t length, int16_t* output) {
+    uint32_t i = 0;
+    if (aligned32(a, b, output)) {
+        for (; i + 2 <= length; i += 2) {
+            int32_t a0, a1, b0, b1;
+            load2(&a[i], a0, a1);
+            load2(&b[i], b0, b1);
+            store2(&output[i], saturate16(a0 + b0), saturate16(a1 + b1));
+        }
+    }
+    for (; i < length; i++) { output[i] = saturate16(a[i] + b[i]); }
+}
+
+void OPTIMIZE_FOR_SPEED gainAudio(const int16_t* input, uint32_t length, uint16_t gainQ12, int16_t* output) {
+    const int32_t g = gainQ12 > 32767 ? 32767 : gainQ12;
+    uint32_t i = 0;
+    if (aligned32(input, input, output)) {
+        for (; i + 2 <= length; i += 2) {
+            int32_t x0, x1;
+            load2(&input[i], x0, x1);
+            store2(&output[i], gain1(x0, g), gain1(x1, g));
+        }
+    }
+    for (; i < length; i++) { output[i] = (int16_t)gain1(input[i], g); }
+}
+
+void OPTIMIZE_FOR_SPEED crossfadeAudio(const int16_t* a, const int16_t* b, uint32_t frames, uint8_t channels, int16_t startQ15, int16_t endQ15, int16_t* output) {
+    if (frames == 0) { return; }
+    // The ratio of b in 15.16 fixed point (so the step has plenty of precision). It is multiplied
+    // rather than shifted up since the step is negative when fading back to a.
+    const int32_t start = startQ15 < 0 ? 0 : startQ15, end = endQ15 < 0 ? 0 : endQ15;
+    int32_t ratio = start * 65536;
+    const int32_t step = (end - start) * 65536 / (int32_t)frames;
+    if (channels == 2 && aligned32(a, b, output)) {
+        for (uint32_t i = 0; i < 2 * frames; i += 2) {
+            const int32_t r = (ratio + 0x8000) >> 16;
+            int32_t a0, a1, b0, b1;
+            load2(&a[i], a0, a1);
+            load2(&b[i], b0, b1);
+            store2(&output[i], mix1(b0, a0, r), mix1(b1, a1, r));
+            ratio += step;
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < frames; i++) {
+        const int32_t r = (ratio + 0x8000) >> 16;
+        for (uint8_t ch = 0; ch < channels; ch++) {
+            const uint32_t j = i * channels + ch;
+            output[j] = (int16_t)mix1(b[j], a[j], r);
+        }
+        ratio += step;
+    }
+}
+
+void OPTIMIZE_FOR_SPEED rampGainAudio(const int16_t* input, uint32_t frames, uint8_t channels, uint16_t startQ12, uint16_t endQ12, int16_t* output) {
+    if (frames == 0) { return; }
+    // The gain in Q12 with 12 more fractional bits (so the step has plenty of precision without overflowing)
+    const int32_t start = startQ12 > 32767 ? 32767 : startQ12, end = endQ12 > 32767 ? 32767 : endQ12;
+    int32_t gain = start * 4096;
+    const int32_t step = (end - start) * 4096 / (int32_t)frames;
+    if (channels == 2 && aligned32(input, input, output)) {
+        for (uint32_t i = 0; i < 2 * frames; i += 2) {
+            const int32_t g = (gain + 0x800) >> 12;
+            int32_t x0, x1;
+            load2(&input[i], x0, x1);
+            store2(&output[i], gain1(x0, g), gain1(x1, g));
+            gain += step;
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < frames; i++) {
+        const int32_t g = (gain + 0x800) >> 12;
+        for (uint8_t ch = 0; ch < channels; ch++) {
+            const uint32_t j = i * channels + ch;
+            output[j] = (int16_t)gain1(input[j], g);
+        }
+        gain += step;
+    }
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+// Block kernels for combining and scaling 16-bit audio (e.g. blending the suppressed audio with the
+// original). All of them saturate instead of wrapping around and round to the nearest sample.
+// Ratios are Q15 (32767 is just under 1.0) and gains are Q12 (4096 is 1.0, so up to 8x).
+//
+// Lengths are in samples (all channels), except for crossfadeAudio() which needs whole frames. The
+// output may be the same as any of the inputs. Interleaved stereo blocks take a faster path that
+// handles a whole frame (two samples) per 32-bit load and store when the buffers are aligned.
+
+#include <stdint.h>
+
+#define Q15_ONE 32768
+#define GAIN_Q12_ONE 4096
+
+/** Convert a ratio in [0, 1] to Q15 (1.0 becomes 32767). */
+static inline int16_t ratioToQ15(float ratio) {
+    float x = ratio * Q15_ONE + 0.5f;
+    return x >= 32767.0f ? 32767 : x <= 0.0f ? 0 : (int16_t)x;
+}
+
+/** Convert a gain in [0, 8) to Q12. */
+static inline uint16_t gainToQ12(float gain) {
+    float x = gain * GAIN_Q12_ONE + 0.5f;
+    return x >= 32767.0f ? 32767 : x <= 0.0f ? 0 : (uint16_t)x;
+}
+
+/** Saturate an int32 to an int16. */
+static inline int16_t saturate16(int32_t x) {
+    return x > 32767 ? 32767 : x < -32768 ? -32768 : (int16_t)x;
+}
+
+/** Round a float to the nearest int16, saturating. */
+static inline int16_t saturate16(float x) {
+    if (x >= 32767.0f) { return 32767; }
+    if (x <= -32768.0f) { return -32768; }
+    return (int16_t)(x >= 0 ? x + 0.5f : x - 0.5f);
+}
+
+/** Mix two blocks: output = a * ratio + b * (1 - ratio). */
+void mixAudio(const int16_t* a, const int16_t* b, uint32_t length, int16_t ratioQ15, int16_t* output);
+
+/** Add two blocks: output = a + b. */
+void addAudio(const int16_t* a, const int16_t* b, uint32_t length, int16_t* output);
+
+/** Scale a block: output = input * gain. */
+void gainAudio(const int16_t* input, uint32_t length, uint16_t gainQ12, int16_t* output);
+
+/**
+ * Crossfade from a to b over a block of frames: the ratio of b goes linearly from startQ15 at the
+ * first frame to endQ15 at the frame after the last (so consecutive blocks join up smoothly).
+ */
+void crossfadeAudio(const int16_t* a, const int16_t* b, uint32_t frames, uint8_t channels, int16_t startQ15, int16_t endQ15, int16_t* output);
+
+/**
+ * Scale a block of frames by a gain that goes linearly from startQ12 at the first frame to endQ12
+ * at the frame after the last (so consecutive blocks join up smoothly, like crossfadeAudio()).
+ */
+void rampGainAudio(const int16_t* input, uint32_t frames, uint8_t channels, uint16_t startQ12, uint16_t endQ12, int16_t* output);
@@ -0,0 +1,140 @@
+#include "benchmarks.h"
+#include "audio_mix.h"
+#include "biquad.hpp"
+#include "signal_gen.hpp"
+
+#include <Arduino.h>  // esp_cpu_get_ccount
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+// Samples in each block benchmarked (a DMA block of stereo audio) and how many times each is run
+#define BENCH_SAMPLES 2048
+#define BENCH_REPEATS 16
+
+
+///// The loops the kernels replaced (from audio.cpp) /////
+
+static void oldMixAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, float ratio, uint16_t* output) {
+    for (uint32_t i = 0; i < length; i++) {
+        output[i] = sample1[i] * ratio + sample2[i] * (1 - ratio);
+    }
+}
+
+static void oldAddAudio(uint16_t* sample1, uint16_t* sample2, uint32_t length, uint16_t* output) {
+    for (uint32_t i = 0; i < length; i++) {
+        output[i] = sample1[i] + sample2[i];
+    }
+}
+
+static void oldGainAudio(int16_t* input, uint32_t length, float gain, int16_t* output) {
+    for (uint32_t i = 0; i < length; i++) {
+        output[i] = input[i] * gain;
+    }
+}
+
+static uint32_t oldGenerateSineWave(float frequency, int16_t amplitude, uint32_t offset, uint16_t* buffer, uint32_t length) {
+    const float angularFreq = 2.0 * PI * frequency / 44100;
+    for (uint32_t i = 0; i < length/2; i++) {
+        buffer[2*i] = buffer[2*i+1] = amplitude * sin(angularFreq * (i + offset));
+    }
+    return (offset + length/2);
+}
+
+
+/** The 1-pole low-pass of the hear-through path (see hearThroughFilter() in audio.cpp). */
+static void onePoleLowPass(const int16_t* in, int16_t* out, size_t numSamples, float alpha) {
+    static float prev[2] = { 0.0f, 0.0f };
+    for (size_t i = 0; i < numSamples; i += 2) {
+        for (int ch = 0; ch < 2; ++ch) {
+            prev[ch] = alpha * in[i + ch] + (1 - alpha) * prev[ch];
+            out[i + ch] = (int16_t)prev[ch];
+        }
+    }
+}
+
+
+/** Print the cycles per sample of a benchmark that ran BENCH_REPEATS times. */
+static void report(const char* name, esp_cpu_ccount_t cycles) {
+    printf("  %-24s %6.2f cycles/sample\n", name, (float)cycles / (BENCH_REPEATS * BENCH_SAMPLES));
+}
+
+#define BENCH(name, code) do { \
+        esp_cpu_ccount_t start = esp_cpu_get_ccount(); \
+        for (int rep = 0; rep < BENCH_REPEATS; rep++) { code; } \
+        report(name, esp_cpu_get_ccount() - start); \
+    } while (0)
+
+void benchmarkMixing() {
+    int16_t* a = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    int16_t* b = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    int16_t* out = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    if (!a || !b || !out) { printf("!! Failed to allocate the benchmark buffers\n"); free(a); free(b); free(out); return; }
+    for (int i = 0; i < BENCH_SAMPLES; i++) {
+        a[i] = (int16_t)(rand() - RAND_MAX / 2);
+        b[i] = (int16_t)(rand() - RAND_MAX / 2);
+    }
+    a[0] = b[0] = 30000; // must saturate
+
+    printf("Mixing benchmarks (%d samples):\n", BENCH_SAMPLES);
+    BENCH("old mixAudio (float)", oldMixAudio((uint16_t*)a, (uint16_t*)b, BENCH_SAMPLES, 0.25f, (uint16_t*)out));
+    BENCH("mixAudio", mixAudio(a, b, BENCH_SAMPLES, ratioToQ15(0.25f), out));
+    BENCH("old addAudio (wraps)", oldAddAudio((uint16_t*)a, (uint16_t*)b, BENCH_SAMPLES, (uint16_t*)out));
+    BENCH("addAudio", addAudio(a, b, BENCH_SAMPLES, out));
+    if (out[0] != 32767) { printf("!! addAudio did not saturate: %d\n", out[0]); }
+    BENCH("gain (float)", oldGainAudio(a, BENCH_SAMPLES, 1.5f, out));
+    BENCH("gainAudio", gainAudio(a, BENCH_SAMPLES, gainToQ12(1.5f), out));
+    if (out[0] != 32767) { printf("!! gainAudio did not saturate: %d\n", out[0]); }
+    BENCH("crossfadeAudio (stereo)", crossfadeAudio(a, b, BENCH_SAMPLES / 2, 2, 0, 32767, out));
+    BENCH("crossfadeAudio (mono)", crossfadeAudio(a, b, BENCH_SAMPLES, 1, 0, 32767, out));
+
+    free(a);
+    free(b);
+    free(out);
+}
+
+void benchmarkSignals() {
+    int16_t* out = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    if (!out) { printf("!! Failed to allocate the benchmark buffers\n"); return; }
+    SignalGenerator gen(44100);
+    uint32_t offset = 0;
+    const float tones[4] = { 250, 500, 1000, 2000 };
+
+    printf("Signal benchmarks (%d samples):\n", BENCH_SAMPLES);
+    BENCH("old generateSineWave", offset = oldGenerateSineWave(440, 16384, offset, (uint16_t*)out, BENCH_SAMPLES));
+    gen.setSine(440, 0.5f);
+    BENCH("sine", gen.generate(out, BENCH_SAMPLES / 2));
+    gen.setStereo(2.5f, 0.5f);
+    BENCH("sine (delayed)", gen.generate(out, BENCH_SAMPLES / 2));
+    gen.setStereo(0, 1);
+    gen.setMultitone(tones, 4, 0.5f);
+    BENCH("multitone (4)", gen.generate(out, BENCH_SAMPLES / 2));
+    gen.setSweep(20, 20000, 1, true, 0.5f);
+    BENCH("log sweep", gen.generate(out, BENCH_SAMPLES / 2));
+    gen.setNoise(0.5f);
+    BENCH("noise", gen.generate(out, BENCH_SAMPLES / 2));
+
+    free(out);
+}
+
+void benchmarkFilters() {
+    int16_t* in = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    int16_t* out = (int16_t*)malloc(BENCH_SAMPLES * sizeof(int16_t));
+    if (!in || !out) { printf("!! Failed to allocate the benchmark buffers\n"); free(in); free(out); return; }
+    for (int i = 0; i < BENCH_SAMPLES; i++) { in[i] = (int16_t)(rand() - RAND_MAX / 2); }
+    const BiquadCoeffs lowpass = designBiquad(BIQUAD_LOWPASS, 360, 0.7071f, 0, 44100);
+    BiquadCascade filter(2);
+    BiquadCascadeQ15 filterQ15(2);
+    filter.addStage(lowpass);
+    filterQ15.addStage(lowpass);
+
+    printf("Filter benchmarks (%d samples):\n", BENCH_SAMPLES);
+    BENCH("1-pole (hear-through)", onePoleLowPass(in, out, BENCH_SAMPLES, 0.05f));
+    BENCH("biquad (float)", filter.process(in, out, BENCH_SAMPLES / 2));
+    BENCH("biquad (Q30)", filterQ15.process(in, out, BENCH_SAMPLES / 2));
+    filter.addStage(lowpass);
+    BENCH("biquad x2 (float)", filter.process(in, out, BENCH_SAMPLES / 2));
+
+    free(in);
+    free(out);
+}
@@ -0,0 +1,14 @@
+#pragma once
+
+// Benchmarks of the audio kernels against the loops they replaced, run on the device (they print
+// the cycles per sample and check the results). These are not run normally, see BENCHMARKS in
+// config.h.
+
+/** Benchmark the mixing and gain kernels in audio_mix.h. */
+void benchmarkMixing();
+
+/** Benchmark the biquad cascades in biquad.hpp against the 1-pole low-pass of the hear-through path. */
+void benchmarkFilters();
+
+/** Benchmark the test signal generator in signal_gen.hpp. */
+void benchmarkSignals();
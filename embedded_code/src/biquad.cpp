@@ -0,0 +1,217 @@
+#include "biquad.hpp"
+#include "audio_mix.h" // saturate16
+#include "fast_math.hpp"
+
+#include <math.h>
+#include <string.h>
+
+#define Q30_ONE 1073741824.0
+
+
+///// Design /////
+
+BiquadCoeffs designBiquad(BiquadType type, float frequency, float q, float gainDB, float sampleRate) {
+    const float w0 = 2.0f * (float)M_PI * frequency / sampleRate;
+    const float cosw = cosf(w0), sinw = sinf(w0);
+    const float alpha = sinw / (2.0f * q);
+    const float A = powf(10.0f, gainDB / 40.0f);
+    float b0, b1, b2, a0, a1, a2;
+    switch (type) {
+    case BIQUAD_LOWPASS:
+        b0 = (1 - cosw) / 2; b1 = 1 - cosw; b2 = (1 - cosw) / 2;
+        a0 = 1 + alpha; a1 = -2 * cosw; a2 = 1 - alpha;
+        break;
+    case BIQUAD_HIGHPASS:
+        b0 = (1 + cosw) / 2; b1 = -(1 + cosw); b2 = (1 + cosw) / 2;
+        a0 = 1 + alpha; a1 = -2 * cosw; a2 = 1 - alpha;
+        break;
+    case BIQUAD_BANDPASS:
+        b0 = alpha; b1 = 0; b2 = -alpha;
+        a0 = 1 + alpha; a1 = -2 * cosw; a2 = 1 - alpha;
+        break;
+    case BIQUAD_NOTCH:
+        b0 = 1; b1 = -2 * cosw; b2 = 1;
+        a0 = 1 + alpha; a1 = -2 * cosw; a2 = 1 - alpha;
+        break;
+    case BIQUAD_PEAKING:
+        b0 = 1 + alpha * A; b1 = -2 * cosw; b2 = 1 - alpha * A;
+        a0 = 1 + alpha / A; a1 = -2 * cosw; a2 = 1 - alpha / A;
+        break;
+    case BIQUAD_LOWSHELF: {
+        const float s = 2 * sqrtf(A) * alpha;
+        b0 = A * ((A + 1) - (A - 1) * cosw + s);
+        b1 = 2 * A * ((A - 1) - (A + 1) * cosw);
+        b2 = A * ((A + 1) - (A - 1) * cosw - s);
+        a0 = (A + 1) + (A - 1) * cosw + s;
+        a1 = -2 * ((A - 1) + (A + 1) * cosw);
+        a2 = (A + 1) + (A - 1) * cosw - s;
+        break;
+    }
+    case BIQUAD_HIGHSHELF:
+    default: {
+        const float s = 2 * sqrtf(A) * alpha;
+        b0 = A * ((A + 1) + (A - 1) * cosw + s);
+        b1 = -2 * A * ((A - 1) + (A + 1) * cosw);
+        b2 = A * ((A + 1) + (A - 1) * cosw - s);
+        a0 = (A + 1) - (A - 1) * cosw + s;
+        a1 = 2 * ((A - 1) - (A + 1) * cosw);
+        a2 = (A + 1) - (A - 1) * cosw - s;
+        break;
+    }
+    }
+    return BiquadCoeffs { b0 / a0, b1 / a0, b2 / a0, a1 / a0, a2 / a0 };
+}
+
+
+///// Float /////
+
+BiquadCascade::BiquadCascade(uint8_t channels) : channels(channels < BIQUAD_MAX_CHANNELS ? channels : BIQUAD_MAX_CHANNELS) { reset(); }
+
+bool BiquadCascade::addStage(const BiquadCoeffs& c) {
+    if (stages >= BIQUAD_MAX_STAGES) { return false; }
+    coeffs[stages++] = c;
+    return true;
+}
+
+void BiquadCascade::reset() { memset(state, 0, sizeof(state)); }
+
+/**
+ * Filter a block with the number of channels and stages known at compile time, so the loops are
+ * unrolled and the state (copied into locals for the block) stays in registers.
+ */
+template <int CHANNELS, int STAGES, typename T>
+static inline void OPTIMIZE_FOR_SPEED processFloat(
+    const BiquadCoeffs* coeffs, float state[][BIQUAD_MAX_CHANNELS][2],
+    const T* in, T* out, size_t frames
+) {
+    const uint8_t stages = STAGES;
+    float s[STAGES][CHANNELS][2];
+    for (uint8_t k = 0; k < stages; k++) {
+        for (int ch = 0; ch < CHANNELS; ch++) { s[k][ch][0] = state[k][ch][0]; s[k][ch][1] = state[k][ch][1]; }
+    }
+    for (size_t i = 0; i < frames; i++) {
+        float x[CHANNELS];
+        for (int ch = 0; ch < CHANNELS; ch++) { x[ch] = (float)in[i * CHANNELS + ch]; }
+        for (uint8_t k = 0; k < stages; k++) {
+            const BiquadCoeffs& c = coeffs[k];
+            for (int ch = 0; ch < CHANNELS; ch++) {
+                const float y = c.b0 * x[ch] + s[k][ch][0];
+                s[k][ch][0] = c.b1 * x[ch] - c.a1 * y + s[k][ch][1];
+                s[k][ch][1] = c.b2 * x[ch] - c.a2 * y;
+                x[ch] = y;
+            }
+        }
+        for (int ch = 0; ch < CHANNELS; ch++) {
+            if (sizeof(T) == sizeof(int16_t)) { out[i * CHANNELS + ch] = (T)saturate16(x[ch]); }
+            else { out[i * CHANNELS + ch] = (T)x[ch]; }
+        }
+    }
+    for (uint8_t k = 0; k < stages; k++) {
+        for (int ch = 0; ch < CHANNELS; ch++) { state[k][ch][0] = s[k][ch][0]; state[k][ch][1] = s[k][ch][1]; }
+    }
+}
+
+/** Call processFloat() for the number of stages. */
+template <int CHANNELS, typename T>
+static void processFloat(const BiquadCoeffs* coeffs, uint8_t stages, float state[][BIQUAD_MAX_CHANNELS][2], const T* in, T* out, size_t frames) {
+    static_assert(BIQUAD_MAX_STAGES == 4, "processFloat() must handle every number of stages");
+    switch (stages) {
+    case 1: processFloat<CHANNELS, 1>(coeffs, state, in, out, frames); break;
+    case 2: processFloat<CHANNELS, 2>(coeffs, state, in, out, frames); break;
+    case 3: processFloat<CHANNELS, 3>(coeffs, state, in, out, frames); break;
+    case 4: processFloat<CHANNELS, 4>(coeffs, state, in, out, frames); break;
+    default: if (in != out) { memmove(out, in, frames * CHANNELS * sizeof(T)); } break; // no stages
+    }
+}
+
+void BiquadCascade::process(const int16_t* in, int16_t* out, size_t frames) {
+    if (channels == 2) { processFloat<2>(coeffs, stages, state, in, out, frames); }
+    else { processFloat<1>(coeffs, stages, state, in, out, frames); }
+}
+
+void BiquadCascade::process(const float* in, float* out, size_t frames) {
+    if (channels == 2) { processFloat<2>(coeffs, stages, state, in, out, frames); }
+    else { processFloat<1>(coeffs, stages, state, in, out, frames); }
+}
+
+
+///// Q15 /////
+
+BiquadCascadeQ15::BiquadCascadeQ15(uint8_t channels) : channels(channels < BIQUAD_MAX_CHANNELS ? channels : BIQUAD_MAX_CHANNELS) { reset(); }
+
+bool BiquadCascadeQ15::addStage(const BiquadCoeffs& c) {
+    if (stages >= BIQUAD_MAX_STAGES) { return false; }
+    const float values[5] = { c.b0, c.b1, c.b2, c.a1, c.a2 };
+    int32_t scaled[5];
+    for (int i = 0; i < 5; i++) {
+        double x = round((double)values[i] * Q30_ONE);
+        if (x < -2147483648.0 || x > 2147483647.0) { return false; }
+        scaled[i] = (int32_t)x;
+    }
+    memcpy(coeffs[stages], scaled, sizeof(scaled));
+    stages++;
+    return true;
+}
+
+void BiquadCascadeQ15::reset() { memset(state, 0, sizeof(state)); }
+
+/**
+ * Filter a block with the number of channels and stages known at compile time (see processFloat()).
+ * The part of each output that is rounded off is added to the next one (error feedback), which
+ * keeps the rounding noise from being amplified by the poles of a low cutoff.
+ */
+template <int CHANNELS, int STAGES>
+static inline void OPTIMIZE_FOR_SPEED processQ15(
+    const int32_t coeffs[][5], int32_t state[][BIQUAD_MAX_CHANNELS][5],
+    const int16_t* in, int16_t* out, size_t frames
+) {
+    const uint8_t stages = STAGES;
+    int32_t s[STAGES][CHANNELS][5];
+    for (uint8_t k = 0; k < stages; k++) {
+        for (int ch = 0; ch < CHANNELS; ch++) {
+            for (int j = 0; j < 5; j++) { s[k][ch][j] = state[k][ch][j]; }
+        }
+    }
+    for (size_t i = 0; i < frames; i++) {
+        int32_t x[CHANNELS];
+        for (int ch = 0; ch < CHANNELS; ch++) { x[ch] = in[i * CHANNELS + ch]; }
+        for (uint8_t k = 0; k < stages; k++) {
+            const int32_t* c = coeffs[k];
+            for (int ch = 0; ch < CHANNELS; ch++) {
+                int32_t* st = s[k][ch];
+                const int64_t acc = (int64_t)c[0] * x[ch] + (int64_t)c[1] * st[0] + (int64_t)c[2] * st[1]
+                                  - (int64_t)c[3] * st[2] - (int64_t)c[4] * st[3] + st[4];
+                const int32_t rounded = (int32_t)((acc + (1 << 29)) >> 30);
+                const int32_t y = saturate16(rounded);
+                st[4] = y == rounded ? (int32_t)(acc - ((int64_t)y << 30)) : 0;
+                st[1] = st[0]; st[0] = x[ch];
+                st[3] = st[2]; st[2] = y;
+                x[ch] = y;
+            }
+        }
+        for (int ch = 0; ch < CHANNELS; ch++) { out[i * CHANNELS + ch] = (int16_t)x[ch]; }
+    }
+    for (uint8_t k = 0; k < stages; k++) {
+        for (int ch = 0; ch < CHANNELS; ch++) {
+            for (int j = 0; j < 5; j++) { state[k][ch][j] = s[k][ch][j]; }
+        }
+    }
+}
+
+/** Call processQ15() for the number of stages. */
+template <int CHANNELS>
+static void processQ15(const int32_t coeffs[][5], uint8_t stages, int32_t state[][BIQUAD_MAX_CHANNELS][5], const int16_t* in, int16_t* out, size_t frames) {
+    static_assert(BIQUAD_MAX_STAGES == 4, "processQ15() must handle every number of stages");
+    switch (stages) {
+    case 1: processQ15<CHANNELS, 1>(coeffs, state, in, out, frames); break;
+    case 2: processQ15<CHANNELS, 2>(coeffs, state, in, out, frames); break;
+    case 3: processQ15<CHANNELS, 3>(coeffs, state, in, out, frames); break;
+    case 4: processQ15<CHANNELS, 4>(coeffs, state, in, out, frames); break;
+    default: if (in != out) { memmove(out, in, frames * CHANNELS * sizeof(int16_t)); } break; // no stages
+    }
+}
+
+void BiquadCascadeQ15::process(const int16_t* in, int16_t* out, size_t frames) {
+    if (channels == 2) { processQ15<2>(coeffs, stages, state, in, out, frames); }
+    else { processQ15<1>(coeffs, stages, state, in, out, frames); }
+}
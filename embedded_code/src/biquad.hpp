@@ -0,0 +1,118 @@
+/**
+ * Cascades of biquad (second-order IIR) filters for blocks of interleaved audio.
+ *
+ * Each filter object keeps its own state, so any number of them can run at
+ * once (e.g. an EQ chain and a filter on a test signal). The
+ * coefficients are designed at init with designBiquad() (the RBJ Audio EQ
+ * Cookbook formulas) and then added as stages of a cascade.
+ *
+ * A block is processed in a single pass: each frame goes through every stage
+ * for every channel before moving on to the next frame, with the state kept
+ * in locals during the block. There is a general version and a faster one for
+ * stereo.
+ *
+ * BiquadCascade uses float math (transposed direct form II), which the ESP32
+ * FPU does with fused multiply-adds. BiquadCascadeQ15 uses integer math on
+ * Q15 audio (direct form I with Q30 coefficients, 64-bit accumulators and
+ * error feedback, so low cutoffs like a 360 Hz low-pass keep
+ * their response and don't amplify the rounding noise) for
+ * when the FPU is busy or exact repeatability is needed; its stages must not
+ * have a gain above 0 dB at any frequency or they will saturate.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Most stages in a cascade and channels in a block
+#define BIQUAD_MAX_STAGES 4
+#define BIQUAD_MAX_CHANNELS 2
+
+/** The kind of filter made by designBiquad(). */
+enum BiquadType : uint8_t {
+    BIQUAD_LOWPASS,
+    BIQUAD_HIGHPASS,
+    BIQUAD_BANDPASS,    // 0 dB peak gain
+    BIQUAD_NOTCH,
+    BIQUAD_PEAKING,     // uses the gain
+    BIQUAD_LOWSHELF,    // uses the gain
+    BIQUAD_HIGHSHELF,   // uses the gain
+};
+
+/** Coefficients of a biquad, normalized so a0 is 1. */
+struct BiquadCoeffs {
+    float b0, b1, b2;
+    float a1, a2;
+};
+
+/**
+ * Design a biquad. The frequency is the cutoff/center in Hz, q is the quality factor (0.7071 for
+ * Butterworth low/high-pass filters), and the gain in dB is only used by the peaking and shelf
+ * filters.
+ */
+BiquadCoeffs designBiquad(BiquadType type, float frequency, float q, float gainDB, float sampleRate);
+
+/** A cascade of biquads using float math. */
+class BiquadCascade {
+    const uint8_t channels;
+    uint8_t stages = 0;
+    BiquadCoeffs coeffs[BIQUAD_MAX_STAGES];
+    float state[BIQUAD_MAX_STAGES][BIQUAD_MAX_CHANNELS][2]; // transposed direct form II
+
+public:
+    /** Create an empty cascade (which passes the audio through) for interleaved audio. */
+    explicit BiquadCascade(uint8_t channels = 2);
+
+    /** Add a stage at the end of the cascade. Returns false if there are already the most stages. */
+    bool addStage(const BiquadCoeffs& coeffs);
+
+    /** Remove all of the stages. */
+    void clear() { stages = 0; reset(); }
+
+    /** Clear the state (e.g. when the audio is interrupted). */
+    void reset();
+
+    /** The number of stages. */
+    uint8_t size() const { return stages; }
+
+    /**
+     * Filter a block of interleaved 16-bit audio from in into out (which may be the same). The
+     * output is rounded and saturated.
+     */
+    void process(const int16_t* in, int16_t* out, size_t frames);
+
+    /** Filter a block of interleaved float audio from in into out (which may be the same). */
+    void process(const float* in, float* out, size_t frames);
+};
+
+/** A cascade of biquads using integer math (Q30 coefficients, so each must be in [-2, 2)). */
+class BiquadCascadeQ15 {
+    const uint8_t channels;
+    uint8_t stages = 0;
+    int32_t coeffs[BIQUAD_MAX_STAGES][5]; // b0, b1, b2, a1, a2 in Q30
+    int32_t state[BIQUAD_MAX_STAGES][BIQUAD_MAX_CHANNELS][5]; // direct form I: x1, x2, y1, y2, and the rounding error
+
+public:
+    /** Create an empty cascade (which passes the audio through) for interleaved audio. */
+    explicit BiquadCascadeQ15(uint8_t channels = 2);
+
+    /**
+     * Add a stage at the end of the cascade. Returns false if there are already the most stages or
+     * a coefficient doesn't fit in Q30.
+     */
+    bool addStage(const BiquadCoeffs& coeffs);
+
+    /** Remove all of the stages. */
+    void clear() { stages = 0; reset(); }
+
+    /** Clear the state (e.g. when the audio is interrupted). */
+    void reset();
+
+    /** The number of stages. */
+    uint8_t size() const { return stages; }
+
+    /** Filter a block of interleaved 16-bit audio from in into out (which may be the same). */
+    void process(const int16_t* in, int16_t* out, size_t frames);
+};
@@ -1,7 +1,7 @@
 #include "button.h"
 #include "config.h"
-#include "sd.h"
 #include "data.h"
+#include "audio.h"
 
 #include <stdbool.h>
 
@@ -23,6 +23,7 @@
 // The current button state (used in the interrupt handlers)
 unsigned long IRAM_DATA_ATTR WORD_ALIGNED_ATTR lastPress = 0;  // when 0 not currently pressed
 unsigned long IRAM_DATA_ATTR WORD_ALIGNED_ATTR lastRelease = 0;
+uint32_t IRAM_DATA_ATTR WORD_ALIGNED_ATTR pressFrame = 0; // recorded frame of the current press
 
 
 /** Record button press into the global variables (with some debouncing). */
@@ -34,24 +35,18 @@ void IRAM_ATTR onPress() {
     if (now - lastRelease < 10) { return; }
 
     lastPress = now;
+    pressFrame = getRecordingFrame();
 }
 
 
 /**
  * Record button release into the global variables.
- * Add the button press and release times to the button queue.
+ * Queue the button press and release (as recorded frames) to be written along with the audio.
  */
 void IRAM_ATTR onRelease() {
     if (lastPress == 0) { return; }
     lastRelease = (unsigned long)(esp_timer_get_time() / 1000ULL); // milliseconds
-
-    // Write the button press and release times to the file (using a task)
-    static ButtonEvent events[MAX_FILE_TASKS];
-    static unsigned char index = 0;
-    events[index].pressTime = lastPress;
-    events[index].releaseTime = lastRelease;
-    submitSDTaskFromISR((SDCallback)writeButtonData, &events[index]);
-    index = (index + 1) % MAX_FILE_TASKS;
+    addButtonEvent(pressFrame, getRecordingFrame());
 
     lastPress = 0;
 }
@@ -73,8 +68,8 @@ void IRAM_ATTR onChange(void*) {
 
 /**
  * Set up the button for recording timestamps of button presses and releases.
- * This sets up an interrupt on the button pin along with a queue to store the timestamps and a
- * task to write them to the SD card.
+ * This sets up an interrupt on the button pin. Each press is queued (as recorded frames) and
+ * written by the SD card task along with the audio.
  */
 void setupButton() {
     // TODO: due to issues with edge-triggered interrupts on ESP32, some extra logic may be needed here and in onChange.
@@ -4,7 +4,7 @@
 
 /**
  * Set up the button for recording timestamps of button presses and releases.
- * This sets up an interrupt on the button pin along with a queue to store the timestamps and a
- * task to write them to the SD card.
+ * This sets up an interrupt on the button pin. Each press is queued (as recorded frames) and
+ * written by the SD card task along with the audio.
  */
 void setupButton();
@@ -0,0 +1,140 @@
+#include "capture_stats.h"
+#include "config.h"
+
+#include <esp_timer.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <atomic>
+
+// There is a single writer (the audio task), so the counters are only ever loaded and stored, never
+// read-modify-written atomically, and other tasks may read them at any time.
+
+// Totals since the start
+static std::atomic<uint32_t> totalBlocks(0);
+static std::atomic<uint32_t> totalClipped(0);
+static std::atomic<uint32_t> totalEvents[CAPTURE_EVENTS];
+static std::atomic<uint32_t> totalMaxJitterUs(0);
+
+// The period being accumulated (only used by the audio task)
+static struct {
+    uint32_t blocks;
+    int16_t peak;
+    uint32_t clipped;
+    uint32_t events[CAPTURE_EVENTS];
+    uint32_t maxJitterUs;
+    float meanSquares;  // sum of the mean square of each block
+    int64_t start;
+} period;
+
+static uint32_t blockUs = 0;
+static int64_t lastReadTime = 0;
+
+// The last two summaries: the audio task fills in the other one and then switches to it, so readers
+// always see a complete summary (like the frame clock in audio.cpp)
+static CaptureSummary summaries[2];
+static std::atomic<int8_t> summaryIndex(-1); // -1 until the first summary
+
+
+/** Add to a counter that only has a single writer. */
+template <typename T> static inline void add(std::atomic<T>& counter, T value) {
+    counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+void setupCaptureStats(uint32_t blockFrames, uint32_t sampleRate) {
+    blockUs = (uint32_t)((uint64_t)blockFrames * 1000000 / sampleRate);
+    memset(&period, 0, sizeof(period));
+    for (int i = 0; i < CAPTURE_EVENTS; i++) { totalEvents[i].store(0, std::memory_order_relaxed); }
+}
+
+/** Roll the period into a summary and start the next period. */
+static void makeSummary(int64_t now) {
+    int8_t next = summaryIndex.load(std::memory_order_relaxed) == 0 ? 1 : 0;
+    CaptureSummary& summary = summaries[next];
+    summary.blocks = period.blocks;
+    summary.periodMs = (uint32_t)((now - period.start) / 1000);
+    summary.peak = period.peak;
+    summary.peakDBFS = period.peak > 0 ? 20.0f * log10f(period.peak / 32768.0f) : -INFINITY;
+    float meanSquare = period.blocks ? period.meanSquares / period.blocks : 0.0f;
+    summary.rmsDBFS = meanSquare > 0 ? 10.0f * log10f(meanSquare / (32768.0f * 32768.0f)) : -INFINITY;
+    summary.clipped = period.clipped;
+    memcpy(summary.events, period.events, sizeof(summary.events));
+    summary.maxJitterUs = period.maxJitterUs;
+    summaryIndex.store(next, std::memory_order_release);
+
+#ifdef DEBUG
+    printCaptureSummary(&summary);
+#endif
+
+    memset(&period, 0, sizeof(period));
+    period.start = now;
+}
+
+void captureBlock(const int16_t* samples, uint32_t count, int64_t readTime) {
+    // Levels of every CAPTURE_LEVEL_STRIDE-th sample
+    int32_t peak = 0;
+    uint32_t clipped = 0;
+    int64_t sumSquares = 0;
+    uint32_t measured = 0;
+    for (uint32_t i = 0; i < count; i += CAPTURE_LEVEL_STRIDE) {
+        int32_t x = samples[i];
+        int32_t mag = x < 0 ? -x : x;
+        if (mag > peak) { peak = mag; }
+        clipped += mag >= CAPTURE_CLIP_LEVEL;
+        sumSquares += x * x;
+        measured++;
+    }
+    if (peak > 32767) { peak = 32767; }
+    clipped *= CAPTURE_LEVEL_STRIDE;
+
+    // Jitter of the time between reads (the first read has nothing to compare to)
+    uint32_t jitter = 0;
+    if (lastReadTime) {
+        int64_t diff = readTime - lastReadTime - blockUs;
+        jitter = (uint32_t)(diff < 0 ? -diff : diff);
+    }
+    lastReadTime = readTime;
+
+    if (period.start == 0) { period.start = readTime; }
+    period.blocks++;
+    if (peak > period.peak) { period.peak = (int16_t)peak; }
+    period.clipped += clipped;
+    if (jitter > period.maxJitterUs) { period.maxJitterUs = jitter; }
+    if (measured) { period.meanSquares += (float)sumSquares / measured; }
+
+    add(totalBlocks, 1u);
+    if (clipped) { add(totalClipped, clipped); }
+    if (jitter > totalMaxJitterUs.load(std::memory_order_relaxed)) { totalMaxJitterUs.store(jitter, std::memory_order_relaxed); }
+
+    if (readTime - period.start >= CAPTURE_SUMMARY_MS * 1000) { makeSummary(readTime); }
+}
+
+void captureEvent(CaptureEvent event) {
+    period.events[event]++;
+    add(totalEvents[event], 1u);
+}
+
+bool getCaptureSummary(CaptureSummary* summary) {
+    int8_t index = summaryIndex.load(std::memory_order_acquire);
+    if (index < 0) { return false; }
+    *summary = summaries[index];
+    return true;
+}
+
+void getCaptureTotals(CaptureTotals* totals) {
+    totals->blocks = totalBlocks.load(std::memory_order_relaxed);
+    totals->clipped = totalClipped.load(std::memory_order_relaxed);
+    for (int i = 0; i < CAPTURE_EVENTS; i++) { totals->events[i] = totalEvents[i].load(std::memory_order_relaxed); }
+    totals->maxJitterUs = totalMaxJitterUs.load(std::memory_order_relaxed);
+}
+
+void printCaptureSummary(const CaptureSummary* summary) {
+    printf("Audio: %u blocks in %u ms, peak %.1f dBFS, RMS %.1f dBFS, %u clipped, jitter %u us\n",
+        summary->blocks, summary->periodMs, summary->peakDBFS, summary->rmsDBFS, summary->clipped, summary->maxJitterUs);
+    if (summary->events[CAPTURE_DMA_ERROR] || summary->events[CAPTURE_RX_OVERFLOW] ||
+        summary->events[CAPTURE_TX_OVERFLOW] || summary->events[CAPTURE_READ_ERROR]) {
+        printf("!! I2S: %u DMA errors, %u receive overflows, %u transmit overflows, %u read errors\n",
+            summary->events[CAPTURE_DMA_ERROR], summary->events[CAPTURE_RX_OVERFLOW],
+            summary->events[CAPTURE_TX_OVERFLOW], summary->events[CAPTURE_READ_ERROR]);
+    }
+}
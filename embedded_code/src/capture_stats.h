@@ -0,0 +1,72 @@
+#pragma once
+
+// Statistics about the audio captured from I2S: levels, clipping, driver errors, and how evenly the
+// blocks arrive. The audio task adds each block with captureBlock(), which only looks at every
+// CAPTURE_LEVEL_STRIDE-th sample and updates a few counters (nothing is printed per block). Every
+// CAPTURE_SUMMARY_MS the counters are rolled into a summary that any task can read without locking.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// How often the summary is made (and printed if DEBUG is defined)
+#define CAPTURE_SUMMARY_MS 1000
+
+// Samples at or beyond this magnitude count as clipped
+#define CAPTURE_CLIP_LEVEL 32767
+
+// The levels are measured on every this many samples. It is odd so every channel of interleaved
+// audio takes turns being measured. Clipping and peaks last for several samples, so few are missed.
+#define CAPTURE_LEVEL_STRIDE 7
+
+/** Errors reported by the I2S driver. */
+typedef enum _CaptureEvent : uint8_t {
+    CAPTURE_DMA_ERROR = 0,
+    CAPTURE_RX_OVERFLOW,    // the receive DMA buffers were full (audio was lost before it was read)
+    CAPTURE_TX_OVERFLOW,    // the transmit DMA buffers were full
+    CAPTURE_READ_ERROR,     // a read failed or was short
+    CAPTURE_EVENTS
+} CaptureEvent;
+
+/** A summary of the captured audio over a period. */
+typedef struct _CaptureSummary {
+    uint32_t blocks;            // blocks read in the period
+    uint32_t periodMs;          // length of the period
+    int16_t peak;               // largest sample magnitude (of the measured samples)
+    float peakDBFS;             // the peak in dB relative to full scale
+    float rmsDBFS;              // RMS level in dB relative to full scale
+    uint32_t clipped;           // samples at or beyond CAPTURE_CLIP_LEVEL (estimated from the measured ones)
+    uint32_t events[CAPTURE_EVENTS]; // driver errors in the period
+    uint32_t maxJitterUs;       // largest difference between the time between reads and the block length
+} CaptureSummary;
+
+/** Totals since the capture started. */
+typedef struct _CaptureTotals {
+    uint32_t blocks;
+    uint32_t clipped;
+    uint32_t events[CAPTURE_EVENTS];
+    uint32_t maxJitterUs;
+} CaptureTotals;
+
+/**
+ * Set the length of each block that will be added (in frames) and the sample rate, used for the
+ * jitter. Must be called before the first block.
+ */
+void setupCaptureStats(uint32_t blockFrames, uint32_t sampleRate);
+
+/**
+ * Add a block of interleaved 16-bit samples read at the given time (esp_timer). Only called from
+ * the audio task. Once a period has passed, this also makes the summary.
+ */
+void captureBlock(const int16_t* samples, uint32_t count, int64_t readTime);
+
+/** Count an error reported by the I2S driver. Only called from the audio task. */
+void captureEvent(CaptureEvent event);
+
+/** Get the summary of the last complete period. Returns false if there isn't one yet. */
+bool getCaptureSummary(CaptureSummary* summary);
+
+/** Get the totals since the capture started. */
+void getCaptureTotals(CaptureTotals* totals);
+
+/** Print a summary. */
+void printCaptureSummary(const CaptureSummary* summary);
@@ -0,0 +1,26 @@
+/**
+ * CodecBus on top of the Arduino I2C library.
+ */
+
+#include "codec_registers.hpp"
+
+#ifdef ESP_PLATFORM
+
+#include <Wire.h>
+
+class I2CCodecBus : public CodecBus {
+    TwoWire* const wire;
+
+public:
+    explicit I2CCodecBus(TwoWire* wire) : wire(wire) { }
+
+    bool transmit(uint8_t address, const uint8_t* data, size_t length) override {
+        wire->beginTransmission(address);
+        if (wire->write(data, length) != length) { wire->endTransmission(); return false; }
+        return wire->endTransmission() == 0; // 0 is success
+    }
+};
+
+CodecBus* create_i2c_codec_bus(TwoWire* wire) { return new I2CCodecBus(wire); }
+
+#endif
@@ -0,0 +1,157 @@
+#include "codec_registers.hpp"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <stdio.h>
+#include <string.h>
+
+static_assert(CODEC_MAX_REGISTERS <= 64, "The known registers are a 64-bit mask");
+
+// Set on a posted value until the writer takes it (values are at most 9 bits)
+#define POSTED 0x8000
+
+
+CodecRegisters::CodecRegisters(CodecBus* bus, uint8_t address, CodecRegisterFormat format) :
+    bus(bus), address(address), format(format) {
+    memset(shadow, 0, sizeof(shadow));
+    for (int i = 0; i < CODEC_MAX_REGISTERS; i++) { posted[i].store(0, std::memory_order_relaxed); }
+}
+
+void CodecRegisters::assume(uint8_t reg, uint16_t value) {
+    if (reg >= CODEC_MAX_REGISTERS) { return; }
+    shadow[reg] = value;
+    known |= 1ull << reg;
+}
+
+uint16_t CodecRegisters::get(uint8_t reg) const {
+    return reg < CODEC_MAX_REGISTERS && (known & (1ull << reg)) ? shadow[reg] : 0;
+}
+
+bool CodecRegisters::write(uint8_t reg, uint16_t value) {
+    if (reg >= CODEC_MAX_REGISTERS) { printf("!! Codec register 0x%02x out of range\n", reg); return false; }
+    stats.writes++;
+    if ((known & (1ull << reg)) && shadow[reg] == value) { stats.skipped++; return true; }
+    bool ok = true;
+    if (queued == CODEC_QUEUE_SIZE) { ok = flush(); }
+    shadow[reg] = value;
+    known |= 1ull << reg;
+    queue[queued++] = Write { reg, value };
+    return ok;
+}
+
+/** Send a run of consecutive registers in one transaction (or one each if the codec can't do bursts). */
+bool CodecRegisters::send(uint8_t reg, const uint16_t* values, uint8_t count) {
+    uint8_t data[CODEC_MAX_BURST + 1];
+    size_t length;
+    if (format == CODEC_REGS_9BIT) {
+        data[0] = (uint8_t)((reg << 1) | ((values[0] >> 8) & 1));
+        data[1] = (uint8_t)values[0];
+        length = 2;
+        count = 1;
+    } else {
+        data[0] = reg;
+        for (uint8_t i = 0; i < count; i++) { data[i + 1] = (uint8_t)values[i]; }
+        length = count + 1;
+    }
+    stats.transactions++;
+    stats.bytes += length;
+    if (!bus->transmit(address, data, length)) {
+        stats.errors++;
+        for (uint8_t i = 0; i < count; i++) { known &= ~(1ull << (reg + i)); }
+        printf("!! Codec register 0x%02x write failed\n", reg);
+        return false;
+    }
+    return true;
+}
+
+bool CodecRegisters::flush() {
+    bool ok = true;
+    const uint8_t maxBurst = format == CODEC_REGS_9BIT ? 1 : CODEC_MAX_BURST;
+    uint8_t i = 0;
+    while (i < queued) {
+        // Take the run of writes to consecutive registers
+        uint16_t values[CODEC_MAX_BURST];
+        const uint8_t start = queue[i].reg;
+        uint8_t count = 0;
+        while (i < queued && count < maxBurst && queue[i].reg == start + count) { values[count++] = queue[i++].value; }
+        if (!send(start, values, count)) { ok = false; }
+    }
+    queued = 0;
+    if (anyPosted.load(std::memory_order_acquire)) { ok = sendPosted() && ok; }
+    return ok;
+}
+
+void CodecRegisters::post(uint8_t reg, uint16_t value) {
+    if (reg >= CODEC_MAX_REGISTERS) { printf("!! Codec register 0x%02x out of range\n", reg); return; }
+    posted[reg].store(POSTED | value, std::memory_order_relaxed);
+    anyPosted.store(true, std::memory_order_release);
+    if (writerTask) { xTaskNotifyGive((TaskHandle_t)writerTask); }
+}
+
+/** Send the posted writes (in register order). */
+bool CodecRegisters::sendPosted() {
+    anyPosted.store(false, std::memory_order_relaxed);
+    bool ok = true;
+    for (uint8_t reg = 0; reg < CODEC_MAX_REGISTERS; reg++) {
+        uint16_t value = posted[reg].exchange(0, std::memory_order_acquire);
+        if (!(value & POSTED)) { continue; }
+        value &= ~POSTED;
+        stats.writes++;
+        if ((known & (1ull << reg)) && shadow[reg] == value) { stats.skipped++; continue; }
+        shadow[reg] = value;
+        known |= 1ull << reg;
+        if (!send(reg, &value, 1)) { ok = false; }
+    }
+    return ok;
+}
+
+/** The writer task: sends the posted writes whenever it is notified. */
+void CodecRegisters::writer(void* arg) {
+    CodecRegisters* regs = (CodecRegisters*)arg;
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        regs->sendPosted();
+    }
+}
+
+bool CodecRegisters::startWriter(uint8_t priority) {
+    if (writerTask) { return true; }
+    TaskHandle_t handle = NULL;
+    // I2C writes and the error printf() need a bit more than the minimum stack
+    if (xTaskCreate(writer, "CodecWriter", 2048, this, priority, &handle) != pdPASS) {
+        printf("!! Failed to create the codec writer task\n");
+        return false;
+    }
+    writerTask = handle;
+    if (anyPosted.load(std::memory_order_acquire)) { xTaskNotifyGive(handle); }
+    return true;
+}
+
+uint32_t CodecRegisters::busTimeUs(uint32_t clockHz) const {
+    const uint64_t bits = (uint64_t)(stats.bytes + stats.transactions) * 9 + stats.transactions * 2;
+    return (uint32_t)(bits * 1000000 / clockHz);
+}
+
+
+///// Mock /////
+
+bool MockCodecBus::transmit(uint8_t address, const uint8_t* data, size_t length) {
+    transactions++;
+    bytes += length;
+    if (failures > 0) { failures--; return false; }
+    if (address != this->address || length == 0) { return false; } // not acknowledged
+    if (format == CODEC_REGS_9BIT) {
+        if (length != 2) { return false; }
+        const uint8_t reg = data[0] >> 1;
+        if (reg >= CODEC_MAX_REGISTERS) { return false; }
+        registers[reg] = (uint16_t)((data[0] & 1) << 8 | data[1]);
+    } else {
+        for (size_t i = 1; i < length; i++) {
+            const size_t reg = data[0] + i - 1;
+            if (reg >= CODEC_MAX_REGISTERS) { return false; }
+            registers[reg] = data[i];
+        }
+    }
+    return true;
+}
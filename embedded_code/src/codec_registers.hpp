@@ -0,0 +1,171 @@
+/**
+ * Register map of an audio codec that is controlled over I2C, shared by the
+ * codec drivers.
+ *
+ * Every register written is kept in a shadow copy, so writing a register with
+ * the value it already has costs nothing (e.g. setting the same volume again).
+ * Writes are queued by write() and sent in order by flush(). Consecutive
+ * registers in the queue are sent as a single burst when the codec
+ * auto-increments the register address (the ES8388 does, the WM8960 doesn't),
+ * so setting up a codec takes a handful of transactions instead of one for
+ * every register.
+ *
+ * post() is for writes from tasks that shouldn't wait on the bus (e.g. the
+ * volume): it only records the latest value of the register and the writes
+ * are sent later by a writer task (see startWriter()) or the next flush().
+ * Posted registers are sent in increasing register order, and a register
+ * posted several times before being sent is only written once.
+ *
+ * The bus itself is a CodecBus: either the real I2C bus or MockCodecBus, which
+ * acts like the codec's register file so the drivers can be tested on a
+ * computer.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+// Most registers in a codec (the addresses must be less than this)
+#define CODEC_MAX_REGISTERS 64
+// Writes waiting for flush() (flushed automatically when full)
+#define CODEC_QUEUE_SIZE 64
+// Longest burst of registers in one transaction
+#define CODEC_MAX_BURST 16
+
+/** How the registers are laid out on the bus. */
+enum CodecRegisterFormat : uint8_t {
+    CODEC_REGS_8BIT,    // 8-bit address then 8-bit values, the address auto-increments (ES8388)
+    CODEC_REGS_9BIT,    // 7-bit address and a 9-bit value in 2 bytes, one register at a time (WM8960)
+};
+
+/** A bus that can send write transactions to a device. */
+class CodecBus {
+public:
+    virtual ~CodecBus() { }
+
+    /** Send one write transaction (start, address, data, stop). Returns true if it was acknowledged. */
+    virtual bool transmit(uint8_t address, const uint8_t* data, size_t length) = 0;
+};
+
+class TwoWire;
+
+/** Create a CodecBus for an I2C bus (ESP32 only). The bus must already be started. */
+CodecBus* create_i2c_codec_bus(TwoWire* wire);
+
+/**
+ * A stand-in for the I2C bus and the codec on it. It decodes the transactions into a register file
+ * and counts the transactions and bytes sent, and can be made to fail to test error handling.
+ */
+class MockCodecBus : public CodecBus {
+    const uint8_t address;
+    const CodecRegisterFormat format;
+    uint16_t registers[CODEC_MAX_REGISTERS] = { 0 };
+    uint32_t transactions = 0, bytes = 0, failures = 0;
+
+public:
+    MockCodecBus(uint8_t address, CodecRegisterFormat format) : address(address), format(format) { }
+
+    bool transmit(uint8_t address, const uint8_t* data, size_t length) override;
+
+    /** The value of a register in the simulated codec. */
+    uint16_t get(uint8_t reg) const { return reg < CODEC_MAX_REGISTERS ? registers[reg] : 0; }
+
+    /** The number of transactions and bytes (not counting the device address) sent. */
+    uint32_t getTransactions() const { return transactions; }
+    uint32_t getBytes() const { return bytes; }
+
+    /** Make the next transactions fail (not be acknowledged). */
+    void fail(uint32_t count) { failures = count; }
+
+    /** Reset the counters. */
+    void resetCounts() { transactions = bytes = 0; }
+};
+
+/** Statistics about the writes to a codec. */
+struct CodecRegisterStats {
+    uint32_t writes;        // registers written with write() or post()
+    uint32_t skipped;       // writes skipped since the register already had the value
+    uint32_t transactions;  // bus transactions sent
+    uint32_t bytes;         // bytes sent (not counting the device address)
+    uint32_t errors;        // transactions that failed
+};
+
+class CodecRegisters {
+    struct Write { uint8_t reg; uint16_t value; };
+
+    CodecBus* const bus;
+    const uint8_t address;
+    const CodecRegisterFormat format;
+
+    uint16_t shadow[CODEC_MAX_REGISTERS];   // the value of each register (after the queued writes)
+    uint64_t known = 0;                     // bit for each register in the shadow copy that is known
+    Write queue[CODEC_QUEUE_SIZE];
+    uint8_t queued = 0;
+
+    // Posted values (with POSTED set until they are taken by the writer)
+    std::atomic<uint16_t> posted[CODEC_MAX_REGISTERS];
+    std::atomic<bool> anyPosted{false};
+    void* writerTask = nullptr;
+
+    CodecRegisterStats stats = { };
+
+    bool send(uint8_t reg, const uint16_t* values, uint8_t count);
+    bool sendPosted();
+    static void writer(void* arg);
+
+public:
+    /** Create the register map of the codec at the given address. Nothing is known about the registers yet. */
+    CodecRegisters(CodecBus* bus, uint8_t address, CodecRegisterFormat format);
+
+    /**
+     * Set the shadow copy of a register without writing it (e.g. to its value after a reset) so
+     * writing the same value is skipped.
+     */
+    void assume(uint8_t reg, uint16_t value);
+
+    /** Forget the shadow copy of all of the registers (e.g. after the codec was reset). */
+    void forget() { known = 0; }
+
+    /**
+     * Queue a write of a register, which is skipped if the register already has the value. Returns
+     * false if the queue had to be flushed and that failed.
+     */
+    bool write(uint8_t reg, uint16_t value);
+
+    /**
+     * Send all of the queued and posted writes. Returns false if any transaction failed (the
+     * registers involved are forgotten so writing them again isn't skipped).
+     */
+    bool flush();
+
+    /** Queue a write and flush. */
+    bool writeNow(uint8_t reg, uint16_t value) { return write(reg, value) && flush(); }
+
+    /**
+     * Post a write that is sent later by the writer task or the next flush(), without waiting for
+     * the bus. This can be called from any task.
+     */
+    void post(uint8_t reg, uint16_t value);
+
+    /**
+     * Start a task that sends the posted writes as soon as they are posted. Returns
+     * false if the task could not be created. Once started, the other methods must not be used at
+     * the same time as a post() is being sent (e.g. only post() after the codec is set up).
+     */
+    bool startWriter(uint8_t priority = 1);
+
+    /** The shadow copy of a register (0 if it isn't known). */
+    uint16_t get(uint8_t reg) const;
+
+    /** Get the statistics of the writes. */
+    void getStats(CodecRegisterStats* stats) const { *stats = this->stats; }
+
+    /**
+     * Estimate the time the writes so far took on the bus in microseconds, at the given clock
+     * speed (each byte and the device address take 9 clocks, plus 2 for the start and stop).
+     */
+    uint32_t busTimeUs(uint32_t clockHz) const;
+};
@@ -5,6 +5,17 @@
 // If defined, the program will print debug messages to the serial port and perform other debugging tasks
 #define DEBUG 1
 
+// If 1, the DUET stage timings, peaks, and best-source map are sent as binary telemetry over the
+// serial port (decode with tools/telemetry_decode.py) instead of being printed
+#define TELEMETRY 0
+
+// If 1, the benchmarks in benchmarks.h are run (and printed) at startup
+#define BENCHMARKS 0
+
+// If 1, the end-to-end latency is measured and printed (see latency.h), which replaces the played
+// audio with probes and needs a cable from the output to the input (or the virtual loopback)
+#define LATENCY_TEST 0
+
 // The pin that the debug LED is connected to
 #define DEBUG_LED_PIN 13
 
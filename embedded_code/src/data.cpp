@@ -3,78 +3,351 @@
 #include "settings.h"
 #include "audio.h"
 #include "wav.h"
+#include "audio_encoder.hpp"
+#include "spsc_queue.hpp"
 
 #define DISABLE_FS_H_WARNING
 #include <SdFat.h>
 
+// Update the WAV header and sync the files after this many chunks of audio data have been recorded.
+// This bounds how much is lost if the card is removed or the power is cut (32 chunks of 32 KB is
+// ~6 seconds of 44.1 kHz stereo audio). Each sync costs a few extra small writes.
+#define SYNC_EVERY_N_CHUNKS 32
 
+// Start new files after this many frames have been recorded (one hour)
+#define FRAMES_PER_FILE (getSampleRate() * 3600)
+#define FRAMES_PER_CHUNK (SD_WRITE_CHUNK / (REC_CHANNELS * REC_BYTES_PER_SAMPLE))
+
+
+// The recording files are kept open for the whole session. They are only ever used from the SD
+// card task, so none of this needs to be protected.
 char audioFileName[32] = { 0 };
-char timestampFileName[32] = { 0 };
-unsigned long startTimestamp;
+FsFile audioFile;
+uint32_t filesGeneration = 0; // the SD card mount generation the files were opened on
+uint32_t audioDataSize = 0; // amount of audio data written to the file (not including the partial chunk)
+uint32_t fileFrames = 0; // number of frames recorded in the file
+uint32_t chunksSinceSync = 0;
+uint32_t writtenFrames = 0; // number of recorded frames written (to any file), same count as getRecordingFrame()
+uint32_t fileStartFrame = 0; // the value of writtenFrames when the current files were started
+
+// Button events and annotations waiting for the audio they happened during to be written. Button
+// events come from an ISR, annotations from any task (taking turns with the lock).
+#define MAX_BUTTON_EVENTS 32
+#define MAX_PENDING_ANNOTATIONS 16
+SPSCQueue<ButtonEvent, MAX_BUTTON_EVENTS> buttonEvents;
+SPSCQueue<WavCue, MAX_PENDING_ANNOTATIONS> pendingAnnotations;
+portMUX_TYPE annotationLock = portMUX_INITIALIZER_UNLOCKED;
+
+// The annotations of the current files, kept in RAM and written as cues after the audio data each
+// time the files are synced (allocated the first time it is needed)
+#define MAX_ANNOTATIONS_PER_FILE 512
+WavCue* annotations = NULL;
+uint32_t annotationCount = 0;
+uint32_t droppedAnnotations = 0;
+
+// The encoder of the current files (NULL for PCM) and the encoding for the next files (which can be
+// set from any task)
+AudioEncoder* encoder = NULL;
+WavFormat fileFormat;
+volatile RecordingEncoding nextEncoding = ENCODING_PCM;
+uint8_t* encodedChunk = NULL; // output of the encoder for one chunk of recorded audio
+uint32_t encodedChunkSize = 0;
+
+// Audio data that doesn't fill a whole chunk yet (allocated the first time it is needed)
+uint8_t* partialChunk = NULL;
+uint32_t partialChunkLen = 0;
 
 
-/** Get the next available file names */
+/** Close the recording file without writing anything else to it. */
+void closeFiles() {
+    audioFile.close();
+    filesGeneration = 0;
+}
+
+/** Update the WAV header, write the annotations after the audio data, and sync the file. */
+bool syncFiles() {
+    chunksSinceSync = 0;
+    return updateWAVHeader(audioFile, fileFormat, audioDataSize, encoder ? encoder->framesEncoded() : 0) &&
+           writeWAVCues(audioFile, audioDataSize, annotations, annotationCount) && audioFile.sync();
+}
+
+bool bufferAudio(const uint8_t* data, uint32_t length);
+
+/**
+ * Flush the encoder, write any partial chunk, finalize the WAV header, and close the files. Files
+ * from a previous mount of the card are just closed.
+ */
+void finishFiles() {
+    if (audioFile.isOpen() && filesGeneration == sdMountGeneration()) {
+        if (encoder && encodedChunk) { bufferAudio(encodedChunk, encoder->flush(encodedChunk)); }
+        if (partialChunkLen > 0 && audioFile.write(partialChunk, partialChunkLen) == partialChunkLen) {
+            audioDataSize += partialChunkLen;
+        }
+        audioFile.truncate(WAV_DATA_OFFSET + audioDataSize); // release any unused pre-allocated clusters
+        syncFiles();
+    }
+    partialChunkLen = 0;
+    closeFiles();
+}
+
+/**
+ * Set up the encoder for the next files: switch to the encoding set with setRecordingEncoding()
+ * and make sure there is room for its output.
+ */
+void setupEncoder() {
+    RecordingEncoding encoding = nextEncoding;
+    if ((encoder ? encoder->encoding() : ENCODING_PCM) != encoding) {
+        delete encoder;
+        encoder = create_audio_encoder(encoding);
+    }
+    if (encoder) {
+        encoder->reset();
+        uint32_t size = encoder->maxEncodedSize(FRAMES_PER_CHUNK);
+        if (size > encodedChunkSize) {
+            free(encodedChunk);
+            encodedChunk = (uint8_t*)malloc(size);
+            encodedChunkSize = encodedChunk ? size : 0;
+        }
+        if (!encodedChunk) {
+            Serial.println("!! Failed to allocate the encoder buffer, recording uncompressed audio");
+            delete encoder;
+            encoder = NULL;
+        }
+    }
+    fileFormat = encoder ? encoder->format() : pcmWAVFormat();
+}
+
+/** Finish the current file (if any) and start the next available file */
 bool nextFiles(SdFs* sd) {
-    // Make sure the current files are closed
+    finishFiles();
+
     //int counter = incrementCounter(); // don't want to do this yet (while testing); once we do, remove the line below
     int counter = 0;
 
+    setupEncoder();
+
     sprintf(audioFileName, "/audio_%06d.wav", counter);
-    FsFile audioFile = sd->open(audioFileName, O_WRONLY | O_CREAT);  // TODO: O_EXCL
-    if (!audioFile) { Serial.printf("!! Failed to create file '%s'\n", audioFileName); return false; }
-    if (!startWAVFile(audioFile)) { return false; }
-    audioFile.close();
-    
-    sprintf(timestampFileName, "/timestamps_%06d.txt", counter);
-    FsFile timestampFile = sd->open(timestampFileName, O_WRONLY | O_CREAT);  // TODO: O_EXCL
-    if (!timestampFile) { Serial.printf("!! Failed to create file '%s'\n", timestampFileName); return false; }
-    startTimestamp = millis(); // the time that the timestamps are relative to
-    timestampFile.close();
+    audioFile = sd->open(audioFileName, O_RDWR | O_CREAT | O_TRUNC);  // TODO: O_EXCL
+    if (!audioFile) { Serial.printf("!! Failed to create file '%s'\n", audioFileName); audioFileName[0] = 0; return false; }
+    if (!startWAVFile(audioFile, fileFormat, fileFormat.byteRate * (FRAMES_PER_FILE / getSampleRate()))) { closeFiles(); audioFileName[0] = 0; return false; }
+    audioDataSize = 0;
+    fileFrames = 0;
+    chunksSinceSync = 0;
+    annotationCount = 0;
+    fileStartFrame = writtenFrames; // the frame that the annotations are relative to
 
+    filesGeneration = sdMountGeneration();
     return true;
 }
 
-/** Ensure that the audio and timestamp files are available to write to */
+/**
+ * Reopen the current files after the card has been remounted (e.g. it was removed and reinserted).
+ * The audio file is truncated to the size in its header from the last sync, so anything written
+ * after that is lost but the file stays valid. If the files can't be reopened (e.g. a different
+ * card was inserted), new files are started instead.
+ */
+bool reopenFiles(SdFs* sd) {
+    closeFiles();
+    partialChunkLen = 0; // this would follow data that was lost
+
+    uint32_t dataSize = 0;
+    audioFile = sd->open(audioFileName, O_RDWR);
+    if (!audioFile || !readWAVDataSize(audioFile, dataSize) ||
+        !audioFile.truncate(WAV_DATA_OFFSET + dataSize) || !audioFile.seek(WAV_DATA_OFFSET + dataSize)) {
+        Serial.printf("!! Failed to reopen file '%s', starting new files\n", audioFileName);
+        closeFiles();
+        return nextFiles(sd);
+    }
+    audioDataSize = dataSize;
+    chunksSinceSync = 0;
+
+    filesGeneration = sdMountGeneration();
+    return true;
+}
+
+/** Ensure that the audio file is open and available to write to */
 bool ensureFiles(SdFs* sd) {
-    // If the SD card is not available, clear the file names
+    // If the SD card is not available, close the files but keep the file names so they can be reopened
     if (!sd) {
-        audioFileName[0] = 0;
-        timestampFileName[0] = 0;
+        closeFiles();
         return false;
     }
 
-    // Make sure files are availale
-    return (audioFileName[0] && timestampFileName[0]) || nextFiles(sd);
+    // Make sure files are open on the currently mounted card
+    if (audioFile.isOpen() && filesGeneration == sdMountGeneration()) { return true; }
+    return audioFileName[0] ? reopenFiles(sd) : nextFiles(sd);
 }
 
 /**
- * Write the given audio data to the WAV file on the SD card.
- * The writing flag is set to false when the writing is done.
+ * Write a whole chunk of audio data to the audio file. The file is always at a multiple of
+ * SD_WRITE_CHUNK when this is called, so this writes whole, aligned clusters.
  */
-bool writeWAVData(SdFs* sd, WriteWAVParams *params) {
-    if (!ensureFiles(sd)) { return false; }
+bool writeChunk(const uint8_t* data) {
+    if (audioFile.write(data, SD_WRITE_CHUNK) != SD_WRITE_CHUNK) {
+        Serial.printf("!! Failed to write audio data to '%s'\n", audioFileName);
+        closeFiles(); // reopened on the next write (once the card is remounted)
+        return false;
+    }
+    audioDataSize += SD_WRITE_CHUNK;
+    return true;
+}
 
-    FsFile file = sd->open(audioFileName, O_WRONLY);
-    if (!file) { Serial.printf("!! Failed to open file '%s'\n", audioFileName); return false; }
-    size_t data_size = appendWAVData(file, params->buffer, params->length);
-    file.close();
-    params->writing = false;
-    if (data_size > ONE_HOUR_OF_DATA) { nextFiles(sd); }
-    return data_size > 0;
+/**
+ * Append (encoded) audio data to the open audio file. Only whole chunks are written to the file,
+ * anything left over is copied to the partial chunk to be written later.
+ */
+bool bufferAudio(const uint8_t* data, uint32_t length) {
+    // Finish off the partial chunk first
+    if (partialChunkLen > 0) {
+        uint32_t n = SD_WRITE_CHUNK - partialChunkLen;
+        if (n > length) { n = length; }
+        memcpy(&partialChunk[partialChunkLen], data, n);
+        partialChunkLen += n;
+        data += n;
+        length -= n;
+        if (partialChunkLen < SD_WRITE_CHUNK) { return true; }
+        partialChunkLen = 0;
+        if (!writeChunk(partialChunk)) { return false; }
+    }
+
+    // Write whole chunks directly from the data
+    while (length >= SD_WRITE_CHUNK) {
+        if (!writeChunk(data)) { return false; }
+        data += SD_WRITE_CHUNK;
+        length -= SD_WRITE_CHUNK;
+    }
+
+    // Save the rest for later
+    if (length > 0) {
+        if (!partialChunk && !(partialChunk = (uint8_t*)malloc(SD_WRITE_CHUNK))) {
+            Serial.println("!! Failed to allocate the partial audio chunk");
+            return false;
+        }
+        memcpy(partialChunk, data, length);
+        partialChunkLen = length;
+    }
+    return true;
 }
 
-/** Write the button press and release times to the file. */
-bool writeButtonData(SdFs* sd, ButtonEvent* event) {
+/** Keep an annotation for the current file (relative to the start of the file). */
+void keepAnnotation(WavCue cue) {
+    if (!annotations && !(annotations = (WavCue*)malloc(MAX_ANNOTATIONS_PER_FILE * sizeof(WavCue)))) {
+        Serial.println("!! Failed to allocate the annotations");
+    }
+    if (!annotations || annotationCount >= MAX_ANNOTATIONS_PER_FILE) {
+        if (droppedAnnotations++ == 0) { Serial.println("!! Too many annotations, dropping them"); }
+        return;
+    }
+    // Anything from before the file was started (e.g. while the card was out) goes at the start
+    int32_t frame = (int32_t)(cue.frame - fileStartFrame);
+    if (frame < 0) {
+        cue.length = (uint32_t)-frame < cue.length ? cue.length + frame : 0;
+        frame = 0;
+    }
+    cue.frame = frame;
+    annotations[annotationCount++] = cue;
+}
+
+/**
+ * Move the button events and annotations that happened during audio that has been written to the
+ * annotations of the current file. They are written to it along with the WAV header.
+ */
+void takeAnnotations() {
+    ButtonEvent event;
+    while (buttonEvents.peek(event) && (int32_t)(event.pressFrame - writtenFrames) < 0) {
+        WavCue cue = { event.pressFrame, event.releaseFrame - event.pressFrame, "button" };
+        if ((int32_t)cue.length < 0) { cue.length = 0; }
+        keepAnnotation(cue);
+        buttonEvents.pop();
+    }
+    WavCue cue;
+    while (pendingAnnotations.peek(cue) && (int32_t)(cue.frame - writtenFrames) < 0) {
+        keepAnnotation(cue);
+        pendingAnnotations.pop();
+    }
+}
+
+/**
+ * Write up to a chunk of recorded audio (whole frames), encoding it if the current files are
+ * compressed. New files are started every hour (between writes; the encoder holds on to the frames
+ * of a partial block until the next write or the end of the file).
+ */
+bool writeRecordedAudio(SdFs* sd, const uint8_t* data, uint32_t length) {
     if (!ensureFiles(sd)) { return false; }
+    if (fileFrames >= FRAMES_PER_FILE && !nextFiles(sd)) { return false; }
+
+    const uint32_t frames = length / (REC_CHANNELS * REC_BYTES_PER_SAMPLE);
+    bool ok = encoder ?
+        bufferAudio(encodedChunk, encoder->encode((const int16_t*)data, frames, encodedChunk)) :
+        bufferAudio(data, length);
+    if (!ok) { return false; }
 
-    // Note: technically this could end up writing negative numbers, but then they apply to the previous file
-    // TODO: worse than that, we need the timestamp to be relative to the start of the recording, not the start of the files being open (which could be 100ms off!)
-    FsFile file = sd->open(timestampFileName, O_WRONLY | O_APPEND);
-    if (!file) { Serial.printf("!! Failed to open file '%s'\n", timestampFileName); return false; }
-    bool error = file.printf("%ld %ld\n", event->pressTime - startTimestamp, event->releaseTime - startTimestamp) == 0;
-    if (error) {
-        Serial.printf("!! Error writing button data to file (%ld %ld)\n", file.getWriteError());
+    fileFrames += frames;
+    writtenFrames += frames;
+    takeAnnotations();
+    if (length == SD_WRITE_CHUNK && ++chunksSinceSync >= SYNC_EVERY_N_CHUNKS) { syncFiles(); }
+    return true;
+}
+
+/**
+ * Write the recorded audio waiting in the ring buffer, a chunk at a time, while there is at least
+ * `least` bytes of it. The ring buffer is a multiple of SD_WRITE_CHUNK so chunks only wrap around
+ * after a partial chunk was taken by closeRecording(); then the piece before the end is written on
+ * its own (and bufferAudio() puts the chunks back together).
+ */
+bool writeRecording(SdFs* sd, RingBuffer* ring, uint32_t least) {
+    uint32_t length;
+    const uint8_t* data;
+    while (ring->available() >= least && (data = ring->peek(length))) {
+        if (length > SD_WRITE_CHUNK) { length = SD_WRITE_CHUNK; }
+        if (!writeRecordedAudio(sd, data, length)) { return false; } // leave it for next time
+        ring->release(length);
+    }
+    return true;
+}
+
+/**
+ * Write the recorded audio waiting in the ring buffer to the WAV file on the SD card, one whole
+ * chunk at a time. Uncompressed chunks are written straight from the ring buffer.
+ */
+bool writeRecordingBuffer(SdFs* sd, RingBuffer* ring) {
+    ring->consumerDone(); // anything committed from now on schedules another call
+    return writeRecording(sd, ring, SD_WRITE_CHUNK);
+}
+
+/** Set the encoding for recordings. This takes effect when the next files are started. */
+void setRecordingEncoding(RecordingEncoding encoding) { nextEncoding = encoding; }
+
+/** Get the encoding that the next recording files will use. */
+RecordingEncoding getRecordingEncoding() { return nextEncoding; }
+
+/** Add a button press and release to be written with the audio it happened during. */
+bool IRAM_ATTR addButtonEvent(uint32_t pressFrame, uint32_t releaseFrame) {
+    return buttonEvents.push(ButtonEvent { pressFrame, releaseFrame });
+}
+
+/** Add an annotation to be written with the audio it happened during. */
+bool addAnnotation(uint32_t frame, uint32_t length, const char* label) {
+    WavCue cue = { frame, length, { 0 } };
+    strncpy(cue.label, label, WAV_CUE_LABEL_LEN - 1);
+    portENTER_CRITICAL(&annotationLock);
+    bool ok = pendingAnnotations.push(cue);
+    portEXIT_CRITICAL(&annotationLock);
+    return ok;
+}
+
+/**
+ * Write out the audio left in the ring buffer (down to the last partial chunk) and any buffered
+ * audio data, finalize the WAV header, and close the recording files.
+ */
+bool closeRecording(SdFs* sd, void* params) {
+    RingBuffer* ring = (RingBuffer*)params;
+    if (sd) {
+        if (ring) { writeRecording(sd, ring, 1); }
+        finishFiles();
+    } else {
+        closeFiles();
     }
-    file.close();
-    return !error;
+    audioFileName[0] = 0;
+    return true;
 }
@@ -4,28 +4,61 @@
 #include <stdint.h>
 
 #include "sd.h"
+#include "ring_buffer.hpp"
+#include "audio_encoder.hpp"
+#include "wav.h"
 
 
-typedef struct _WriteWAVParams {
-    uint8_t* buffer;
-    uint32_t length;
-    bool writing; // whether a buffer is currently being written to the SD card
-} WriteWAVParams;
+/**
+ * Write the recorded audio waiting in the ring buffer to the WAV file on the SD card.
+ * Audio is taken from the ring buffer in whole SD_WRITE_CHUNKs (encoded if the files are
+ * compressed, otherwise written directly from the ring buffer), anything left over stays in the
+ * ring buffer for the next call. If writing fails, the data is left in the ring buffer so it can be
+ * retried once the card is available again. This is scheduled by the audio recording task with
+ * RingBuffer::scheduleConsumer().
+ */
+bool writeRecordingBuffer(SdFs* sd, RingBuffer* ring);
 
 /**
- * Write the given audio data to the WAV file on the SD card.
- * The writing flag is set to false when the writing is done.
+ * Set the encoding for recordings (uncompressed, IMA ADPCM, or lossless). This can be called from
+ * any task and takes effect when the next recording files are started (the current files keep
+ * their encoding). The default is ENCODING_PCM.
  */
-bool writeWAVData(SdFs* sd, WriteWAVParams *params);
+void setRecordingEncoding(RecordingEncoding encoding);
+
+/** Get the encoding that the next recording files will use. */
+RecordingEncoding getRecordingEncoding();
 
 
-// Each ButtonEvent represents a button press and release
+// Each ButtonEvent represents a button press and release, as indices of recorded frames (see
+// getRecordingFrame())
 typedef struct _ButtonEvent {
-    unsigned long pressTime;
-    unsigned long releaseTime;
+    uint32_t pressFrame;
+    uint32_t releaseFrame;
 } ButtonEvent;
 
 /**
- * Write the button press and release times to the timestamp file.
+ * Add a button press and release to be saved with the recording. This is constant time and only
+ * queues the event (it is safe to call from an ISR). Once the audio it was pressed during has been
+ * written, the SD card task keeps it with that file, and it is saved in the WAV file as a region
+ * labeled "button" (in a cue chunk after the audio data, rewritten each time the file is synced).
+ * Returns false if the queue is full (the event is dropped).
+ */
+bool IRAM_ATTR addButtonEvent(uint32_t pressFrame, uint32_t releaseFrame);
+
+/**
+ * Add an annotation (e.g. something detected by DUET) to be saved with the recording: a label at a
+ * recorded frame (see getRecordingFrame()) with a length in frames (0 for just a point in time).
+ * Labels longer than WAV_CUE_LABEL_LEN-1 characters are cut off. This can be called from any task
+ * and never waits on the SD card. Like button events, annotations are kept with the file the audio
+ * at their frame is in. Returns false if too many annotations are waiting (it is dropped).
+ */
+bool addAnnotation(uint32_t frame, uint32_t length, const char* label);
+
+/**
+ * Write out the audio waiting in the recording ring buffer given as the params (if not NULL),
+ * including the last partial chunk, and any buffered audio data, then finalize the WAV header and
+ * close the recording files. The next write starts new files. This is an SDCallback, so it can be
+ * submitted to the SD card task with getRecordingBuffer() as its params.
  */
-bool writeButtonData(SdFs* sd, ButtonEvent* event);
+bool closeRecording(SdFs* sd, void* params);
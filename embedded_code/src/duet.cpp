@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <assert.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
@@ -9,11 +10,15 @@
 
 #include <vector>
 #include <algorithm>
+#include <functional>
 
 #include <esp_dsp.h>
+#include <esp_private/esp_clk.h>
+#include <Arduino.h>  // esp_cpu_get_ccount
 
 #include "duet.h"
 #include "mean_shift.hpp"
+#include "duet_scheduler.hpp"
 #include "fast_math.hpp"
 #include "audio.h"
 
@@ -37,11 +42,14 @@ constexpr float P = DUET_P;
 constexpr float Q = DUET_Q;
 #endif
 constexpr float POINT_THRESHOLD = DUET_POINT_THRESHOLD;
+constexpr int MAX_POINTS = DUET_MAX_POINTS;
+constexpr int MAX_POINTS_PER_TIME = DUET_MAX_POINTS_PER_TIME;
 
 // Check parameters
 static_assert((WINDOW_SIZE != 0) && ((WINDOW_SIZE & (WINDOW_SIZE - 1)) == 0), "Window size must be a power of 2");
 static_assert(WINDOW_SIZE >= 8 && WINDOW_SIZE <= 8192, "Window size must be at least 8 and at most 8192");
 static_assert((N_SAMPLES != 0) && (((N_SAMPLES % (WINDOW_SIZE / 2))) == 0), "Number of samples must be a multiple of WINDOW_SIZE/2");
+static_assert(MAX_POINTS >= 0 && MAX_POINTS_PER_TIME >= 0, "Max points must be non-negative (0 for no limit)");
 
 constexpr int WINDOW_SIZE_HALF = WINDOW_SIZE >> 1;
 constexpr int HOP = WINDOW_SIZE_HALF;
@@ -88,13 +96,26 @@ static __attribute__((aligned(16))) float FREQS_POW_Q[N_FREQ]; // pow(fabs(FREQU
 // smaller values result in more aliasing possibly making the audio more artificial sounding.
 // A multiple of 4 has some slight benefits in processing time and memory usage. In scipy, the
 // default is 20*DECIMATION + 1.
-constexpr int DECIMATION = 3; // TODO: REC_SAMPLE_RATE / DUET_SAMPLE_RATE
-constexpr int DECIMATION_FIR_LEN = DECIMATION*20; // Length of the FIR filter for decimation (prefer a multiple of 4, although odd lengths have benefits as well)
-static __attribute__((aligned(16))) float DECIMATION_FIR_COEFFS[(DECIMATION_FIR_LEN + 3) & ~3]; // with DECIMATION_FIR_LEN = 40, this is 0.16 KB of memory
+// The decimation is the input sample rate given to duet_init() over DUET_SAMPLE_RATE, so a lower
+// input rate (e.g. 32 kHz instead of 48 kHz) means a shorter filter and less work per sample.
+constexpr int MAX_DECIMATION = DUET_MAX_DECIMATION;
+static int DECIMATION = 3;
+static int DECIMATION_FIR_LEN = DECIMATION*20; // Length of the FIR filter for decimation (prefer a multiple of 4, although odd lengths have benefits as well)
+static __attribute__((aligned(16))) float DECIMATION_FIR_COEFFS[(MAX_DECIMATION*20 + 3) & ~3]; // with MAX_DECIMATION = 6, this is 0.47 KB of memory
 static __attribute__((aligned(16))) fir_f32_t decimation_filters[N_CHANNELS];
 
 // Number of samples given during each frame (pre-decimation)
-constexpr int AUDIO_FRAME_INIT_SIZE = WINDOW_SIZE_HALF * DECIMATION;
+static int AUDIO_FRAME_INIT_SIZE = WINDOW_SIZE_HALF * DECIMATION;
+
+// Analysis Band
+// Only the frequency bins in [BAND_START, BAND_END) are used to find the sources, see
+// DUET_BAND_LOW_HZ. Bin f is at (f+1) * DT_SAMPLE_RATE / WINDOW_SIZE Hz.
+constexpr int band_start(uint32_t low_hz) { return (int)((low_hz * WINDOW_SIZE + DT_SAMPLE_RATE - 1) / DT_SAMPLE_RATE) - 1; }
+constexpr int band_end(uint32_t high_hz) { return (int)(high_hz * WINDOW_SIZE / DT_SAMPLE_RATE); }
+static_assert(band_start(DUET_BAND_LOW_HZ) < band_end(DUET_BAND_HIGH_HZ) && band_start(DUET_BAND_LOW_HZ) < N_FREQ,
+    "DUET band must contain at least one frequency bin");
+static int BAND_START = band_start(DUET_BAND_LOW_HZ) < 0 ? 0 : band_start(DUET_BAND_LOW_HZ);
+static int BAND_END = band_end(DUET_BAND_HIGH_HZ) > N_FREQ ? N_FREQ : band_end(DUET_BAND_HIGH_HZ);
 
 // Mean Shift Parameters
 // TODO: make some of these configurable with defines
@@ -107,6 +128,7 @@ struct DuetMeanShiftParams: public MeanShiftParams {
     static constexpr float convergence_tol = 0.1f;
     static constexpr int min_count = 3;
     static constexpr int top_n = 20;
+    static constexpr int max_iter = DUET_MAX_ITERATIONS;
 };
 // Mean Shift object for DUET and temporary vectors
 typedef MeanShift<DuetMeanShiftParams> DuetMeanShift;
@@ -114,6 +136,10 @@ static DuetMeanShift mean_shift;
 static std::vector<DuetMeanShift::point_t> ms_points;
 static std::vector<float> ms_weights;
 static std::vector<DuetMeanShift::point_t> ms_centroids;
+static std::vector<float> ms_selection; // copy of the weights for selecting the largest ones
+
+// Keeps each hop within its deadline (the budget is set in duet_init() from the CPU frequency)
+static DuetScheduler scheduler(0);
 
 
 /////////////////////////////
@@ -258,7 +284,7 @@ void OPTIMIZE_FOR_SPEED prep_data(const int16_t * const in, const int n, float*
  * Compute the global FIR coefficients for the decimation filter.
  */
 void init_decimate_fir_coeffs() {
-    constexpr int fir_len_4 = (DECIMATION_FIR_LEN + 3) & ~3;  // round up to the nearest multiple of 4 and zero-pad
+    const int fir_len_4 = (DECIMATION_FIR_LEN + 3) & ~3;  // round up to the nearest multiple of 4 and zero-pad
     compute_fir_coeffs(DECIMATION_FIR_COEFFS, DECIMATION_FIR_LEN, recip(DECIMATION));
     for (int i = DECIMATION_FIR_LEN; i < fir_len_4; i++) { DECIMATION_FIR_COEFFS[i] = 0.0f; }
 }
@@ -278,7 +304,7 @@ int init_decimate_filter(fir_f32_t* fir) {
     // dsps_fird_init_f32 on ESP32-S3 requires:
     //    a multiple of 4 fir length (pad with zeros if necessary)
     //    coeffs and delay line must be aligned to 16 bytes: memalign(16, nbytes) or __attribute__((aligned(16))) for global variables
-    constexpr int fir_len_4 = (DECIMATION_FIR_LEN + 3) & ~3;  // round up to the nearest multiple of 4 and zero-pad
+    const int fir_len_4 = (DECIMATION_FIR_LEN + 3) & ~3;  // round up to the nearest multiple of 4 and zero-pad
     float* delay = (float*)memalign(16, fir_len_4 * sizeof(float));
     if (delay == NULL) { return ESP_ERR_NO_MEM; }
     return dsps_fird_init_f32(fir, DECIMATION_FIR_COEFFS, delay, fir_len_4, DECIMATION);
@@ -520,20 +546,28 @@ void init_freqs_inv() {
  * all time slices). This assumes that the `alpha` and `delta` arrays are
  * already rolled.
  * 
+ * Only the frequency bins in the analysis band are computed. If `tf_weights` is
+ * given, the values are only computed where the weight is above the threshold
+ * (the rest are set to 0) since the other points are never clustered. The
+ * weights must already be computed for the new time slices.
+ * 
  * Requires `init_freqs_inv()` to be called before this function.
  */
 inline void OPTIMIZE_FOR_SPEED compute_atten_and_delay_2(
     const cfloat * const spectrogram, // in, shape (N_FREQ, N_TIME)
     const int new_times,
     float* alpha,                     // out, shape (N_FREQ, N_TIME)
-    float* delta                      // out, shape (N_FREQ, N_TIME)
+    float* delta,                     // out, shape (N_FREQ, N_TIME)
+    const float * const tf_weights,   // in, shape (N_FREQ, N_TIME) or NULL
+    const float threshold
 ) {
     const cfloat * const spec0 = spectrogram;  // 5.011 ms, 0.788 ms        4.950 ms, 0.774 ms
     const cfloat * const spec1 = &spectrogram[N_FREQ_TIME];
     int old_times = N_TIME - new_times;
-    for (int f = 0, i = old_times; f < N_FREQ; f++, i += old_times) {
+    for (int f = BAND_START, i = f*N_TIME + old_times; f < BAND_END; f++, i += old_times) {
         float freq_inv = FREQS_INV[f];
         for (int i_end = i + new_times; i < i_end; i++) {
+            if (tf_weights && tf_weights[i] <= threshold) { alpha[i] = 0; delta[i] = 0; continue; }
             cfloat lr_ratio = (spec1[i] + FLT_EPSILON) / (spec0[i] + FLT_EPSILON);
             // Note: using this instead of the easy formula is actually slower but does at least compute the correct values
             // cfloat lr_ratio; // z1/z2 = (a+ib)/(c+id) = (a*c + b*d + i * (b*c - a*d)) / (c*c + d*d)
@@ -580,17 +614,26 @@ inline void OPTIMIZE_FOR_SPEED compute_atten_and_delay_2(
  * all time slices). This assumes that the `alpha` and `delta` arrays are
  * already rolled.
  * 
+ * If `tf_weights` is given (computed first with `compute_weights()`), only the
+ * points with a weight above the threshold are computed, which skips the
+ * division, arctangent, and square root for the quiet points. Any threshold
+ * later given to `find_peaks()` must be at least this one. Pass NULL to compute
+ * every point.
+ * 
  * Requires `init_freqs_inv()` to be called before this function.
  */
 void OPTIMIZE_FOR_SPEED compute_atten_and_delay(
     const cfloat * const spectrogram, // in, shape (N_CHANNELS, N_FREQ, N_TIME)
     const int new_times,
     float* alpha,                     // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
-    float* delta                      // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
+    float* delta,                     // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
+    const float * const tf_weights,   // in, shape (N_CHANNELS-1, N_FREQ, N_TIME) or NULL
+    const float threshold
 ) {
     for (int i = 0; i < N_CHANNELS-1; i++) {
         compute_atten_and_delay_2(
-            &spectrogram[i*N_FREQ_TIME], new_times, &alpha[i*N_FREQ_TIME], &delta[i*N_FREQ_TIME]
+            &spectrogram[i*N_FREQ_TIME], new_times, &alpha[i*N_FREQ_TIME], &delta[i*N_FREQ_TIME],
+            tf_weights ? &tf_weights[i*N_FREQ_TIME] : NULL, threshold
         );
     }
 }
@@ -616,6 +659,8 @@ void init_freqs_pow_q() {
  *
  * This only computes the values for the newest time slices (pass N_TIME to get
  * all time slices). This assumes that the `tf_weights` array is already rolled.
+ * Only the frequency bins in the analysis band are computed, the others are set
+ * to 0 so they are never clustered.
  * 
  * Uses the global P and Q values to compute the weights. Requires
  * `init_freqs_pow_q()` to be called before this function if Q is non-zero.
@@ -628,8 +673,10 @@ void compute_weights_2(  // NOTE: putting OPTIMIZE_FOR_SPEED on this function ca
     const cfloat * const spec0 = spectrogram;
     const cfloat * const spec1 = &spectrogram[N_FREQ_TIME];
     int old_times = N_TIME - new_times;
-    int i = old_times;
-    for (int f = 0; f < N_FREQ; f++, i += old_times) {
+    for (int f = 0; f < BAND_START; f++) { memset(&tf_weights[f*N_TIME + old_times], 0, new_times * sizeof(float)); }
+    for (int f = BAND_END; f < N_FREQ; f++) { memset(&tf_weights[f*N_TIME + old_times], 0, new_times * sizeof(float)); }
+    int i = BAND_START*N_TIME + old_times;
+    for (int f = BAND_START; f < BAND_END; f++, i += old_times) {
         WITH_NONZERO_Q(float freq_pow_q = FREQS_POW_Q[f]);
         for (int i_end = i + new_times; i < i_end; i++) {
             float tf_weight_val = sqrt_fast(cabs2(spec0[i]) * cabs2(spec1[i]));
@@ -675,13 +722,29 @@ static void init_find_peaks() {
     ms_points.reserve(N_FREQ_TIME/4);
     ms_weights.reserve(N_FREQ_TIME/4);
     ms_centroids.reserve(16);
+    ms_selection.reserve(N_FREQ_TIME/4);
+}
+
+/**
+ * Select the k largest of n values (0 < k < n): keep the values above the
+ * returned cutoff and the first `ties` values equal to it. This reorders the
+ * values. Like largest_k() but with a selection instead of a heap, so it takes
+ * linear time (on average) no matter how large k is.
+ */
+static float select_largest_k(float* values, int n, int k, int* ties) {
+    std::nth_element(values, values + k - 1, values + n, std::greater<float>());
+    const float cutoff = values[k - 1];
+    *ties = k;
+    for (int i = 0; i < k - 1; i++) { if (values[i] > cutoff) { (*ties)--; } }
+    return cutoff;
 }
 
 /**
  * Get the mean-shift points from the spectrogram data.
- * This extracts the points from the spectrogram data that have a weight above
- * the POINT_THRESHOLD. It also checks that the alpha and delta values are
- * within the bounds of ATTENUATION_MAX and DELAY_MAX. The points are stored
+ * This extracts the points in the analysis band that have a weight above
+ * the threshold, keeping only the `max_points_per_time` largest weights in
+ * each time slice (if not 0). It also checks that the alpha and delta values
+ * are within the bounds of ATTENUATION_MAX and DELAY_MAX. The points are stored
  * in the `points` vector and the weights in the `weights` vector.
  */
 static void get_ms_points(
@@ -689,10 +752,29 @@ static void get_ms_points(
     const float * const alpha,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     const float * const delta,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     std::vector<DuetMeanShift::point_t>& points,    // out, length n_pts
-    std::vector<float>& weights                     // out, length n_pts
+    std::vector<float>& weights,                    // out, length n_pts
+    const float threshold,
+    const int max_points_per_time
 ) {
-    for (int i = 0; i < N_FREQ_TIME; i++) {
-        if (tf_weights[i] <= POINT_THRESHOLD) { continue; }
+    // The cutoff for each time slice (and how many weights equal to it to keep)
+    float cutoffs[N_TIME];
+    int ties[N_TIME];
+    for (int t = 0; t < N_TIME; t++) {
+        cutoffs[t] = threshold;
+        ties[t] = 0;
+        if (max_points_per_time <= 0) { continue; }
+        float column[N_FREQ];
+        int n = 0;
+        for (int f = BAND_START; f < BAND_END; f++) {
+            const float w = tf_weights[f*N_TIME + t];
+            if (w > threshold) { column[n++] = w; }
+        }
+        if (n > max_points_per_time) { cutoffs[t] = select_largest_k(column, n, max_points_per_time, &ties[t]); }
+    }
+
+    for (int i = BAND_START*N_TIME; i < BAND_END*N_TIME; i++) {
+        const int t = i % N_TIME;
+        if (tf_weights[i] < cutoffs[t] || (tf_weights[i] == cutoffs[t] && ties[t]-- <= 0)) { continue; }
 
         // NOTE: this alternates alphas and deltas, the original Python code instead places all
         // alphas first and then all deltas. Only changes how mean-shift works, not the results.
@@ -714,28 +796,63 @@ static void get_ms_points(
 }
 
 /**
- * Find the peaks in the spectrogram data.
+ * Keep only the `max_points` points with the largest weights (if not 0),
+ * keeping their order.
+ */
+static void limit_ms_points(
+    std::vector<DuetMeanShift::point_t>& points,    // in/out, length n_pts
+    std::vector<float>& weights,                    // in/out, length n_pts
+    const int max_points
+) {
+    const int n = weights.size();
+    if (max_points <= 0 || n <= max_points) { return; }
+    ms_selection.assign(weights.begin(), weights.end());
+    int ties;
+    const float cutoff = select_largest_k(ms_selection.data(), n, max_points, &ties);
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+        if (weights[i] < cutoff || (weights[i] == cutoff && ties-- <= 0)) { continue; }
+        points[j] = points[i];
+        weights[j] = weights[i];
+        j++;
+    }
+    points.resize(j);
+    weights.resize(j);
+}
+
+/**
+ * Find the peaks in the spectrogram data: cluster the points with a weight
+ * above the threshold with mean-shift, limited to the given number of
+ * iterations for each centroid. Only the points with the largest weights are
+ * clustered: at most `max_points` overall and `max_points_per_time` from each
+ * time slice (0 for no limit). No peaks are output if there are no seeds.
  */
 void find_peaks(
     const float * const tf_weights, // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     const float * const alpha,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     const float * const delta,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     std::vector<float>& alpha_peaks, // out, shape (n_sources, N_CHANNELS-1)
-    std::vector<float>& delta_peaks  // out, shape (n_sources, N_CHANNELS-1)
+    std::vector<float>& delta_peaks, // out, shape (n_sources, N_CHANNELS-1)
+    const float threshold,
+    const int max_iterations,
+    const int max_points,
+    const int max_points_per_time
 ) {
     // clear temporary vectors
     ms_points.clear();
     ms_weights.clear();
     ms_centroids.clear();
 
-    get_ms_points(tf_weights, alpha, delta, ms_points, ms_weights);
-    mean_shift.compute_seeds(ms_points, ms_centroids);
-    if (ms_centroids.empty()) { return; }
-    mean_shift.mean_shift(ms_points, ms_weights, ms_centroids);
-
     // clear the output vectors
     alpha_peaks.clear();
     delta_peaks.clear();
+
+    get_ms_points(tf_weights, alpha, delta, ms_points, ms_weights, threshold, max_points_per_time);
+    limit_ms_points(ms_points, ms_weights, max_points);
+    mean_shift.compute_seeds(ms_points, ms_centroids);
+    if (ms_centroids.empty()) { return; }
+    mean_shift.mean_shift(ms_points, ms_weights, ms_centroids, max_iterations);
+
     alpha_peaks.reserve(ms_centroids.size() * (N_CHANNELS-1));
     delta_peaks.reserve(ms_centroids.size() * (N_CHANNELS-1));
 
@@ -762,9 +879,16 @@ void convert_sym_to_atn(std::vector<float>& atn) {
 /////////////////////////
 ///////// Demix /////////
 /////////////////////////
+/** Mark the frequency bins outside of the analysis band as passed through. */
+static void pass_through_outside_band(uint8_t* best) { // out, shape (N_FREQ, N_TIME)
+    memset(best, DUET_BEST_PASS_THROUGH, BAND_START * N_TIME);
+    memset(&best[BAND_END * N_TIME], DUET_BEST_PASS_THROUGH, (N_FREQ - BAND_END) * N_TIME);
+}
+
 /**
  * Full Demixing when there is only one source. Turns the binaural spectrogram
- * into a monaural one. The demixed output has the DC component skipped.
+ * into a monaural one. The demixed output has the DC component skipped. The
+ * frequency bins outside of the analysis band are left as 0 and passed through.
  */
 void full_demix_1(
     const cfloat * const spectrogram, // in, shape (2, N_FREQ, N_TIME)
@@ -773,7 +897,8 @@ void full_demix_1(
     std::vector<cfloat> &demixed,     // out, shape (1, N_FREQ, N_TIME)
     uint8_t* best                     // out, shape (N_FREQ, N_TIME)
 ) {
-    memset(best, 0, N_FREQ_TIME);  // source 0 is always the best source in this case
+    memset(&best[BAND_START * N_TIME], 0, (BAND_END - BAND_START) * N_TIME);  // source 0 is always the best source in this case
+    pass_through_outside_band(best);
 
     // fill in the rest with the best source
     const cfloat * const spec0 = &spectrogram[0 * N_FREQ_TIME];
@@ -782,7 +907,7 @@ void full_demix_1(
     // precompute denominator
     float denom = recip(1.0 + alpha * alpha);
 
-    for (int f = 0; f < N_FREQ; f++) {
+    for (int f = BAND_START; f < BAND_END; f++) {
         // precompute the core for this frequency (not dependent on time)
         float freq = FREQUENCIES[f];
         cfloat core = alpha * iexp_fast(-delta * freq);
@@ -802,6 +927,10 @@ void full_demix_1(
  * in other computations.
  * 
  * All of steps 5 and 6 of the DUET algorithm are done in this function.
+ * 
+ * Only the frequency bins in the analysis band are demixed. The others are 0 in
+ * every source and their best source is DUET_BEST_PASS_THROUGH so the original
+ * audio is kept there.
  */
 void full_demix(
     const cfloat * const spectrogram, // in, shape (2, N_FREQ, N_TIME)
@@ -812,7 +941,7 @@ void full_demix(
 ) {
     // TODO: support >2 channels
     int n_sources = alpha.size() / (N_CHANNELS-1);
-    assert(n_sources >= 1 && n_sources <= 255);
+    assert(n_sources >= 1 && n_sources < DUET_BEST_PASS_THROUGH);
 
     // fill in all demixed values with zeros (so masked sources are 0)
     demixed.clear();
@@ -832,7 +961,8 @@ void full_demix(
     float denom[n_sources];
     for (int s = 0; s < n_sources; s++) { denom[s] = recip(1.0 + alpha[s] * alpha[s]); }
 
-    for (int f = 0; f < N_FREQ; f++) {
+    pass_through_outside_band(best);
+    for (int f = BAND_START; f < BAND_END; f++) {
         // precompute the core for this frequency (not dependent on time)
         float freq = FREQUENCIES[f];
         cfloat core[n_sources];
@@ -899,7 +1029,7 @@ void zero_out_bad_sources(
     cfloat* spectrogram             // in/out, shape (N_CHANNELS, N_FREQ, N_TIME)
 ) {
     for (int i = 0; i < N_FREQ_TIME; i++) {
-        if (bad[best[i]]) {
+        if (best[i] != DUET_BEST_PASS_THROUGH && bad[best[i]]) {
             for (int c = 0; c < N_CHANNELS; c++) { spectrogram[c*N_FREQ_TIME + i] = 0; }
         }
     }
@@ -953,9 +1083,23 @@ void duet_deinit() {
     deinit_stft_fft();
 }
 
-esp_err_t duet_init() {
+void duet_get_scheduler_stats(DuetSchedulerStats* stats) { scheduler.getStats(stats); }
+
+void duet_get_peaks(std::vector<float>& alpha, std::vector<float>& delta) {
+    alpha = alpha_peaks;
+    delta = delta_peaks;
+}
+
+esp_err_t duet_init(uint32_t input_sample_rate) {
     if (weights) { return ESP_OK; } // already initialized
 
+    // Only exact decimation is supported (so the frequencies of the bins are right)
+    if (input_sample_rate % DT_SAMPLE_RATE != 0 || input_sample_rate / DT_SAMPLE_RATE < 1 ||
+        input_sample_rate / DT_SAMPLE_RATE > MAX_DECIMATION) { return ESP_ERR_INVALID_ARG; }
+    DECIMATION = input_sample_rate / DT_SAMPLE_RATE;
+    DECIMATION_FIR_LEN = DECIMATION*20;
+    AUDIO_FRAME_INIT_SIZE = WINDOW_SIZE_HALF * DECIMATION;
+
     init_decimate_fir_coeffs();
     for (int i = 0; i < N_CHANNELS; i++) {
         esp_err_t err = init_decimate_filter(&decimation_filters[i]);
@@ -970,30 +1114,41 @@ esp_err_t duet_init() {
         init_freqs_pow_q();
     #endif
     init_find_peaks();
+    scheduler.setBudget((uint32_t)((uint64_t)esp_clk_cpu_freq() * WINDOW_SIZE_HALF / DT_SAMPLE_RATE * DUET_BUDGET_PERCENT / 100));
+
+    // Allocate memory for the audio buffer and other arrays (zeroed: the first frames are rolled in
+    // after silence)
+    audio_temp = (float*)calloc(N_CHANNELS * WINDOW_SIZE_HALF * DECIMATION, sizeof(float));
+    audio = (float*)calloc(N_CHANNELS * N_SAMPLES, sizeof(float));
+    spectrogram = (cfloat*)calloc(N_CHANNELS * N_FREQ_TIME, sizeof(cfloat));
+    alpha = (float*)calloc((N_CHANNELS-1) * N_FREQ_TIME, sizeof(float));
+    delta = (float*)calloc((N_CHANNELS-1) * N_FREQ_TIME, sizeof(float));
+    weights = (float*)calloc((N_CHANNELS-1) * N_FREQ_TIME, sizeof(float));
+    best = (uint8_t*)calloc(N_FREQ_TIME, sizeof(uint8_t));
+    if (!audio_temp || !audio || !spectrogram || !alpha || !delta || !weights || !best) {
+        duet_deinit();
+        return ESP_ERR_NO_MEM;
+    }
 
-    // TODO: Temporarily disable this since we are testing
-    // // Allocate memory for the audio buffer and other arrays
-    // audio_temp = (float*)malloc(N_CHANNELS * WINDOW_SIZE_HALF * DECIMATION * sizeof(float));
-    // audio = (float*)malloc(N_CHANNELS * N_SAMPLES * sizeof(float));
-    // spectrogram = (cfloat*)malloc(N_CHANNELS * N_FREQ_TIME * sizeof(cfloat));
-    // alpha = (float*)malloc((N_CHANNELS-1) * N_FREQ_TIME * sizeof(float));
-    // delta = (float*)malloc((N_CHANNELS-1) * N_FREQ_TIME * sizeof(float));
-    // weights = (float*)malloc((N_CHANNELS-1) * N_FREQ_TIME * sizeof(float));
-    // best = (uint8_t*)malloc(N_FREQ_TIME * sizeof(uint8_t));
-    // if (!audio_temp || !audio || !spectrogram || !alpha || !delta || !weights || !best) {
-    //     duet_deinit();
-    //     return ESP_ERR_NO_MEM;
-    // }
-
-    // // Start with 8 sources (they can grow more later)
-    // alpha_peaks.reserve(8*(N_CHANNELS-1));
-    // delta_peaks.reserve(8*(N_CHANNELS-1));
-    // demixed_sources.reserve(8*N_FREQ_TIME);
-    // bad.reserve(8);
+    // Start with 8 sources (they can grow more later)
+    alpha_peaks.reserve(8*(N_CHANNELS-1));
+    delta_peaks.reserve(8*(N_CHANNELS-1));
+    demixed_sources.reserve(8*N_FREQ_TIME);
+    bad.reserve(8);
 
     return ESP_OK;
 }
 
+int duet_decimation() { return DECIMATION; }
+
+esp_err_t duet_set_band(uint32_t low_hz, uint32_t high_hz) {
+    const int start = std::max(band_start(low_hz), 0), end = std::min(band_end(high_hz), N_FREQ);
+    if (start >= end) { return ESP_ERR_INVALID_ARG; }
+    BAND_START = start;
+    BAND_END = end;
+    return ESP_OK;
+}
+
 /**
  * Add the new audio frame to the existing audio buffer and process it with
  * DUET. The new audio frame is interleaved channel data with
@@ -1001,32 +1156,46 @@ esp_err_t duet_init() {
  */
 void process_audio_frame(const int16_t * const frame) {
     // TODO: test with roll, roll2, and roll_with_buffer
+    scheduler.startFrame(esp_cpu_get_ccount());
 
     // De-interleave and normalize the new data
     prep_data(frame, AUDIO_FRAME_INIT_SIZE, audio_temp);
+    scheduler.endStage(STAGE_PREP, esp_cpu_get_ccount());
 
     // Decimate the new data, placing the results at the end of the audio buffer
     roll2(audio, N_CHANNELS*N_SAMPLES, WINDOW_SIZE_HALF);
     decimate(audio_temp, AUDIO_FRAME_INIT_SIZE, audio, N_SAMPLES - WINDOW_SIZE_HALF);
+    scheduler.endStage(STAGE_DECIMATE, esp_cpu_get_ccount());
 
     // Compute the spectrogram for the new audio data
     roll2(spectrogram, N_CHANNELS*N_FREQ_TIME, 1);
     compute_spectrogram(audio, 2, spectrogram);
+    scheduler.endStage(STAGE_SPECTROGRAM, esp_cpu_get_ccount());
 
     // Compute the alpha, delta, and weights for the new spectrogram
     roll2(alpha, (N_CHANNELS-1)*N_FREQ_TIME, 1);
     roll2(delta, (N_CHANNELS-1)*N_FREQ_TIME, 1);
     roll2(weights, (N_CHANNELS-1)*N_FREQ_TIME, 1);
-    compute_atten_and_delay(spectrogram, 2, alpha, delta);
+    // (the weights are first so alpha and delta are only computed for the points that can be clustered)
     compute_weights(spectrogram, 2, weights);
-
-    // Find the peaks in the weights, alpha, and delta (i.e. the sources)
-    find_peaks(weights, alpha, delta, alpha_peaks, delta_peaks);
-    if (alpha_peaks.empty()) { return; } // No peaks found, return early // TODO: output silence or the original audio something
-    convert_sym_to_atn(alpha_peaks);
+    scheduler.endStage(STAGE_WEIGHTS, esp_cpu_get_ccount());
+    compute_atten_and_delay(spectrogram, 2, alpha, delta, weights, POINT_THRESHOLD);
+    scheduler.endStage(STAGE_ATTEN_DELAY, esp_cpu_get_ccount());
+
+    // Find the peaks in the weights, alpha, and delta (i.e. the sources), unless there isn't time
+    // and the last peaks are reused
+    if (scheduler.shouldCluster(esp_cpu_get_ccount(), !alpha_peaks.empty())) {
+        find_peaks(weights, alpha, delta, alpha_peaks, delta_peaks,
+            scheduler.pointThreshold(POINT_THRESHOLD), scheduler.maxIterations(DuetMeanShiftParams::max_iter),
+            scheduler.maxPoints(MAX_POINTS), scheduler.maxPoints(MAX_POINTS_PER_TIME));
+        convert_sym_to_atn(alpha_peaks);
+        scheduler.endStage(STAGE_PEAKS, esp_cpu_get_ccount());
+    }
+    if (alpha_peaks.empty()) { scheduler.endFrame(esp_cpu_get_ccount()); return; } // No peaks found, return early // TODO: output silence or the original audio something
 
     // Compute the demixed sources based on the peaks
     full_demix(spectrogram, alpha_peaks, delta_peaks, demixed_sources, best);
+    scheduler.endStage(STAGE_DEMIX, esp_cpu_get_ccount());
 
     // Check if any of the sources are bad
     if (check_for_bad_sources(demixed_sources, bad)) {
@@ -1040,4 +1209,5 @@ void process_audio_frame(const int16_t * const frame) {
     } else {
         // TODO: output the original audio
     }
+    scheduler.endFrame(esp_cpu_get_ccount());
 }
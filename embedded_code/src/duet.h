@@ -2,6 +2,8 @@
 
 #include <stdint.h>
 #include <complex.h>
+#include <vector>
+#include <esp_err.h>
 typedef float _Complex cfloat; // complex float type for the DUET algorithm
 
 
@@ -49,6 +51,11 @@ typedef float _Complex cfloat; // complex float type for the DUET algorithm
 #define DUET_SAMPLE_RATE 16000 // 16 kHz
 #endif
 
+// Largest ratio of the input sample rate to DUET_SAMPLE_RATE (e.g. 96 kHz to 16 kHz)
+#ifndef DUET_MAX_DECIMATION
+#define DUET_MAX_DECIMATION 6
+#endif
+
 // Size of the STFT Window
 // Must be a power of 2, max of 8192
 // Preferred to be twice a power of 4 (8, 32, 128, 512, 2048, 8192) which will be relatively faster
@@ -87,6 +94,45 @@ typedef float _Complex cfloat; // complex float type for the DUET algorithm
 #define DUET_POINT_THRESHOLD 0.5f
 #endif
 
+// Most points (above the threshold) to cluster in each frame, keeping the ones
+// with the largest weights. This makes the time to find the peaks about the
+// same no matter how loud the input is (and makes a lower threshold affordable).
+// 0 for no limit.
+#ifndef DUET_MAX_POINTS
+#define DUET_MAX_POINTS 384
+#endif
+
+// Most of those points that can come from one time slice, so a single loud
+// slice can't take all of them. 0 for no limit. The default allows a slice
+// twice its share.
+#ifndef DUET_MAX_POINTS_PER_TIME
+#define DUET_MAX_POINTS_PER_TIME (DUET_MAX_POINTS * 2 / DUET_N_TIME)
+#endif
+
+// Most mean-shift iterations for each cluster center, which bounds the time
+// finding the peaks can take (a center that hasn't converged by then is used
+// where it got to).
+#ifndef DUET_MAX_ITERATIONS
+#define DUET_MAX_ITERATIONS 50
+#endif
+
+// The band of frequencies (in Hz) used to find the sources. Only the frequency
+// bins in this band have their weights, attenuation, and delay computed and
+// are clustered, so the time taken scales with the width of the band. The bins
+// outside it are passed through by the demixer (their best source is
+// DUET_BEST_PASS_THROUGH). The low bins have unreliable delay estimates, and
+// the sounds being looked for may only need part of the spectrum. Can be
+// changed with duet_set_band().
+#ifndef DUET_BAND_LOW_HZ
+#define DUET_BAND_LOW_HZ 0
+#endif
+#ifndef DUET_BAND_HIGH_HZ
+#define DUET_BAND_HIGH_HZ (DUET_SAMPLE_RATE / 2)
+#endif
+
+// The best source of the bins outside of the band
+#define DUET_BEST_PASS_THROUGH 0xFF
+
 // Min and max bounds for processing attenuation (alpha) values
 #ifndef ATTENUATION_MAX
 #define ATTENUATION_MAX 3.6f
@@ -105,9 +151,29 @@ typedef float _Complex cfloat; // complex float type for the DUET algorithm
  * DUET algorithm along with allocating memory for the audio buffer and other
  * arrays.
  * 
- * Returns ESP_OK on success, or an error code on failure.
+ * The input sample rate must be an exact multiple of DUET_SAMPLE_RATE (up to
+ * DUET_MAX_DECIMATION times it); the input is decimated by that ratio.
+ * 
+ * Returns ESP_OK on success, ESP_ERR_INVALID_ARG if the input sample rate
+ * can't be decimated exactly, or another error code on failure.
  */
-esp_err_t duet_init();
+esp_err_t duet_init(uint32_t input_sample_rate);
+
+/**
+ * The decimation used for the input (the input sample rate over DUET_SAMPLE_RATE).
+ * Each audio frame has DUET_WINDOW_SIZE_HALF times this many samples per channel.
+ */
+int duet_decimation();
+
+/**
+ * Set the band of frequencies (in Hz) used to find the sources (see
+ * DUET_BAND_LOW_HZ). This should be called from the same task as
+ * process_audio_frame().
+ * 
+ * Returns ESP_OK on success or ESP_ERR_INVALID_ARG if there are no frequency
+ * bins in the band.
+ */
+esp_err_t duet_set_band(uint32_t low_hz, uint32_t high_hz);
 
 /**
  * Deinitializes the Duet audio processing library.
@@ -115,6 +181,27 @@ esp_err_t duet_init();
  */
 void duet_deinit();
 
+/**
+ * Get the statistics of the scheduler that keeps the processing of each frame
+ * within its deadline (see duet_scheduler.hpp): the time of each stage, the
+ * deadline misses, and the changes of the level of processing.
+ */
+struct DuetSchedulerStats;
+void duet_get_scheduler_stats(DuetSchedulerStats* stats);
+
+/**
+ * Add a frame of audio and process it with DUET. The frame is interleaved
+ * stereo with DUET_WINDOW_SIZE_HALF * duet_decimation() samples for each
+ * channel (at the input sample rate given to duet_init()).
+ */
+void process_audio_frame(const int16_t * const frame);
+
+/**
+ * Get the sources found in the last frame that clustered: the attenuation and
+ * the delay of each one.
+ */
+void duet_get_peaks(std::vector<float>& alpha, std::vector<float>& delta);
+
 
 // TODO: remove this and only support the overall function which calls these in the right order
 
@@ -129,20 +216,25 @@ void compute_atten_and_delay(
     const cfloat * const spectrogram, // in, shape (N_CHANNELS, N_FREQ, N_TIME)
     const int new_times,
     float* alpha,                     // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
-    float* delta                      // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
+    float* delta,                     // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
+    const float * const tf_weights = nullptr, // in, shape (N_CHANNELS-1, N_FREQ, N_TIME); only compute points above the threshold
+    const float threshold = DUET_POINT_THRESHOLD
 );
 void compute_weights(
     const cfloat * const spectrogram, // in, shape (N_CHANNELS, N_FREQ, N_TIME)
     const int new_times,
     float* tf_weights                 // out, shape (N_CHANNELS-1, N_FREQ, N_TIME)
 );
-#include <vector>
 void find_peaks(
     const float * const tf_weights, // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     const float * const alpha,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     const float * const delta,      // in, shape (N_CHANNELS-1, N_FREQ, N_TIME)
     std::vector<float>& alpha_peaks, // out, shape (n_sources, N_CHANNELS-1)
-    std::vector<float>& delta_peaks  // out, shape (n_sources, N_CHANNELS-1)
+    std::vector<float>& delta_peaks, // out, shape (n_sources, N_CHANNELS-1)
+    const float threshold = DUET_POINT_THRESHOLD,
+    const int max_iterations = DUET_MAX_ITERATIONS,
+    const int max_points = DUET_MAX_POINTS,
+    const int max_points_per_time = DUET_MAX_POINTS_PER_TIME
 );
 void convert_sym_to_atn(std::vector<float>& atn);
 void full_demix(
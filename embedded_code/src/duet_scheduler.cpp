@@ -0,0 +1,86 @@
+#include "duet_scheduler.hpp"
+
+#include <string.h>
+
+
+/** Move an average 1/8 of the way to a new value. */
+static inline uint32_t average(uint32_t avg, uint32_t value) {
+    return avg == 0 ? value : (uint32_t)((int32_t)avg + ((int32_t)(value - avg) >> 3));
+}
+
+/** Check if a stage is clustering (the one that is skipped at the lower levels). */
+static inline bool isClusteringStage(TelemetryStage stage) { return stage == STAGE_PEAKS; }
+
+
+void DuetScheduler::changeLevel(DuetLevel level) {
+    if (level == current) { return; }
+    current = level;
+    recoverFrames = 0;
+    stats.levelChanges++;
+}
+
+void DuetScheduler::startFrame(uint32_t now) {
+    frameStart = stageStart = now;
+    frameClusteringCycles = 0;
+    clustered = true;
+}
+
+void DuetScheduler::endStage(TelemetryStage stage, uint32_t now) {
+    const uint32_t cycles = now - stageStart;
+    stageStart = now;
+    if (stage >= TELEMETRY_STAGES) { return; }
+    stageAverage[stage] = average(stageAverage[stage], cycles);
+    if (isClusteringStage(stage)) { frameClusteringCycles += cycles; }
+}
+
+bool DuetScheduler::shouldCluster(uint32_t now, bool havePeaks) {
+    if (!havePeaks || framesSinceClustered >= DUET_RECOVER_FRAMES) {
+        // Cluster once in a while anyway to keep its cost up to date (the scene may have changed)
+        clustered = true;
+    } else if (current == DUET_LEVEL_SKIP_CLUSTERING) {
+        clustered = false;
+    } else if (current == DUET_LEVEL_REUSE_PEAKS && clusteredLast) {
+        clustered = false;
+    } else {
+        // Even at the other levels, skip it if it won't fit in what is left of the budget
+        clustered = now - frameStart + clusteringCycles <= budget;
+    }
+    if (clustered) { framesSinceClustered = 0; } else { framesSinceClustered++; stats.skippedClustering++; }
+    return clustered;
+}
+
+void DuetScheduler::endFrame(uint32_t now) {
+    const uint32_t cycles = now - frameStart;
+    stats.frames++;
+    if (cycles > stats.worstCycles) { stats.worstCycles = cycles; }
+    if (clustered) { clusteringCycles = frameClusteringCycles; }
+    clusteredLast = clustered;
+
+    if (cycles > budget) {
+        stats.misses++;
+        if (current + 1 < DUET_LEVELS) { changeLevel((DuetLevel)(current + 1)); }
+        return;
+    }
+
+    // Would this frame have fit comfortably a level up? (clustering every frame instead of none or
+    // every other, or clustering more points, which is estimated as twice the work)
+    if (current == DUET_LEVEL_FULL) { return; }
+    uint32_t projected = cycles;
+    if (!clustered) {
+        projected += clusteringCycles;
+    } else if (current == DUET_LEVEL_FEWER_POINTS) {
+        projected += frameClusteringCycles;
+    }
+    if ((uint64_t)projected * 100 < (uint64_t)budget * DUET_RECOVER_PERCENT) {
+        if (++recoverFrames >= DUET_RECOVER_FRAMES) { changeLevel((DuetLevel)(current - 1)); }
+    } else {
+        recoverFrames = 0;
+    }
+}
+
+void DuetScheduler::getStats(DuetSchedulerStats* stats) const {
+    *stats = this->stats;
+    stats->budgetCycles = budget;
+    stats->level = current;
+    memcpy(stats->stageCycles, stageAverage, sizeof(stageAverage));
+}
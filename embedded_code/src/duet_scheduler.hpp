@@ -0,0 +1,122 @@
+/**
+ * Keeps the DUET processing of each hop within a deadline.
+ *
+ * The time of each stage is tracked (in CPU cycles) against a budget, which is
+ * a fraction of the hop so the audio and SD card tasks still get their time.
+ * Clustering the points into peaks (mean-shift) is the only stage whose cost
+ * depends on the scene, so when a frame goes over the budget the scheduler
+ * steps down a level that does less of it:
+ *
+ *   DUET_LEVEL_FULL             everything every hop
+ *   DUET_LEVEL_FEWER_POINTS     a higher point threshold, half the points, and fewer mean-shift iterations
+ *   DUET_LEVEL_REUSE_PEAKS      cluster every other hop, reusing the last peaks in between
+ *   DUET_LEVEL_SKIP_CLUSTERING  don't cluster, keep using the last peaks
+ *
+ * It steps back up once frames would have fit comfortably at the level above
+ * (using the cost of clustering the last time it ran) for a while. Within a
+ * frame, clustering is also skipped if it wouldn't fit in what is left of the
+ * budget. At any level it still clusters at least once every
+ * DUET_RECOVER_FRAMES frames to keep its cost up to date.
+ *
+ * This only does the bookkeeping; the cycle counts are given to it, so it can
+ * be tested on a computer.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "telemetry.h" // TelemetryStage
+
+// Percent of the hop DUET may use
+#ifndef DUET_BUDGET_PERCENT
+#define DUET_BUDGET_PERCENT 75
+#endif
+
+// Step up a level once this many frames in a row would have been under DUET_RECOVER_PERCENT of the
+// budget at that level
+#define DUET_RECOVER_FRAMES 32
+#define DUET_RECOVER_PERCENT 60
+
+// At DUET_LEVEL_FEWER_POINTS and below: the point threshold is multiplied by this, the max points
+// are halved, and mean-shift is limited to this many iterations for each centroid
+#define DUET_DEGRADED_THRESHOLD_SCALE 2.0f
+#define DUET_DEGRADED_MAX_ITERATIONS 10
+
+/** The levels of processing, from the most to the least work. */
+enum DuetLevel : uint8_t {
+    DUET_LEVEL_FULL,
+    DUET_LEVEL_FEWER_POINTS,
+    DUET_LEVEL_REUSE_PEAKS,
+    DUET_LEVEL_SKIP_CLUSTERING,
+    DUET_LEVELS
+};
+
+/** Statistics of the scheduler. */
+struct DuetSchedulerStats {
+    uint32_t frames;            // frames processed
+    uint32_t misses;            // frames over the budget
+    uint32_t levelChanges;      // times the level changed (either way)
+    uint32_t skippedClustering; // frames that reused the last peaks
+    uint32_t worstCycles;       // longest frame
+    uint32_t budgetCycles;
+    uint32_t stageCycles[TELEMETRY_STAGES]; // average of each stage (over the frames it ran in)
+    DuetLevel level;
+};
+
+class DuetScheduler {
+    uint32_t budget;
+    DuetLevel current = DUET_LEVEL_FULL;
+    uint32_t frameStart = 0, stageStart = 0;
+    uint32_t frameClusteringCycles = 0;     // cycles of the clustering stages in this frame
+    uint32_t recoverFrames = 0;             // frames in a row that would have fit a level up
+    bool clustered = false;                 // whether this frame is clustering
+    bool clusteredLast = false;             // whether the last frame clustered
+    uint32_t framesSinceClustered = 0;
+
+    // Averages in cycles (exponential, 1/8 of the way to each new value)
+    uint32_t stageAverage[TELEMETRY_STAGES] = { 0 };
+    uint32_t clusteringCycles = 0;          // cycles of clustering the last time it ran
+
+    DuetSchedulerStats stats = { };
+
+    void changeLevel(DuetLevel level);
+
+public:
+    /** Create a scheduler with the given budget for each frame. */
+    explicit DuetScheduler(uint32_t budgetCycles) : budget(budgetCycles) { }
+
+    /** Set the budget for each frame in cycles. */
+    void setBudget(uint32_t budgetCycles) { budget = budgetCycles; }
+
+    /** Start a frame at the given cycle count. */
+    void startFrame(uint32_t now);
+
+    /** Finish a stage at the given cycle count (it took the time since the end of the last one). */
+    void endStage(TelemetryStage stage, uint32_t now);
+
+    /**
+     * Decide if this frame clusters the points (or reuses the last peaks) at the given cycle count,
+     * before the clustering stages. Frames with no peaks to reuse always cluster.
+     */
+    bool shouldCluster(uint32_t now, bool havePeaks);
+
+    /** Finish the frame at the given cycle count, counting a miss and changing the level if needed. */
+    void endFrame(uint32_t now);
+
+    /** The point threshold to use at the current level. */
+    float pointThreshold(float threshold) const { return current >= DUET_LEVEL_FEWER_POINTS ? threshold * DUET_DEGRADED_THRESHOLD_SCALE : threshold; }
+
+    /** The most points to cluster (0 for no limit) at the current level. */
+    int maxPoints(int points) const { return current >= DUET_LEVEL_FEWER_POINTS && points > 1 ? points / 2 : points; }
+
+    /** The most mean-shift iterations for each centroid at the current level. */
+    int maxIterations(int iterations) const { return current >= DUET_LEVEL_FEWER_POINTS && iterations > DUET_DEGRADED_MAX_ITERATIONS ? DUET_DEGRADED_MAX_ITERATIONS : iterations; }
+
+    /** The current level. */
+    DuetLevel level() const { return current; }
+
+    /** Get the statistics. */
+    void getStats(DuetSchedulerStats* stats) const;
+};
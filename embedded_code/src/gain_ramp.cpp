@@ -0,0 +1,85 @@
+#include "gain_ramp.hpp"
+#include "audio_mix.h"
+#include "fast_math.hpp"
+
+#include <math.h>
+#include <string.h>
+
+
+GainRamp::GainRamp(uint8_t channels, uint32_t rampFrames, float gain) :
+    channels(channels), rampFrames(rampFrames ? rampFrames : 1), target(gainToQ12(gain)),
+    rampStart(gainToQ12(gain)), rampEnd(gainToQ12(gain)), rampPosition(this->rampFrames) { }
+
+void GainRamp::setGain(float gain) { target.store(gainToQ12(gain), std::memory_order_relaxed); }
+
+void GainRamp::setGainDb(float dB) { setGain(powf(10.0f, dB / 20.0f)); }
+
+void GainRamp::scaleNow(float factor) {
+    const uint16_t now = gainToQ12(gainAt(rampPosition) * factor / GAIN_Q12_ONE);
+    rampStart = rampEnd = now;
+    rampPosition = rampFrames;
+    target.store(now, std::memory_order_relaxed);
+}
+
+float GainRamp::getTarget() const { return (float)target.load(std::memory_order_relaxed) / GAIN_Q12_ONE; }
+
+/** The gain at a position in the current ramp. */
+uint16_t GainRamp::gainAt(uint32_t position) const {
+    if (position >= rampFrames) { return rampEnd; }
+    return (uint16_t)(rampStart + (int64_t)((int32_t)rampEnd - rampStart) * position / rampFrames);
+}
+
+/**
+ * Get the next run of frames (up to the given number) over which the gain is linear, and the gains
+ * at its start and just after its end. This starts a new ramp if the gain was changed.
+ */
+uint32_t GainRamp::nextSegment(uint32_t frames, uint16_t* start, uint16_t* end) {
+    const uint16_t latest = target.load(std::memory_order_relaxed);
+    if (latest != rampEnd) {
+        rampStart = gainAt(rampPosition);
+        rampEnd = latest;
+        rampPosition = 0;
+    }
+    if (rampPosition >= rampFrames) { *start = *end = rampEnd; return frames; }
+    const uint32_t count = frames < rampFrames - rampPosition ? frames : rampFrames - rampPosition;
+    *start = gainAt(rampPosition);
+    rampPosition += count;
+    *end = gainAt(rampPosition);
+    return count;
+}
+
+void OPTIMIZE_FOR_SPEED GainRamp::process(const int16_t* input, int16_t* output, uint32_t frames) {
+    while (frames > 0) {
+        uint16_t start, end;
+        const uint32_t count = nextSegment(frames, &start, &end);
+        const uint32_t samples = count * channels;
+        if (start != end) {
+            rampGainAudio(input, count, channels, start, end, output);
+        } else if (start == GAIN_Q12_ONE) {
+            if (input != output) { memcpy(output, input, samples * sizeof(int16_t)); }
+        } else if (start == 0) {
+            memset(output, 0, samples * sizeof(int16_t));
+        } else {
+            gainAudio(input, samples, start, output);
+        }
+        input += samples;
+        output += samples;
+        frames -= count;
+    }
+}
+
+void OPTIMIZE_FOR_SPEED GainRamp::process(const float* input, float* output, uint32_t frames) {
+    while (frames > 0) {
+        uint16_t start, end;
+        const uint32_t count = nextSegment(frames, &start, &end);
+        const float step = ((float)end - start) / (count * GAIN_Q12_ONE);
+        float gain = (float)start / GAIN_Q12_ONE;
+        for (uint32_t i = 0; i < count; i++) {
+            for (uint8_t ch = 0; ch < channels; ch++) { output[ch] = input[ch] * gain; }
+            input += channels;
+            output += channels;
+            gain += step;
+        }
+        frames -= count;
+    }
+}
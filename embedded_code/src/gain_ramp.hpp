@@ -0,0 +1,68 @@
+/**
+ * A software gain stage that changes smoothly. A new gain is never applied
+ * all at once (which clicks, or "zippers" when the volume is moved through many
+ * small steps): the gain goes linearly from where it is to the new gain over a
+ * ramp of a fixed number of frames, per sample and across block boundaries.
+ *
+ * The gain can be set from any task (e.g. the volume task, or DUET to fade out a
+ * suppressed source) without locking and is picked up by the next block
+ * processed. If the gain changes again before a ramp is done, a new ramp starts
+ * from wherever the gain got to.
+ *
+ * Gains are kept in Q12 (see audio_mix.h), so they are at most 8x and the
+ * resolution is best near 1 (about 0.01 dB at 0 dB, 0.1 dB at -20 dB). Large
+ * attenuations are better done in the codec.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <atomic>
+
+class GainRamp {
+    const uint8_t channels;
+    uint32_t rampFrames;
+
+    std::atomic<uint16_t> target;   // the latest gain set (Q12)
+    uint16_t rampStart, rampEnd;    // the gains at the start and end of the current ramp (Q12)
+    uint32_t rampPosition;          // frames of the current ramp done (rampFrames when not ramping)
+
+    uint16_t gainAt(uint32_t position) const;
+    uint32_t nextSegment(uint32_t frames, uint16_t* start, uint16_t* end);
+
+public:
+    /** Create a gain stage for interleaved audio that starts at the given gain. */
+    GainRamp(uint8_t channels, uint32_t rampFrames, float gain = 1.0f);
+
+    /** Set the length of the ramps in frames (only call from the task that processes the audio). */
+    void setRampFrames(uint32_t frames) { rampFrames = frames ? frames : 1; }
+
+    /** Ramp to a new linear gain (0 to 8). This can be called from any task. */
+    void setGain(float gain);
+
+    /** Ramp to a new gain in dB. This can be called from any task. */
+    void setGainDb(float dB);
+
+    /**
+     * Multiply the gain at once, without a ramp, from the next frame processed (e.g. to make up for
+     * a step in the codec's volume). Any ramp underway stops there, so set the gain again to carry
+     * on. Only call this from the task that processes the audio, when no other task sets the gain.
+     */
+    void scaleNow(float factor);
+
+    /** The gain that was last set (it may still be ramping to it). */
+    float getTarget() const;
+
+    /** Check if the gain is still changing. */
+    bool isRamping() const { return rampPosition < rampFrames || rampEnd != target.load(std::memory_order_relaxed); }
+
+    /**
+     * Apply the gain to a block of interleaved frames. The output may be the same as the input (a
+     * gain of exactly 1 that isn't ramping then costs nothing).
+     */
+    void process(const int16_t* input, int16_t* output, uint32_t frames);
+
+    /** Apply the gain to a block of interleaved float frames (e.g. DUET's output). */
+    void process(const float* input, float* output, uint32_t frames);
+};
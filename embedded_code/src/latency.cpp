@@ -0,0 +1,201 @@
+#include "latency.h"
+#include "audio.h"
+#include "duet.h" // DUET_SAMPLE_RATE, DUET_WINDOW_SIZE
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+// The chirp goes from LATENCY_CHIRP_LOW_HZ up to LATENCY_CHIRP_HIGH_HZ (or 40% of the sample rate)
+#define LATENCY_CHIRP_LOW_HZ 1000
+#define LATENCY_CHIRP_HIGH_HZ 8000
+#define LATENCY_CHIRP_AMPLITUDE 0.5f
+#define LATENCY_IMPULSE_AMPLITUDE 0.9f
+
+/** What the audio task is doing with the probe. */
+enum LatencyState : uint8_t {
+    LATENCY_IDLE,       // not measuring
+    LATENCY_WAITING,    // playing silence until the next probe
+    LATENCY_CAPTURING,  // playing the probe and capturing the input after it
+    LATENCY_CAPTURED,   // the input has been captured, waiting for latencyProcess()
+};
+
+// Set by setupLatency() and startLatency() (before the audio task uses them)
+static uint32_t sampleRate = 0, blockFrames = 0, outputQueueFrames = 0;
+static int16_t* probe = NULL;
+static uint32_t probeFrames = 0;
+static int16_t* capture = NULL; // channel 0 of the input starting at the frame the probe was played at
+static uint32_t captureFrames = 0;
+
+static std::atomic<bool> running(false);
+static std::atomic<uint8_t> state(LATENCY_IDLE);
+static std::atomic<uint32_t> duetUs(0);
+
+// Only used by the audio task: the frames recorded and played so far (they wrap around, so only
+// differences are used), when the next probe starts, where the current one started, and how much of
+// it has been played and of the input after it captured
+static uint32_t inputFrames = 0, outputFrames = 0;
+static uint32_t nextProbe = 0, probeStart = 0, probePlayed = 0, captured = 0;
+
+// Only used by latencyProcess()
+static uint32_t measurements = 0, missed = 0;
+
+
+void setupLatency(uint32_t sampleRate_, uint32_t blockFrames_, uint32_t outputQueueFrames_) {
+    sampleRate = sampleRate_;
+    blockFrames = blockFrames_;
+    outputQueueFrames = outputQueueFrames_;
+}
+
+/** Make the probe: a Hann-windowed linear chirp or a single impulse. */
+static void makeProbe(LatencyProbe type) {
+    if (type == LATENCY_IMPULSE) {
+        probeFrames = 1;
+        probe[0] = (int16_t)(LATENCY_IMPULSE_AMPLITUDE * 32767);
+        return;
+    }
+    probeFrames = LATENCY_PROBE_FRAMES;
+    const float high = LATENCY_CHIRP_HIGH_HZ < 0.4f * sampleRate ? LATENCY_CHIRP_HIGH_HZ : 0.4f * sampleRate;
+    const float duration = (float)probeFrames / sampleRate;
+    for (uint32_t i = 0; i < probeFrames; i++) {
+        const float t = (float)i / sampleRate;
+        const float phase = 2.0f * (float)M_PI * (LATENCY_CHIRP_LOW_HZ * t + (high - LATENCY_CHIRP_LOW_HZ) * t * t / (2 * duration));
+        const float window = 0.5f - 0.5f * cosf(2.0f * (float)M_PI * i / (probeFrames - 1));
+        probe[i] = (int16_t)(LATENCY_CHIRP_AMPLITUDE * 32767 * window * sinf(phase));
+    }
+}
+
+bool startLatency(LatencyProbe type) {
+    if (!sampleRate) { printf("!! Latency measurement not set up\n"); return false; }
+    stopLatency();
+    while (state.load(std::memory_order_acquire) != LATENCY_IDLE) { vTaskDelay(1); } // wait for the audio task to stop using the buffers
+
+    const uint32_t frames = (uint32_t)((uint64_t)LATENCY_MAX_MS * sampleRate / 1000) + LATENCY_PROBE_FRAMES;
+    if (frames != captureFrames) {
+        free(capture);
+        capture = (int16_t*)malloc(frames * sizeof(int16_t));
+        captureFrames = capture ? frames : 0;
+    }
+    if (!probe) { probe = (int16_t*)malloc(LATENCY_PROBE_FRAMES * sizeof(int16_t)); }
+    if (!capture || !probe) { printf("!! Failed to allocate the latency buffers\n"); return false; }
+    makeProbe(type);
+    running.store(true, std::memory_order_release);
+    return true;
+}
+
+void stopLatency() { running.store(false, std::memory_order_release); }
+
+bool isLatencyRunning() { return running.load(std::memory_order_relaxed); }
+
+void latencyDuetCompute(uint32_t us) { duetUs.store(us, std::memory_order_relaxed); }
+
+
+///// Audio Task /////
+
+void latencyInput(const int16_t* samples, uint32_t frames) {
+    if (state.load(std::memory_order_relaxed) == LATENCY_CAPTURING) {
+        // The part of the block in the capture window (which starts where the probe was played)
+        uint32_t offset = 0;
+        if ((int32_t)(inputFrames - probeStart) < (int32_t)captured) { offset = probeStart + captured - inputFrames; }
+        for (uint32_t i = offset; i < frames && captured < captureFrames; i++) { capture[captured++] = samples[i * REC_CHANNELS]; }
+        if (captured == captureFrames) {
+            nextProbe = probeStart + (uint32_t)((uint64_t)LATENCY_PERIOD_MS * sampleRate / 1000);
+            state.store(LATENCY_CAPTURED, std::memory_order_release);
+        }
+    }
+    inputFrames += frames;
+}
+
+void latencyOutput(int16_t* samples, uint32_t frames) {
+    uint8_t current = state.load(std::memory_order_acquire);
+    if (!running.load(std::memory_order_acquire)) {
+        if (current != LATENCY_IDLE) { state.store(LATENCY_IDLE, std::memory_order_release); }
+        outputFrames += frames;
+        return;
+    }
+    if (current == LATENCY_IDLE) {
+        nextProbe = outputFrames + frames; // start with the next block
+        current = LATENCY_WAITING;
+        state.store(current, std::memory_order_relaxed);
+    }
+
+    // Only the probe is played while measuring so nothing else is mistaken for it
+    memset(samples, 0, frames * PLAY_CHANNELS * sizeof(int16_t));
+    if (current == LATENCY_WAITING && (int32_t)(nextProbe - outputFrames) < (int32_t)frames) {
+        probeStart = (int32_t)(nextProbe - outputFrames) < 0 ? outputFrames : nextProbe;
+        probePlayed = 0;
+        // The input up to the end of this block was already captured (it can't have the probe in it)
+        captured = (int32_t)(inputFrames - probeStart) > 0 ? inputFrames - probeStart : 0;
+        memset(capture, 0, captured * sizeof(int16_t));
+        current = LATENCY_CAPTURING;
+        state.store(current, std::memory_order_relaxed);
+    }
+    if (current == LATENCY_CAPTURING && probePlayed < probeFrames) {
+        uint32_t i = probePlayed == 0 ? probeStart - outputFrames : 0;
+        for (; i < frames && probePlayed < probeFrames; i++, probePlayed++) {
+            for (int ch = 0; ch < PLAY_CHANNELS; ch++) { samples[i * PLAY_CHANNELS + ch] = probe[probePlayed]; }
+        }
+    }
+    outputFrames += frames;
+}
+
+
+///// Processing /////
+
+bool latencyProcess(LatencyReport* report) {
+    if (state.load(std::memory_order_acquire) != LATENCY_CAPTURED) { return false; }
+
+    // Cross-correlate the probe with the capture, normalized by the energy of both (so a clean copy of
+    // the probe at any level is 1 and noise is close to 0)
+    float probeEnergy = 0, captureEnergy = 0;
+    for (uint32_t i = 0; i < probeFrames; i++) { probeEnergy += (float)probe[i] * probe[i]; }
+    for (uint32_t i = 0; i < captureFrames; i++) { captureEnergy += (float)capture[i] * capture[i]; }
+    float best = 0;
+    uint32_t lag = 0;
+    for (uint32_t l = 0; l + probeFrames <= captureFrames; l++) {
+        float c = 0;
+        for (uint32_t i = 0; i < probeFrames; i++) { c += (float)probe[i] * capture[l + i]; }
+        if (fabsf(c) > best) { best = fabsf(c); lag = l; }
+    }
+    const float correlation = captureEnergy > 0 ? best / sqrtf(probeEnergy * captureEnergy) : 0;
+
+    // Capture the next probe
+    uint8_t expected = LATENCY_CAPTURED;
+    state.compare_exchange_strong(expected, LATENCY_WAITING, std::memory_order_acq_rel);
+
+    if (correlation < LATENCY_MIN_CORRELATION) {
+        missed++;
+        printf("!! Latency probe not found (best correlation %.2f)\n", correlation);
+        return false;
+    }
+
+    const float msPerFrame = 1000.0f / sampleRate;
+    report->measurements = ++measurements;
+    report->missed = missed;
+    report->roundTripFrames = lag;
+    report->correlation = correlation;
+    report->roundTripMs = lag * msPerFrame;
+    report->blockMs = blockFrames * msPerFrame;
+    report->outputQueueMs = outputQueueFrames * msPerFrame;
+    report->convertersMs = report->roundTripMs - report->blockMs - report->outputQueueMs;
+    report->hopMs = DUET_WINDOW_SIZE_HALF * 1000.0f / DUET_SAMPLE_RATE;
+    report->windowMs = DUET_WINDOW_SIZE * 1000.0f / DUET_SAMPLE_RATE;
+    report->duetComputeMs = duetUs.load(std::memory_order_relaxed) / 1000.0f;
+    report->totalMs = report->roundTripMs + report->hopMs + report->windowMs + report->duetComputeMs;
+    return true;
+}
+
+void printLatencyReport(const LatencyReport* report) {
+    printf("Latency: %.2f ms round trip (%u frames, correlation %.2f, %u measured, %u missed)\n",
+        report->roundTripMs, (unsigned)report->roundTripFrames, report->correlation,
+        (unsigned)report->measurements, (unsigned)report->missed);
+    printf("  block %.2f ms + output DMA %.2f ms + converters and input DMA %.2f ms\n",
+        report->blockMs, report->outputQueueMs, report->convertersMs);
+    printf("  with DUET: + hop %.2f ms + window %.2f ms + compute %.2f ms = %.2f ms\n",
+        report->hopMs, report->windowMs, report->duetComputeMs, report->totalMs);
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+// Measures the end-to-end latency of the audio path with a loopback: a probe (a short chirp or an
+// impulse) is played instead of the output, and the recorded input is cross-correlated with it to
+// find when it came back. This needs a cable from the codec's output to its input, or the virtual
+// bus's simulated loopback (see configureVirtualLoopback()).
+//
+// The round trip counted in frames is the same as the latency of the live audio from the ADC to the
+// DAC: the block the audio task waits to fill, the output queued in the I2S DMA buffers, and the rest
+// (the codec's converters and filters, the cable, and the input waiting in the DMA buffers). DUET's
+// output would also wait for its hop and window and the time to compute it, which are added on to
+// give the total.
+//
+// The audio task calls latencyInput() and latencyOutput() for every block (which only copy samples)
+// and the correlation is done by latencyProcess() in another task.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Length of the chirp probe (the impulse is a single frame)
+#define LATENCY_PROBE_FRAMES 256
+
+// Longest round trip that can be measured (the input is captured for this long after each probe)
+#define LATENCY_MAX_MS 250
+
+// Time between probes
+#define LATENCY_PERIOD_MS 1000
+
+// The smallest normalized correlation that counts as finding the probe (0 to 1)
+#define LATENCY_MIN_CORRELATION 0.3f
+
+/** The probes that can be played. */
+typedef enum _LatencyProbe : uint8_t {
+    LATENCY_CHIRP,      // a windowed linear chirp, easy to find even in noise
+    LATENCY_IMPULSE,    // a single loud sample, shows the impulse response directly
+} LatencyProbe;
+
+/** The result of a measurement. All times are in milliseconds. */
+typedef struct _LatencyReport {
+    uint32_t measurements;  // probes found so far
+    uint32_t missed;        // probes not found (no cable, too quiet, or too late)
+    uint32_t roundTripFrames;
+    float correlation;      // normalized correlation of the probe with the input where it was found
+
+    float roundTripMs;      // ADC to DAC latency of the live audio
+    float blockMs;          // the block the audio task waits to fill before processing it
+    float outputQueueMs;    // output queued in the DMA buffers
+    float convertersMs;     // the rest of the round trip: converters, cable, and input DMA buffers
+
+    float hopMs;            // DUET: time between updates
+    float windowMs;         // DUET: the window of audio each update needs
+    float duetComputeMs;    // DUET: time to compute an update (from latencyDuetCompute())
+    float totalMs;          // round trip with DUET processing
+} LatencyReport;
+
+/**
+ * Set the sample rate, the frames in each block of the audio task, and the frames of output the I2S
+ * driver queues. Called by setupAudio().
+ */
+void setupLatency(uint32_t sampleRate, uint32_t blockFrames, uint32_t outputQueueFrames);
+
+/** Start playing probes and measuring the latency. Returns false if the buffers can't be allocated. */
+bool startLatency(LatencyProbe probe);
+
+/** Stop measuring (the audio goes back to normal with the next block). */
+void stopLatency();
+
+/** Check if the latency is being measured. */
+bool isLatencyRunning();
+
+/** Add a block of interleaved recorded frames. Only called from the audio task. */
+void latencyInput(const int16_t* samples, uint32_t frames);
+
+/**
+ * Replace a block of interleaved frames to be played with the probe (or silence between probes)
+ * while measuring. Only called from the audio task, after latencyInput() for the same block.
+ */
+void latencyOutput(int16_t* samples, uint32_t frames);
+
+/** Report the time DUET took to compute an update. */
+void latencyDuetCompute(uint32_t us);
+
+/**
+ * Find the last probe in the input if it has all been captured. Returns true (and the report) if a
+ * new measurement was made. This is slow (a cross-correlation) so don't call it from the audio task.
+ */
+bool latencyProcess(LatencyReport* report);
+
+/** Print a report. */
+void printLatencyReport(const LatencyReport* report);
@@ -9,6 +9,10 @@
 #include "button.h"
 
 #include "duet.h" // DUET algorithm
+#include "telemetry.h"
+#include "benchmarks.h"
+#include "signal_gen.hpp"
+#include "latency.h"
 
 #include <driver/gpio.h>
 
@@ -21,8 +25,16 @@
 #include "clock_signal.hpp"
 
 #include "test.h"
+#define TEST_SAMPLE_RATE 48000 // the test data is recorded at 48 kHz (3 times DUET_SAMPLE_RATE)
 char buffer[256];
 
+// Report the time of a DUET stage (between start and end)
+#if TELEMETRY
+#define REPORT_STAGE(stage, name) telemetryStageTime(stage, (end - start) / (uint32_t)(CPU_FREQ / 1000))
+#else
+#define REPORT_STAGE(stage, name) printf("DUET " name " took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ)
+#endif
+
 //static_assert(n_samples == DUET_N_SAMPLES, "n_samples must be equal to DUET_N_SAMPLES");
 //float decimated[2 * DUET_N_SAMPLES / 2];
 
@@ -54,13 +66,12 @@ void dump(const char* name, const float* data, int n, const char* shape) { dump(
 void dump(const char* name, const std::vector<float>& data, const char* shape) { dump(Serial, name, data, shape); }
 void dump(const char* name, const uint8_t* data, int n, const char* shape) { dump(Serial, name, data, n, shape); }
 
-SemaphoreHandle_t sd_semaphore = NULL;
 char dump_filename[128] = "/duet/dump.py";
 
 void prepare_for_sd() {
     if (!setupSD()) { while (true); }
-    sd_semaphore = xSemaphoreCreateBinary();
-    submitSDTask([](SdFs* sd, void* params) {
+    // dumps are on the same lane so they are written after the filename is chosen
+    submitSDTask(SD_LANE_DUMP, [](SdFs* sd, void* params) {
         if (sd == nullptr) { printf("SD Task: sd is null\n"); return false; }
         if (!sd->exists("/duet")) { sd->mkdir("/duet"); }
         for (int i = 0; i < 10000; i++) {
@@ -68,31 +79,48 @@ void prepare_for_sd() {
             if (!sd->exists(dump_filename)) break;
         }
         printf("Dump filename: %s\n", dump_filename);
-        xSemaphoreGive(sd_semaphore);
         return true;
     }, nullptr);
-    xSemaphoreTake(sd_semaphore, portMAX_DELAY);
 }
 
-typedef struct {
-    const char* name;
-    const void* data;
-    int n;
-    const char* shape;
-} SDDumpParams;
+/**
+ * Prints into SD card pool buffers, handing each one over to be appended to the dump file when it
+ * is full. This only waits if all of the buffers are in use. If the dump lane is full a buffer is
+ * dropped, which is reported once the dump is done (the dump file is then incomplete).
+ */
+class SDDumpPrint : public Print {
+    SDBuffer* buffer = nullptr;
+    uint32_t dropped = 0; // bytes that could not be handed over to the SD card task
+    void submit() {
+        if (!buffer) { return; }
+        uint32_t length = buffer->length; // the buffer is back in the pool if it is dropped
+        if (submitSDBuffer(SD_LANE_DUMP, buffer, dump_filename) == SD_HANDLE_NONE) { dropped += length; }
+        buffer = nullptr;
+    }
+public:
+    ~SDDumpPrint() {
+        submit();
+        if (dropped) { printf("!! Dropped %u bytes of the dump to %s (SD card queue full)\n", dropped, dump_filename); }
+    }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t* data, size_t size) override {
+        size_t written = 0;
+        while (written < size) {
+            if (!buffer && !(buffer = acquireSDBuffer(portMAX_DELAY))) { break; }
+            size_t n = SD_BUFFER_SIZE - buffer->length;
+            if (n > size - written) { n = size - written; }
+            memcpy(&buffer->data[buffer->length], &data[written], n);
+            buffer->length += n;
+            written += n;
+            if (buffer->length == SD_BUFFER_SIZE) { submit(); }
+        }
+        return written;
+    }
+};
+
 void dump_to_sd(const char* name, const float* data, int n, const char* shape) {
-    SDDumpParams params = { name, data, n, shape };
-    submitSDTask([](SdFs* sd, void* params) {
-        SDDumpParams* p = (SDDumpParams*)params;
-        if (sd == nullptr) { printf("SD Task: sd is null\n"); return false; }
-        FsFile file = sd->open(dump_filename, O_WRONLY | O_CREAT | O_APPEND);
-        if (!file) { printf("Failed to open file for writing\n"); return false; }
-        dump(file, p->name, (const float*)p->data, p->n, p->shape);
-        file.close();
-        xSemaphoreGive(sd_semaphore);
-        return true;
-    }, &params);
-    xSemaphoreTake(sd_semaphore, portMAX_DELAY);
+    SDDumpPrint p;
+    dump(p, name, data, n, shape);
 }
 void dump_to_sd(const char* name, const std::vector<float>& data, const char* shape) {
     dump_to_sd(name, data.data(), data.size(), shape);
@@ -101,18 +129,8 @@ void dump_to_sd(const char* name, const std::vector<cfloat>& data, const char* s
     dump_to_sd(name, (float*)data.data(), data.size()*2, shape);
 }
 void dump_to_sd(const char* name, const uint8_t* data, int n, const char* shape) {
-    SDDumpParams params = { name, data, n, shape };
-    submitSDTask([](SdFs* sd, void* params) {
-        SDDumpParams* p = (SDDumpParams*)params;
-        if (sd == nullptr) { printf("SD Task: sd is null\n"); return false; }
-        FsFile file = sd->open(dump_filename, O_WRONLY | O_CREAT | O_APPEND);
-        if (!file) { printf("Failed to open file for writing\n"); return false; }
-        dump(file, p->name, (const uint8_t*)p->data, p->n, p->shape);
-        file.close();
-        xSemaphoreGive(sd_semaphore);
-        return true;
-    }, &params);
-    xSemaphoreTake(sd_semaphore, portMAX_DELAY);
+    SDDumpPrint p;
+    dump(p, name, data, n, shape);
 }
 
 
@@ -159,6 +177,20 @@ template <typename T> static void roll2(
     roll2(data, shape * data_len, new_len);
 }
 
+#if LATENCY_TEST
+/**
+ * Print a report whenever a latency probe has come back. This runs forever, checking several times
+ * per probe (the cross-correlation is too slow for the audio task).
+ */
+static void latencyReportTask(void* pvParameters) {
+    while (true) {
+        LatencyReport report;
+        if (latencyProcess(&report)) { printLatencyReport(&report); }
+        vTaskDelay(pdMS_TO_TICKS(LATENCY_PERIOD_MS / 10));
+    }
+}
+#endif
+
 void setup() {
     gpio_config_t led_conf = {
         .pin_bit_mask = (1ULL << DEBUG_LED_PIN),
@@ -177,15 +209,33 @@ void setup() {
     bootloader_random_disable();
 
     print_config();
+    #if BENCHMARKS
+    benchmarkMixing();
+    benchmarkFilters();
+    benchmarkSignals();
+    #endif
     esp_cpu_ccount_t start, end, diff, total = 0;
 
     prepare_for_sd();
 
+    #if LATENCY_TEST
+    // Measure the latency of the live audio while the DUET test below runs (which reports how long
+    // each update takes); the played audio is replaced with probes
+    if (!Wire.begin()) { printf("!! I2C communication failed\n"); while (true); }
+    if (!setupAudio()) { while (true); }
+    if (!startLatency(LATENCY_CHIRP)) { while (true); }
+    // The same priority as the loop task (running the DUET test) so the reports aren't held up until it is done
+    if (xTaskCreate(latencyReportTask, "LatencyReport", 4096, NULL, 1, NULL) != pdPASS) {
+        printf("!! Failed to create the latency report task\n");
+        abort();
+    }
+    #endif
+
     printf("Amount of audio: %f ms\n", n_samples * 1000.0 / DUET_SAMPLE_RATE);
     printf("Update size: %f ms\n", DUET_WINDOW_SIZE * 1000.0 / DUET_SAMPLE_RATE);
 
     start = esp_cpu_get_ccount();
-    if (duet_init() != ESP_OK) { printf("DUET init failed\n"); return; }
+    if (duet_init(TEST_SAMPLE_RATE) != ESP_OK) { printf("DUET init failed\n"); return; }
     end = esp_cpu_get_ccount();
     printf("DUET init took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
     print_mem_info();
@@ -212,14 +262,15 @@ void setup() {
 
 
     for (int i = 0; i < n_chunks; i++) {
-        printf("***** Processing chunk %d / %d *****\n", i+1, n_chunks);
+        if (!TELEMETRY) { printf("***** Processing chunk %d / %d *****\n", i+1, n_chunks); }
         const int16_t* chunk = audio_data[i];
+        const esp_cpu_ccount_t chunkStart = total;
 
         start = esp_cpu_get_ccount();
         prep_data(chunk, n_samples, audio_temp);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET prep took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_PREP, "prep");
         //dump_to_sd("audio", audio, 2 * n_samples, "(2, -1)");
         //print_mem_info();
 
@@ -227,26 +278,26 @@ void setup() {
         roll(audio, REC_CHANNELS, DUET_N_SAMPLES, DUET_WINDOW_SIZE_HALF, 0);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET roll took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_OTHER, "roll");
 
         start = esp_cpu_get_ccount();
         decimate(audio_temp, n_samples, audio, DUET_N_SAMPLES - DUET_WINDOW_SIZE_HALF);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET decimate took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_DECIMATE, "decimate");
         //print_mem_info();
 
         start = esp_cpu_get_ccount();
         roll(spectrogram, REC_CHANNELS*DUET_N_FREQ, DUET_N_TIME, 1, 1);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET roll took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_OTHER, "roll");
 
         start = esp_cpu_get_ccount();
         compute_spectrogram(audio, 2, spectrogram);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET spectrogram took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_SPECTROGRAM, "spectrogram");
         //dump_to_sd("spectrogram", (float*)spectrogram, 2 * DUET_N_TIME * DUET_N_FREQ * 2, "(2, 128, -1, 2)");
         //print_mem_info();
 
@@ -256,43 +307,47 @@ void setup() {
         roll(weights, DUET_N_FREQ, DUET_N_TIME, 1, 1);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET roll took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_OTHER, "roll");
 
         start = esp_cpu_get_ccount();
-        compute_atten_and_delay(spectrogram, 2, alpha, delta);
+        compute_weights(spectrogram, 2, weights);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET compute atten and delay took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
-        // dump_to_sd("alpha", alpha, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
-        // dump_to_sd("delta", delta, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
+        REPORT_STAGE(STAGE_WEIGHTS, "compute weights");
+        // dump_to_sd("weights", weights, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
         // print_mem_info();
 
         start = esp_cpu_get_ccount();
-        compute_weights(spectrogram, 2, weights);
+        compute_atten_and_delay(spectrogram, 2, alpha, delta, weights);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET compute weights took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
-        // dump_to_sd("weights", weights, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
+        REPORT_STAGE(STAGE_ATTEN_DELAY, "compute atten and delay");
+        // dump_to_sd("alpha", alpha, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
+        // dump_to_sd("delta", delta, DUET_N_TIME * DUET_N_FREQ, "(128, -1)");
         // print_mem_info();
 
         start = esp_cpu_get_ccount();
         find_peaks(weights, alpha, delta, alpha_peaks, delta_peaks);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET find_peaks took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_PEAKS, "find_peaks");
         // dump("alpha_peaks", alpha_peaks, itoa(alpha_peaks.size(), buffer, 10));
         // dump_to_sd("alpha_peaks", alpha_peaks, itoa(alpha_peaks.size(), buffer, 10));
         // dump("delta_peaks", delta_peaks, itoa(delta_peaks.size(), buffer, 10));
         // dump_to_sd("delta_peaks", delta_peaks, itoa(delta_peaks.size(), buffer, 10));
         // print_mem_info();
 
-        if (alpha_peaks.empty()) { printf("No peaks found, skipping demix\n"); continue; } // No peaks found, skip demix
+        if (TELEMETRY) { telemetryPeaks(alpha_peaks.data(), delta_peaks.data(), alpha_peaks.size()); }
+        if (alpha_peaks.empty()) { // No peaks found, skip demix
+            if (TELEMETRY) { telemetryEndFrame(); } else { printf("No peaks found, skipping demix\n"); }
+            continue;
+        }
 
         start = esp_cpu_get_ccount();
         convert_sym_to_atn(alpha_peaks);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET convert_sym_to_atn alpha took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_PEAKS, "convert_sym_to_atn alpha");
         // dump("alpha_peaks_sym", alpha_peaks, itoa(alpha_peaks.size(), buffer, 10));
         // dump_to_sd("alpha_peaks_sym", alpha_peaks, itoa(alpha_peaks.size(), buffer, 10));
         // print_mem_info();
@@ -301,11 +356,18 @@ void setup() {
         full_demix(spectrogram, alpha_peaks, delta_peaks, demixed, best);
         end = esp_cpu_get_ccount();
         total += end - start;
-        printf("DUET full_demix took %d cycles / %0.3f ms\n", end - start, (end - start) / CPU_FREQ);
+        REPORT_STAGE(STAGE_DEMIX, "full_demix");
         // dump_to_sd("demixed", demixed, "(-1, 128, 13, 2)");
         // dump_to_sd("best", best, DUET_N_FREQ * DUET_N_TIME, "(128, 13)");
-        
-        print_mem_info();
+        latencyDuetCompute((total - chunkStart) / (uint32_t)(CPU_FREQ / 1000));
+
+        if (TELEMETRY) {
+            telemetryBestColumn(best, DUET_N_TIME - 1);
+            telemetrySpectrumColumn(spectrogram, 0, DUET_N_TIME - 1);
+            telemetryEndFrame();
+        } else {
+            print_mem_info();
+        }
     }
 
     printf("--------------------------------\n");
@@ -373,11 +435,11 @@ void setup() {
     // setupVolumeMonitor();
 }
 
-// uint16_t audioBuffer[4096];
-// uint32_t audioOffset = 0;
+// SignalGenerator testSignal(getSampleRate()); // call testSignal.setSine(440, 1.0f) in setup()
+// int16_t audioBuffer[4096];
 
 void loop() {
-    // audioOffset = generateSineWave(440, 32767, audioOffset, audioBuffer, 4096);
-    // sendAudioToI2S((uint8_t*)audioBuffer, 4096 * sizeof(uint16_t));
+    // testSignal.generate(audioBuffer, 2048);
+    // sendAudioToI2S((uint8_t*)audioBuffer, 4096 * sizeof(int16_t));
     yield();
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <assert.h>
 #include <vector>
 #include <array>
 #include <type_traits>
@@ -73,6 +74,13 @@ struct MeanShiftParams {
 
     /** Number of most populated bins to consider as seeds, >= 0, 0 to disable */
     static constexpr int top_n = 20;
+
+    /**
+     * Most iterations for each centroid, >= 0, 0 for no limit. A centroid that
+     * hasn't converged by then is left where it got to. This bounds the time
+     * mean-shift can take (it can be lowered further when calling `mean_shift()`).
+     */
+    static constexpr int max_iter = 50;
 };
 
 
@@ -123,6 +131,10 @@ public:
     static constexpr int top_n = Params::top_n;
     static_assert(top_n >= 0, "`top_n` must be at least 0");
 
+    /** Most iterations for each centroid, >= 0, 0 for no limit */
+    static constexpr int max_iter = Params::max_iter;
+    static_assert(max_iter >= 0, "`max_iter` must be at least 0");
+
 private:
     typedef typename std::remove_const<decltype(bandwidth)>::type bandwidth_t;
     constexpr static bool is_single_bandwidth = std::is_same<bandwidth_t, float>::value;
@@ -227,13 +239,15 @@ public:
      *    usually the output of `compute_seeds()`. The number of centroids should
      *    be significantly less than the number points. The resulting centroids will
      *    be written back to this array. There may be at most 255 centroids.
+     *  - max_iterations : The most iterations for each centroid (0 for no limit).
      *
      * Numerous template parameters may need to be tweaked.
      */
     void mean_shift(
         const std::vector<point_t>& points,
         const std::vector<float>& weights,
-        std::vector<point_t>& centroids
+        std::vector<point_t>& centroids,
+        int max_iterations = max_iter
     ) {
         bool mask[centroids.size()] = {false};
 
@@ -247,6 +261,7 @@ public:
         for (int c = 0; c < centroids.size(); c++) {
             point_t& centroid = centroids[c];
             bool not_converged;
+            int iterations = 0;
             do {
                 if (grid_filtering) {
                     int grid_index = point_to_index(centroid);
@@ -294,7 +309,7 @@ public:
 
                 // Update the centroid
                 centroid = pt_new;
-            } while (not_converged);
+            } while (not_converged && ++iterations != max_iterations);
         }
 
 
@@ -359,7 +374,7 @@ private:
     static int point_to_index(
         const point_t& point,
         const std::array<int16_t, dim>& shape = hist_shape,
-        const point_t& min_bounds = min_bounds
+        const point_t& min_bounds = MeanShift::min_bounds
     ) {
         int index = 0;
         for (int d = 0; d < dim; d++) {
@@ -380,7 +395,7 @@ private:
     static void index_to_point(
         int index, point_t& point,
         const std::array<int16_t, dim>& shape = hist_shape,
-        const point_t& min_bounds = min_bounds
+        const point_t& min_bounds = MeanShift::min_bounds
     ) {
         for (int d = dim - 1; d > 0; d--) {
             point[d] = (index % shape[d]) * _get(bandwidth, d) + min_bounds[d];
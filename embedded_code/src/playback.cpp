@@ -0,0 +1,332 @@
+#include "playback.h"
+#include "audio.h"
+#include "sd.h"
+#include "wav.h"
+#include "ring_buffer.hpp"
+
+#include <string.h>
+#include <atomic>
+#include <esp_timer.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+#define DISABLE_FS_H_WARNING
+#include <SdFat.h>
+
+static_assert(PLAY_BITS_PER_SAMPLE == 16, "Playback: PLAY_BITS_PER_SAMPLE must be 16");
+static_assert(PLAY_CHANNELS == 2, "Playback: PLAY_CHANNELS must be 2");
+
+#define PLAYBACK_SLOTS 3 // one being played and two read ahead
+#define PLAYBACK_DEFAULT_LATENCY_US 50000 // assumed read latency until one has been measured
+
+
+enum PlaybackState : uint8_t { PLAYBACK_IDLE, PLAYBACK_STARTING, PLAYBACK_PLAYING, PLAYBACK_STOPPING };
+static std::atomic<uint8_t> state(PLAYBACK_IDLE);
+static std::atomic<bool> consumerActive(false); // the audio task is in readPlayback()
+static std::atomic<bool> waitingForConsumer(false); // openPlayback() is waiting for it to leave
+static SemaphoreHandle_t consumerLeft = NULL; // given when it leaves while openPlayback() waits
+
+// Only used by the SD card task
+static char playbackPath[64];
+static FsFile playbackFile;
+static uint32_t bytesLeftToRead = 0;
+static uint8_t* ringMemory = NULL;
+static uint32_t ringMemorySize = 0;
+static uint32_t reportedUnderruns = 0;
+
+// Set up by the SD card task before playing starts
+static RingBuffer* ring = NULL;
+static WavInfo info;
+static uint8_t bytesPerSample;
+static uint32_t slotSize = 0;
+static uint32_t step; // file frames per output frame (16.16 fixed point)
+static std::atomic<uint32_t> framesTotal(0); // reduced if reading fails
+
+// Only used by the audio task (while playing)
+static const uint8_t* slot = NULL; // the slot being played, NULL if a new one is needed
+static uint32_t slotPos;
+static uint32_t framesConsumed;
+static int32_t cur[2], nxt[2]; // the frames being interpolated between
+static uint32_t frac; // position between cur and nxt (16.16 fixed point)
+
+// Scheduling reads
+static std::atomic<bool> fillScheduled(false);
+static std::atomic<bool> closeFailed(false); // stopping, but closing the file couldn't be submitted (tried again each block)
+static std::atomic<int64_t> fillRequestedAt(0);
+
+// Statistics
+static std::atomic<uint32_t> underruns(0);
+static std::atomic<uint32_t> framesPlayed(0);
+static std::atomic<uint32_t> readLatencyUs(0);
+
+
+///// SD Card Task /////
+
+/**
+ * Choose the size of the slots so that each slot lasts as long as the read latency. Since two
+ * slots are read ahead, reads can take twice as long as any seen so far without starving.
+ */
+static uint32_t chooseSlotSize(uint32_t latencyUs, uint32_t byteRate, uint16_t blockAlign) {
+    uint32_t size = (uint32_t)((uint64_t)latencyUs * byteRate / 1000000);
+    if (size < PLAYBACK_MIN_SLOT) { size = PLAYBACK_MIN_SLOT; }
+    if (size > PLAYBACK_MAX_SLOT) {
+        Serial.printf("!! SD read latency of %u ms is too long for playback, underruns are likely\n", latencyUs / 1000);
+        size = PLAYBACK_MAX_SLOT;
+    }
+
+    // Whole sectors and whole frames
+    uint32_t a = 512, b = blockAlign;
+    while (b) { uint32_t t = a % b; a = b; b = t; }
+    uint32_t unit = 512 / a * blockAlign;
+    return (size + unit - 1) / unit * unit;
+}
+
+/** Read from the file into all of the free slots. */
+static void readSlots() {
+    while (bytesLeftToRead > 0 && ring->available() + slotSize <= ring->capacity()) {
+        uint8_t* p = ring->acquire();
+        uint32_t n = bytesLeftToRead < slotSize ? bytesLeftToRead : slotSize;
+        int bytesRead = playbackFile.read(p, n);
+        if (bytesRead != (int)n) {
+            // Play what was read and stop there
+            Serial.printf("!! Failed to read '%s', stopping playback\n", playbackPath);
+            uint32_t got = bytesRead > 0 ? bytesRead - bytesRead % info.blockAlign : 0;
+            framesTotal.store(framesTotal.load() - (bytesLeftToRead - got) / info.blockAlign);
+            n = bytesLeftToRead = got;
+        }
+        if (n < slotSize) { memset(&p[n], 0, slotSize - n); } // the end is not played
+        ring->commit();
+        bytesLeftToRead -= n;
+    }
+}
+
+/** Close the file and go back to idle. */
+static void closePlayback() {
+    closeFailed.store(false);
+    playbackFile.close();
+    bytesLeftToRead = 0;
+    state.store(PLAYBACK_IDLE);
+}
+
+/** SD card task: read ahead into the free slots, or close the file if playback has stopped. */
+static bool fillPlayback(SdFs* sd, void* params) {
+    fillScheduled.store(false);
+    if (!sd || state.load() == PLAYBACK_STOPPING) {
+        if (!sd) { Serial.println("!! SD card not available, stopping playback"); }
+        closePlayback();
+        return sd != NULL;
+    }
+    if (state.load() != PLAYBACK_PLAYING) { return true; }
+
+    readSlots();
+
+    // Measure how long it took from the request until the read was done
+    uint32_t latency = (uint32_t)(esp_timer_get_time() - fillRequestedAt.load());
+    if (latency > readLatencyUs.load()) { readLatencyUs.store(latency); }
+
+    uint32_t n = underruns.load();
+    if (n != reportedUnderruns) {
+        Serial.printf("!! Playback underrun (%u total, slots of %u bytes, read latency up to %u ms)\n", n, slotSize, readLatencyUs.load() / 1000);
+        reportedUnderruns = n;
+    }
+    return true;
+}
+
+/** SD card task: open the file, set everything up, and fill the buffer before playing starts. */
+static bool openPlayback(SdFs* sd, void* params) {
+    if (!sd) { Serial.println("!! SD card not available for playback"); state.store(PLAYBACK_IDLE); return false; }
+
+    // Wait for the audio task to be done looking at the last playback (it won't start again until
+    // the state is PLAYBACK_PLAYING). A give left over from an earlier wait just checks again.
+    if (!consumerLeft && !(consumerLeft = xSemaphoreCreateBinary())) {
+        Serial.println("!! Failed to create the playback semaphore");
+        state.store(PLAYBACK_IDLE);
+        return false;
+    }
+    waitingForConsumer.store(true);
+    while (consumerActive.load()) { xSemaphoreTake(consumerLeft, portMAX_DELAY); }
+    waitingForConsumer.store(false);
+
+    int64_t start = esp_timer_get_time();
+    uint32_t dataSize = 0;
+    playbackFile = sd->open(playbackPath, O_RDONLY);
+    if (!playbackFile || !readWavHeader(playbackFile, dataSize, info)) {
+        Serial.printf("!! Failed to open WAV file '%s' for playback\n", playbackPath);
+        closePlayback();
+        return false;
+    }
+    if (info.audioFormat != WAVE_FORMAT_PCM) {
+        Serial.printf("!! Can only play PCM WAV files, '%s' has format 0x%04x\n", playbackPath, info.audioFormat);
+        closePlayback();
+        return false;
+    }
+    uint32_t available = playbackFile.fileSize() - playbackFile.position();
+    if (dataSize > available) { dataSize = available; } // e.g. a recording that wasn't finished
+
+    // Size the slots from the worst read latency seen so far (including opening this file)
+    uint32_t latency = readLatencyUs.load();
+    if (latency == 0) { latency = PLAYBACK_DEFAULT_LATENCY_US; }
+    uint32_t openLatency = (uint32_t)(esp_timer_get_time() - start);
+    if (openLatency > latency) { latency = openLatency; }
+    slotSize = chooseSlotSize(latency, info.sampleRate * info.blockAlign, info.blockAlign);
+    if (ringMemorySize != slotSize * PLAYBACK_SLOTS) {
+        free(ringMemory);
+        ringMemory = (uint8_t*)malloc(slotSize * PLAYBACK_SLOTS);
+        ringMemorySize = ringMemory ? slotSize * PLAYBACK_SLOTS : 0;
+        if (!ringMemory) { Serial.println("!! Failed to allocate the playback buffer"); closePlayback(); return false; }
+    }
+    delete ring;
+    ring = new RingBuffer(ringMemory, slotSize, PLAYBACK_SLOTS, slotSize);
+
+    // Set up the conversion
+    bytesPerSample = (info.bitsPerSample + 7) / 8;
+    step = (uint32_t)(((uint64_t)info.sampleRate << 16) / getSampleRate());
+    bytesLeftToRead = dataSize - dataSize % info.blockAlign;
+    framesTotal.store(bytesLeftToRead / info.blockAlign);
+
+    // Reset the audio task's state
+    slot = NULL;
+    framesConsumed = 0;
+    cur[0] = cur[1] = nxt[0] = nxt[1] = 0;
+    frac = 0x10000; // load a frame first
+    underruns.store(0);
+    framesPlayed.store(0);
+    reportedUnderruns = 0;
+
+    // Fill all slots and start playing (unless stopped in the meantime)
+    readSlots();
+    uint8_t expected = PLAYBACK_STARTING;
+    if (!state.compare_exchange_strong(expected, PLAYBACK_PLAYING)) { closePlayback(); }
+    return true;
+}
+
+
+///// Audio Task /////
+
+/**
+ * Have the SD card task read into any free slots (or close the file when stopping). Returns false if
+ * the SD card lane is full (try again later).
+ */
+static bool scheduleFill() {
+    if (fillScheduled.exchange(true)) { return true; }
+    fillRequestedAt.store(esp_timer_get_time());
+    if (submitSDTask(SD_LANE_AUDIO, fillPlayback, NULL, 0)) { return true; }
+    fillScheduled.store(false);
+    return false;
+}
+
+/** Convert the frame at p to 16-bit stereo. */
+static inline void decodeFrame(const uint8_t* p, int32_t* out) {
+    const int channels = info.numChannels < 2 ? info.numChannels : 2;
+    for (int ch = 0; ch < channels; ch++) {
+        const uint8_t* s = &p[ch * bytesPerSample];
+        switch (bytesPerSample) {
+            case 1: out[ch] = ((int32_t)s[0] - 128) << 8; break; // 8-bit WAV is unsigned
+            case 2: out[ch] = (int16_t)(s[0] | (s[1] << 8)); break;
+            default: out[ch] = (int16_t)(s[bytesPerSample - 2] | (s[bytesPerSample - 1] << 8)); break; // top 16 bits
+        }
+    }
+    if (channels == 1) { out[1] = out[0]; }
+}
+
+/** Get the next frame from the buffer. Returns false if there isn't one (yet). */
+static inline bool nextFrame(int32_t* out) {
+    if (framesConsumed >= framesTotal.load(std::memory_order_relaxed)) { return false; }
+    if (!slot) {
+        uint32_t length;
+        if (!(slot = ring->peek(length))) { return false; }
+        slotPos = 0;
+    }
+    decodeFrame(&slot[slotPos], out);
+    framesConsumed++;
+    slotPos += info.blockAlign;
+    if (slotPos >= slotSize) {
+        ring->release(slotSize);
+        slot = NULL;
+        scheduleFill();
+    }
+    return true;
+}
+
+/** Leave readPlayback(), waking up openPlayback() if it is waiting for that. */
+static inline void leaveConsumer() {
+    consumerActive.store(false);
+    if (waitingForConsumer.load()) { xSemaphoreGive(consumerLeft); }
+}
+
+bool readPlayback(int16_t* output, uint32_t frames) {
+    consumerActive.store(true);
+    if (state.load() != PLAYBACK_PLAYING) {
+        // Stopping, but the SD card lane was full: ask it to close the file again
+        if (closeFailed.load() && state.load() == PLAYBACK_STOPPING) { closeFailed.store(!scheduleFill()); }
+        leaveConsumer();
+        return false;
+    }
+
+    // Make sure the reads are keeping up (e.g. if a request couldn't be submitted)
+    if (ring->available() + slotSize <= ring->capacity()) { scheduleFill(); }
+
+    // Linear interpolation between file frames (just copies the frames when the rates match)
+    uint32_t i = 0;
+    for (; i < frames; i++) {
+        while (frac >= 0x10000) {
+            int32_t frame[2];
+            if (!nextFrame(frame)) { goto starved; }
+            frac -= 0x10000;
+            cur[0] = nxt[0]; cur[1] = nxt[1];
+            nxt[0] = frame[0]; nxt[1] = frame[1];
+        }
+        int32_t f = frac >> 1; // 15 bits so the product fits
+        output[2*i] = (int16_t)(cur[0] + (((nxt[0] - cur[0]) * f) >> 15));
+        output[2*i+1] = (int16_t)(cur[1] + (((nxt[1] - cur[1]) * f) >> 15));
+        frac += step;
+    }
+    framesPlayed.fetch_add(frames, std::memory_order_relaxed);
+    leaveConsumer();
+    return true;
+
+starved:
+    // Out of data: either the end of the file or the reads aren't keeping up
+    memset(&output[2*i], 0, (frames - i) * PLAY_CHANNELS * PLAY_BYTES_PER_SAMPLE);
+    framesPlayed.fetch_add(i, std::memory_order_relaxed);
+    if (framesConsumed >= framesTotal.load()) {
+        state.store(PLAYBACK_STOPPING);
+        closeFailed.store(!scheduleFill()); // closes the file (or tried again on the next block)
+    } else {
+        underruns.fetch_add(1, std::memory_order_relaxed);
+    }
+    leaveConsumer();
+    return true;
+}
+
+
+///// Control /////
+
+bool startPlayback(const char* path) {
+    uint8_t expected = PLAYBACK_IDLE;
+    if (!state.compare_exchange_strong(expected, PLAYBACK_STARTING)) { return false; }
+    strncpy(playbackPath, path, sizeof(playbackPath) - 1);
+    playbackPath[sizeof(playbackPath) - 1] = 0;
+    submitSDTask(SD_LANE_EVENT, openPlayback, NULL);
+    return true;
+}
+
+void stopPlayback() {
+    uint8_t expected = PLAYBACK_PLAYING;
+    if (state.compare_exchange_strong(expected, PLAYBACK_STOPPING)) {
+        submitSDTask(SD_LANE_EVENT, fillPlayback, NULL); // closes the file (waits for room in the lane)
+    } else if (expected == PLAYBACK_STARTING) {
+        state.compare_exchange_strong(expected, PLAYBACK_STOPPING); // openPlayback() will close it
+    }
+}
+
+bool isPlaying() { return state.load() != PLAYBACK_IDLE; }
+
+void getPlaybackStats(PlaybackStats* stats) {
+    stats->underruns = underruns.load();
+    stats->framesPlayed = framesPlayed.load();
+    stats->slotSize = slotSize;
+    stats->readLatencyUs = readLatencyUs.load();
+}
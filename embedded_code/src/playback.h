@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Size limits of each of the three playback buffer slots (the actual size is chosen from the
+// measured SD read latency, see startPlayback())
+#define PLAYBACK_MIN_SLOT 4096
+#define PLAYBACK_MAX_SLOT (16*1024)
+
+/** Statistics about playback. */
+typedef struct _PlaybackStats {
+    uint32_t underruns;         // number of output blocks that ran out of data (filled with silence)
+    uint32_t framesPlayed;      // number of frames played from the current/last file
+    uint32_t slotSize;          // size of each buffer slot in bytes for the current/last file
+    uint32_t readLatencyUs;     // longest time from requesting a read to it being done
+} PlaybackStats;
+
+/**
+ * Start playing a WAV file from the SD card. The file is opened and read ahead by the SD card task
+ * into a triple buffer and played by the audio task in place of the live audio. Files that don't
+ * match the PLAY_* format (any PCM sample size, mono, or a different sample rate) are converted on
+ * the fly.
+ *
+ * Each buffer slot holds enough audio to cover the longest read latency seen so far (from
+ * requesting a read in the audio task to it being done in the SD card task, including waiting
+ * behind recording writes). Two slots are read ahead, so reads can take up to twice that long
+ * before the audio runs out.
+ *
+ * Returns false if something is already playing. Problems with the file are reported from the
+ * SD card task and playback just doesn't start.
+ */
+bool startPlayback(const char* path);
+
+/** Stop playing. The live audio is output again from the next block. */
+void stopPlayback();
+
+/** Check if a file is being played (or is about to be). */
+bool isPlaying();
+
+/** Get the playback statistics. */
+void getPlaybackStats(PlaybackStats* stats);
+
+/**
+ * Get the next frames to play in the PLAY_* format. This is called by the audio task for each
+ * block. Returns false if nothing is playing (and output is untouched). If the buffer runs out the
+ * rest of the output is silence and an underrun is counted. When the end of the file is reached
+ * playback stops.
+ */
+bool readPlayback(int16_t* output, uint32_t frames);
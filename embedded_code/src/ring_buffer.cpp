@@ -0,0 +1,70 @@
+#include "ring_buffer.hpp"
+
+#include <stdio.h>
+#include <esp_timer.h>
+
+RingBuffer::RingBuffer(uint8_t* buffer, uint32_t blockSize, uint32_t nBlocks, uint32_t chunkSize) :
+    buffer(buffer), blockSize(blockSize), chunkSize(chunkSize), size(blockSize * nBlocks),
+    head(0), tail(0), chunkWaitingSince(0), consumerScheduled(false),
+    highWater(0), overruns(0), stallUs(0), maxStallUs(0) {
+    if (size % chunkSize != 0) { printf("!! Ring buffer size %u is not a multiple of the chunk size %u\n", size, chunkSize); }
+}
+
+uint8_t* RingBuffer::acquire() {
+    uint32_t h = head.load(std::memory_order_relaxed);
+    uint32_t t = tail.load(std::memory_order_acquire);
+    if (used(h, t) + blockSize > size) {
+        overruns.store(overruns.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        return NULL;
+    }
+    return &buffer[offset(h)];
+}
+
+void RingBuffer::commit() {
+    uint32_t h = advance(head.load(std::memory_order_relaxed), blockSize);
+    head.store(h, std::memory_order_release);
+
+    uint32_t n = used(h, tail.load(std::memory_order_acquire));
+    if (n > highWater.load(std::memory_order_relaxed)) { highWater.store(n, std::memory_order_relaxed); }
+
+    // Track how long a whole chunk has been waiting for the consumer
+    int64_t now = esp_timer_get_time();
+    int64_t since = chunkWaitingSince.load(std::memory_order_acquire);
+    if (n < chunkSize) {
+        stallUs.store(0, std::memory_order_relaxed);
+    } else if (since == 0) {
+        // compare-exchange since the consumer may have just reset it
+        chunkWaitingSince.compare_exchange_strong(since, now);
+        stallUs.store(0, std::memory_order_relaxed);
+    } else {
+        uint32_t stall = (uint32_t)(now - since);
+        stallUs.store(stall, std::memory_order_relaxed);
+        if (stall > maxStallUs.load(std::memory_order_relaxed)) { maxStallUs.store(stall, std::memory_order_relaxed); }
+    }
+}
+
+const uint8_t* RingBuffer::peek(uint32_t& length) const {
+    uint32_t t = tail.load(std::memory_order_relaxed);
+    uint32_t n = used(head.load(std::memory_order_acquire), t);
+    if (n == 0) { length = 0; return NULL; }
+    uint32_t off = offset(t);
+    length = (off + n > size) ? size - off : n;
+    return &buffer[off];
+}
+
+void RingBuffer::release(uint32_t length) {
+    uint32_t t = advance(tail.load(std::memory_order_relaxed), length);
+    tail.store(t, std::memory_order_release);
+
+    // If a whole chunk is still waiting it has only been waiting since now
+    uint32_t n = used(head.load(std::memory_order_acquire), t);
+    chunkWaitingSince.store(n >= chunkSize ? esp_timer_get_time() : 0, std::memory_order_release);
+}
+
+void RingBuffer::stats(RingBufferStats* stats) const {
+    stats->used = available();
+    stats->highWater = highWater.load(std::memory_order_relaxed);
+    stats->overruns = overruns.load(std::memory_order_relaxed);
+    stats->stallUs = stallUs.load(std::memory_order_relaxed);
+    stats->maxStallUs = maxStallUs.load(std::memory_order_relaxed);
+}
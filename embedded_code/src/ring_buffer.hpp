@@ -0,0 +1,113 @@
+/**
+ * Lock-free single-producer/single-consumer ring buffer for handing blocks of
+ * data from one task to another without copying them.
+ *
+ * The producer acquires a whole block, fills it in place (e.g. with i2s_read),
+ * and commits it. The consumer peeks at the contiguous data that is available,
+ * uses it in place (e.g. writes it to the SD card), and releases it. The
+ * buffer size is a multiple of both the block size and the consumer's chunk
+ * size, so a block or a chunk never wraps around the end of the buffer.
+ *
+ * Only the producer may call acquire() and commit() and only the consumer may
+ * call peek() and release(). The stats can be read from any task.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <atomic>
+
+/** Statistics about how well the consumer is keeping up with the producer. */
+struct RingBufferStats {
+    uint32_t used;          // bytes currently waiting in the buffer
+    uint32_t highWater;     // most bytes that have ever been waiting in the buffer
+    uint32_t overruns;      // number of blocks the producer dropped because the buffer was full
+    uint32_t stallUs;       // how long a whole chunk has currently been waiting for the consumer
+    uint32_t maxStallUs;    // longest a whole chunk has ever waited for the consumer
+};
+
+class RingBuffer {
+    uint8_t* const buffer;
+    const uint32_t blockSize;
+    const uint32_t chunkSize;
+    const uint32_t size;
+
+    // Positions are kept in [0, 2*size) so a full buffer can be told apart from an empty one
+    std::atomic<uint32_t> head;  // written by the producer
+    std::atomic<uint32_t> tail;  // written by the consumer
+
+    // Time (esp_timer) since which at least a whole chunk has been waiting, 0 if less is waiting
+    std::atomic<int64_t> chunkWaitingSince;
+
+    std::atomic<bool> consumerScheduled;
+
+    // Only written by the producer
+    std::atomic<uint32_t> highWater;
+    std::atomic<uint32_t> overruns;
+    std::atomic<uint32_t> stallUs;
+    std::atomic<uint32_t> maxStallUs;
+
+    inline uint32_t used(uint32_t h, uint32_t t) const { return h >= t ? h - t : h + 2*size - t; }
+    inline uint32_t advance(uint32_t pos, uint32_t n) const { pos += n; return pos >= 2*size ? pos - 2*size : pos; }
+    inline uint32_t offset(uint32_t pos) const { return pos >= size ? pos - size : pos; }
+
+public:
+    /**
+     * Create a ring buffer using the given memory, which must be
+     * `blockSize * nBlocks` bytes. That must be a multiple of `chunkSize`,
+     * the amount the consumer is expected to take at a time.
+     */
+    RingBuffer(uint8_t* buffer, uint32_t blockSize, uint32_t nBlocks, uint32_t chunkSize);
+
+    /** Total size of the buffer in bytes. */
+    uint32_t capacity() const { return size; }
+
+    /** Number of bytes currently waiting in the buffer (from either side). */
+    uint32_t available() const { return used(head.load(std::memory_order_acquire), tail.load(std::memory_order_acquire)); }
+
+    ///// Producer /////
+
+    /**
+     * Get the next free block to fill. Returns NULL if the buffer is full, in
+     * which case the block is counted as an overrun.
+     */
+    uint8_t* acquire();
+
+    /** Check if acquire() would return a block (without counting an overrun if it wouldn't). */
+    bool hasRoom() const { return used(head.load(std::memory_order_relaxed), tail.load(std::memory_order_acquire)) + blockSize <= size; }
+
+    /** Commit the block returned by the last acquire(), making it available to the consumer. */
+    void commit();
+
+    /**
+     * Mark the consumer as scheduled. Returns true if it wasn't already, in
+     * which case the caller must actually schedule it (or call
+     * consumerDone() if that fails). This prevents flooding the consumer with
+     * requests while it is already behind.
+     */
+    bool scheduleConsumer() { return !consumerScheduled.exchange(true); }
+
+    ///// Consumer /////
+
+    /**
+     * Get the contiguous data waiting in the buffer. Returns NULL if there is
+     * none, otherwise `length` is set to the number of contiguous bytes
+     * (which may be less than available() when the data wraps around).
+     */
+    const uint8_t* peek(uint32_t& length) const;
+
+    /** Release `length` bytes returned by peek(), freeing them for the producer. */
+    void release(uint32_t length);
+
+    /**
+     * Mark the consumer as no longer scheduled. Call this at the start of the
+     * consumer so data committed while it runs schedules it again.
+     */
+    void consumerDone() { consumerScheduled.store(false); }
+
+    ///// Statistics /////
+
+    /** Get the current statistics. This can be called from any task. */
+    void stats(RingBufferStats* stats) const;
+};
@@ -3,6 +3,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <atomic>
 
 #define DISABLE_FS_H_WARNING
 #include <SPI.h>
@@ -10,6 +11,8 @@
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
+#include <freertos/task.h>
+#include <esp_timer.h>
 
 // SD Card Pins
 #define SD_SCK  18
@@ -39,20 +42,46 @@
 //       [48 kHz audio is 192 bytes/ms, thus only 9.1% of the time is used for writing audio data]
 //   - Opening a file takes ~100 us (there seems to be some caching, first open is slower)
 //     - At 30 MHz it is ~70 us after the first few opens
-// Should probably not leave files open and just reopen them for every read/write as opening is
-// apparently fast and already partially cached in the SD card driver. If we leave them open, we
-// could run into issues with the SD card driver if a card is switched or similar (the file doesn't
-// get closed when the card is removed, so it could be in an invalid state).
+// Opening is fast, but an open/seek/write/close for every small write still costs several
+// partial-sector read-modify-writes and FAT updates. The recording files are therefore kept open
+// for the whole session and written in whole SD_WRITE_CHUNKs. To deal with the card being removed
+// or switched (the open files are not closed when that happens), every successful mount increments
+// a generation counter and files opened on an older generation are reopened.
 
-// Just one SD card object and a queue for submitting tasks to the SD card
+// Just one SD card object and queues for submitting tasks to the SD card
 // This allows us to use the faster dedicated SPI bus for the SD card
+// There is a queue for each priority lane, submitting a task also notifies the SD card task
 SdFs sd;
-QueueHandle_t IRAM_DATA_ATTR WORD_ALIGNED_ATTR queue = NULL;
+QueueHandle_t IRAM_DATA_ATTR WORD_ALIGNED_ATTR queues[SD_LANE_COUNT] = { NULL };
+const UBaseType_t queueLengths[SD_LANE_COUNT] = { MAX_AUDIO_FILE_TASKS, MAX_FILE_TASKS, MAX_DUMP_FILE_TASKS };
 struct SDTaskParams {
-    SDCallback callback;
-    void* params;
+    SDCallback callback;    // NULL for an append
+    void* params;           // the path for an append
+    int64_t submitted;      // when the task was submitted (esp_timer)
+    SDBuffer* buffer;       // the buffer given to the task (always set for an append)
 };
-TaskHandle_t sdTaskHandle = NULL;
+TaskHandle_t IRAM_DATA_ATTR WORD_ALIGNED_ATTR sdTaskHandle = NULL;
+
+// Pool of buffers for submitSDBuffer(), the queue holds the ones that are free
+SDBuffer buffers[SD_BUFFER_COUNT];
+QueueHandle_t IRAM_DATA_ATTR WORD_ALIGNED_ATTR freeBuffers = NULL;
+static_assert(SD_BUFFER_COUNT <= 256, "SD_BUFFER_COUNT must fit in the low byte of a handle");
+
+// Status of the last submission of each buffer, a handle is the buffer index in the low byte and a
+// sequence number in the rest (so old handles can be told apart from the current one)
+volatile SDHandle IRAM_DATA_ATTR WORD_ALIGNED_ATTR bufferHandles[SD_BUFFER_COUNT] = { 0 };
+volatile SDStatus IRAM_DATA_ATTR bufferStatus[SD_BUFFER_COUNT];
+std::atomic<uint32_t> IRAM_DATA_ATTR WORD_ALIGNED_ATTR handleSequence(0);
+
+// Lane statistics (only updated by the SD card task)
+struct LaneStats {
+    uint32_t maxDepth;
+    uint32_t completed;
+    uint32_t merged;
+    uint32_t maxLatencyUs;
+    uint64_t totalLatencyUs;
+} laneStats[SD_LANE_COUNT] = {};
+uint32_t mountGeneration = 0;  // incremented every time the card is successfully mounted
 
 /**
  * Setup the SD card. Returns true if the SD card is set up and false if there was an error.
@@ -92,6 +121,7 @@ bool setupSDCard() {
 
     uint32_t sectors = sd.card()->sectorCount();
     if (sectors == 0) { Serial.println("!! Can't determine the SD card size.\n"); return false; }
+    mountGeneration++;
 
 #ifdef DEBUG
     // Print SD card info
@@ -140,15 +170,129 @@ bool ensureSDCard() {
     return avail || setupSDCard();
 }
 
+/**
+ * Get the number of times the SD card has been (re)mounted. Files opened while this had a
+ * different value belong to a previous mount and must be reopened.
+ */
+uint32_t sdMountGeneration() { return mountGeneration; }
+
+/** Record the statistics for a task that is about to run. */
+void recordTaskStart(SDLane lane, const SDTaskParams& params, UBaseType_t depth) {
+    LaneStats& stats = laneStats[lane];
+    if (depth > stats.maxDepth) { stats.maxDepth = depth; }
+    uint32_t latency = (uint32_t)(esp_timer_get_time() - params.submitted);
+    if (latency > stats.maxLatencyUs) { stats.maxLatencyUs = latency; }
+    stats.totalLatencyUs += latency;
+    stats.completed++;
+}
+
+/** Check if there is a task waiting in a lane with a higher priority. */
+bool higherPriorityWaiting(SDLane lane) {
+    for (int i = 0; i < lane; i++) { if (uxQueueMessagesWaiting(queues[i])) { return true; } }
+    return false;
+}
+
+/** Give a buffer back to the pool once the SD card task is done with it. */
+void finishBuffer(SDBuffer* buffer, bool ok) {
+    uint32_t index = buffer - buffers;
+    bufferStatus[index] = ok ? SD_STATUS_DONE : SD_STATUS_FAILED;
+    if (buffer->completion) { buffer->completion(ok, buffer->context); }
+    xQueueSendToBack(freeBuffers, &buffer, 0);
+}
+
+/** Check if a task is an append of a buffer to the given file. */
+inline bool isAppendTo(const SDTaskParams& params, const char* path) {
+    return params.callback == NULL && strcmp((const char*)params.params, path) == 0;
+}
+
+// The data of merged appends, so it is written in one go instead of a write for each buffer (only
+// used by the SD card task)
+uint8_t mergeData[SD_MERGE_SIZE];
+uint32_t mergeLength = 0;
+static_assert(SD_MERGE_SIZE >= SD_BUFFER_SIZE, "SD_MERGE_SIZE must hold a whole buffer");
+
+/** Write the merged data to a file. */
+inline bool writeMerged(FsFile& file) {
+    bool ok = mergeLength == 0 || file.write(mergeData, mergeLength) == mergeLength;
+    mergeLength = 0;
+    return ok;
+}
+
+/** Add the data of an append task to the merged data, writing that first if there isn't room. */
+inline bool mergeAppend(FsFile& file, const SDTaskParams& params) {
+    bool ok = mergeLength + params.buffer->length <= SD_MERGE_SIZE || writeMerged(file);
+    memcpy(&mergeData[mergeLength], params.buffer->data, params.buffer->length);
+    mergeLength += params.buffer->length;
+    return ok;
+}
+
+/**
+ * Run an append task, along with any appends to the same file waiting right after it in the same
+ * lane, so the file is only opened and closed once and their data is written together. Merging
+ * stops if a task with a higher priority is waiting. Buffers are finished once the file is closed.
+ */
+bool runAppend(SdFs* sd, SDLane lane, SDTaskParams& params) {
+    const char* path = (const char*)params.params;
+    SDBuffer* done[SD_BUFFER_COUNT]; // every buffer can be in the queue at once
+    uint32_t nDone = 0;
+    done[nDone++] = params.buffer;
+
+    FsFile file;
+    bool ok = sd && (file = sd->open(path, O_WRONLY | O_CREAT | O_APPEND));
+    if (!ok) { Serial.printf("!! Failed to open '%s' for appending\n", path); }
+    else {
+        ok = mergeAppend(file, params);
+        while (!higherPriorityWaiting(lane) &&
+               xQueuePeek(queues[lane], &params, 0) == pdTRUE && isAppendTo(params, path)) {
+            UBaseType_t depth = uxQueueMessagesWaiting(queues[lane]);
+            xQueueReceive(queues[lane], &params, 0);
+            recordTaskStart(lane, params, depth);
+            laneStats[lane].merged++;
+            done[nDone++] = params.buffer;
+            ok = mergeAppend(file, params) && ok;
+        }
+        ok = writeMerged(file) && ok;
+        if (!ok) { Serial.printf("!! Failed to append to '%s'\n", path); }
+        ok = file.close() && ok;
+    }
+
+    for (uint32_t i = 0; i < nDone; i++) { finishBuffer(done[i], ok); }
+    return ok;
+}
+
+/**
+ * Take the next task from the highest priority lane that has one. Returns false if there are
+ * no tasks waiting.
+ */
+bool nextTask(SDLane& lane, SDTaskParams& params) {
+    for (int i = 0; i < SD_LANE_COUNT; i++) {
+        UBaseType_t depth = uxQueueMessagesWaiting(queues[i]);
+        if (depth && xQueueReceive(queues[i], &params, 0) == pdTRUE) {
+            lane = (SDLane)i;
+            recordTaskStart(lane, params, depth);
+            return true;
+        }
+    }
+    return false;
+}
+
 /** Task that runs tasks utilizing the SD card. */
 void sdTask(void *pvParameters) {
     int highWaterMark = 0;
 
     SDTaskParams params;
+    SDLane lane;
     setupSDCard(); // try once at the beginning to save time later
     while (true) {
-        if (xQueueReceive(queue, &params, portMAX_DELAY)) {
-            params.callback(ensureSDCard() ? &sd : NULL, params.params);
+        // Wait to be notified of new tasks, then run everything that is waiting (by priority)
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (nextTask(lane, params)) {
+            SdFs* card = ensureSDCard() ? &sd : NULL;
+            if (!params.callback) { runAppend(card, lane, params); }
+            else {
+                bool ok = params.callback(card, params.params);
+                if (params.buffer) { finishBuffer(params.buffer, ok); }
+            }
 
             if (uxTaskGetStackHighWaterMark(NULL) > highWaterMark) { // TODO: remove this debug code
                 highWaterMark = uxTaskGetStackHighWaterMark(NULL);
@@ -161,16 +305,33 @@ void sdTask(void *pvParameters) {
 
 /**
  * Set up the SD card task for later use.
- * Returns true if the queue and task was created and false if it was not.
+ * Returns true if the queues and task were created and false if they were not.
  */
 bool setupSD() {
-    queue = xQueueCreate(MAX_FILE_TASKS, sizeof(SDTaskParams));
-    if (!queue) { Serial.println("!! Failed to create SD card queue"); return false; }
+    for (int i = 0; i < SD_LANE_COUNT; i++) {
+        queues[i] = xQueueCreate(queueLengths[i], sizeof(SDTaskParams));
+        if (!queues[i]) {
+            Serial.println("!! Failed to create SD card queue");
+            for (int j = 0; j < i; j++) { vQueueDelete(queues[j]); queues[j] = NULL; }
+            return false;
+        }
+    }
+
+    freeBuffers = xQueueCreate(SD_BUFFER_COUNT, sizeof(SDBuffer*));
+    if (!freeBuffers) {
+        for (int i = 0; i < SD_LANE_COUNT; i++) { vQueueDelete(queues[i]); queues[i] = NULL; }
+        Serial.println("!! Failed to create SD card buffer pool");
+        return false;
+    }
+    for (int i = 0; i < SD_BUFFER_COUNT; i++) {
+        SDBuffer* buffer = &buffers[i];
+        xQueueSendToBack(freeBuffers, &buffer, 0);
+    }
 
     // TODO: can the stack size be smaller?
     if (xTaskCreate(sdTask, "SDCard", 4096*4, NULL, tskIDLE_PRIORITY, &sdTaskHandle) != pdPASS) {
-        vQueueDelete(queue);
-        queue = NULL;
+        for (int i = 0; i < SD_LANE_COUNT; i++) { vQueueDelete(queues[i]); queues[i] = NULL; }
+        vQueueDelete(freeBuffers); freeBuffers = NULL;
         Serial.println("!! Failed to create SD card task");
         return false;
     }
@@ -184,14 +345,10 @@ bool setupSD() {
 
 /**
  * Submit a file task to the SD card task.
- * If there is no room in the queue, this will block until there is.
+ * If there is no room in the lane's queue, this will block until there is.
  */
-void submitSDTask(SDCallback callback, void* params) {
-    SDTaskParams sdtp = {
-        .callback = callback,
-        .params = params,
-    };
-    xQueueSendToBack(queue, &sdtp, portMAX_DELAY);
+void submitSDTask(SDLane lane, SDCallback callback, void* params) {
+    submitSDTask(lane, callback, params, portMAX_DELAY);
 }
 
 /**
@@ -199,25 +356,135 @@ void submitSDTask(SDCallback callback, void* params) {
  * This waits for a certain amount of time for the task to be submitted on to the queue.
  * If there is no room in the queue after the time has elapsed, this will return false.
  */
-bool submitSDTask(SDCallback callback, void* params, TickType_t ticks_to_wait) {
-    SDTaskParams sdtp = {
-        .callback = callback,
-        .params = params,
-    };
-    return xQueueSendToBack(queue, &sdtp, ticks_to_wait) == pdTRUE;
+bool submitSDTask(SDLane lane, SDCallback callback, void* params, TickType_t ticks_to_wait) {
+    SDTaskParams sdtp;
+    sdtp.callback = callback;
+    sdtp.params = params;
+    sdtp.submitted = esp_timer_get_time();
+    sdtp.buffer = NULL;
+    if (xQueueSendToBack(queues[lane], &sdtp, ticks_to_wait) != pdTRUE) { return false; }
+    xTaskNotifyGive(sdTaskHandle);
+    return true;
 }
 
 /**
  * Submit a file task to the SD card task from an ISR.
  * If there is no room in the queue, this will return false.
  */
-bool IRAM_ATTR submitSDTaskFromISR(SDCallback callback, void* params) {
-    SDTaskParams sdtp = {
-        .callback = callback,
-        .params = params,
-    };
+bool IRAM_ATTR submitSDTaskFromISR(SDLane lane, SDCallback callback, void* params) {
+    SDTaskParams sdtp;
+    sdtp.callback = callback;
+    sdtp.params = params;
+    sdtp.submitted = esp_timer_get_time();
+    sdtp.buffer = NULL;
     BaseType_t higher_priority_task_woken = pdFALSE;
-    bool retval = xQueueSendToBackFromISR(queue, &sdtp, &higher_priority_task_woken) == pdTRUE;
+    bool retval = xQueueSendToBackFromISR(queues[lane], &sdtp, &higher_priority_task_woken) == pdTRUE;
+    if (retval) { vTaskNotifyGiveFromISR(sdTaskHandle, &higher_priority_task_woken); }
     if (higher_priority_task_woken == pdTRUE) { portYIELD_FROM_ISR(); }
     return retval;
 }
+
+/**
+ * Get a buffer from the pool, waiting up to ticks_to_wait for one to become free. Returns NULL
+ * if none are free.
+ */
+SDBuffer* acquireSDBuffer(TickType_t ticks_to_wait) {
+    SDBuffer* buffer = NULL;
+    if (!freeBuffers || xQueueReceive(freeBuffers, &buffer, ticks_to_wait) != pdTRUE) { return NULL; }
+    buffer->length = 0;
+    return buffer;
+}
+
+/** Get a buffer from the pool from an ISR. Returns NULL if none are free. */
+SDBuffer* IRAM_ATTR acquireSDBufferFromISR() {
+    SDBuffer* buffer = NULL;
+    if (!freeBuffers || xQueueReceiveFromISR(freeBuffers, &buffer, NULL) != pdTRUE) { return NULL; }
+    buffer->length = 0;
+    return buffer;
+}
+
+/** Give a buffer back to the pool without writing it. */
+void releaseSDBuffer(SDBuffer* buffer) { xQueueSendToBack(freeBuffers, &buffer, 0); }
+
+/**
+ * Fill in a buffer and the task to give it to the SD card task. Returns the handle for the buffer.
+ */
+inline SDHandle IRAM_ATTR prepareBuffer(SDTaskParams& sdtp, SDBuffer* buffer, const char* path, SDCallback callback,
+                                        SDCompletion completion, void* context) {
+    uint32_t index = buffer - buffers;
+    uint32_t sequence = handleSequence.fetch_add(1, std::memory_order_relaxed) + 1;
+    buffer->path = path;
+    buffer->callback = callback;
+    buffer->completion = completion;
+    buffer->context = context;
+    buffer->handle = (sequence << 8) | index;
+    if (buffer->handle == SD_HANDLE_NONE) { buffer->handle = 1 << 8; } // the sequence wrapped around
+    bufferStatus[index] = SD_STATUS_PENDING;
+    bufferHandles[index] = buffer->handle;
+
+    sdtp.callback = callback;
+    sdtp.params = callback ? (void*)buffer->data : (void*)path;
+    sdtp.submitted = esp_timer_get_time();
+    sdtp.buffer = buffer;
+    return buffer->handle;
+}
+
+/**
+ * Hand a buffer over to the SD card task. This never blocks; if there is no room in the queue the
+ * buffer goes straight back to the pool and SD_HANDLE_NONE is returned.
+ */
+SDHandle submitSDBuffer(SDLane lane, SDBuffer* buffer, const char* path, SDCallback callback,
+                        SDCompletion completion, void* context) {
+    SDTaskParams sdtp;
+    SDHandle handle = prepareBuffer(sdtp, buffer, path, callback, completion, context);
+    if (xQueueSendToBack(queues[lane], &sdtp, 0) != pdTRUE) {
+        bufferStatus[buffer - buffers] = SD_STATUS_FAILED;
+        if (completion) { completion(false, context); }
+        releaseSDBuffer(buffer);
+        return SD_HANDLE_NONE;
+    }
+    xTaskNotifyGive(sdTaskHandle);
+    return handle;
+}
+
+/**
+ * Same as submitSDBuffer() but from an ISR. If the buffer could not be queued, the completion is
+ * not called.
+ */
+SDHandle IRAM_ATTR submitSDBufferFromISR(SDLane lane, SDBuffer* buffer, const char* path, SDCallback callback,
+                                         SDCompletion completion, void* context) {
+    SDTaskParams sdtp;
+    SDHandle handle = prepareBuffer(sdtp, buffer, path, callback, completion, context);
+    BaseType_t higher_priority_task_woken = pdFALSE;
+    if (xQueueSendToBackFromISR(queues[lane], &sdtp, &higher_priority_task_woken) == pdTRUE) {
+        vTaskNotifyGiveFromISR(sdTaskHandle, &higher_priority_task_woken);
+    } else {
+        // the completion is not called since it would have to run in the ISR
+        bufferStatus[buffer - buffers] = SD_STATUS_FAILED;
+        xQueueSendToBackFromISR(freeBuffers, &buffer, &higher_priority_task_woken);
+        handle = SD_HANDLE_NONE;
+    }
+    if (higher_priority_task_woken == pdTRUE) { portYIELD_FROM_ISR(); }
+    return handle;
+}
+
+/** Check on a buffer submitted with submitSDBuffer(). */
+SDStatus pollSDBuffer(SDHandle handle) {
+    if (handle == SD_HANDLE_NONE) { return SD_STATUS_FAILED; }
+    uint32_t index = handle & 0xFF;
+    if (index >= SD_BUFFER_COUNT || bufferHandles[index] != handle) { return SD_STATUS_EXPIRED; }
+    SDStatus status = bufferStatus[index];
+    // the buffer may have been reused while reading the status
+    return bufferHandles[index] == handle ? status : SD_STATUS_EXPIRED;
+}
+
+/** Get the statistics for an SD card task lane. */
+void getSDLaneStats(SDLane lane, SDLaneStats* stats) {
+    const LaneStats& ls = laneStats[lane];
+    stats->depth = queues[lane] ? uxQueueMessagesWaiting(queues[lane]) : 0;
+    stats->maxDepth = ls.maxDepth;
+    stats->completed = ls.completed;
+    stats->merged = ls.merged;
+    stats->maxLatencyUs = ls.maxLatencyUs;
+    stats->avgLatencyUs = ls.completed ? (uint32_t)(ls.totalLatencyUs / ls.completed) : 0;
+}
@@ -1,34 +1,160 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
+
+#include <freertos/FreeRTOS.h>
 
 #define DISABLE_FS_H_WARNING
 #include <SdFat.h>
 
-#define MAX_FILE_TASKS 8
+// The SD card task has a queue for each priority lane (see SDLane) with room for this many tasks
+#define MAX_AUDIO_FILE_TASKS 4
+#define MAX_FILE_TASKS 8  // for events
+#define MAX_DUMP_FILE_TASKS 16
+
+// Pool of buffers that can be handed over to the SD card task (see acquireSDBuffer())
+#define SD_BUFFER_SIZE 512
+#define SD_BUFFER_COUNT 16
+
+// Appends to the same file that are merged (see submitSDBuffer()) are copied together and written
+// this much at a time
+#define SD_MERGE_SIZE (4*SD_BUFFER_SIZE)
+
+// Large writes to the SD card are done in chunks of this size. It matches the 32 KB cluster size
+// that setupSDCard() recommends, so each chunk covers whole clusters.
+#define SD_WRITE_CHUNK (32*1024)
 
 /** Set up the SD card task for later use. */
 bool setupSD();
 
+/**
+ * Get the number of times the SD card has been (re)mounted. Files opened while this had a
+ * different value belong to a previous mount (e.g. before the card was removed) and must be
+ * reopened. This must only be called from SD file tasks.
+ */
+uint32_t sdMountGeneration();
+
 /**
  * Callback for SD file tasks. If the SD card is not present, the first parameter will be NULL.
  */
 typedef bool (*SDCallback)(SdFs* sd, void* params);
 
+/**
+ * Priority lanes of the SD card task. Whenever the SD card task picks the next task, it takes it
+ * from the highest priority lane that has one, so audio never waits behind more than the one task
+ * already running.
+ */
+typedef enum _SDLane : uint8_t {
+    SD_LANE_AUDIO = 0,  // recording and playback, must keep up with the audio
+    SD_LANE_EVENT = 1,  // button presses and other small, infrequent writes
+    SD_LANE_DUMP = 2,   // debugging dumps and other bulk, low priority work
+    SD_LANE_COUNT
+} SDLane;
+
+/** Statistics for an SD card task lane. */
+typedef struct _SDLaneStats {
+    uint32_t depth;             // tasks waiting right now
+    uint32_t maxDepth;          // most tasks that have been waiting at once
+    uint32_t completed;         // tasks run (merged appends count individually)
+    uint32_t merged;            // appends that were merged into a previous append
+    uint32_t maxLatencyUs;      // longest time from submitting a task until it started
+    uint32_t avgLatencyUs;      // average time from submitting a task until it started
+} SDLaneStats;
+
 /**
  * Submit a file task to the SD card task.
- * If there is no room in the queue, this will block until there is.
+ * If there is no room in the lane's queue, this will block until there is.
  */
-void submitSDTask(SDCallback callback, void* params);
+void submitSDTask(SDLane lane, SDCallback callback, void* params);
 
 /**
  * Submit a file task to the SD card task.
  * This waits for a certain amount of time for the task to be submitted on to the queue.
  * If there is no room in the queue after the time has elapsed, this will return false.
  */
-// bool submitSDTask(SDCallback callback, void* params, TickType_t ticks_to_wait);
+bool submitSDTask(SDLane lane, SDCallback callback, void* params, TickType_t ticks_to_wait);
 
 /**
  * Submit a file task to the SD card task from an ISR.
  * If there is no room in the queue, this will return false.
  */
-bool IRAM_ATTR submitSDTaskFromISR(SDCallback callback, void* params);
+bool IRAM_ATTR submitSDTaskFromISR(SDLane lane, SDCallback callback, void* params);
+
+/**
+ * Called by the SD card task once a buffer has been written (ok is false if there was an error).
+ * The buffer goes back to the pool as soon as this returns.
+ */
+typedef void (*SDCompletion)(bool ok, void* context);
+
+/**
+ * A buffer from the pool. It is filled in by its owner and then handed over to the SD card task
+ * with submitSDBuffer(), which writes straight from it and returns it to the pool when done.
+ */
+typedef struct _SDBuffer {
+    uint8_t data[SD_BUFFER_SIZE];
+    uint32_t length;            // number of bytes of data used
+    // The rest are set by submitSDBuffer()
+    const char* path;           // file to append the data to (when callback is NULL)
+    SDCallback callback;        // called with the data as its params (instead of appending)
+    SDCompletion completion;    // called when done (may be NULL)
+    void* context;              // passed to the completion
+    uint32_t handle;
+} SDBuffer;
+
+/**
+ * Handle for following a submitted buffer with pollSDBuffer(). SD_HANDLE_NONE means the buffer
+ * could not be submitted.
+ */
+typedef uint32_t SDHandle;
+#define SD_HANDLE_NONE 0
+
+typedef enum _SDStatus : uint8_t {
+    SD_STATUS_PENDING,  // waiting to be written
+    SD_STATUS_DONE,     // written
+    SD_STATUS_FAILED,   // there was an error writing it (or it could not be submitted)
+    SD_STATUS_EXPIRED,  // finished long enough ago that its buffer has been reused
+} SDStatus;
+
+/**
+ * Get a buffer from the pool, waiting up to ticks_to_wait for one to become free. Returns NULL
+ * if none are free. The buffer must be given back with either submitSDBuffer() or releaseSDBuffer().
+ */
+SDBuffer* acquireSDBuffer(TickType_t ticks_to_wait = 0);
+
+/** Get a buffer from the pool from an ISR. Returns NULL if none are free. */
+SDBuffer* IRAM_ATTR acquireSDBufferFromISR();
+
+/** Give a buffer back to the pool without writing it. */
+void releaseSDBuffer(SDBuffer* buffer);
+
+/**
+ * Hand a buffer over to the SD card task. If callback is NULL the data is appended to the file at
+ * path (which must stay valid until done, e.g. a global), otherwise the callback is run with the
+ * buffer's data as its params. Appends to the same file that are waiting next to each other in a
+ * lane are merged: the file is opened once, their data is copied together and written up to
+ * SD_MERGE_SIZE at a time, and it is closed once.
+ *
+ * This never blocks. The buffer belongs to the SD card task from now on, even if it could not be
+ * queued (then it goes straight back to the pool, the completion is called with ok as false, and
+ * SD_HANDLE_NONE is returned). Otherwise, the returned handle can be polled with pollSDBuffer().
+ *
+ * Submitting only fails when the lane's queue is full, and then the data is dropped. This can
+ * happen even though a buffer was available, since every buffer in the pool can be waiting in a
+ * lane along with other tasks. Callers that mind losing data must check for SD_HANDLE_NONE and
+ * count or report it (or keep a copy to submit again).
+ */
+SDHandle submitSDBuffer(SDLane lane, SDBuffer* buffer, const char* path, SDCallback callback = NULL,
+                        SDCompletion completion = NULL, void* context = NULL);
+
+/**
+ * Same as submitSDBuffer() but from an ISR. The completion still runs in the SD card task, so if
+ * the buffer could not be queued it is not called at all.
+ */
+SDHandle IRAM_ATTR submitSDBufferFromISR(SDLane lane, SDBuffer* buffer, const char* path, SDCallback callback = NULL,
+                                         SDCompletion completion = NULL, void* context = NULL);
+
+/** Check on a buffer submitted with submitSDBuffer(). */
+SDStatus pollSDBuffer(SDHandle handle);
+
+/** Get the statistics for an SD card task lane. */
+void getSDLaneStats(SDLane lane, SDLaneStats* stats);
@@ -1,45 +1,43 @@
 #include "settings.h"
 
 #include <stdio.h>
-#include <esp_spiffs.h>
 
-// TODO: move to LittleFS which is faster and wastes less space
-// See https://github.com/joltwallet/esp_littlefs
-
-#define BASE_SETTINGS_PATH "/spiffs"
+// The data partition the settings are stored in (raw, see settings_store.hpp and partitions.csv)
 #define SETTINGS_PARTITION_LABEL "settings"
 
-/** Set up the settings for the program. Settings are persistently stored in SPIFFS. */
-void setupSettings() {
-    esp_vfs_spiffs_conf_t conf = {  // -> esp_vfs_littlefs_conf_t
-        .base_path = BASE_SETTINGS_PATH,
-        .partition_label = SETTINGS_PARTITION_LABEL,
-        .max_files = 5, // max simultaneously open files
-        .format_if_mount_failed = true,
-    };
-    ESP_ERROR_CHECK(esp_vfs_spiffs_register(&conf));  // -> esp_vfs_littlefs_register
+SettingsStore* settings = NULL;
+
+/**
+ * Set up the settings for the program. Settings are persistently stored in a log in the on-chip
+ * flash. If that isn't available, they are still kept in RAM.
+ */
+bool setupSettings() {
+    if (settings) { return true; }
+    SettingsFlash* flash = create_partition_settings_flash(SETTINGS_PARTITION_LABEL);
+    if (!flash) { printf("!! Settings partition '%s' not found\n", SETTINGS_PARTITION_LABEL); }
+    settings = new SettingsStore(flash);
+    if (!flash || !settings->begin()) {
+        printf("!! Failed to load settings, they will not be saved\n");
+        return false;
+    }
+    return true;
 }
 
+/** Get the persistent settings store. */
+SettingsStore* getSettings() { return settings; }
 
-///// Counter /////
 
-int _counter = -1; // cache the counter value, -1 means it hasn't been read yet
+///// Counter /////
 
 /** Get the current, persistently increasing, counter value. */
-int getCounter() {
-    if (_counter < 0) {
-        _counter = 0;
-        FILE* file = fopen(BASE_SETTINGS_PATH "/counter", "r");
-        if (file) { fread((uint8_t*)&_counter, sizeof(_counter), 1, file); fclose(file); }
-    }
-    return _counter;
-}
+int getCounter() { return settings ? settings->getInt(SETTING_COUNTER, 0) : 0; }
 
 /** Set the current, persistently increasing, counter value. Return the new value. */
 int setCounter(int counter) {
-    FILE* file = fopen(BASE_SETTINGS_PATH "/counter", "w");
-    if (file) { fwrite((uint8_t*)&counter, sizeof(counter), 1, file); fclose(file); }
-    _counter = counter;
+    if (settings) {
+        settings->setInt(SETTING_COUNTER, counter);
+        settings->commit();
+    }
     return counter;
 }
 
@@ -1,8 +1,28 @@
 #pragma once
 
+#include "settings_store.hpp"
 
-/** Set up the settings for the program. Settings are persistently stored on-chip. */
-void setupSettings();
+
+/**
+ * Set up the settings for the program. Settings are persistently stored on-chip.
+ * Returns false if the settings partition can't be used (settings then only last until restart).
+ */
+bool setupSettings();
+
+/**
+ * Keys of the persistent settings. New settings get new keys (never reuse or renumber a key since
+ * the stored values would be read as the wrong setting). Keys must be less than SETTINGS_MAX_KEYS.
+ */
+enum SettingKey : uint16_t {
+    SETTING_COUNTER = 1,
+};
+
+/**
+ * Get the persistent settings store, for typed access to any of the settings. Changes must be
+ * committed with commit() to be saved (batch several changes into one commit when possible).
+ * Returns NULL before setupSettings() is called.
+ */
+SettingsStore* getSettings();
 
 
 ///// Counter /////
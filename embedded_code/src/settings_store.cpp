@@ -0,0 +1,237 @@
+#include "settings_store.hpp"
+
+#include <string.h>
+#include <stddef.h>
+
+// Each sector starts with a header, which is written last when the values are moved to a sector
+#define SECTOR_MAGIC 0x54535154 // "TQST"
+struct SectorHeader {
+    uint32_t magic;
+    uint32_t sequence; // the sector with the highest sequence is the active one
+};
+
+// Each record is a header followed by the value, padded to a multiple of 4 bytes
+struct RecordHeader {
+    uint16_t key; // 0xFFFF (erased) marks the end of the records
+    SettingType type;
+    uint8_t length;
+    uint32_t crc; // CRC-32 of the key, type, length, and value
+};
+static_assert(sizeof(SectorHeader) == 8 && sizeof(RecordHeader) == 8, "Settings headers must be packed");
+static_assert(SETTINGS_MAX_VALUE <= 255, "Settings value lengths must fit in a byte");
+
+#define ERASED_KEY 0xFFFF
+#define RECORD_SIZE(length) (sizeof(RecordHeader) + (((length) + 3) & ~3))
+#define MAX_RECORD_SIZE RECORD_SIZE(SETTINGS_MAX_VALUE)
+// Every value has to fit in a single sector when they are moved to the next one
+#define MIN_SECTOR_SIZE (sizeof(SectorHeader) + SETTINGS_MAX_KEYS * MAX_RECORD_SIZE)
+static_assert(MIN_SECTOR_SIZE <= 4096, "Settings must fit in a 4 KB flash sector");
+static_assert(SETTINGS_PENDING_SIZE >= MAX_RECORD_SIZE, "Settings pending buffer must fit a record");
+
+
+/** CRC-32 (the same as zlib), continuing from a previous crc (start with 0). */
+static uint32_t crc32(uint32_t crc, const void* data, uint32_t length) {
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    while (length--) {
+        crc ^= *bytes++;
+        for (int i = 0; i < 8; i++) { crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1)); }
+    }
+    return ~crc;
+}
+
+/** The CRC of a record. */
+static uint32_t recordCRC(const RecordHeader& header, const void* value) {
+    return crc32(crc32(0, &header, offsetof(RecordHeader, crc)), value, header.length);
+}
+
+/** Build a record in out (which must have room for RECORD_SIZE(length)). Returns its size. */
+static uint32_t makeRecord(uint8_t* out, uint16_t key, SettingType type, const void* value, uint8_t length) {
+    RecordHeader header = { key, type, length, 0 };
+    header.crc = recordCRC(header, value);
+    memcpy(out, &header, sizeof(header));
+    memcpy(out + sizeof(header), value, length);
+    uint32_t size = RECORD_SIZE(length);
+    memset(out + sizeof(header) + length, 0xFF, size - sizeof(header) - length); // leave padding erased
+    return size;
+}
+
+
+SettingsStore::SettingsStore(SettingsFlash* flash) : flash(flash) {
+    memset(entries, 0, sizeof(entries));
+}
+
+/**
+ * Load the records of a sector into the cache. Stops at the end of the records or at a damaged
+ * record (after which the sector is no longer written to). Returns false if reading failed.
+ */
+bool SettingsStore::scanSector(uint32_t sector) {
+    memset(entries, 0, sizeof(entries));
+    needsCompaction = false;
+    const uint32_t size = flash->sectorSize();
+    uint32_t offset = sizeof(SectorHeader);
+    uint8_t value[SETTINGS_MAX_VALUE];
+    while (offset + sizeof(RecordHeader) <= size) {
+        RecordHeader header;
+        if (!flash->read(sector, offset, &header, sizeof(header))) { return false; }
+        if (header.key == ERASED_KEY && header.type == 0xFF && header.length == 0xFF) { break; }
+
+        uint32_t recordSize = RECORD_SIZE(header.length);
+        if (header.key >= SETTINGS_MAX_KEYS || header.length > SETTINGS_MAX_VALUE || offset + recordSize > size ||
+            !flash->read(sector, offset + sizeof(header), value, header.length) ||
+            recordCRC(header, value) != header.crc) {
+            // Damaged (e.g. the power was cut while writing it), so nothing after it can be trusted
+            // and the rest of the sector might be partly written
+            needsCompaction = true;
+            offset = size;
+            break;
+        }
+
+        Entry& entry = entries[header.key];
+        entry.type = header.type;
+        entry.length = header.type == SETTING_NONE ? 0 : header.length;
+        memcpy(entry.value, value, entry.length);
+        offset += recordSize;
+    }
+    writeOffset = offset;
+    return true;
+}
+
+/**
+ * Find the active sector and load all of the values into the cache. If there isn't one, the store
+ * starts out empty.
+ */
+bool SettingsStore::begin() {
+    if (!flash || flash->sectorCount() < 2 || flash->sectorSize() < MIN_SECTOR_SIZE) { return false; }
+
+    // Find the sector with the highest sequence
+    bool found = false;
+    for (uint32_t i = 0; i < flash->sectorCount(); i++) {
+        SectorHeader header;
+        if (!flash->read(i, 0, &header, sizeof(header))) { return false; }
+        if (header.magic == SECTOR_MAGIC && (!found || (int32_t)(header.sequence - sequence) > 0)) {
+            found = true;
+            activeSector = i;
+            sequence = header.sequence;
+        }
+    }
+    pendingLength = 0;
+
+    if (!found) {
+        // Never used (or completely damaged): start with an empty first sector
+        memset(entries, 0, sizeof(entries));
+        activeSector = flash->sectorCount() - 1; // so compact() uses sector 0
+        sequence = 0;
+        loaded = compact();
+    } else {
+        loaded = scanSector(activeSector);
+    }
+    return loaded;
+}
+
+/**
+ * Write the latest value of every key to the next sector and make it the active sector. The old
+ * sector stays valid until the header of the new one is written at the very end.
+ */
+bool SettingsStore::compact() {
+    uint32_t next = (activeSector + 1) % flash->sectorCount();
+    if (!flash->erase(next)) { return false; }
+
+    uint32_t offset = sizeof(SectorHeader);
+    uint8_t record[MAX_RECORD_SIZE];
+    for (uint16_t key = 0; key < SETTINGS_MAX_KEYS; key++) {
+        const Entry& entry = entries[key];
+        if (entry.type == SETTING_NONE) { continue; }
+        uint32_t size = makeRecord(record, key, entry.type, entry.value, entry.length);
+        if (!flash->write(next, offset, record, size)) { return false; }
+        offset += size;
+    }
+
+    SectorHeader header = { SECTOR_MAGIC, sequence + 1 };
+    if (!flash->write(next, 0, &header, sizeof(header))) { return false; }
+
+    activeSector = next;
+    sequence++;
+    writeOffset = offset;
+    pendingLength = 0; // already in the cache
+    needsCompaction = false;
+    compactions++;
+    return true;
+}
+
+/** Write all of the queued changes in one write. */
+bool SettingsStore::commit() {
+    if (!loaded) { return false; }
+    if (pendingLength == 0 && !needsCompaction) { return true; }
+    if (needsCompaction || writeOffset + pendingLength > flash->sectorSize()) { return compact(); }
+    if (!flash->write(activeSector, writeOffset, pending, pendingLength)) {
+        needsCompaction = true; // the write may have been partly done
+        return false;
+    }
+    writeOffset += pendingLength;
+    pendingLength = 0;
+    commits++;
+    return true;
+}
+
+/** Update the cache and queue a record for the value (unless it hasn't changed). */
+bool SettingsStore::set(uint16_t key, SettingType type, const void* value, uint8_t length) {
+    if (key >= SETTINGS_MAX_KEYS || length > SETTINGS_MAX_VALUE) { return false; }
+    Entry& entry = entries[key];
+    if (entry.type == type && entry.length == length && memcmp(entry.value, value, length) == 0) { return true; }
+    if (pendingLength + RECORD_SIZE(length) > SETTINGS_PENDING_SIZE && !commit()) {
+        // Everything is in the cache, so it will all be written by the next (successful) compaction
+        pendingLength = 0;
+        needsCompaction = true;
+    }
+
+    entry.type = type;
+    entry.length = length;
+    memcpy(entry.value, value, length);
+    pendingLength += makeRecord(&pending[pendingLength], key, type, value, length);
+    return true;
+}
+
+const SettingsStore::Entry* SettingsStore::find(uint16_t key, SettingType type) const {
+    if (key >= SETTINGS_MAX_KEYS || entries[key].type != type) { return NULL; }
+    return &entries[key];
+}
+
+int32_t SettingsStore::getInt(uint16_t key, int32_t defaultValue) const {
+    const Entry* entry = find(key, SETTING_INT32);
+    if (!entry) { return defaultValue; }
+    int32_t value;
+    memcpy(&value, entry->value, sizeof(value));
+    return value;
+}
+
+float SettingsStore::getFloat(uint16_t key, float defaultValue) const {
+    const Entry* entry = find(key, SETTING_FLOAT);
+    if (!entry) { return defaultValue; }
+    float value;
+    memcpy(&value, entry->value, sizeof(value));
+    return value;
+}
+
+uint32_t SettingsStore::getBlob(uint16_t key, void* data, uint32_t maxLength) const {
+    const Entry* entry = find(key, SETTING_BLOB);
+    if (!entry) { return 0; }
+    memcpy(data, entry->value, entry->length < maxLength ? entry->length : maxLength);
+    return entry->length;
+}
+
+bool SettingsStore::has(uint16_t key) const { return key < SETTINGS_MAX_KEYS && entries[key].type != SETTING_NONE; }
+
+bool SettingsStore::setInt(uint16_t key, int32_t value) { return set(key, SETTING_INT32, &value, sizeof(value)); }
+bool SettingsStore::setFloat(uint16_t key, float value) { return set(key, SETTING_FLOAT, &value, sizeof(value)); }
+bool SettingsStore::setBlob(uint16_t key, const void* data, uint32_t length) {
+    return length <= SETTINGS_MAX_VALUE && set(key, SETTING_BLOB, data, (uint8_t)length);
+}
+bool SettingsStore::remove(uint16_t key) { return !has(key) || set(key, SETTING_NONE, "", 0); }
+
+void SettingsStore::stats(SettingsStoreStats* stats) const {
+    stats->used = writeOffset;
+    stats->commits = commits;
+    stats->compactions = compactions;
+    stats->sequence = sequence;
+}
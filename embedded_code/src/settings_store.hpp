@@ -0,0 +1,169 @@
+/**
+ * Persistent key-value store for settings, kept in a log in raw flash.
+ *
+ * The flash is split into sectors (the smallest unit that can be erased).
+ * One sector is active at a time and each change is appended to it as a
+ * record with a CRC. Changes are batched: set*() only updates the RAM cache
+ * and queues the record, commit() writes all of the queued records with a
+ * single flash write. A record that was only partly written (e.g. the power
+ * was cut) fails its CRC and is ignored, so a commit is all-or-nothing for
+ * each record.
+ *
+ * When the active sector is full the latest value of every key is written
+ * to the next sector (round-robin over all of the sectors), whose header is
+ * written last so the old sector stays valid until the new one is complete.
+ * This compaction rewrites every key, changed or not, so only set*() calls
+ * that change a value add records. A sector is erased once each time the
+ * log fills up, and the round-robin spreads those erases evenly over all of
+ * the sectors.
+ *
+ * All sectors are scanned once by begin(), after that every get is O(1)
+ * from the RAM cache (keys index an array directly).
+ *
+ * The store is not thread-safe, it should be used from one task at a time.
+ *
+ * Flash access goes through SettingsFlash so the store can also run on top
+ * of a file (e.g. on Linux) with create_file_settings_flash().
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Keys must be less than this
+#define SETTINGS_MAX_KEYS 32
+// Longest value (e.g. a blob of calibration data)
+#define SETTINGS_MAX_VALUE 64
+// Records waiting for commit() (committed automatically when full)
+#define SETTINGS_PENDING_SIZE 512
+
+/** Raw access to the flash (or a stand-in for it) used by SettingsStore. */
+class SettingsFlash {
+public:
+    virtual ~SettingsFlash() { }
+
+    /** The size of each sector (the unit that is erased). */
+    virtual uint32_t sectorSize() const = 0;
+
+    /** The number of sectors, there must be at least 2. */
+    virtual uint32_t sectorCount() const = 0;
+
+    /** Read from a sector. */
+    virtual bool read(uint32_t sector, uint32_t offset, void* data, uint32_t length) = 0;
+
+    /**
+     * Write to a sector. Like NOR flash, writing can only clear bits, so anything written must
+     * still be erased (all 0xFF). Offsets and lengths are multiples of 4.
+     */
+    virtual bool write(uint32_t sector, uint32_t offset, const void* data, uint32_t length) = 0;
+
+    /** Erase a sector, setting it to all 0xFF. */
+    virtual bool erase(uint32_t sector) = 0;
+};
+
+/**
+ * Create a SettingsFlash for the data partition with the given label (ESP32 only). Returns NULL if
+ * there is no such partition.
+ */
+SettingsFlash* create_partition_settings_flash(const char* label);
+
+/**
+ * Create a SettingsFlash backed by a file, for testing on a computer. The file is created (erased)
+ * if it doesn't exist. Writes behave like NOR flash (they can only clear bits). Returns NULL if the
+ * file can't be opened.
+ */
+SettingsFlash* create_file_settings_flash(const char* path, uint32_t sectorSize = 4096, uint32_t sectorCount = 2);
+
+/** The type of a setting value. */
+enum SettingType : uint8_t {
+    SETTING_NONE = 0,   // not set (or removed)
+    SETTING_INT32 = 1,
+    SETTING_FLOAT = 2,
+    SETTING_BLOB = 3,
+};
+
+/** Statistics about the flash use of a SettingsStore. */
+struct SettingsStoreStats {
+    uint32_t used;          // bytes used in the active sector
+    uint32_t commits;       // number of commits that wrote to flash
+    uint32_t compactions;   // number of times the values were moved to the next sector (each erases one sector)
+    uint32_t sequence;      // sequence number of the active sector (counts compactions over the life of the flash)
+};
+
+class SettingsStore {
+    SettingsFlash* const flash;
+
+    // Cache of every value, indexed by key
+    struct Entry {
+        SettingType type;
+        uint8_t length;
+        uint8_t value[SETTINGS_MAX_VALUE];
+    } entries[SETTINGS_MAX_KEYS];
+
+    uint32_t activeSector = 0;
+    uint32_t sequence = 0;
+    uint32_t writeOffset = 0; // where the next record goes in the active sector
+    bool needsCompaction = false; // set if the active sector has damaged records
+    bool loaded = false; // set once begin() succeeds, before that nothing is written
+
+    // Records waiting to be committed
+    uint8_t pending[SETTINGS_PENDING_SIZE];
+    uint32_t pendingLength = 0;
+
+    uint32_t commits = 0;
+    uint32_t compactions = 0;
+
+    bool scanSector(uint32_t sector);
+    bool compact();
+    bool set(uint16_t key, SettingType type, const void* value, uint8_t length);
+    const Entry* find(uint16_t key, SettingType type) const;
+
+public:
+    /** Create a store on top of some flash, begin() must be called before using it. */
+    explicit SettingsStore(SettingsFlash* flash);
+
+    /**
+     * Find the active sector and load all of the values into the cache. If the flash has never
+     * been used (or is damaged), it is erased and the store starts out empty. Returns false if
+     * the flash can't be read or written.
+     */
+    bool begin();
+
+    /** Get an integer setting, or the default if it isn't set. */
+    int32_t getInt(uint16_t key, int32_t defaultValue = 0) const;
+
+    /** Get a float setting, or the default if it isn't set. */
+    float getFloat(uint16_t key, float defaultValue = 0.0f) const;
+
+    /**
+     * Get a blob setting, copying up to maxLength bytes of it into data. Returns its full length
+     * (0 if it isn't set).
+     */
+    uint32_t getBlob(uint16_t key, void* data, uint32_t maxLength) const;
+
+    /** Check if a setting is set (with any type). */
+    bool has(uint16_t key) const;
+
+    /**
+     * Set a value. This only updates the cache and queues the change for commit(); nothing is
+     * queued if the value is the same. Returns false if the key or length is out of range.
+     */
+    bool setInt(uint16_t key, int32_t value);
+    bool setFloat(uint16_t key, float value);
+    bool setBlob(uint16_t key, const void* data, uint32_t length);
+
+    /** Remove a setting (queued for commit() like setting it). */
+    bool remove(uint16_t key);
+
+    /**
+     * Write all of the queued changes to the flash in one write (moving everything to the next
+     * sector first if there isn't room). Returns false if writing failed or begin() didn't succeed
+     * (the cache keeps the new values, and they will be written with the next compaction).
+     */
+    bool commit();
+
+    /** Get the flash use statistics. */
+    void stats(SettingsStoreStats* stats) const;
+};
@@ -0,0 +1,71 @@
+/**
+ * A stand-in for the settings flash that is backed by a file, so the settings
+ * store can be used and tested on a computer. Writes behave like NOR flash:
+ * they can only clear bits and erasing sets a whole sector to 0xFF.
+ */
+
+#include "settings_store.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+class FileSettingsFlash : public SettingsFlash {
+    FILE* file;
+    const uint32_t size;
+    const uint32_t count;
+
+public:
+    FileSettingsFlash(FILE* file, uint32_t sectorSize, uint32_t sectorCount) :
+        file(file), size(sectorSize), count(sectorCount) { }
+    ~FileSettingsFlash() override { fclose(file); }
+
+    uint32_t sectorSize() const override { return size; }
+    uint32_t sectorCount() const override { return count; }
+
+    bool read(uint32_t sector, uint32_t offset, void* data, uint32_t length) override {
+        if (sector >= count || offset + length > size) { return false; }
+        return fseek(file, sector * size + offset, SEEK_SET) == 0 && fread(data, 1, length, file) == length;
+    }
+
+    bool write(uint32_t sector, uint32_t offset, const void* data, uint32_t length) override {
+        if (sector >= count || offset + length > size || offset % 4 || length % 4) { return false; }
+        uint8_t* current = (uint8_t*)malloc(length);
+        if (!current) { return false; }
+        bool ok = read(sector, offset, current, length);
+        for (uint32_t i = 0; ok && i < length; i++) { current[i] &= ((const uint8_t*)data)[i]; } // only clears bits
+        ok = ok && fseek(file, sector * size + offset, SEEK_SET) == 0 &&
+             fwrite(current, 1, length, file) == length && fflush(file) == 0;
+        free(current);
+        return ok;
+    }
+
+    bool erase(uint32_t sector) override {
+        if (sector >= count || fseek(file, sector * size, SEEK_SET) != 0) { return false; }
+        uint8_t erased[256];
+        memset(erased, 0xFF, sizeof(erased));
+        for (uint32_t pos = 0; pos < size; pos += sizeof(erased)) {
+            uint32_t n = size - pos < sizeof(erased) ? size - pos : sizeof(erased);
+            if (fwrite(erased, 1, n, file) != n) { return false; }
+        }
+        return fflush(file) == 0;
+    }
+};
+
+/**
+ * Create a SettingsFlash backed by a file. The file is created (erased) if it doesn't exist.
+ */
+SettingsFlash* create_file_settings_flash(const char* path, uint32_t sectorSize, uint32_t sectorCount) {
+    FILE* file = fopen(path, "r+b");
+    bool created = false;
+    if (!file) {
+        file = fopen(path, "w+b");
+        created = true;
+    }
+    if (!file) { return NULL; }
+    FileSettingsFlash* flash = new FileSettingsFlash(file, sectorSize, sectorCount);
+    for (uint32_t i = 0; created && i < sectorCount; i++) {
+        if (!flash->erase(i)) { delete flash; return NULL; }
+    }
+    return flash;
+}
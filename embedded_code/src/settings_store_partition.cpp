@@ -0,0 +1,46 @@
+/**
+ * The settings flash on the ESP32: a data partition in the on-chip flash,
+ * accessed with the esp_partition API.
+ */
+
+#include "settings_store.hpp"
+
+#ifdef ESP_PLATFORM
+
+#include <esp_partition.h>
+
+class PartitionSettingsFlash : public SettingsFlash {
+    const esp_partition_t* const partition;
+
+public:
+    explicit PartitionSettingsFlash(const esp_partition_t* partition) : partition(partition) { }
+
+    uint32_t sectorSize() const override { return SPI_FLASH_SEC_SIZE; }
+    uint32_t sectorCount() const override { return partition->size / SPI_FLASH_SEC_SIZE; }
+
+    bool read(uint32_t sector, uint32_t offset, void* data, uint32_t length) override {
+        return esp_partition_read(partition, sector * SPI_FLASH_SEC_SIZE + offset, data, length) == ESP_OK;
+    }
+
+    bool write(uint32_t sector, uint32_t offset, const void* data, uint32_t length) override {
+        return esp_partition_write(partition, sector * SPI_FLASH_SEC_SIZE + offset, data, length) == ESP_OK;
+    }
+
+    bool erase(uint32_t sector) override {
+        return esp_partition_erase_range(partition, sector * SPI_FLASH_SEC_SIZE, SPI_FLASH_SEC_SIZE) == ESP_OK;
+    }
+};
+
+/** Create a SettingsFlash for the data partition with the given label. */
+SettingsFlash* create_partition_settings_flash(const char* label) {
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+    if (!partition) { return NULL; }
+    return new PartitionSettingsFlash(partition);
+}
+
+#else
+
+/** There is no on-chip flash when not running on an ESP32. */
+SettingsFlash* create_partition_settings_flash(const char* label) { return NULL; }
+
+#endif
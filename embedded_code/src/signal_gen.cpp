@@ -0,0 +1,167 @@
+#include "signal_gen.hpp"
+#include "audio_mix.h"
+#include "fast_math.hpp"
+
+#include <math.h>
+#include <string.h>
+
+static_assert((2 * SIGNAL_MAX_DELAY & (2 * SIGNAL_MAX_DELAY - 1)) == 0, "SIGNAL_MAX_DELAY must be a power of 2");
+
+
+SignalGenerator::SignalGenerator(float sampleRate) : sampleRate(sampleRate) {
+    memset(history, 0, sizeof(history));
+}
+
+void SignalGenerator::setTone(Oscillator& osc, float frequency, float phase, float amp) {
+    const float w = 2.0f * (float)M_PI * frequency / sampleRate;
+    osc.re = cosf(phase); osc.im = sinf(phase);
+    osc.stepRe = cosf(w); osc.stepIm = sinf(w);
+    osc.amp = amp;
+}
+
+void SignalGenerator::setSine(float frequency, float amplitude) {
+    setTone(tones[0], frequency, 0, amplitude);
+    toneCount = 1;
+    type = SIGNAL_SINE;
+}
+
+void SignalGenerator::setMultitone(const float* frequencies, uint8_t count, float amplitude) {
+    if (count > SIGNAL_MAX_TONES) { count = SIGNAL_MAX_TONES; }
+    for (uint8_t k = 0; k < count; k++) {
+        setTone(tones[k], frequencies[k], -(float)M_PI * k * (k + 1) / count, amplitude / count);
+    }
+    toneCount = count;
+    type = count ? SIGNAL_MULTITONE : SIGNAL_SILENCE;
+}
+
+void SignalGenerator::setSweep(float startHz, float endHz, float seconds, bool logarithmic, float amplitude) {
+    setTone(tones[0], startHz, 0, amplitude);
+    toneCount = 1;
+    sweepStart = startHz;
+    sweepEnd = endHz;
+    sweepLog = logarithmic && startHz > 0 && endHz > 0;
+    sweepPosition = 0;
+    sweepRate = seconds > 0 ? 1.0f / (seconds * sampleRate) : 0;
+    type = SIGNAL_SWEEP;
+}
+
+void SignalGenerator::setNoise(float amplitude, uint32_t seed) {
+    this->amplitude = amplitude;
+    noiseState = seed ? seed : 1; // xorshift gets stuck at 0
+    type = SIGNAL_NOISE;
+}
+
+void SignalGenerator::setImpulses(float periodSeconds, float amplitude) {
+    this->amplitude = amplitude;
+    impulsePeriod = (uint32_t)(periodSeconds * sampleRate + 0.5f);
+    if (impulsePeriod == 0) { impulsePeriod = 1; }
+    impulseCountdown = 0;
+    type = SIGNAL_IMPULSES;
+}
+
+void SignalGenerator::setStereo(float delaySamples, float attenuation) {
+    if (delaySamples > SIGNAL_MAX_DELAY) { delaySamples = SIGNAL_MAX_DELAY; }
+    if (delaySamples < -SIGNAL_MAX_DELAY) { delaySamples = -SIGNAL_MAX_DELAY; }
+    delayRight = delaySamples > 0 ? delaySamples : 0;
+    delayLeft = delaySamples < 0 ? -delaySamples : 0;
+    this->attenuation = attenuation;
+}
+
+
+///// Generating /////
+
+/** Rotate an oscillator by its step for a chunk of samples, adding its output to mono. */
+static inline void OPTIMIZE_FOR_SPEED rotate(float& re, float& im, float stepRe, float stepIm, float amp, float* mono, uint32_t count) {
+    float r = re, i = im;
+    for (uint32_t n = 0; n < count; n++) {
+        mono[n] += amp * i;
+        const float t = r * stepRe - i * stepIm;
+        i = r * stepIm + i * stepRe;
+        r = t;
+    }
+    // Pull the phasor back to unit length (one Newton step of 1/sqrt is plenty since it only drifts
+    // by rounding errors)
+    const float g = 1.5f - 0.5f * (r * r + i * i);
+    re = r * g; im = i * g;
+}
+
+/** Generate up to SIGNAL_CHUNK samples of the signal (before the stereo delay). */
+void OPTIMIZE_FOR_SPEED SignalGenerator::fill(float* mono, uint32_t count) {
+    memset(mono, 0, count * sizeof(float));
+    switch (type) {
+    case SIGNAL_SWEEP: {
+        Oscillator& osc = tones[0];
+        const float frequency = sweepLog
+            ? sweepStart * expf(sweepPosition * logf(sweepEnd / sweepStart))
+            : sweepStart + (sweepEnd - sweepStart) * sweepPosition;
+        sincos_fast(2.0f * (float)M_PI * frequency / sampleRate, &osc.stepIm, &osc.stepRe);
+        sweepPosition += sweepRate * count;
+        if (sweepPosition >= 1.0f) { sweepPosition -= (int)sweepPosition; }
+        rotate(osc.re, osc.im, osc.stepRe, osc.stepIm, osc.amp, mono, count);
+        break;
+    }
+    case SIGNAL_SINE:
+    case SIGNAL_MULTITONE:
+        for (uint8_t k = 0; k < toneCount; k++) {
+            Oscillator& osc = tones[k];
+            rotate(osc.re, osc.im, osc.stepRe, osc.stepIm, osc.amp, mono, count);
+        }
+        break;
+    case SIGNAL_NOISE: {
+        uint32_t x = noiseState;
+        const float scale = amplitude / 2147483648.0f;
+        for (uint32_t n = 0; n < count; n++) {
+            x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+            mono[n] = (int32_t)x * scale;
+        }
+        noiseState = x;
+        break;
+    }
+    case SIGNAL_IMPULSES:
+        for (uint32_t n = 0; n < count; n++) {
+            if (impulseCountdown == 0) { mono[n] = amplitude; impulseCountdown = impulsePeriod; }
+            impulseCountdown--;
+        }
+        break;
+    case SIGNAL_SILENCE:
+    default:
+        break;
+    }
+}
+
+/** Get the sample from the given (fractional) number of samples before the newest one in the history. */
+inline float SignalGenerator::delayed(float delay) const {
+    const uint32_t whole = (uint32_t)delay;
+    const float frac = delay - whole;
+    const float a = history[(historyPos - whole) & (HISTORY - 1)];
+    if (frac == 0) { return a; }
+    const float b = history[(historyPos - whole - 1) & (HISTORY - 1)];
+    return a + (b - a) * frac;
+}
+
+void OPTIMIZE_FOR_SPEED SignalGenerator::generate(float* output, uint32_t frames) {
+    float mono[SIGNAL_CHUNK];
+    while (frames > 0) {
+        const uint32_t count = frames < SIGNAL_CHUNK ? frames : SIGNAL_CHUNK;
+        fill(mono, count);
+        for (uint32_t n = 0; n < count; n++) {
+            historyPos = (historyPos + 1) & (HISTORY - 1);
+            history[historyPos] = mono[n];
+            output[2 * n] = delayed(delayLeft);
+            output[2 * n + 1] = attenuation * delayed(delayRight);
+        }
+        output += 2 * count;
+        frames -= count;
+    }
+}
+
+void OPTIMIZE_FOR_SPEED SignalGenerator::generate(int16_t* output, uint32_t frames) {
+    float block[2 * SIGNAL_CHUNK];
+    while (frames > 0) {
+        const uint32_t count = frames < SIGNAL_CHUNK ? frames : SIGNAL_CHUNK;
+        generate(block, count);
+        for (uint32_t n = 0; n < 2 * count; n++) { output[n] = saturate16(block[n] * 32767.0f); }
+        output += 2 * count;
+        frames -= count;
+    }
+}
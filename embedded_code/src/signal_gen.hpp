@@ -0,0 +1,114 @@
+/**
+ * Test signals for characterizing the audio path and the DUET code: sines,
+ * multitones, sweeps, white noise and impulse trains.
+ *
+ * The oscillators never call sin() per sample. Each one is a phasor that is
+ * rotated by a fixed complex step every sample (two multiplies and two
+ * multiply-adds), and is renormalized once per chunk of samples so its
+ * amplitude doesn't drift. Sweeps change their step once per chunk (with
+ * sincos_fast()), which keeps the phase continuous. Nothing grows with time, so
+ * a generator can run forever.
+ *
+ * The output is interleaved stereo where the right channel is a delayed and
+ * attenuated copy of the left. The delay can be fractional (linearly
+ * interpolated) and negative (the left channel is delayed instead), which
+ * matches the mixing model used by DUET so its estimates can be checked.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Most tones in a multitone
+#define SIGNAL_MAX_TONES 8
+// Most inter-channel delay in samples (either way)
+#define SIGNAL_MAX_DELAY 64
+// Samples generated between renormalizing the oscillators and updating sweeps
+#define SIGNAL_CHUNK 32
+
+/** The kinds of signal made by a SignalGenerator. */
+enum SignalType : uint8_t {
+    SIGNAL_SILENCE,
+    SIGNAL_SINE,
+    SIGNAL_MULTITONE,
+    SIGNAL_SWEEP,
+    SIGNAL_NOISE,
+    SIGNAL_IMPULSES,
+};
+
+class SignalGenerator {
+    /** A unit phasor, the rotation applied to it every sample, and its amplitude. */
+    struct Oscillator { float re, im, stepRe, stepIm, amp; };
+
+    const float sampleRate;
+    SignalType type = SIGNAL_SILENCE;
+    float amplitude = 0;
+
+    Oscillator tones[SIGNAL_MAX_TONES];
+    uint8_t toneCount = 0;
+
+    float sweepStart = 0, sweepEnd = 0; // Hz
+    float sweepPosition = 0;            // in [0, 1)
+    float sweepRate = 0;                // change in position per sample
+    bool sweepLog = false;
+
+    uint32_t noiseState = 1;
+    uint32_t impulsePeriod = 0, impulseCountdown = 0;
+
+    // The right channel is the left channel delayed by delayRight samples (or the left is the right
+    // delayed by delayLeft) and scaled by attenuation
+    float delayLeft = 0, delayRight = 0, attenuation = 1;
+    static const uint32_t HISTORY = 2 * SIGNAL_MAX_DELAY; // power of 2 with room for the delay
+    float history[HISTORY];
+    uint32_t historyPos = 0;
+
+    void setTone(Oscillator& osc, float frequency, float phase, float amp);
+    void fill(float* mono, uint32_t count);
+    float delayed(float delay) const;
+
+public:
+    /** Create a generator that is silent until a signal is chosen. */
+    explicit SignalGenerator(float sampleRate);
+
+    /** Generate a sine wave. The amplitude is relative to full scale (0 to 1). */
+    void setSine(float frequency, float amplitude);
+
+    /**
+     * Generate the sum of several sines with the total amplitude split evenly between them. The
+     * starting phases are spread out (Schroeder phases) to keep the peaks low.
+     */
+    void setMultitone(const float* frequencies, uint8_t count, float amplitude);
+
+    /**
+     * Generate a sweep from startHz to endHz over the given time, then start over. A logarithmic
+     * sweep spends the same time on each octave.
+     */
+    void setSweep(float startHz, float endHz, float seconds, bool logarithmic, float amplitude);
+
+    /** Generate uniform white noise (a xorshift generator, so the same seed gives the same noise). */
+    void setNoise(float amplitude, uint32_t seed = 1);
+
+    /** Generate single-sample impulses with the given period, starting with the next sample. */
+    void setImpulses(float periodSeconds, float amplitude);
+
+    /** Generate silence. */
+    void setSilence() { type = SIGNAL_SILENCE; }
+
+    /**
+     * Set how the right channel differs from the left: the delay in samples (positive when the
+     * right channel lags, fractions allowed, clamped to SIGNAL_MAX_DELAY) and the attenuation of the
+     * right channel relative to the left.
+     */
+    void setStereo(float delaySamples, float attenuation);
+
+    /** The kind of signal being generated. */
+    SignalType getType() const { return type; }
+
+    /** Generate a block of interleaved stereo 16-bit audio, rounded and saturated. */
+    void generate(int16_t* output, uint32_t frames);
+
+    /** Generate a block of interleaved stereo float audio (full scale is 1). */
+    void generate(float* output, uint32_t frames);
+};
@@ -0,0 +1,57 @@
+/**
+ * Lock-free single-producer/single-consumer queue of small values with a
+ * fixed capacity, for handing events from an ISR to a task.
+ *
+ * push() is constant time and never waits, so it is safe to call from an ISR
+ * (it is always inlined so it ends up in IRAM along with the ISR). If the
+ * queue is full the value is dropped and counted.
+ *
+ * Only the producer may call push() and only the consumer may call peek() and
+ * pop(). The number dropped can be read from any task.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, uint32_t N>
+class SPSCQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "SPSCQueue capacity must be a power of 2");
+
+    T items[N];
+
+    // Free-running counts, the difference is the number of items waiting
+    std::atomic<uint32_t> head; // written by the producer
+    std::atomic<uint32_t> tail; // written by the consumer
+    std::atomic<uint32_t> dropped; // written by the producer
+
+public:
+    SPSCQueue() : head(0), tail(0), dropped(0) { }
+
+    /** Add an item to the queue. Returns false (and counts it) if the queue is full. */
+    inline __attribute__((always_inline)) bool push(const T& item) {
+        uint32_t h = head.load(std::memory_order_relaxed);
+        if (h - tail.load(std::memory_order_acquire) >= N) {
+            dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        items[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Get the oldest item without removing it. Returns false if the queue is empty. */
+    inline bool peek(T& item) const {
+        uint32_t t = tail.load(std::memory_order_relaxed);
+        if (head.load(std::memory_order_acquire) == t) { return false; }
+        item = items[t & (N - 1)];
+        return true;
+    }
+
+    /** Remove the oldest item (after looking at it with peek()). */
+    inline void pop() { tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release); }
+
+    /** The number of items that were dropped because the queue was full. */
+    inline uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+};
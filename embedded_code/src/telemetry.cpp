@@ -0,0 +1,165 @@
+#include "telemetry.h"
+
+#include <Arduino.h>  // Serial
+#include <esp_timer.h>
+#include <math.h>
+#include <string.h>
+
+// Most peaks sent in a frame
+#define MAX_PEAKS 15
+// Largest payload (a spectrum column) and the packet and encoded sizes that go with it
+#define MAX_PAYLOAD (2 + DUET_N_FREQ)
+#define MAX_PACKET (3 + MAX_PAYLOAD + 2)
+#define MAX_ENCODED (MAX_PACKET + MAX_PACKET / 254 + 1 + 2)
+static_assert(MAX_PAYLOAD >= 1 + MAX_PEAKS * 4 && MAX_PAYLOAD >= 2 * TELEMETRY_STAGES, "Telemetry payload is too small");
+static_assert(DUET_N_TIME <= 255, "Telemetry time indices must fit in a byte");
+
+// The token bucket: filled at the rate the serial port can send, holding up to 100 ms worth
+#define BYTES_PER_SEC (TELEMETRY_BAUD / 10)
+#define BUCKET_SIZE (BYTES_PER_SEC / 10)
+// Tokens that must be left over to send each kind of less important message
+#define RESERVE_BEST (BUCKET_SIZE / 4)
+#define RESERVE_SPECTRUM (BUCKET_SIZE / 2)
+static_assert(BUCKET_SIZE >= MAX_ENCODED + RESERVE_SPECTRUM, "Telemetry baud rate is too low for spectrum columns");
+
+// Send the statistics every this many frames
+#define STATS_EVERY_N_FRAMES 128
+
+// Only used from the DUET task
+static int32_t tokens = BUCKET_SIZE;
+static int64_t lastRefill = 0;
+static uint16_t frame = 0;
+static uint32_t stageUs[TELEMETRY_STAGES] = { 0 };
+static TelemetryStats telemetryStats = { 0, 0, 0 };
+
+
+/** CRC-16/CCITT-FALSE (polynomial 0x1021, starting at 0xFFFF). */
+static uint16_t crc16(const uint8_t* data, uint32_t length) {
+    uint16_t crc = 0xFFFF;
+    while (length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (int i = 0; i < 8; i++) { crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1; }
+    }
+    return crc;
+}
+
+/**
+ * COBS encode data into out, with a 0 before and after it (out must have room for
+ * length + length/254 + 3 bytes). Returns the encoded length.
+ */
+static uint32_t cobsEncode(const uint8_t* data, uint32_t length, uint8_t* out) {
+    uint32_t pos = 0;
+    out[pos++] = 0;
+    uint32_t code = pos++; // where the length of the current run goes
+    uint8_t run = 1;
+    for (uint32_t i = 0; i < length; i++) {
+        if (data[i] != 0) { out[pos++] = data[i]; run++; }
+        if (data[i] == 0 || run == 0xFF) {
+            out[code] = run;
+            code = pos++;
+            run = 1;
+        }
+    }
+    out[code] = run;
+    out[pos++] = 0;
+    return pos;
+}
+
+/**
+ * Check if there is room for a message: the bucket must have enough tokens for it plus the reserve
+ * and the serial port must have room to take it without waiting.
+ */
+static bool haveRoom(uint32_t encodedLength, uint32_t reserve) {
+    int64_t now = esp_timer_get_time();
+    int64_t refill = (now - lastRefill) * BYTES_PER_SEC / 1000000;
+    if (refill > 0) {
+        tokens = tokens + refill > BUCKET_SIZE ? BUCKET_SIZE : (int32_t)(tokens + refill);
+        lastRefill = now;
+    }
+    return tokens >= (int32_t)(encodedLength + reserve) && Serial.availableForWrite() >= (int)encodedLength;
+}
+
+/** Send a message (if there is room) for the current frame. */
+static bool send(uint8_t type, const uint8_t* payload, uint32_t length, uint32_t reserve) {
+    uint8_t packet[MAX_PACKET];
+    packet[0] = type;
+    packet[1] = frame & 0xFF;
+    packet[2] = frame >> 8;
+    memcpy(&packet[3], payload, length);
+    uint16_t crc = crc16(packet, 3 + length);
+    packet[3 + length] = crc & 0xFF;
+    packet[4 + length] = crc >> 8;
+
+    uint8_t encoded[MAX_ENCODED];
+    uint32_t encodedLength = cobsEncode(packet, 5 + length, encoded);
+    if (!haveRoom(encodedLength, reserve)) { telemetryStats.dropped++; return false; }
+    Serial.write(encoded, encodedLength);
+    tokens -= encodedLength;
+    telemetryStats.bytesSent += encodedLength;
+    return true;
+}
+
+/** Add time spent in a stage of the current frame. */
+void telemetryStageTime(TelemetryStage stage, uint32_t us) { stageUs[stage] += us; }
+
+/** Send the peaks found in the current frame. */
+void telemetryPeaks(const float* alpha, const float* delta, uint8_t count) {
+    if (count > MAX_PEAKS) { count = MAX_PEAKS; }
+    uint8_t payload[1 + MAX_PEAKS * 4];
+    payload[0] = count;
+    for (uint8_t i = 0; i < count; i++) {
+        int16_t a = (int16_t)lrintf(alpha[i] * 4096.0f);
+        int16_t d = (int16_t)lrintf(delta[i] * 4096.0f);
+        memcpy(&payload[1 + i * 4], &a, 2);
+        memcpy(&payload[3 + i * 4], &d, 2);
+    }
+    send(TELEMETRY_PEAKS, payload, 1 + count * 4, 0);
+}
+
+/** Send one time slice of the best-source map. */
+void telemetryBestColumn(const uint8_t* best, uint8_t time) {
+    uint8_t payload[1 + DUET_N_FREQ / 2];
+    payload[0] = time;
+    for (int f = 0; f < DUET_N_FREQ; f += 2) {
+        uint8_t lo = best[f * DUET_N_TIME + time], hi = best[(f + 1) * DUET_N_TIME + time];
+        payload[1 + f / 2] = (lo > 14 ? 15 : lo) | (hi > 14 ? 15 : hi) << 4;
+    }
+    send(TELEMETRY_BEST, payload, sizeof(payload), RESERVE_BEST);
+}
+
+/** Send one time slice of one channel of the spectrogram if there is plenty of room. */
+void telemetrySpectrumColumn(const cfloat* spectrogram, uint8_t channel, uint8_t time) {
+    // Check first since working out the magnitudes takes a while
+    if (!haveRoom(MAX_ENCODED, RESERVE_SPECTRUM)) { telemetryStats.dropped++; return; }
+    uint8_t payload[2 + DUET_N_FREQ];
+    payload[0] = channel;
+    payload[1] = time;
+    const cfloat* column = &spectrogram[channel * DUET_N_FREQ * DUET_N_TIME + time];
+    for (int f = 0; f < DUET_N_FREQ; f++) {
+        cfloat x = column[f * DUET_N_TIME];
+        float power = crealf(x) * crealf(x) + cimagf(x) * cimagf(x);
+        float halfDB = power > 0 ? 20.0f * log10f(power) + 128.0f : 0.0f; // 10*log10 is dB, twice for half dB
+        payload[2 + f] = halfDB <= 0 ? 0 : halfDB >= 255 ? 255 : (uint8_t)lrintf(halfDB);
+    }
+    send(TELEMETRY_SPECTRUM, payload, sizeof(payload), RESERVE_SPECTRUM);
+}
+
+/** Finish the current frame: send the stage timings and start the next frame. */
+void telemetryEndFrame() {
+    uint16_t payload[TELEMETRY_STAGES];
+    for (int i = 0; i < TELEMETRY_STAGES; i++) {
+        payload[i] = stageUs[i] > 0xFFFF ? 0xFFFF : stageUs[i];
+        stageUs[i] = 0;
+    }
+    send(TELEMETRY_TIMINGS, (const uint8_t*)payload, sizeof(payload), 0);
+
+    telemetryStats.frames++;
+    if (telemetryStats.frames % STATS_EVERY_N_FRAMES == 0) {
+        uint32_t stats[2] = { telemetryStats.bytesSent, telemetryStats.dropped };
+        send(TELEMETRY_STATS, (const uint8_t*)stats, sizeof(stats), 0);
+    }
+    frame++;
+}
+
+/** Get the telemetry statistics. */
+void getTelemetryStats(TelemetryStats* stats) { *stats = telemetryStats; }
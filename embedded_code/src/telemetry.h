@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "duet.h"
+
+// Binary live telemetry over the serial port, decoded on the computer with tools/telemetry_decode.py.
+//
+// Each message is a packet of [type, frame number (2 bytes), payload..., CRC-16 (2 bytes)] that is
+// COBS encoded and has a 0 byte before and after it. Text printed on the same port (which never
+// contains a 0) ends up between packets, where the decoder shows it as text.
+//
+// Messages are sent only if there is room in the serial bandwidth: a token bucket is filled at the
+// rate the port can send (TELEMETRY_BAUD / 10 bytes per second). Stage timings and peaks are
+// always sent while there are tokens, the best-source map needs some left over afterwards, and
+// spectrogram columns are only sent when there are plenty. Anything that doesn't fit is dropped
+// (and counted) instead of slowing the firmware down.
+
+// Baud rate of the serial port the telemetry is sent over (does not change the port's setting)
+#ifndef TELEMETRY_BAUD
+#define TELEMETRY_BAUD 115200
+#endif
+
+// Message types
+#define TELEMETRY_TIMINGS 1     // time of each processing stage in us (uint16 each)
+#define TELEMETRY_PEAKS 2       // count (uint8) then alpha and delta of each peak (int16 in 1/4096ths)
+#define TELEMETRY_BEST 3        // time index (uint8) then the best source of each frequency (4 bits each, 15 is none)
+#define TELEMETRY_SPECTRUM 4    // channel and time index (uint8 each) then the magnitude of each frequency (uint8 in half dB, 0 is -64 dB)
+#define TELEMETRY_STATS 5       // bytes sent and messages dropped so far (uint32 each)
+
+/** Processing stages that are timed. */
+typedef enum _TelemetryStage : uint8_t {
+    STAGE_PREP = 0,
+    STAGE_DECIMATE,
+    STAGE_SPECTROGRAM,
+    STAGE_ATTEN_DELAY,
+    STAGE_WEIGHTS,
+    STAGE_PEAKS,
+    STAGE_DEMIX,
+    STAGE_OTHER,    // rolling buffers and anything else
+    TELEMETRY_STAGES
+} TelemetryStage;
+
+/** Statistics about the telemetry. */
+typedef struct _TelemetryStats {
+    uint32_t frames;        // frames ended with telemetryEndFrame()
+    uint32_t bytesSent;     // encoded bytes sent
+    uint32_t dropped;       // messages dropped because there was no room
+} TelemetryStats;
+
+/** Add time spent in a stage of the current frame (sent by telemetryEndFrame()). */
+void telemetryStageTime(TelemetryStage stage, uint32_t us);
+
+/** Send the peaks found in the current frame. */
+void telemetryPeaks(const float* alpha, const float* delta, uint8_t count);
+
+/** Send one time slice of the best-source map (shape (N_FREQ, N_TIME), 0xFF is no source). */
+void telemetryBestColumn(const uint8_t* best, uint8_t time);
+
+/** Send one time slice of one channel of the spectrogram (shape (N_CHANNELS, N_FREQ, N_TIME)) if there is plenty of room. */
+void telemetrySpectrumColumn(const cfloat* spectrogram, uint8_t channel, uint8_t time);
+
+/**
+ * Finish the current frame: send the stage timings (and the statistics every so often), then start
+ * the next frame.
+ */
+void telemetryEndFrame();
+
+/** Get the telemetry statistics. */
+void getTelemetryStats(TelemetryStats* stats);
@@ -1,20 +1,27 @@
 #include "volume.h"
+#include "volume_map.hpp"
 #include "audio.h"
 
 #include <stdbool.h>
 #include <stdint.h>
-#include <string.h> // for memset
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <driver/adc.h>
 
 
-// Number of volume readings to average over, higher will be smoother but slower to respond
-#define NUM_OF_VOL_READINGS 20
+// The knob is read every VOL_POLL_IDLE_MS, or every VOL_POLL_MOVING_MS while it is being turned. Each
+// reading is the average of a quick burst of VOL_BURST_READINGS ADC readings, which is then smoothed
+// further by the VolumeMap. (The ESP32's continuous ADC mode would need the I2S0 peripheral, which is
+// used for the audio.)
+#define VOL_POLL_IDLE_MS 100
+#define VOL_POLL_MOVING_MS 20
+#define VOL_BURST_READINGS 8
 
-// Delay between volume readings in milliseconds, lower will be faster to respond but more overhead
-#define VOL_READING_DELAY 10
+// The smoothing (each reading moves the smoothed reading 1/2^VOL_SMOOTHING_SHIFT of the way) and
+// hysteresis (in 1/256 of a level) of the mapping
+#define VOL_SMOOTHING_SHIFT 2
+#define VOL_HYSTERESIS 64
 
 // The pin the volume is connected to
 #define VOLUME_PIN 34  // A2, on ADC1 (ADC2 has several restrictions, may as well avoid it)
@@ -32,50 +39,49 @@
 
 static_assert(MAX_VOLUME <= ABSOLUTE_MAX_VOLUME, "MAX_VOLUME must be less than or equal to ABSOLUTE_MAX_VOLUME");
 static_assert(MIN_VOLUME >= ABSOLUTE_MIN_VOLUME, "MIN_VOLUME must be greater than or equal to ABSOLUTE_MIN_VOLUME");
+static_assert(VOL_BURST_READINGS * (VOLUME_ADC_FULL_SCALE - 1) <= UINT16_MAX, "The burst of readings must fit in 16 bits");
+
+
+/** Read the volume knob: the average of a burst of ADC readings. */
+static uint16_t readVolumeKnob() {
+    uint16_t total = 0;
+    for (int i = 0; i < VOL_BURST_READINGS; i++) { total += adc1_get_raw(VOLUME_CHANNEL); }
+    return total / VOL_BURST_READINGS;
+}
 
 
 /**
- * Constantly monitor the volume level from the ADC and adjust the audio codec's volume.
- * This task will run forever and reads the volume level from the ADC every VOL_READING_DELAY milliseconds.
- * The volume level is then mapped to a volume level and set on the audio codec.
- * The volume level is calculated as a rolling average of the last NUM_OF_VOL_READINGS readings.
+ * Monitor the volume knob and set the volume whenever its level changes.
+ * This task runs forever. It sleeps between readings (longer while the knob isn't being turned) and
+ * only calls setVolume() when the level mapped from the smoothed readings changes. The levels go
+ * from 0 to 79 [<0 is muted, 0 is -73dB, 79 is +6dB (1dB steps)], with the knob turned all the way
+ * down at MIN_VOLUME.
  */
 void adjustVolumeTask(void* pvParameters) {
-    uint16_t volumeReadings[NUM_OF_VOL_READINGS] = {};  // used to make a rolling average of readings on ADC input
-    memset(volumeReadings, 0, sizeof(volumeReadings));
-    int32_t total = 0;  // the total of the last NUM_OF_VOL_READINGS readings
-    uint8_t prevVolume = 0;  // the previous set volume level
-
-    // Get the initial readings and total
-    for (int i = 0; i < NUM_OF_VOL_READINGS; i++) {
-        volumeReadings[i] = adc1_get_raw(VOLUME_CHANNEL);
-        total += volumeReadings[i];
-        vTaskDelay(VOL_READING_DELAY / portTICK_PERIOD_MS / 4); // shorter delay to get the initial readings faster
-    }
+    VolumeMap map(MAX_VOLUME - ABSOLUTE_MIN_VOLUME, MAX_VOLUME - MIN_VOLUME + 1, VOL_SMOOTHING_SHIFT, VOL_HYSTERESIS);
+    map.reset(readVolumeKnob());
+    setVolume(map.level());
+#ifdef DEBUG
+    UBaseType_t lowestFree = ~(UBaseType_t)0;
+#endif
 
-    // Main loop to read the volume level and adjust the audio codec's volume
-    int i = 0;
     while (true) {
-        // Read the volume level from the ADC into the rolling average array
-        // Also update the total to make the average calculation faster
-        total -= volumeReadings[i];
-        volumeReadings[i] = adc1_get_raw(VOLUME_CHANNEL);
-        total += volumeReadings[i];
-        if (++i >= NUM_OF_VOL_READINGS) { i = 0; }
-
-        // Map it from 0-4096 to a volume level (0-79) [<0 is muted, 0 is -73dB, 79 is +6dB (1dB steps)]
-        int8_t volume = (ABSOLUTE_MAX_VOLUME - MIN_VOLUME) - (total * (MAX_VOLUME - MIN_VOLUME + 1)) / (NUM_OF_VOL_READINGS * 4096);
-
-        // If the volume has changed, update the audio codec
-        if (volume != prevVolume) {
+        vTaskDelay((map.isMoving() ? VOL_POLL_MOVING_MS : VOL_POLL_IDLE_MS) / portTICK_PERIOD_MS);
+
+        int8_t volume;
+        if (map.update(readVolumeKnob(), &volume)) {
             setVolume(volume);
-            //printf("Volume:  %03x  %02x  %d dB\n", total/NUM_OF_VOL_READINGS, volume, (int)volume - 73);
+            //printf("Volume:  %d dB\n", (int)volume - 73);
         }
-        prevVolume = volume;
-
-        vTaskDelay(VOL_READING_DELAY / portTICK_PERIOD_MS);
 
-        // printf("Volume Monitor Task: %d\n", uxTaskGetStackHighWaterMark(NULL));
+#ifdef DEBUG
+        // For checking the stack size (see setupVolumeMonitor())
+        const UBaseType_t free = uxTaskGetStackHighWaterMark(NULL);
+        if (free < lowestFree) {
+            lowestFree = free;
+            printf("Volume task stack high water mark: %u bytes\n", (unsigned)free);
+        }
+#endif
     }
 
     vTaskDelete(NULL);
@@ -84,7 +90,7 @@ void adjustVolumeTask(void* pvParameters) {
 
 /**
  * Set up the volume monitor task. This task reads the volume level from the ADC and adjusts the
- * audio codec's volume.
+ * volume of the played audio.
  * The return value indicates if the task was successfully created.
  */
 void setupVolumeMonitor() {
@@ -97,9 +103,12 @@ void setupVolumeMonitor() {
     assert(pin == VOLUME_PIN);
 #endif
 
-    // A stack size of 1024 was just barely too small (could do a printf() but not setVolume())
-    // With +80, the high water mark is 40, indicating +40 should be sufficient, but reducing to +72 becomes too small
-    if (xTaskCreate(adjustVolumeTask, "AdjustVolume", 1024+80+48, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
+    // The old size (1024+80+48) was measured when setVolume() wrote the codec over I2C from this task,
+    // which left only 40 bytes free. setVolume() now just sets a request for the audio task, so the
+    // deepest call left is a printf() (setVolume() when the codec isn't set up, or the DEBUG stack
+    // report), and 1024 was measured to be enough for a printf() here. This hasn't been measured on
+    // the board since, so it has 512 bytes to spare: check the DEBUG report before making it smaller.
+    if (xTaskCreate(adjustVolumeTask, "AdjustVolume", 1024+512, NULL, tskIDLE_PRIORITY, NULL) != pdPASS) {
         printf("!! Failed to create the adjust volume task\n");
         abort();
     }
@@ -0,0 +1,36 @@
+#include "volume_map.hpp"
+
+
+VolumeMap::VolumeMap(int8_t maxLevel, uint8_t levels, uint8_t shift, uint8_t hysteresis) :
+    maxLevel(maxLevel), levels(levels ? levels : 1), shift(shift), hysteresis(hysteresis) { }
+
+/** The smoothed reading in levels from the top in Q8 (0 to levels*256). */
+int32_t VolumeMap::position() const { return (smoothed * levels) / (VOLUME_ADC_FULL_SCALE * 16 / 256); }
+
+void VolumeMap::reset(uint16_t reading) {
+    smoothed = lastReading = (int32_t)reading << 4;
+    const int32_t i = position() >> 8;
+    index = (uint8_t)(i >= levels ? levels - 1 : i);
+}
+
+bool VolumeMap::update(uint16_t reading, int8_t* level) {
+    lastReading = (int32_t)reading << 4;
+    smoothed += (lastReading - smoothed) >> shift;
+
+    // Only move to another level once the position is far enough past the edges of this one
+    const int32_t pos = position();
+    const int32_t low = ((int32_t)index << 8) - hysteresis, high = ((int32_t)(index + 1) << 8) + hysteresis;
+    if (pos >= low && pos < high) { return false; }
+    int32_t i = pos >> 8;
+    if (i >= levels) { i = levels - 1; }
+    if (i < 0) { i = 0; }
+    if (i == index) { return false; }
+    index = (uint8_t)i;
+    *level = this->level();
+    return true;
+}
+
+bool VolumeMap::isMoving() const {
+    const int32_t diff = lastReading > smoothed ? lastReading - smoothed : smoothed - lastReading;
+    return diff * levels * 2 > VOLUME_ADC_FULL_SCALE * 16;
+}
@@ -0,0 +1,57 @@
+/**
+ * Maps the readings of the volume knob (12-bit ADC readings) to volume levels
+ * (see setVolume()).
+ *
+ * The readings are smoothed with a 1-pole IIR filter (in fixed point, so it
+ * costs a few instructions per reading) and the level has hysteresis: it only
+ * changes once the smoothed reading is a fraction of a level past the edge of
+ * the current one. So a noisy reading, or a knob left right on the edge between
+ * two levels, doesn't make the level flicker and the volume is only set when it
+ * really changes.
+ *
+ * This doesn't touch the ADC, so it can be tested on a computer with recorded
+ * or made up traces of readings.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define VOLUME_ADC_FULL_SCALE 4096  // 12-bit readings
+
+class VolumeMap {
+    const int8_t maxLevel;      // level at a reading of 0
+    const uint8_t levels;       // number of levels (the lowest is maxLevel - levels + 1)
+    const uint8_t shift;        // the IIR filter moves 1/2^shift of the way to each reading
+    const uint8_t hysteresis;   // how far past the edge of a level the reading must be (in 1/256 of a level)
+
+    int32_t smoothed = 0;       // the smoothed reading in Q4
+    int32_t lastReading = 0;
+    uint8_t index = 0;          // of the current level (0 is maxLevel)
+
+    int32_t position() const;
+
+public:
+    /**
+     * Create a map where a reading of 0 is maxLevel and a full scale reading is levels - 1 lower.
+     * Each reading moves the smoothed reading 1/2^shift of the way to it, and the hysteresis is in
+     * 1/256 of a level (e.g. 64 is a quarter of a level).
+     */
+    VolumeMap(int8_t maxLevel, uint8_t levels, uint8_t shift = 2, uint8_t hysteresis = 64);
+
+    /** Start over from a reading (no smoothing or hysteresis). */
+    void reset(uint16_t reading);
+
+    /** Add a reading. Returns true (and the new level) if the level changed. */
+    bool update(uint16_t reading, int8_t* level);
+
+    /** The current level. */
+    int8_t level() const { return (int8_t)(maxLevel - index); }
+
+    /**
+     * Check if the knob looks like it is being turned (the last reading is more than half a level
+     * from the smoothed reading), i.e. readings should be taken more often.
+     */
+    bool isMoving() const;
+};
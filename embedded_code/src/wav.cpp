@@ -11,11 +11,19 @@
 #define WAVE_FORMAT_ID { 'W', 'A', 'V', 'E' }
 #define FMT_BLOCK_ID { 'f', 'm', 't', ' ' }
 #define DATA_BLOCK_ID { 'd', 'a', 't', 'a' }
+#define JUNK_BLOCK_ID { 'J', 'U', 'N', 'K' }
+#define FACT_BLOCK_ID { 'f', 'a', 'c', 't' }
+#define CUE_BLOCK_ID { 'c', 'u', 'e', ' ' }
+#define LIST_BLOCK_ID { 'L', 'I', 'S', 'T' }
+#define ADTL_LIST_ID { 'a', 'd', 't', 'l' }
+#define LABL_BLOCK_ID { 'l', 'a', 'b', 'l' }
+#define LTXT_BLOCK_ID { 'l', 't', 'x', 't' }
+#define REGION_PURPOSE_ID { 'r', 'g', 'n', ' ' }
 
 const static uint8_t RIFF_BLOCK_ID_CONST[] = RIFF_BLOCK_ID;
 const static uint8_t WAVE_FORMAT_ID_CONST[] = WAVE_FORMAT_ID;
 const static uint8_t FMT_BLOCK_ID_CONST[] = FMT_BLOCK_ID;
-const static uint8_t DATA_BLOCK_ID_CONST[] = FMT_BLOCK_ID;
+const static uint8_t DATA_BLOCK_ID_CONST[] = DATA_BLOCK_ID;
 
 /** The master header of a RIFF (WAV) file. */
 struct __attribute__((packed)) RiffHeader {
@@ -44,49 +52,149 @@ struct __attribute__((packed)) FmtChunk {
     uint16_t bitsPerSample; // 16 for CD quality
 };
 
+/** The extension of the format chunk for compressed formats. */
+struct __attribute__((packed)) FmtExtension {
+    uint16_t extraSize; // always 2 (number of bytes after this field)
+    uint16_t samplesPerBlock; // number of frames in each block
+};
+
+/** The fact chunk of a compressed WAV file. */
+struct __attribute__((packed)) FactChunk {
+    uint8_t blockID[4]; // "fact"
+    uint32_t blockSize; // always 4
+    uint32_t sampleLength; // number of frames in the file
+};
+
+/** A cue point in the cue chunk (the chunk is a count followed by these). */
+struct __attribute__((packed)) CuePoint {
+    uint32_t id; // matches the labl and ltxt chunks of the cue
+    uint32_t position; // frame of the cue (in play order)
+    uint8_t chunkID[4]; // "data"
+    uint32_t chunkStart; // 0 since there is only one data chunk
+    uint32_t blockStart; // 0 since there is only one data chunk
+    uint32_t sampleOffset; // frame of the cue in the data chunk
+};
+
+/** The labeled text chunk in an adtl list, which gives a cue a length (making it a region). */
+struct __attribute__((packed)) LtxtChunk {
+    uint8_t blockID[4]; // "ltxt"
+    uint32_t blockSize; // always 20 (there is no text)
+    uint32_t cueID;
+    uint32_t sampleLength; // number of frames in the region
+    uint8_t purposeID[4]; // "rgn "
+    uint16_t country, language, dialect, codePage; // all 0
+};
+
 /**
- * The header of a WAV file.
- * This is a combination of the RIFF header, the FMT chunk, and the data chunk.
+ * The header of a PCM WAV file.
+ * This is a combination of the RIFF header and the FMT chunk, followed by a JUNK chunk that pads
+ * the header so that the data chunk's contents start at WAV_DATA_OFFSET.
  * There can be other chunks in a WAV file, but this is the minimum required.
  */
 struct __attribute__((packed)) WavHeader {
     RiffHeader riffHeader;
     FmtChunk fmtChunk;
-    RiffChunk dataChunk;
+    RiffChunk junkChunk;
+};
+
+/**
+ * The header of a compressed WAV file. Compressed formats also need the samples per block in the
+ * format chunk and a fact chunk with the number of frames.
+ */
+struct __attribute__((packed)) WavHeaderCompressed {
+    RiffHeader riffHeader;
+    FmtChunk fmtChunk;
+    FmtExtension fmtExtension;
+    FactChunk factChunk;
+    RiffChunk junkChunk;
 };
 
+// Offsets of the sizes that are updated as data is written
+#define RIFF_SIZE_OFFSET offsetof(WavHeader, riffHeader.fileSize)
+#define FACT_LENGTH_OFFSET offsetof(WavHeaderCompressed, factChunk.sampleLength)
+#define DATA_CHUNK_OFFSET (WAV_DATA_OFFSET - sizeof(RiffChunk))
+#define DATA_SIZE_OFFSET (DATA_CHUNK_OFFSET + offsetof(RiffChunk, blockSize))
+static_assert(DATA_CHUNK_OFFSET >= sizeof(WavHeaderCompressed), "WAV_DATA_OFFSET is too small for the WAV header");
+static_assert((DATA_CHUNK_OFFSET - sizeof(WavHeader)) % 2 == 0, "JUNK chunk must be an even size");
+static_assert((DATA_CHUNK_OFFSET - sizeof(WavHeaderCompressed)) % 2 == 0, "JUNK chunk must be an even size");
+
 
 
 ///// Writing WAV Files /////
 
+/** The format of uncompressed recordings. */
+WavFormat pcmWAVFormat() {
+    return WavFormat {
+        .audioFormat = WAVE_FORMAT_PCM,
+        .blockAlign = REC_CHANNELS * REC_BYTES_PER_SAMPLE,
+        .bitsPerSample = REC_BITS_PER_SAMPLE,
+        .byteRate = getSampleRate() * REC_CHANNELS * REC_BYTES_PER_SAMPLE,
+        .samplesPerBlock = 0,
+    };
+}
+
 /**
  * Start a new WAV file with the given file.
- * Writes the minimal header to the file.
+ * Writes the header, padded to WAV_DATA_OFFSET, to the file.
  */
-bool startWAVFile(FsFile& file) {
-    WavHeader header = {
+bool startWAVFile(FsFile& file, const WavFormat& format, uint32_t preallocate) {
+    const bool compressed = format.audioFormat != WAVE_FORMAT_PCM;
+    const uint32_t headerSize = compressed ? sizeof(WavHeaderCompressed) : sizeof(WavHeader);
+    WavHeaderCompressed header = {
         .riffHeader = {
             .fileTypeBlockID = RIFF_BLOCK_ID,
-            .fileSize = sizeof(WavHeader) - 8, // updated as data is written
+            .fileSize = WAV_DATA_OFFSET - 8, // updated as data is written
             .fileFormatID = WAVE_FORMAT_ID,
         },
         .fmtChunk = {
             .blockID = FMT_BLOCK_ID,
-            .blockSize = 16,
-            .audioFormat = 1, // PCM
+            .blockSize = (uint32_t)(sizeof(FmtChunk) - sizeof(RiffChunk) + (compressed ? sizeof(FmtExtension) : 0)),
+            .audioFormat = format.audioFormat,
             .numChannels = REC_CHANNELS,
-            .sampleRate = REC_SAMPLE_RATE,
-            .byteRate = REC_SAMPLE_RATE * REC_CHANNELS * REC_BYTES_PER_SAMPLE,
-            .bytePerBlock = REC_CHANNELS * REC_BYTES_PER_SAMPLE,
-            .bitsPerSample = REC_BITS_PER_SAMPLE,
+            .sampleRate = getSampleRate(),
+            .byteRate = format.byteRate,
+            .bytePerBlock = format.blockAlign,
+            .bitsPerSample = format.bitsPerSample,
         },
-        .dataChunk = {
-            .blockID = DATA_BLOCK_ID,
-            .blockSize = 0, // updated as data is written
+        .fmtExtension = {
+            .extraSize = sizeof(FmtExtension) - sizeof(uint16_t),
+            .samplesPerBlock = format.samplesPerBlock,
         },
+        .factChunk = {
+            .blockID = FACT_BLOCK_ID,
+            .blockSize = sizeof(FactChunk) - sizeof(RiffChunk),
+            .sampleLength = 0, // updated as data is written
+        },
+        .junkChunk = {
+            .blockID = JUNK_BLOCK_ID,
+            .blockSize = DATA_CHUNK_OFFSET - sizeof(WavHeaderCompressed),
+        },
+    };
+    if (!compressed) {
+        // PCM files don't have the extension or fact chunk, move the JUNK chunk up
+        WavHeader* pcmHeader = (WavHeader*)&header;
+        pcmHeader->junkChunk = RiffChunk { .blockID = JUNK_BLOCK_ID, .blockSize = DATA_CHUNK_OFFSET - sizeof(WavHeader) };
+    }
+    RiffChunk dataChunk = {
+        .blockID = DATA_BLOCK_ID,
+        .blockSize = 0, // updated as data is written
     };
-    // TODO: file.preAllocate(...) // pre-allocate space for the file for an hour of recording (or max left on card minus a few KB): ONE_HOUR_OF_DATA + sizeof(WavHeader)
-    if (file.write((uint8_t*)&header, sizeof(header)) != sizeof(header)) {
+
+    // Pre-allocating requires an empty file; failing is fine (e.g. the card is almost full), the
+    // clusters will just be allocated as the data is written
+    if (preallocate && !file.preAllocate(WAV_DATA_OFFSET + preallocate)) {
+        Serial.println("!! Warning: failed to pre-allocate WAV file");
+    }
+
+    // Write the header, the padding, and then the data chunk header
+    uint8_t zeros[512] = { 0 };
+    bool ok = file.write((uint8_t*)&header, headerSize) == headerSize;
+    for (size_t pos = headerSize; ok && pos < DATA_CHUNK_OFFSET; pos += sizeof(zeros)) {
+        size_t n = DATA_CHUNK_OFFSET - pos < sizeof(zeros) ? DATA_CHUNK_OFFSET - pos : sizeof(zeros);
+        ok = file.write(zeros, n) == n;
+    }
+    ok = ok && file.write((uint8_t*)&dataChunk, sizeof(dataChunk)) == sizeof(dataChunk);
+    if (!ok) {
         Serial.println("!! Failed to write complete WAV header");
         return false;
     }
@@ -100,25 +208,96 @@ bool writeAt(FsFile& file, size_t offset, uint32_t data) {
 }
 
 /**
- * Append the given data to the WAV file. Updates the file and data sizes in the header.
+ * Update the file and data sizes (and the frame count for compressed formats) in the header of a
+ * WAV file started with startWAVFile().
  */
-size_t appendWAVData(FsFile& file, uint8_t* data, uint32_t length) {
-    // Append the data
-    size_t cur_size = file.size();
-    if (!file.seek(cur_size)) { Serial.println("!! Failed to seek to end of WAV data"); return 0; }
-    size_t written = file.write(data, length);
-    if (written == 0) { Serial.println("!! Failed to write any WAV data"); return 0; }
-    if (written != length) { Serial.printf("!! Warning: only wrote %llu bytes of WAV data instead of %llu. SD card is probably full\n", written, length); }
-
-    // Update sizes in headers
-    size_t new_size = cur_size + written;
-    size_t data_size = new_size - sizeof(WavHeader);
-    if (!writeAt(file, offsetof(WavHeader, riffHeader.fileSize), new_size-8)) { Serial.println("!! Failed to write file size in WAV header"); return 0; }
-    if (!writeAt(file, offsetof(WavHeader, dataChunk.blockSize), data_size)) { Serial.println("!! Failed to write data size in WAV header"); return 0; }
-
-    // Flush/sync the file
-    file.flush();
-    return data_size;
+bool updateWAVHeader(FsFile& file, const WavFormat& format, uint32_t dataSize, uint32_t frames) {
+    if (format.audioFormat != WAVE_FORMAT_PCM && !writeAt(file, FACT_LENGTH_OFFSET, frames)) { Serial.println("!! Failed to write frame count in WAV header"); return false; }
+    if (!writeAt(file, RIFF_SIZE_OFFSET, WAV_DATA_OFFSET - 8 + dataSize)) { Serial.println("!! Failed to write file size in WAV header"); return false; }
+    if (!writeAt(file, DATA_SIZE_OFFSET, dataSize)) { Serial.println("!! Failed to write data size in WAV header"); return false; }
+    if (!file.seek(WAV_DATA_OFFSET + dataSize)) { Serial.println("!! Failed to seek to end of WAV data"); return false; }
+    return true;
+}
+
+/**
+ * Write cues after the audio data of a WAV file started with startWAVFile() as a cue chunk and a
+ * LIST (adtl) chunk with their labels and lengths, and update the file size in the header.
+ */
+bool writeWAVCues(FsFile& file, uint32_t dataSize, const WavCue* cues, uint32_t count) {
+    if (count == 0) { return true; }
+
+    // Work out the chunk sizes (each labl is padded to an even size)
+    uint32_t cueSize = sizeof(uint32_t) + count * sizeof(CuePoint);
+    uint32_t listSize = 4;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t labelSize = sizeof(uint32_t) + strnlen(cues[i].label, WAV_CUE_LABEL_LEN - 1) + 1;
+        listSize += sizeof(RiffChunk) + labelSize + labelSize % 2;
+        if (cues[i].length) { listSize += sizeof(LtxtChunk); }
+    }
+    uint32_t start = WAV_DATA_OFFSET + dataSize + dataSize % 2; // the data chunk is padded to an even size
+    uint32_t end = start + sizeof(RiffChunk) + cueSize + sizeof(RiffChunk) + listSize;
+
+    // Cue chunk
+    bool ok = file.seek(start);
+    RiffChunk chunk = { .blockID = CUE_BLOCK_ID, .blockSize = cueSize };
+    ok = ok && file.write((uint8_t*)&chunk, sizeof(chunk)) == sizeof(chunk);
+    ok = ok && file.write((uint8_t*)&count, sizeof(count)) == sizeof(count);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        CuePoint point = {
+            .id = i + 1,
+            .position = cues[i].frame,
+            .chunkID = DATA_BLOCK_ID,
+            .chunkStart = 0,
+            .blockStart = 0,
+            .sampleOffset = cues[i].frame,
+        };
+        ok = file.write((uint8_t*)&point, sizeof(point)) == sizeof(point);
+    }
+
+    // LIST chunk with a label for each cue and the length of each region
+    chunk = RiffChunk { .blockID = LIST_BLOCK_ID, .blockSize = listSize };
+    const uint8_t adtl[4] = ADTL_LIST_ID;
+    ok = ok && file.write((uint8_t*)&chunk, sizeof(chunk)) == sizeof(chunk);
+    ok = ok && file.write(adtl, sizeof(adtl)) == sizeof(adtl);
+    for (uint32_t i = 0; ok && i < count; i++) {
+        uint32_t id = i + 1;
+        uint32_t length = strnlen(cues[i].label, WAV_CUE_LABEL_LEN - 1);
+        chunk = RiffChunk { .blockID = LABL_BLOCK_ID, .blockSize = (uint32_t)sizeof(uint32_t) + length + 1 };
+        const uint8_t zeros[2] = { 0, 0 }; // terminator and padding
+        ok = file.write((uint8_t*)&chunk, sizeof(chunk)) == sizeof(chunk) &&
+             file.write((uint8_t*)&id, sizeof(id)) == sizeof(id) &&
+             file.write((const uint8_t*)cues[i].label, length) == length &&
+             file.write(zeros, 2 - length % 2) == 2 - length % 2;
+        if (ok && cues[i].length) {
+            LtxtChunk ltxt = {
+                .blockID = LTXT_BLOCK_ID,
+                .blockSize = sizeof(LtxtChunk) - sizeof(RiffChunk),
+                .cueID = id,
+                .sampleLength = cues[i].length,
+                .purposeID = REGION_PURPOSE_ID,
+                .country = 0, .language = 0, .dialect = 0, .codePage = 0,
+            };
+            ok = file.write((uint8_t*)&ltxt, sizeof(ltxt)) == sizeof(ltxt);
+        }
+    }
+    if (!ok) { Serial.println("!! Failed to write cues to WAV file"); return false; }
+
+    // Include the cues in the file size
+    if (!writeAt(file, RIFF_SIZE_OFFSET, end - 8)) { Serial.println("!! Failed to write file size in WAV header"); return false; }
+    if (!file.seek(WAV_DATA_OFFSET + dataSize)) { Serial.println("!! Failed to seek to end of WAV data"); return false; }
+    return true;
+}
+
+/**
+ * Read the data size from the header of a WAV file started with startWAVFile().
+ */
+bool readWAVDataSize(FsFile& file, uint32_t& dataSize) {
+    RiffChunk dataChunk;
+    if (!file.seek(DATA_CHUNK_OFFSET)) { return false; }
+    if (file.read((uint8_t*)&dataChunk, sizeof(RiffChunk)) != sizeof(RiffChunk)) { return false; }
+    if (memcmp(dataChunk.blockID, DATA_BLOCK_ID_CONST, 4) != 0) { return false; }
+    dataSize = dataChunk.blockSize;
+    return true;
 }
 
 
@@ -135,13 +314,11 @@ bool findChunk(FsFile& file, const uint8_t* chunkID, RiffChunk* chunk) {
 }
 
 /**
- * Read the WAV header from the given file.
- * Returns true if the header is valid. In this case the file position is at the start of the data
- * and the size of the wav data is returned. The start of the data can be obtained by calling
- * file.position() immediately after this function returns true.
- * If false is returned, the file position is undefined.
+ * Read the WAV header from the given file, accepting any format.
+ * Returns true if the header is valid, in which case the format is returned in info and the file
+ * position is at the start of the data.
  */
-bool readWavHeader(FsFile& file, uint32_t& dataSize) {
+bool readWavHeader(FsFile& file, uint32_t& dataSize, WavInfo& info) {
     // Read RIFF header
     RiffHeader riffHeader;
     if (file.read((uint8_t*)&riffHeader, sizeof(RiffHeader)) != sizeof(RiffHeader)) { return false; }
@@ -150,12 +327,20 @@ bool readWavHeader(FsFile& file, uint32_t& dataSize) {
     // Find the format chunk
     FmtChunk fmtChunk;
     if (!findChunk(file, FMT_BLOCK_ID_CONST, (RiffChunk*)&fmtChunk)) { return false; }
-    if (fmtChunk.blockSize != sizeof(FmtChunk) - sizeof(RiffChunk)) { return false; }
+    if (fmtChunk.blockSize < sizeof(FmtChunk) - sizeof(RiffChunk)) { return false; }
+    uint32_t fmtEnd = file.position() + fmtChunk.blockSize + fmtChunk.blockSize % 2;
 
-    // Read and check the rest of the format chunk
+    // Read and check the rest of the format chunk (skipping any extension)
     if (file.read(((uint8_t*)&fmtChunk) + sizeof(RiffChunk), sizeof(FmtChunk) - sizeof(RiffChunk)) != sizeof(FmtChunk) - sizeof(RiffChunk)) { return false; }
-    if (fmtChunk.byteRate != fmtChunk.sampleRate * fmtChunk.numChannels * fmtChunk.bitsPerSample / 8 || fmtChunk.bytePerBlock != fmtChunk.numChannels * fmtChunk.bitsPerSample / 8) { return false; }
-    if (fmtChunk.audioFormat != 1 || fmtChunk.numChannels != PLAY_CHANNELS || fmtChunk.sampleRate != PLAY_SAMPLE_RATE || fmtChunk.bitsPerSample != PLAY_BITS_PER_SAMPLE) { return false; }
+    if (fmtChunk.numChannels == 0 || fmtChunk.sampleRate == 0 || fmtChunk.bytePerBlock == 0) { return false; }
+    if (fmtChunk.audioFormat == WAVE_FORMAT_PCM && (fmtChunk.bitsPerSample == 0 || fmtChunk.bitsPerSample > 32 ||
+        fmtChunk.bytePerBlock != fmtChunk.numChannels * ((fmtChunk.bitsPerSample + 7) / 8))) { return false; }
+    if (!file.seek(fmtEnd)) { return false; }
+    info.audioFormat = fmtChunk.audioFormat;
+    info.numChannels = fmtChunk.numChannels;
+    info.sampleRate = fmtChunk.sampleRate;
+    info.blockAlign = fmtChunk.bytePerBlock;
+    info.bitsPerSample = fmtChunk.bitsPerSample;
 
     // Find the data chunk
     RiffChunk dataChunk;
@@ -165,3 +350,18 @@ bool readWavHeader(FsFile& file, uint32_t& dataSize) {
     dataSize = dataChunk.blockSize;
     return true;
 }
+
+/**
+ * Read the WAV header from the given file.
+ * Returns true if the header is valid and the audio is PCM in the PLAY_* format. In this case the
+ * file position is at the start of the data and the size of the wav data is returned. The start of
+ * the data can be obtained by calling file.position() immediately after this function returns
+ * true.
+ * If false is returned, the file position is undefined.
+ */
+bool readWavHeader(FsFile& file, uint32_t& dataSize) {
+    WavInfo info;
+    if (!readWavHeader(file, dataSize, info)) { return false; }
+    return info.audioFormat == WAVE_FORMAT_PCM && info.numChannels == PLAY_CHANNELS &&
+           info.sampleRate == getSampleRate() && info.bitsPerSample == PLAY_BITS_PER_SAMPLE;
+}
@@ -6,24 +6,96 @@
 #define DISABLE_FS_H_WARNING
 #include <SdFat.h>
 
+#include "sd.h"
+
+// Offset of the audio data in the WAV files we write. The header is padded with a JUNK chunk up to
+// this offset so that the audio data, and every SD_WRITE_CHUNK written after it, is aligned to the
+// clusters on the SD card. Readers skip the JUNK chunk like any other unknown chunk.
+#define WAV_DATA_OFFSET SD_WRITE_CHUNK
+
+// WAV audio format tags
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IMA_ADPCM 0x0011
+#define WAVE_FORMAT_FLAC 0xF1AC  // FLAC frames stored in the data chunk
+
+/** The format of the audio data in a WAV file written with startWAVFile(). */
+struct WavFormat {
+    uint16_t audioFormat;       // one of the WAVE_FORMAT_* tags
+    uint16_t blockAlign;        // bytes per block (for PCM this is the bytes per frame)
+    uint16_t bitsPerSample;     // bits per (encoded) sample
+    uint32_t byteRate;          // average bytes per second
+    uint16_t samplesPerBlock;   // frames per block for compressed formats; 0 for PCM
+};
+
+/** The format of uncompressed recordings. */
+WavFormat pcmWAVFormat();
+
 /**
  * Start a new WAV file with the given file.
- * Writes the minimal header to the file.
+ * Writes the header, padded to WAV_DATA_OFFSET, to the file. If preallocate is non-zero, that many
+ * bytes of audio data are preallocated (contiguously if possible) so appending doesn't need to
+ * search the FAT. The file position is left at the start of the audio data.
+ * Compressed formats get the samples per block in the format chunk and a fact chunk with the
+ * number of frames.
  */
-bool startWAVFile(FsFile& file);
+bool startWAVFile(FsFile& file, const WavFormat& format, uint32_t preallocate = 0);
 
 /**
- * Append the given data to the WAV file. Updates the file and data sizes in the header.
- * Returns the total WAV data size in the file after the append (not including the header).
- * Returns 0 if there was an error.
+ * Update the file and data sizes in the header of a WAV file started with startWAVFile(), along
+ * with the number of frames for compressed formats.
+ * The file position is left at the end of the audio data.
  */
-size_t appendWAVData(FsFile& file, uint8_t* data, uint32_t length);
+bool updateWAVHeader(FsFile& file, const WavFormat& format, uint32_t dataSize, uint32_t frames);
+
+// Longest label of a cue (including the terminating 0)
+#define WAV_CUE_LABEL_LEN 16
+
+/** A marker (or region if it has a length) in a WAV file, e.g. a button press. */
+struct WavCue {
+    uint32_t frame;     // frame the cue is at
+    uint32_t length;    // number of frames for a region, 0 for a marker
+    char label[WAV_CUE_LABEL_LEN];
+};
+
+/**
+ * Write cues after the audio data of a WAV file started with startWAVFile(): a cue chunk with
+ * their positions and a LIST (adtl) chunk with their labels and, for regions, their lengths. The
+ * file size in the header is updated to include them (so this must be called after
+ * updateWAVHeader()). Nothing is written if there are no cues.
+ * The file position is left at the end of the audio data, so more audio can be appended over the
+ * cues before they are written again.
+ */
+bool writeWAVCues(FsFile& file, uint32_t dataSize, const WavCue* cues, uint32_t count);
+
+/**
+ * Read the data size from the header of a WAV file started with startWAVFile(). This is the amount
+ * of data that was in the file the last time updateWAVHeader() was called.
+ */
+bool readWAVDataSize(FsFile& file, uint32_t& dataSize);
+
+/** The format of the audio in a WAV file being read. */
+struct WavInfo {
+    uint16_t audioFormat;   // one of the WAVE_FORMAT_* tags
+    uint16_t numChannels;
+    uint32_t sampleRate;
+    uint16_t blockAlign;    // bytes per frame for PCM
+    uint16_t bitsPerSample;
+};
 
 /**
  * Read the WAV header from the given file.
- * Returns true if the header is valid. In this case the file position is at the start of the data
- * and the size of the wav data is returned. The start of the data can be obtained by calling
- * file.position() immediately after this function returns true.
+ * Returns true if the header is valid and the audio is PCM in the PLAY_* format. In this case the
+ * file position is at the start of the data and the size of the wav data is returned. The start of
+ * the data can be obtained by calling file.position() immediately after this function returns
+ * true.
  * If false is returned, the file position is undefined.
  */
 bool readWavHeader(FsFile& file, uint32_t& dataSize);
+
+/**
+ * Read the WAV header from the given file, accepting any format.
+ * Returns true if the header is valid, in which case the format is returned in info and the file
+ * position is at the start of the data (like the other overload). The caller must check that it can
+ * handle the format.
+ */
+bool readWavHeader(FsFile& file, uint32_t& dataSize, WavInfo& info);
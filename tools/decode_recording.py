@@ -0,0 +1,373 @@
+#!/usr/bin/env python3
+"""
+Decode a recording from the device into a plain 16-bit PCM WAV file.
+
+Recordings can be uncompressed PCM, IMA ADPCM (format tag 0x0011), or
+lossless (format tag 0xF1AC, FLAC frames with fixed predictors). Only the
+Python standard library is needed.
+
+Annotations (button presses and other events) are stored in the recording
+as cue points with labels (and lengths for regions). If there are any, they
+are also written as an Audacity label track next to the output.
+
+Usage: decode_recording.py input.wav [output.wav]
+"""
+
+import struct
+import sys
+import wave
+
+WAVE_FORMAT_PCM = 0x0001
+WAVE_FORMAT_IMA_ADPCM = 0x0011
+WAVE_FORMAT_FLAC = 0xF1AC
+
+
+def read_chunks(data):
+    """Parse a RIFF/WAVE file into a dict of chunk id -> bytes."""
+    if data[0:4] != b'RIFF' or data[8:12] != b'WAVE':
+        raise ValueError('not a WAV file')
+    chunks = {}
+    pos = 12
+    while pos + 8 <= len(data):
+        cid, size = struct.unpack_from('<4sI', data, pos)
+        pos += 8
+        if cid == b'LIST':  # keyed by the list type as well, e.g. b'LISTadtl'
+            cid += data[pos:pos + 4]
+        chunks.setdefault(cid, data[pos:pos + size])
+        pos += size + (size & 1)
+    return chunks
+
+
+def parse_fmt(fmt):
+    tag, channels, rate, byte_rate, block_align, bits = struct.unpack_from('<HHIIHH', fmt, 0)
+    samples_per_block = 0
+    if len(fmt) >= 20:
+        extra, = struct.unpack_from('<H', fmt, 16)
+        if extra >= 2:
+            samples_per_block, = struct.unpack_from('<H', fmt, 18)
+    return dict(tag=tag, channels=channels, rate=rate, block_align=block_align,
+                bits=bits, samples_per_block=samples_per_block)
+
+
+def clamp16(x):
+    return -32768 if x < -32768 else 32767 if x > 32767 else x
+
+
+###### IMA ADPCM ######
+
+STEP_TABLE = [
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45,
+    50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173, 190, 209, 230,
+    253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963,
+    1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327,
+    3660, 4026, 4428, 4871, 5358, 5894, 6484, 7132, 7845, 8630, 9493, 10442,
+    11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794,
+    32767
+]
+INDEX_TABLE = [-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8]
+
+
+def decode_ima_adpcm(data, fmt, frames):
+    """Decode IMA ADPCM blocks into a list of per-channel sample lists."""
+    ch = fmt['channels']
+    align = fmt['block_align']
+    spb = fmt['samples_per_block'] or (align - 4 * ch) * 2 // ch + 1
+    out = [[] for _ in range(ch)]
+    for start in range(0, len(data) - align + 1, align):
+        block = data[start:start + align]
+        pred, index = [], []
+        for c in range(ch):
+            p, i = struct.unpack_from('<hB', block, 4 * c)
+            pred.append(p)
+            index.append(min(i, 88))
+            out[c].append(p)
+        pos = 4 * ch
+        for _ in range((spb - 1) // 8):
+            for c in range(ch):
+                for byte in block[pos:pos + 4]:
+                    for nibble in (byte & 0x0F, byte >> 4):
+                        step = STEP_TABLE[index[c]]
+                        delta = step >> 3
+                        if nibble & 4: delta += step
+                        if nibble & 2: delta += step >> 1
+                        if nibble & 1: delta += step >> 2
+                        pred[c] = clamp16(pred[c] - delta if nibble & 8 else pred[c] + delta)
+                        index[c] = max(0, min(88, index[c] + INDEX_TABLE[nibble]))
+                        out[c].append(pred[c])
+                pos += 4
+    if frames:
+        out = [o[:frames] for o in out]
+    return out
+
+
+###### FLAC frames ######
+
+def crc8(data):
+    crc = 0
+    for b in data:
+        crc ^= b
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x07) & 0xFF if crc & 0x80 else (crc << 1) & 0xFF
+    return crc
+
+
+def crc16(data):
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x8005) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+class BitReader:
+    def __init__(self, data, pos):
+        self.data = data
+        self.bit = pos * 8
+
+    def read(self, n):
+        value = 0
+        for _ in range(n):
+            byte = self.data[self.bit >> 3]
+            value = (value << 1) | ((byte >> (7 - (self.bit & 7))) & 1)
+            self.bit += 1
+        return value
+
+    def read_signed(self, n):
+        value = self.read(n)
+        return value - (1 << n) if value & (1 << (n - 1)) else value
+
+    def read_unary(self):
+        q = 0
+        while self.read(1) == 0:
+            q += 1
+        return q
+
+    def align(self):
+        self.bit = (self.bit + 7) & ~7
+
+    @property
+    def pos(self):
+        return self.bit >> 3
+
+
+BLOCK_SIZES = {1: 192, 2: 576, 3: 1152, 4: 2304, 5: 4608}
+FIXED_COEFS = [[], [1], [2, -1], [3, -3, 1], [4, -6, 4, -1]]
+
+
+def read_residual(r, n, order):
+    method = r.read(2)
+    if method > 1:
+        raise ValueError('bad residual coding method')
+    param_bits = 4 if method == 0 else 5
+    partition_order = r.read(4)
+    partitions = 1 << partition_order
+    residual = []
+    for p in range(partitions):
+        count = (n >> partition_order) - (order if p == 0 else 0)
+        k = r.read(param_bits)
+        if k == (1 << param_bits) - 1:
+            bits = r.read(5)
+            residual.extend(r.read_signed(bits) if bits else 0 for _ in range(count))
+            continue
+        for _ in range(count):
+            u = (r.read_unary() << k) | r.read(k)
+            residual.append((u >> 1) ^ -(u & 1))
+    return residual
+
+
+def read_subframe(r, n, bps):
+    if r.read(1):
+        raise ValueError('bad subframe padding')
+    kind = r.read(6)
+    wasted = 0
+    if r.read(1):
+        wasted = r.read_unary() + 1
+        bps -= wasted
+    if kind == 0:
+        samples = [r.read_signed(bps)] * n
+    elif kind == 1:
+        samples = [r.read_signed(bps) for _ in range(n)]
+    elif 8 <= kind <= 12:
+        order = kind - 8
+        samples = [r.read_signed(bps) for _ in range(order)]
+        coefs = FIXED_COEFS[order]
+        for res in read_residual(r, n, order):
+            samples.append(res + sum(c * samples[-1 - j] for j, c in enumerate(coefs)))
+    else:
+        raise ValueError('unsupported subframe type %d (LPC is not used by the device)' % kind)
+    return [s << wasted for s in samples] if wasted else samples
+
+
+def read_utf8(r):
+    first = r.read(8)
+    n = 0
+    while first & (0x80 >> n):
+        n += 1
+    value = first & (0x7F >> n)
+    for _ in range(max(n - 1, 0)):
+        value = (value << 6) | (r.read(8) & 0x3F)
+    return value
+
+
+def decode_flac_frame(data, pos, channels):
+    """Decode one FLAC frame at pos, returns (per-channel samples, next position)."""
+    r = BitReader(data, pos)
+    if r.read(15) != 0x7FFC:
+        raise ValueError('no sync code')
+    r.read(1)
+    bs_code, rate_code, assignment, size_code = r.read(4), r.read(4), r.read(4), r.read(3)
+    r.read(1)
+    read_utf8(r)
+    if bs_code == 6:
+        n = r.read(8) + 1
+    elif bs_code == 7:
+        n = r.read(16) + 1
+    elif bs_code >= 8:
+        n = 256 << (bs_code - 8)
+    else:
+        n = BLOCK_SIZES[bs_code]
+    if rate_code == 12:
+        r.read(8)
+    elif rate_code in (13, 14):
+        r.read(16)
+    if crc8(data[pos:r.pos]) != r.read(8):
+        raise ValueError('header CRC mismatch')
+    bps = {1: 8, 2: 12, 4: 16, 5: 20, 6: 24}.get(size_code, 16)
+
+    if assignment < 8:
+        chans = [read_subframe(r, n, bps) for _ in range(assignment + 1)]
+    else:
+        a = read_subframe(r, n, bps + (assignment == 9))
+        b = read_subframe(r, n, bps + (assignment != 9))
+        if assignment == 8:    # left/side
+            chans = [a, [x - s for x, s in zip(a, b)]]
+        elif assignment == 9:  # side/right
+            chans = [[s + y for s, y in zip(a, b)], b]
+        else:                  # mid/side
+            left, right = [], []
+            for m, s in zip(a, b):
+                m = (m << 1) | (s & 1)
+                left.append((m + s) >> 1)
+                right.append((m - s) >> 1)
+            chans = [left, right]
+    r.align()
+    end = r.pos
+    if crc16(data[pos:end]) != r.read(16):
+        raise ValueError('frame CRC mismatch')
+    return chans[:channels], end + 2
+
+
+def decode_flac(data, fmt, frames):
+    """
+    Decode the FLAC frames in the data chunk. Damaged frames (e.g. one cut off when the device
+    reopened the file after the SD card was removed) are skipped by searching for the next sync code.
+    """
+    ch = fmt['channels']
+    out = [[] for _ in range(ch)]
+    pos = 0
+    skipped = 0
+    while pos + 2 <= len(data):
+        if data[pos] == 0xFF and (data[pos + 1] & 0xFE) == 0xF8:
+            try:
+                chans, next_pos = decode_flac_frame(data, pos, ch)
+                for c in range(ch):
+                    out[c].extend(chans[c])
+                pos = next_pos
+                continue
+            except (ValueError, IndexError, KeyError):
+                pass
+        pos += 1
+        skipped += 1
+    if skipped:
+        print('warning: skipped %d bytes of damaged data' % skipped, file=sys.stderr)
+    return out
+
+
+###### Annotations ######
+
+def read_cues(chunks):
+    """Read the cue points, returns a list of (frame, length, label) sorted by frame."""
+    if b'cue ' not in chunks:
+        return []
+    cue = chunks[b'cue ']
+    count, = struct.unpack_from('<I', cue, 0)
+    frames = {}
+    for i in range(count):
+        cue_id, _, _, _, _, offset = struct.unpack_from('<II4sIII', cue, 4 + 24 * i)
+        frames[cue_id] = offset
+
+    labels, lengths = {}, {}
+    adtl = chunks.get(b'LISTadtl', b'')
+    pos = 4
+    while pos + 8 <= len(adtl):
+        cid, size = struct.unpack_from('<4sI', adtl, pos)
+        body = adtl[pos + 8:pos + 8 + size]
+        cue_id, = struct.unpack_from('<I', body, 0)
+        if cid == b'labl':
+            labels[cue_id] = body[4:].split(b'\0', 1)[0].decode('utf-8', 'replace')
+        elif cid == b'ltxt':
+            lengths[cue_id], = struct.unpack_from('<I', body, 4)
+        pos += 8 + size + (size & 1)
+
+    return sorted((frames[i], lengths.get(i, 0), labels.get(i, '')) for i in frames)
+
+
+def write_labels(path, rate, cues):
+    """Write cues as an Audacity label track (start, end, and label, times in seconds)."""
+    with open(path, 'w') as f:
+        for frame, length, label in cues:
+            f.write('%.6f\t%.6f\t%s\n' % (frame / rate, (frame + length) / rate, label))
+
+
+###### Main ######
+
+def decode(path):
+    """Decode a recording, returns (sample rate, per-channel sample lists, cues)."""
+    with open(path, 'rb') as f:
+        chunks = read_chunks(f.read())
+    fmt = parse_fmt(chunks[b'fmt '])
+    data = chunks.get(b'data', b'')
+    frames = struct.unpack('<I', chunks[b'fact'][:4])[0] if b'fact' in chunks else 0
+
+    if fmt['tag'] == WAVE_FORMAT_PCM:
+        if fmt['bits'] != 16:
+            raise ValueError('only 16-bit PCM is supported')
+        samples = struct.unpack('<%dh' % (len(data) // 2), data[:len(data) // 2 * 2])
+        out = [list(samples[c::fmt['channels']]) for c in range(fmt['channels'])]
+    elif fmt['tag'] == WAVE_FORMAT_IMA_ADPCM:
+        out = decode_ima_adpcm(data, fmt, frames)
+    elif fmt['tag'] == WAVE_FORMAT_FLAC:
+        out = decode_flac(data, fmt, frames)
+    else:
+        raise ValueError('unsupported format tag 0x%04X' % fmt['tag'])
+    return fmt['rate'], out, read_cues(chunks)
+
+
+def write_wav(path, rate, channels):
+    n = min(len(c) for c in channels)
+    interleaved = [channels[c][i] for i in range(n) for c in range(len(channels))]
+    with wave.open(path, 'wb') as w:
+        w.setnchannels(len(channels))
+        w.setsampwidth(2)
+        w.setframerate(rate)
+        w.writeframes(struct.pack('<%dh' % len(interleaved), *interleaved))
+
+
+def main(argv):
+    if len(argv) not in (2, 3):
+        print(__doc__.strip(), file=sys.stderr)
+        return 1
+    output = argv[2] if len(argv) == 3 else argv[1].rsplit('.', 1)[0] + '_pcm.wav'
+    rate, channels, cues = decode(argv[1])
+    write_wav(output, rate, channels)
+    print('%s: %d frames at %d Hz -> %s' % (argv[1], len(channels[0]), rate, output))
+    if cues:
+        labels = output.rsplit('.', 1)[0] + '_labels.txt'
+        write_labels(labels, rate, cues)
+        print('%d annotations -> %s' % (len(cues), labels))
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""
+Decode the binary live telemetry from the device (see telemetry.h).
+
+Reads from a serial port (needs pyserial) or from a file of captured bytes,
+and writes each kind of message to a CSV file in the output directory. Text
+printed by the device between the binary messages is echoed to stderr. With
+--live, a summary of the stage timings and peaks is printed every second.
+Otherwise only the Python standard library is needed.
+
+Usage: telemetry_decode.py [--baud BAUD] [--out DIR] [--live] PORT_OR_FILE
+"""
+
+import argparse
+import csv
+import os
+import struct
+import sys
+import time
+
+TIMINGS, PEAKS, BEST, SPECTRUM, STATS = 1, 2, 3, 4, 5
+STAGES = ['prep', 'decimate', 'spectrogram', 'atten_delay', 'weights', 'peaks', 'demix', 'other']
+
+
+def crc16(data):
+    """CRC-16/CCITT-FALSE, the same as the device."""
+    crc = 0xFFFF
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) & 0xFFFF if crc & 0x8000 else (crc << 1) & 0xFFFF
+    return crc
+
+
+def cobs_decode(data):
+    """Decode a COBS encoded packet (without the 0 delimiters), returns None if it is invalid."""
+    out = bytearray()
+    pos = 0
+    while pos < len(data):
+        code = data[pos]
+        if code == 0 or pos + code > len(data):
+            return None
+        out += data[pos + 1:pos + code]
+        pos += code
+        if code < 0xFF and pos < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+def parse(packet):
+    """Parse a decoded packet, returns (type, frame, fields) or None if the CRC doesn't match."""
+    if len(packet) < 5 or crc16(packet[:-2]) != struct.unpack_from('<H', packet, len(packet) - 2)[0]:
+        return None
+    kind, frame = packet[0], struct.unpack_from('<H', packet, 1)[0]
+    payload = packet[3:-2]
+    if kind == TIMINGS:
+        fields = list(struct.unpack('<%dH' % (len(payload) // 2), payload))
+    elif kind == PEAKS:
+        count = payload[0]
+        values = struct.unpack_from('<%dh' % (2 * count), payload, 1)
+        fields = [(values[2 * i] / 4096, values[2 * i + 1] / 4096) for i in range(count)]
+    elif kind == BEST:
+        sources = []
+        for b in payload[1:]:
+            sources += [b & 0x0F, b >> 4]
+        fields = [payload[0]] + [-1 if s == 15 else s for s in sources]
+    elif kind == SPECTRUM:
+        fields = [payload[0], payload[1]] + [b / 2 - 64 for b in payload[2:]]
+    elif kind == STATS:
+        fields = list(struct.unpack('<II', payload))
+    else:
+        return None
+    return kind, frame, fields
+
+
+class Writers:
+    """CSV files for each kind of message, opened when the first one arrives."""
+    HEADERS = {
+        TIMINGS: ['frame'] + [s + '_us' for s in STAGES],
+        PEAKS: ['frame', 'peak', 'alpha', 'delta'],
+        BEST: ['frame', 'time', 'best_by_frequency...'],
+        SPECTRUM: ['frame', 'channel', 'time', 'db_by_frequency...'],
+        STATS: ['frame', 'bytes_sent', 'dropped'],
+    }
+    NAMES = {TIMINGS: 'timings', PEAKS: 'peaks', BEST: 'best', SPECTRUM: 'spectrum', STATS: 'stats'}
+
+    def __init__(self, directory):
+        self.directory = directory
+        self.files = {}
+
+    def write(self, kind, frame, fields):
+        if kind not in self.files:
+            f = open(os.path.join(self.directory, self.NAMES[kind] + '.csv'), 'w', newline='')
+            self.files[kind] = (f, csv.writer(f))
+            self.files[kind][1].writerow(self.HEADERS[kind])
+        writer = self.files[kind][1]
+        if kind == PEAKS:
+            for i, (alpha, delta) in enumerate(fields):
+                writer.writerow([frame, i, '%.4f' % alpha, '%.4f' % delta])
+        else:
+            writer.writerow([frame] + fields)
+
+    def close(self):
+        for f, _ in self.files.values():
+            f.close()
+
+
+class Summary:
+    """Per-second summary of the telemetry for --live."""
+
+    def __init__(self):
+        self.reset()
+        self.last = time.monotonic()
+
+    def reset(self):
+        self.frames, self.totals, self.peaks, self.bad = 0, [0] * len(STAGES), 0, 0
+
+    def add(self, kind, fields):
+        if kind == TIMINGS:
+            self.frames += 1
+            self.totals = [t + f for t, f in zip(self.totals, fields)]
+        elif kind == PEAKS:
+            self.peaks += len(fields)
+
+    def maybe_print(self):
+        now = time.monotonic()
+        if now - self.last < 1:
+            return
+        if self.frames:
+            stages = ' '.join('%s=%.2f' % (s, t / self.frames / 1000) for s, t in zip(STAGES, self.totals) if t)
+            print('%5.1f frames/s, %.1f peaks/frame, ms: %s%s' % (
+                self.frames / (now - self.last), self.peaks / self.frames, stages,
+                ' (%d bad packets)' % self.bad if self.bad else ''))
+        self.reset()
+        self.last = now
+
+
+def read_chunks(source, baud):
+    """Yield chunks of bytes from a serial port or a file."""
+    if os.path.isfile(source):
+        with open(source, 'rb') as f:
+            while True:
+                chunk = f.read(4096)
+                if not chunk:
+                    return
+                yield chunk
+    else:
+        import serial  # pyserial, only needed for reading from the device
+        with serial.Serial(source, baud, timeout=0.1) as port:
+            while True:
+                yield port.read(4096)
+
+
+def main(argv):
+    parser = argparse.ArgumentParser(description='Decode the binary live telemetry from the device.')
+    parser.add_argument('source', help='serial port or file of captured bytes')
+    parser.add_argument('--baud', type=int, default=115200)
+    parser.add_argument('--out', default='telemetry', help='directory for the CSV files')
+    parser.add_argument('--live', action='store_true', help='print a summary every second')
+    args = parser.parse_args(argv[1:])
+
+    os.makedirs(args.out, exist_ok=True)
+    writers = Writers(args.out)
+    summary = Summary()
+    pending = bytearray()
+    counts = {}
+    try:
+        for chunk in read_chunks(args.source, args.baud):
+            pending += chunk
+            *packets, pending = pending.split(b'\0')
+            pending = bytearray(pending)
+            for data in packets:
+                if not data:
+                    continue
+                decoded = cobs_decode(data)
+                message = parse(decoded) if decoded is not None else None
+                if message is None:
+                    text = data.decode('ascii', 'replace').strip()
+                    if text:
+                        print(text, file=sys.stderr)
+                    summary.bad += 1
+                    continue
+                kind, frame, fields = message
+                writers.write(kind, frame, fields)
+                summary.add(kind, fields)
+                counts[kind] = counts.get(kind, 0) + 1
+            if args.live:
+                summary.maybe_print()
+    except KeyboardInterrupt:
+        pass
+    finally:
+        writers.close()
+    print(', '.join('%d %s' % (n, Writers.NAMES[k]) for k, n in sorted(counts.items())) or 'no telemetry',
+          '->', args.out)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))